@@ -1,8 +1,69 @@
 #include <stdio.h>
 #include <chrono>
+#include <regex>
+#include <thread>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#endif
 
 #include "tinyrulechecker.h"
 
+// -----------------------------------------------------------------------------
+// PerfCounter
+//
+// hardware counter (e.g. branch misses) of this process for a code section,
+// reads -1 when not available (non-linux, not allowed, virtualized...)
+// -----------------------------------------------------------------------------
+class PerfCounter {
+  public:
+    PerfCounter(uint64_t config) : _fd(-1) {
+#ifdef __linux__
+      struct perf_event_attr pe;
+      memset(&pe, 0, sizeof(pe));
+      pe.type = PERF_TYPE_HARDWARE;
+      pe.size = sizeof(pe);
+      pe.config = config;
+      pe.disabled = 1;
+      pe.exclude_kernel = 1;
+      pe.exclude_hv = 1;
+      _fd = syscall(__NR_perf_event_open, &pe, 0, -1, -1, 0);
+#endif
+    }
+    ~PerfCounter() {
+#ifdef __linux__
+      if (_fd >= 0) close(_fd);
+#endif
+    }
+    void start() {
+#ifdef __linux__
+      if (_fd < 0) return;
+      ioctl(_fd, PERF_EVENT_IOC_RESET, 0);
+      ioctl(_fd, PERF_EVENT_IOC_ENABLE, 0);
+#endif
+    }
+    long long stop() {
+      long long count = -1;
+#ifdef __linux__
+      if (_fd < 0) return -1;
+      ioctl(_fd, PERF_EVENT_IOC_DISABLE, 0);
+      if (read(_fd, &count, sizeof(count)) != sizeof(count)) return -1;
+#endif
+      return count;
+    }
+
+  private:
+    int _fd;
+};
+
+#ifndef __linux__
+#define PERF_COUNT_HW_BRANCH_MISSES 0
+#endif
+
 #define ASSERT_EXPR(expr, expected) { \
   TinyRuleChecker::EvalResult eres = e.eval(expr); \
   if (!eres.error.empty()) { \
@@ -32,6 +93,37 @@
   } \
 }
 
+#define ASSERT_RULE(expr, expected) { \
+  TinyRuleChecker::Rule rule = e.compile(expr); \
+  if (!rule.error.empty()) { \
+    printf ("Error compiling %s\n", expr); \
+    printf ("Error: %s\n", rule.error.c_str()); \
+    printf (">> %s:%d\n", __FILE__, __LINE__); \
+    return false; \
+  } \
+  TinyRuleChecker::EvalResult eres = e.eval(rule); \
+  if (!eres.error.empty()) { \
+    printf ("Error evaluating compiled %s\n", expr); \
+    printf ("Error: %s\n", eres.error.c_str()); \
+    printf (">> %s:%d\n", __FILE__, __LINE__); \
+    return false; \
+  } \
+  if (eres.result != expected) { \
+    printf ("Error evaluating compiled %s, expected value %d, got %d\n", expr, expected, eres.result); \
+    printf (">> %s:%d\n", __FILE__, __LINE__); \
+    return false; \
+  } \
+}
+
+#define ASSERT_ERROR_RULE(expr, expected_error) { \
+  TinyRuleChecker::EvalResult eres = e.eval(e.compile(expr)); \
+  if (eres.error != expected_error) { \
+    printf ("Error evaluating compiled: %s\n - Expected Error: %s\n - Got Error     : %s\n", expr, expected_error, eres.error.c_str()); \
+    printf (">> %s:%d\n", __FILE__, __LINE__); \
+    return false; \
+  } \
+}
+
 bool test_all () {
   TinyRuleChecker e;
   e.setVarInt("a", 1);
@@ -131,70 +223,2924 @@ bool test_all () {
   return true;
 }
 
-bool benchmark(int npasses, int niterations) {
+bool test_compile () {
   TinyRuleChecker e;
-  e.setVarInt("myint", 1);
-  e.setVarFloat("myfloat", 2.0);
-  e.setVarString("mystr", "my string");
+  e.setVarInt("a", 100);
+  e.setVarFloat("b", 2.0);
+  e.setVarString("c", "my string");
 
-  for (int n = 0; n < npasses; n++) {
-    // test performance
-    std::chrono::time_point<std::chrono::system_clock> start, end;
-    start = std::chrono::system_clock::now();
-    for (int i = 0; i < niterations; i++) {
-      ASSERT_EXPR("myfloat.eq(1.9999999) || myint.eq(32)", false);
+  ASSERT_RULE("a.eq(100)", true);
+  ASSERT_RULE("!a.gte(99)", false);
+  ASSERT_RULE("a.eq(a)", true);
+  ASSERT_RULE("!a.neq(a)", true);
+  ASSERT_RULE("a.in([100, 'asdf', 1.2])", true);
+  ASSERT_RULE("a.in([1, a, 1.2])", true);
+  ASSERT_RULE("(a.gte(100) && (a.gt(99) || a.gt(97)))", true);
+  ASSERT_RULE("(a.gte(100) && a.gt(199)) || a.gt(101)", false);
+  ASSERT_RULE("(a.gte(101) && a.gt(199)) || a.gt(101) || a.gt(-12)", true);
+  ASSERT_RULE("b.eq(2.0) && c.contains('string')", true);
+
+  // variables are resolved on every evaluation
+  TinyRuleChecker::Rule rule = e.compile("a.gt(150)");
+  if (e.eval(rule).result) return false;
+  e.setVarInt("a", 200);
+  if (!e.eval(rule).result) return false;
+
+  // typed kernels are guarded by the variable type
+  rule = e.compile("a.gt(150) || c.contains('str')");
+  if (!e.eval(rule).result) return false;
+  e.setVarFloat("a", 1.5);
+  if (e.eval(rule).error != "type mismatch: type f vs i") return false;
+  e.setVarInt("a", 200);
+
+  ASSERT_ERROR_RULE("", "expecting expression");
+  ASSERT_ERROR_RULE("a.eq(2) &&", "expecting expression");
+  ASSERT_ERROR_RULE("a.eq(2) &", "unexpected token '&'");
+  ASSERT_ERROR_RULE("a.k(2)", "unknown method 'k'");
+  ASSERT_ERROR_RULE("j.eq(2)", "variable 'j' not found");
+  ASSERT_ERROR_RULE("a.in([1, j])", "variable 'j' not found");
+  ASSERT_ERROR_RULE("a.eq(2.00)", "type mismatch: type i vs f");
+
+  // stateful methods
+  int factor = 2;
+  e.setMethod("isTimes", [factor](
+    const TinyRuleChecker::VarValue &v1,
+    const TinyRuleChecker::VarValue &v2,
+    TinyRuleChecker::EvalResult &eval
+  ) {
+    eval.result = v1.intval == factor * v2.intval;
+    return true;
+  });
+  ASSERT_EXPR("a.isTimes(100)", true);
+  ASSERT_RULE("a.isTimes(100) && !a.isTimes(99)", true);
+
+  // prepared methods
+  ASSERT_RULE("c.in(['x', 'my string', 3])", true);
+  ASSERT_RULE("c.in(['x', 'my strin', 3])", false);
+  ASSERT_RULE("b.in([1.5, 2.0]) && !b.in([1.5, 2.5])", true);
+  ASSERT_RULE("c.in('this is my string example')", true);
+
+  static int nprepared = 0;
+  e.setMethod("oneOfDigits", [](
+    const TinyRuleChecker::VarValue &literal,
+    std::shared_ptr<void> &prepared,
+    std::string &error
+  ) {
+    if (literal.type != TinyRuleChecker::V_TYPE_STRING) {
+      error = "oneOfDigits expects a string";
+      return false;
     }
-    end = std::chrono::system_clock::now();
-    std::chrono::duration<double> elapsed_seconds = end-start;
-    printf(
-      "Pass %d: %.3f M ops/sec  (%d in %.3f seconds; 1 in %.3f nanoseconds)\n",
-      n+1,
-      ((float)niterations / 1e6) / elapsed_seconds.count(),
-      niterations,
-      elapsed_seconds.count(),
-      elapsed_seconds.count() / ((float)niterations / 1e9)
-    );
+    std::shared_ptr<bool[]> digits(new bool[10]());
+    for (char ch : literal.strval) digits[ch - '0'] = true;
+    prepared = digits;
+    nprepared++;
+    return true;
+  },
+  [](
+    const TinyRuleChecker::VarValue &v1,
+    const TinyRuleChecker::VarValue &v2,
+    const void *prepared,
+    TinyRuleChecker::EvalResult &eval
+  ) {
+    int digit = v1.intval % 10;
+    if (prepared) {
+      eval.result = ((const bool *)prepared)[digit];
+    }
+    else {
+      eval.result = v2.strval.find('0' + digit) != std::string::npos;
+    }
+    return true;
+  });
+  rule = e.compile("a.oneOfDigits('0123') && !a.oneOfDigits('789')");
+  for (int i = 0; i < 10; i++) {
+    if (!e.eval(rule).result) return false;
   }
+  if (nprepared != 2) return false;
+  ASSERT_EXPR("a.oneOfDigits('0123')", true);
+  ASSERT_ERROR_RULE("a.oneOfDigits(1)", "oneOfDigits expects a string");
 
-  for (int n = 0; n < npasses; n++) {
-    // test performance
-    std::chrono::time_point<std::chrono::system_clock> start, end;
-    start = std::chrono::system_clock::now();
-    const char *expression = "(myfloat.eq(1.9999999) || myint.eq(32)) && mystr.contains('string')";
-    size_t nbytes = strlen(expression);
-    size_t nbytesProcessed = 0;
-    for (int i = 0; i < niterations; i++) {
-      ASSERT_EXPR(expression, false);
-      nbytesProcessed += nbytes;
+  // frozen registry with lots of methods
+  for (int i = 0; i < 1024; i++) {
+    e.setMethod(("m" + std::to_string(i)).c_str(), [](
+      const TinyRuleChecker::VarValue &v1,
+      const TinyRuleChecker::VarValue &v2,
+      TinyRuleChecker::EvalResult &eval
+    ) {
+      eval.result = v1.intval == v2.intval;
+      return true;
+    });
+  }
+  if (!e.freezeMethods()) {
+    printf ("Error freezing methods\n");
+    return false;
+  }
+  ASSERT_EXPR("a.m0(200) && a.m1023(200) && a.eq(200)", true);
+  ASSERT_ERROR_EXPR("a.m1024(200)", "unknown method 'm1024'");
+  ASSERT_ERROR_EXPR("a.m(200)", "unknown method 'm'");
+
+  return true;
+}
+
+bool test_matches () {
+  TinyRuleChecker e;
+  e.setVarInt("a", 100);
+
+  // compare against std::regex
+  const char *patterns[] = {
+    "abc", "^abc", "abc$", "^abc$", "a.c", "a[bx]c", "a[^b]c", "[a-c]+z",
+    "ab*c", "ab+c", "ab?c", "a(bc|de)f", "(?:ab)+$", "^\\d{3}-\\d{2,4}$",
+    "\\w+@\\w+\\.com", "^(GET|POST) /", "[0-9]{1,3}(\\.[0-9]{1,3}){3}",
+    "\\s\\S+\\s", "x{2,}", "^$", "", "a|b|c", "^(a|b)c", "[\\d.]+", "a\\.b"
+  };
+  const char *texts[] = {
+    "", "abc", "xabcx", "ac", "abbbbc", "axc", "aXc", "abcabc", "adef",
+    "bcz", "555-1234", "555-12345", "joe@example.com", "GET / HTTP/1.1",
+    "POST /x", "10.0.0.255", "a b c", "xxx", "zz 3.14 zz", "a.b", "ab"
+  };
+
+  for (const char *pattern : patterns) {
+    std::regex stdRegex(pattern);
+    std::string expr = "c.matches('" + std::string(pattern) + "')";
+    TinyRuleChecker::Rule rule = e.compile(expr.c_str());
+    if (!rule.error.empty()) {
+      printf ("Error compiling %s: %s\n", expr.c_str(), rule.error.c_str());
+      return false;
+    }
+
+    for (const char *text : texts) {
+      e.setVarString("c", text);
+      bool expected = std::regex_search(text, stdRegex);
+      TinyRuleChecker::EvalResult eres = e.eval(rule);
+      TinyRuleChecker::EvalResult eresExpr = e.eval(expr.c_str());
+      if (eres.result != expected || eresExpr.result != expected) {
+        printf ("Error matching '%s' with '%s', expected %d\n", text, pattern, expected);
+        return false;
+      }
     }
-    end = std::chrono::system_clock::now();
-    std::chrono::duration<double> elapsed_seconds = end-start;
-    printf(
-      "Pass %d: %.3f MB/sec  (%ld in %.3f seconds; 1 in %.3f nanoseconds)\n",
-      n+1,
-      ((float)nbytesProcessed / 1e6) / elapsed_seconds.count(),
-      nbytesProcessed,
-      elapsed_seconds.count(),
-      elapsed_seconds.count() / ((float)nbytesProcessed / 1e9)
-    );
   }
 
-  // test performance of 1000 ops
-  for (int n = 0; n < npasses; n++) {
-    std::chrono::time_point<std::chrono::system_clock> start, end;
-    start = std::chrono::system_clock::now();
-    int thousand = 1000;
-    for (int i = 0; i < thousand; i++) {
-      ASSERT_EXPR("myfloat.eq(1.9999999) || myint.eq(32)", false);
+  // lazy dfa for patterns that would explode
+  e.setVarString("c", "xxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxaxxxxxxxxxxxxxxx");
+  ASSERT_RULE("c.matches('a.{14}$')", false);
+  ASSERT_RULE("c.matches('a.{15}$')", true);
+  ASSERT_RULE("c.matches('a.{16}$')", false);
+  ASSERT_RULE("c.matches('a.{10}')", true);
+
+  // lazy dfas are per thread
+  std::vector<std::thread> threads;
+  std::atomic<int> mismatches(0);
+  for (int t = 0; t < 4; t++) {
+    threads.emplace_back([&mismatches, t]() {
+      TinyRuleChecker checker;
+      TinyRuleChecker::Rule rule = checker.compile("c.matches('a.{15}$')");
+      for (int i = 0; i < 200; i++) {
+        std::string text = std::string((i + t) % 50, 'x') + "a" + std::string(i % 20, 'y');
+        checker.setVarString("c", text.c_str());
+        mismatches += (checker.eval(rule).result != (i % 20 == 15));
+      }
+    });
+  }
+  for (std::thread &thread : threads) {
+    thread.join();
+  }
+  if (mismatches) {
+    printf ("Error: %d wrong lazy dfa matches across threads\n", (int)mismatches);
+    return false;
+  }
+
+  e.setVarString("c", "Mozilla/5.0 (Windows NT 10.0; Win64; x64)");
+  ASSERT_EXPR("c.matches('Windows NT 1[0-9]')", true);
+  ASSERT_ERROR_RULE("c.matches('a(b')", "invalid regex 'a(b': expecting ')'");
+  ASSERT_ERROR_RULE("c.matches('a)')", "invalid regex 'a)': unbalanced ')'");
+  ASSERT_ERROR_RULE("c.matches('*a')", "invalid regex '*a': nothing to repeat");
+  ASSERT_ERROR_RULE("c.matches('^a|b')", "invalid regex '^a|b': anchors with '|' require a group, e.g. ^(a|b)$");
+
+  // nested repeats multiply, nested groups and repeats recurse
+  ASSERT_ERROR_RULE("c.matches('((a{1000}){1000}){1000}')", "invalid regex '((a{1000}){1000}){1000}': too large");
+  ASSERT_ERROR_RULE("c.matches('(a{1000}){200}')", "invalid regex '(a{1000}){200}': too large");
+  ASSERT_RULE("c.matches('(a{10}){10}')", false);
+  for (const std::string &pattern : { std::string(200000, '(') + "a" + std::string(200000, ')'), "a" + std::string(200000, '?') }) {
+    std::string expr = "c.matches('" + pattern + "')";
+    if (e.compile(expr.c_str()).error != "invalid regex '" + pattern + "': too large") {
+      printf ("Error: deeply nested regex accepted\n");
+      return false;
+    }
+  }
+  ASSERT_ERROR_RULE("c.matches(1)", "unsupported operation 'matches' with type 'i'");
+  ASSERT_ERROR_RULE("a.matches('x')", "unsupported operation 'matches' with type 'i'");
+  return true;
+}
+
+bool test_rulesets () {
+  TinyRuleChecker e;
+  e.setVarInt("a", 100);
+  e.setVarString("url", "/api/v2/users/42");
+  e.setVarString("host", "www.example.com");
+
+  std::vector<std::string> exprs = {
+    "url.startsWith('/api/')",
+    "url.startsWith('/api/v1/') || url.startsWith('/api/v2/')",
+    "url.startsWith('/api/v2/users/42/')",
+    "url.startsWith('') && host.endsWith('.com')",
+    "host.endsWith('example.com') && !host.endsWith('.org')",
+    "host.endsWith('www.example.com.')",
+    "url.startsWith('/api/') && a.gt(50)",
+    "url.contains('users') && a.gt(50)",
+    "a.gt(",
+    "missing.startsWith('/')",
+    "a.startsWith('/')",
+    "url.startsWith(url)",
+  };
+
+  TinyRuleChecker::RuleSet set = e.compile(exprs);
+  if (set.rules.size() != exprs.size()) return false;
+  if (set.predicates.size() != 14) {
+    printf ("Error: expecting 14 shared predicates, got %d\n", (int)set.predicates.size());
+    return false;
+  }
+
+  std::vector<TinyRuleChecker::EvalResult> results;
+  for (int pass = 0; pass < 2; pass++) {
+    e.eval(set, results);
+    for (size_t i = 0; i < exprs.size(); i++) {
+      TinyRuleChecker::EvalResult expected = e.eval(e.compile(exprs[i].c_str()));
+      if (results[i].error != expected.error || (expected.error.empty() && results[i].result != expected.result)) {
+        printf ("Error evaluating rule set: %s\n - expected %d (%s)\n - got %d (%s)\n",
+          exprs[i].c_str(), expected.result, expected.error.c_str(), results[i].result, results[i].error.c_str());
+        return false;
+      }
+    }
+    e.setVarString("url", "/api/v1/");
+    e.setVarString("host", "example.org");
+  }
+
+  ASSERT_EXPR("url.startsWith('/api') && !url.startsWith('/apix')", true);
+  ASSERT_EXPR("host.endsWith('.org') && !host.endsWith('com')", true);
+  ASSERT_ERROR_EXPR("a.endsWith('x')", "type mismatch: type i vs s");
+  return true;
+}
+
+bool test_casefold () {
+  for (int cache = 0; cache < 2; cache++) {
+    TinyRuleChecker e;
+    e.setCaseFoldCache(cache);
+    e.setVarInt("a", 100);
+    e.setVarString("host", "WWW.Example.COM");
+    e.setVarString("agent", "Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/120.0");
+    e.setVarString("method", "Post");
+
+    ASSERT_RULE("host.ieq('www.example.com')", true);
+    ASSERT_RULE("host.ieq('WWW.EXAMPLE.COM')", true);
+    ASSERT_RULE("host.ieq('www.example.co')", false);
+    ASSERT_RULE("host.ieq(host)", true);
+    ASSERT_RULE("agent.icontains('applewebkit')", true);
+    ASSERT_RULE("agent.icontains('CHROME/120')", true);
+    ASSERT_RULE("agent.icontains('chrome/121')", false);
+    ASSERT_RULE("agent.icontains('')", true);
+    ASSERT_RULE("method.iin(['GET', 'POST', 'PUT'])", true);
+    ASSERT_RULE("method.iin(['get', 'put'])", false);
+    ASSERT_RULE("method.iin('GET,POST')", true);
+    ASSERT_RULE("method.iin('get,PUT,xpOStx')", true);
+    ASSERT_RULE("method.iin('get,PUT,pos')", false);
+    ASSERT_RULE("method.iin(method)", true);
+    ASSERT_EXPR("method.iin('a long list: GET, HEAD, POST, PUT')", true);
+    ASSERT_EXPR("method.iin(['GET', 'pOsT'])", true);
+    ASSERT_EXPR("method.iin(['GET', 'PUT'])", false);
+    ASSERT_EXPR("host.ieq('www.EXAMPLE.com') && method.iin(['post'])", true);
+    ASSERT_ERROR_RULE("a.ieq('x')", "unsupported operation 'ieq' with type 'i'");
+    ASSERT_ERROR_RULE("host.icontains(1)", "unsupported operation 'icontains' with type 'i'");
+    ASSERT_ERROR_RULE("a.iin(['x'])", "unsupported operation 'iin' with type 'i'");
+
+    // non-letters are not folded
+    e.setVarString("c", "[@]^_`{}");
+    ASSERT_RULE("c.ieq('{`}~\x7f@[]')", false);
+    ASSERT_RULE("c.ieq('[@]^_`{}')", true);
+    e.setVarString("c", "Long Header Value With Mixed CASE, longer than 16 chars");
+    ASSERT_RULE("c.ieq('long header value with mixed case, longer than 16 chars')", true);
+    ASSERT_RULE("c.ieq('long header value with mixed case, longer than 16 charz')", false);
+    ASSERT_RULE("c.icontains('mixed case, LONGER than 16')", true);
+  }
+  return true;
+}
+
+bool test_contains () {
+  TinyRuleChecker e;
+
+  // compare against std::string::find around the SIMD block boundaries
+  const char *needles[] = { "a", "ab", "ba", "aab", "aaab", "abcabd", "xyz", "needle in a haystack!", "" };
+  for (size_t n = 0; n < 80; n++) {
+    for (size_t pos = 0; pos <= n; pos += 3) {
+      for (const char *needle : needles) {
+        std::string haystack(n, 'a');
+        for (size_t i = 0; i < n; i += 2) haystack[i] = 'b';
+        haystack.replace(pos, std::min(strlen(needle), n - pos), needle, std::min(strlen(needle), n - pos));
+        haystack.resize(n);
+
+        e.setVarString("c", haystack.c_str());
+        std::string expr = "c.contains('" + std::string(needle) + "')";
+        e.setVarString("n", needle);
+        bool expected = haystack.find(needle) != std::string::npos;
+        if (
+          e.eval(e.compile(expr.c_str())).result != expected ||
+          e.eval(expr.c_str()).result != expected ||
+          e.eval("n.in(c)").result != expected
+        ) {
+          printf ("Error searching '%s' in '%s', expected %d\n", needle, haystack.c_str(), expected);
+          return false;
+        }
+      }
+    }
+  }
+
+  e.setVarInt("a", 1);
+  ASSERT_ERROR_RULE("a.contains('x')", "unsupported operation 'contains' with type 'i'");
+  return true;
+}
+
+bool test_arrays () {
+  TinyRuleChecker e;
+  e.setVarInt("a", 1);
+  e.setVarArray("ids", std::vector<int32_t>{ 42, 7, 1000, 7, -3 });
+  e.setVarArray("tags", std::vector<std::string>{ "red", "green", "blue" });
+  e.setVarArray("none", std::vector<int32_t>{});
+
+  ASSERT_RULE("ids.containsAny([1, 2, 7])", true);
+  ASSERT_RULE("ids.containsAny([1, 2, 3])", false);
+  ASSERT_RULE("ids.containsAny(-3)", true);
+  ASSERT_RULE("ids.containsAll([7, 42, -3])", true);
+  ASSERT_RULE("ids.containsAll([7, 42, 43])", false);
+  ASSERT_RULE("ids.containsAll([7, 7.0])", false);
+  ASSERT_RULE("ids.containsAll([])", true);
+  ASSERT_RULE("ids.containsAny([])", false);
+  ASSERT_RULE("ids.containsAny([''])", false);
+  ASSERT_RULE("none.containsAny([1])", false);
+  ASSERT_RULE("tags.containsAny(['yellow', 'blue'])", true);
+  ASSERT_RULE("tags.containsAll(['red', 'blue'])", true);
+  ASSERT_RULE("tags.containsAll(['red', 'Blue'])", false);
+  ASSERT_RULE("tags.intersects(['green', 42])", true);
+  ASSERT_RULE("ids.intersects(tags)", false);
+  ASSERT_RULE("ids.intersects(ids)", true);
+  ASSERT_RULE("ids.containsAll([a, 7])", false);
+  ASSERT_EXPR("tags.containsAny(['red']) && !tags.containsAll(['red', 'black'])", true);
+  ASSERT_RULE("a.in(ids)", false);
+  ASSERT_ERROR_RULE("a.containsAny([1])", "unsupported operation 'containsAny' with type 'i'");
+  ASSERT_ERROR_RULE("a.containsAll([1])", "unsupported operation 'containsAll' with type 'i'");
+
+  // compare against std::set_intersection/std::includes around block sizes
+  srand(1);
+  for (int n = 0; n < 500; n++) {
+    std::vector<int32_t> v1, v2;
+    for (int i = rand() % 40; i > 0; i--) v1.push_back(rand() % 60);
+    for (int i = rand() % (n < 250 ? 40 : 4); i > 0; i--) v2.push_back(rand() % 60);
+    if (n % 3 == 0) v2 = std::vector<int32_t>(v1.begin(), v1.begin() + v1.size() / 2);
+
+    e.setVarArray("v1", v1);
+    e.setVarArray("v2", v2);
+    std::sort(v1.begin(), v1.end());
+    std::sort(v2.begin(), v2.end());
+    v1.erase(std::unique(v1.begin(), v1.end()), v1.end());
+    v2.erase(std::unique(v2.begin(), v2.end()), v2.end());
+    std::vector<int32_t> common;
+    std::set_intersection(v1.begin(), v1.end(), v2.begin(), v2.end(), std::back_inserter(common));
+
+    std::string literal = "[";
+    for (int32_t v : v2) literal += std::to_string(v) + (v == v2.back() ? "" : ",");
+    literal += "]";
+    std::string any = "v1.containsAny(" + literal + ")";
+    std::string all = "v1.containsAll(" + literal + ")";
+
+    bool expectedAny = !common.empty();
+    bool expectedAll = std::includes(v1.begin(), v1.end(), v2.begin(), v2.end());
+    if (
+      e.eval(e.compile(any.c_str())).result != expectedAny ||
+      e.eval(any.c_str()).result != expectedAny ||
+      e.eval("v1.intersects(v2)").result != expectedAny ||
+      e.eval(e.compile(all.c_str())).result != expectedAll ||
+      e.eval("v1.containsAll(v2)").result != expectedAll
+    ) {
+      printf ("Error evaluating %s / %s, expected %d / %d\n", any.c_str(), all.c_str(), expectedAny, expectedAll);
+      return false;
+    }
+  }
+
+  // arrays set as values, in any order
+  auto array = [](std::initializer_list<TinyRuleChecker::VarValue> items) {
+    TinyRuleChecker::VarValue v;
+    v.type = TinyRuleChecker::V_TYPE_ARRAY;
+    v.array = items;
+    return v;
+  };
+  auto num = [](int i) {
+    TinyRuleChecker::VarValue v;
+    v.type = TinyRuleChecker::V_TYPE_INT;
+    v.intval = i;
+    return v;
+  };
+  auto str = [](const char *s) {
+    TinyRuleChecker::VarValue v;
+    v.type = TinyRuleChecker::V_TYPE_STRING;
+    v.strval = s;
+    return v;
+  };
+  TinyRuleChecker::VarValue values[] = { array({ num(5), num(1), num(3), num(1) }), array({ str("zz"), str("bb"), str("aa"), num(2) }) };
+  e.setVars(e.bindingPlan({ "ids", "tags" }), values);
+  e.setVarTree("u", { "", {}, { { "ids", values[0], {} } } });
+  e.setDerivedVar("odd", { "ids" }, [](const std::vector<const TinyRuleChecker::VarValue *> &inputs, TinyRuleChecker::VarValue &value, std::string &) {
+    value.type = TinyRuleChecker::V_TYPE_ARRAY;
+    for (auto it = inputs[0]->array.rbegin(); it != inputs[0]->array.rend(); ++it) {
+      if (it->intval % 2) value.array.push_back(*it);
+    }
+    return true;
+  });
+  const char *unsorted[] = {
+    "ids.containsAny([1])", "ids.containsAll([1, 3])", "ids.containsAll([1, 3, 5])", "ids.intersects(odd)",
+    "tags.containsAll(['aa'])", "tags.containsAll(['bb', 'zz', 2])", "tags.containsAny(['zz'])",
+    "u.ids.containsAny([3])", "u.ids.containsAll(odd)", "odd.containsAll([1, 3, 5])", "odd.containsAny([3])",
+  };
+  for (const char *expr : unsorted) {
+    if (!e.eval(expr).result || !e.eval(e.compile(expr)).result) {
+      printf ("Error evaluating %s on an unsorted array\n", expr);
+      return false;
+    }
+  }
+  TinyRuleChecker::RecordBatch batch = { { "ids", "tags" }, values, 1 };
+  std::vector<TinyRuleChecker::EvalResult> results;
+  e.evalBatch(e.compile("ids.containsAll([1, 3]) && tags.containsAll(['aa']) && odd.containsAny([5])"), batch, results);
+  if (!results[0].result) {
+    printf ("Error evaluating a batch with unsorted arrays\n");
+    return false;
+  }
+  return true;
+}
+
+bool test_bits () {
+  TinyRuleChecker e;
+  e.setVarInt("flags", 0x14);
+  e.setVarInt("perms", (int)0x80000001);
+  e.setVarFloat("f", 1.0);
+
+  ASSERT_RULE("flags.hasAllBits(0x4)", true);
+  ASSERT_RULE("flags.hasAllBits(0x14)", true);
+  ASSERT_RULE("flags.hasAllBits(0x15)", false);
+  ASSERT_RULE("flags.hasAnyBits(0x5)", true);
+  ASSERT_RULE("flags.hasAnyBits(0x3)", false);
+  ASSERT_RULE("flags.hasNoBits(0x3)", true);
+  ASSERT_RULE("flags.hasNoBits(0X10)", false);
+  ASSERT_RULE("flags.hasAllBits(20)", true);
+  ASSERT_RULE("flags.hasAllBits(flags)", true);
+  ASSERT_RULE("perms.hasAllBits(0x80000000)", true);
+  ASSERT_RULE("perms.hasAllBits(0xFFFFFFFF)", false);
+  ASSERT_RULE("perms.hasAllBits(-0x7fffffff)", true);
+  ASSERT_RULE("perms.eq(-0x7FFFFFFF)", true);
+  ASSERT_EXPR("flags.hasAllBits(0x4) && !flags.hasAnyBits(0x1)", true);
+  ASSERT_ERROR_RULE("f.hasAllBits(1)", "unsupported operation 'hasAllBits' with type 'f'");
+  ASSERT_ERROR_RULE("flags.hasAnyBits('1')", "unsupported operation 'hasAnyBits' with type 's'");
+  ASSERT_ERROR_RULE("flags.hasNoBits(1.0)", "unsupported operation 'hasNoBits' with type 'f'");
+  ASSERT_ERROR_RULE("flags.eq(0x)", "expecting ')'");
+  return true;
+}
+
+bool test_parser () {
+  TinyRuleChecker e;
+  e.setVarInt("a", 100);
+
+  // '&&' binds tighter than '||'
+  ASSERT_EXPR("a.eq(1) && a.eq(1) || a.eq(100)", true);
+  ASSERT_EXPR("a.eq(100) || a.eq(1) && a.eq(1)", true);
+  ASSERT_EXPR("a.eq(1) || a.eq(100) && a.eq(1)", false);
+  ASSERT_EXPR("a.eq(1) && (a.eq(1) || a.eq(100))", false);
+  ASSERT_RULE("a.eq(1) && a.eq(1) || a.eq(100)", true);
+  ASSERT_RULE("a.eq(1) || a.eq(100) && a.eq(1)", false);
+  ASSERT_RULE("a.eq(100) && a.eq(1) || a.eq(1) && a.eq(100) || a.eq(100) && a.eq(100)", true);
+  ASSERT_EXPR("!!a.eq(100)", true);
+  ASSERT_RULE("!!!a.eq(100)", false);
+  ASSERT_EXPR("((((a.eq(100)))))", true);
+  ASSERT_RULE("((a.eq(1) || (a.eq(100))) && ((a.eq(100))))", true);
+  ASSERT_ERROR_EXPR("(a.eq(100)", "expecting ')'");
+  ASSERT_ERROR_EXPR("((a.eq(100)) || a.eq(1)", "expecting ')'");
+  ASSERT_ERROR_EXPR("a.eq(100))", "unexpected token ')'");
+  ASSERT_ERROR_EXPR("()", "expecting identifier");
+  ASSERT_ERROR_EXPR("!", "expecting statement");
+  ASSERT_ERROR_RULE("a.eq(100) && || a.eq(1)", "expecting identifier");
+
+  // long and deeply nested expressions don't use the native stack
+  std::string chain, nested;
+  for (int i = 0; i < 100000; i++) {
+    chain += (i == 0) ? "a.eq(1)" : (i == 50000 ? " || a.eq(100)" : " && a.eq(1)");
+    nested += "(";
+  }
+  nested += "a.eq(100)" + std::string(100000, ')');
+
+  ASSERT_EXPR(chain.c_str(), false);
+  ASSERT_RULE(chain.c_str(), false);
+  ASSERT_EXPR(nested.c_str(), true);
+  ASSERT_RULE(nested.c_str(), true);
+  return true;
+}
+
+bool test_limits () {
+  TinyRuleChecker e;
+  e.setVarInt("a", 100);
+  e.setVarString("big", std::string(1 << 20, 'x').c_str());
+
+  TinyRuleChecker::EvalLimits limits = {};
+  limits.maxSteps = 10;
+  e.setEvalLimits(limits);
+
+  const char *tenTerms = "a.gt(1) && a.gt(2) && a.gt(3) && a.gt(4) && a.gt(5) && a.gt(6) && a.gt(7) && a.gt(8) && a.gt(9) && a.gt(10)";
+  std::string elevenTerms = std::string(tenTerms) + " && a.gt(11)";
+  ASSERT_EXPR(tenTerms, true);
+  ASSERT_RULE(tenTerms, true);
+  ASSERT_ERROR_EXPR(elevenTerms.c_str(), "budget exceeded");
+  ASSERT_ERROR_RULE(elevenTerms.c_str(), "budget exceeded");
+  if (e.eval(e.compile(elevenTerms.c_str())).status != TinyRuleChecker::EVAL_BUDGET_EXCEEDED) return false;
+  if (e.eval("a.eq('x')").status != TinyRuleChecker::EVAL_ERROR) return false;
+  if (e.eval(tenTerms).status != TinyRuleChecker::EVAL_OK) return false;
+
+  // big operands cost more steps, and are refused before running
+  std::string hugeArray = "a.in([";
+  for (int i = 0; i < 1000; i++) hugeArray += std::to_string(i) + ",";
+  hugeArray += "1000])";
+  ASSERT_ERROR_RULE(hugeArray.c_str(), "budget exceeded");
+  ASSERT_ERROR_EXPR("big.contains('y')", "budget exceeded");
+
+  // literals are charged while parsed, and compiling through the rule cache
+  // is paid for before preparing them
+  TinyRuleChecker parsing;
+  parsing.setVarInt("a", 1);
+  parsing.setEvalLimits(limits);
+  std::string hugeMatch = "a.eq(2) || a.eq(1) && !a.in(" + hugeArray.substr(5, hugeArray.size() - 6) + ")";
+  std::string longPattern = "a.eq(1) || a.matches('" + std::string(1000, 'x') + "')";
+  for (const std::string &expr : { hugeMatch, longPattern }) {
+    for (int i = 0; i < 3; i++) {
+      TinyRuleChecker::EvalResult er = parsing.eval(expr.c_str());
+      if (er.status != TinyRuleChecker::EVAL_BUDGET_EXCEEDED || parsing.ruleCacheStats().entries != 0) {
+        printf ("Error: expression parsed over budget: %s\n", er.error.c_str());
+        return false;
+      }
+    }
+  }
+
+  // partial rule set results
+  std::vector<std::string> exprs;
+  for (int i = 0; i < 8; i++) {
+    exprs.push_back("a.gt(" + std::to_string(i) + ") && a.lt(" + std::to_string(200 + i) + ")");
+  }
+  TinyRuleChecker::RuleSet set = e.compile(exprs);
+  std::vector<TinyRuleChecker::EvalResult> results;
+  e.eval(set, results);
+  for (int i = 0; i < 8; i++) {
+    TinyRuleChecker::EvalStatus expected = (i < 5) ? TinyRuleChecker::EVAL_OK : TinyRuleChecker::EVAL_BUDGET_EXCEEDED;
+    if (results[i].status != expected || results[i].result != (i < 5)) {
+      printf ("Error: rule %d of partial rule set, status %d\n", i, results[i].status);
+      return false;
+    }
+  }
+
+  // time budget
+  std::string longExpr = "a.eq(100)";
+  for (int i = 0; i < 100000; i++) longExpr += " && a.gt(1)";
+  limits.maxSteps = 0;
+  limits.maxMicros = 100;
+  e.setEvalLimits(limits);
+  TinyRuleChecker::Rule longRule = e.compile(longExpr.c_str());
+  ASSERT_RULE(tenTerms, true);
+  if (e.eval(longRule).status != TinyRuleChecker::EVAL_BUDGET_EXCEEDED) return false;
+
+  // cancellation, from another thread
+  std::atomic<bool> cancel(false);
+  limits.maxMicros = 0;
+  limits.cancel = &cancel;
+  e.setEvalLimits(limits);
+  ASSERT_RULE(tenTerms, true);
+  std::thread canceller([&cancel]() {
+    std::this_thread::sleep_for(std::chrono::milliseconds(5));
+    cancel = true;
+  });
+  TinyRuleChecker::EvalResult er;
+  do {
+    er = e.eval(longRule);
+  } while (er.status == TinyRuleChecker::EVAL_OK);
+  canceller.join();
+  if (er.status != TinyRuleChecker::EVAL_CANCELLED || er.error != "evaluation cancelled") return false;
+  ASSERT_ERROR_EXPR("a.eq(100)", "evaluation cancelled");
+
+  // no limits
+  e.setEvalLimits({});
+  ASSERT_RULE(longExpr.c_str(), true);
+  ASSERT_RULE(hugeArray.c_str(), true);
+  return true;
+}
+
+bool test_cache () {
+  TinyRuleChecker e;
+  e.setVarInt("a", 100);
+  e.setRuleCache(2);
+
+  // compiled the second time it's seen, then cached
+  for (int i = 0; i < 3; i++) {
+    ASSERT_EXPR("a.gt(50) && a.lt(150)", true);
+  }
+  TinyRuleChecker::RuleCache::Stats stats = e.ruleCacheStats();
+  if (stats.hits != 1 || stats.misses != 2 || stats.entries != 1) {
+    printf ("Error: unexpected cache stats %d/%d/%d\n", (int)stats.hits, (int)stats.misses, (int)stats.entries);
+    return false;
+  }
+
+  // variables are read on every evaluation
+  e.setVarInt("a", 10);
+  ASSERT_EXPR("a.gt(50) && a.lt(150)", false);
+
+  // errors are the same as interpreted, compiled or not
+  for (int i = 0; i < 3; i++) {
+    ASSERT_ERROR_EXPR("a.gt(50) && a.lt(", "expecting value, got EOF");
+    ASSERT_ERROR_EXPR("a.eq('x') || a.eq(", "type mismatch: type i vs s");
+    ASSERT_ERROR_EXPR("a.matches('(')", "unsupported operation 'matches' with type 'i'");
+    ASSERT_ERROR_EXPR("b.eq(1)", "variable 'b' not found");
+  }
+
+  // least recently used are evicted
+  for (int i = 0; i < 2; i++) {
+    ASSERT_EXPR("a.eq(1)", false);
+    ASSERT_EXPR("a.eq(2)", false);
+    ASSERT_EXPR("a.eq(10)", true);
+  }
+  stats = e.ruleCacheStats();
+  if (stats.entries != 2 || stats.evictions == 0) return false;
+
+  // methods set afterwards are seen by cached rules
+  ASSERT_EXPR("a.eq(10)", true);
+  e.setMethod("eq", [](const TinyRuleChecker::VarValue &, const TinyRuleChecker::VarValue &, TinyRuleChecker::EvalResult &eval) {
+    eval.result = false;
+    return true;
+  });
+  ASSERT_EXPR("a.eq(10)", false);
+  if (e.ruleCacheStats().entries != 0) return false;
+
+  // bounded memory
+  e.setRuleCache(1000, 16 * 1024);
+  for (int i = 0; i < 1000; i++) {
+    std::string expr = "a.in([" + std::to_string(i) + ", 2, 3, 4, 5, 6, 7, 8])";
+    e.eval(expr.c_str());
+    e.eval(expr.c_str());
+  }
+  stats = e.ruleCacheStats();
+  if (stats.bytes > 16 * 1024 || stats.entries == 0 || stats.entries == 1000) return false;
+
+  // shared by checkers in several threads
+  std::shared_ptr<TinyRuleChecker::RuleCache> shared = std::make_shared<TinyRuleChecker::RuleCache>(8, 0, true);
+  std::atomic<int> failures(0);
+  std::vector<std::thread> threads;
+  for (int t = 0; t < 4; t++) {
+    threads.emplace_back([shared, t, &failures]() {
+      TinyRuleChecker e;
+      e.setRuleCache(shared);
+      e.setVarInt("a", t);
+      for (int i = 0; i < 20000; i++) {
+        std::string expr = "a.eq(" + std::to_string(i % 12) + ")";
+        if (e.eval(expr.c_str()).result != (i % 12 == t)) {
+          failures++;
+        }
+      }
+    });
+  }
+  for (std::thread &thread : threads) {
+    thread.join();
+  }
+  if (failures != 0 || shared->stats().hits == 0) return false;
+
+  // checkers with other methods don't run each other's rules
+  TinyRuleChecker plain, custom, none(false);
+  custom.setMethod("eq", [](const TinyRuleChecker::VarValue &, const TinyRuleChecker::VarValue &, TinyRuleChecker::EvalResult &eval) {
+    eval.result = true;
+    return true;
+  });
+  for (TinyRuleChecker *checker : { &plain, &custom, &none }) {
+    checker->setRuleCache(shared);
+    checker->setVarInt("a", 1);
+  }
+  for (int i = 0; i < 3; i++) {
+    if (
+      plain.eval("a.eq(2)").result || !custom.eval("a.eq(2)").result ||
+      none.eval("a.eq(2)").error != "unknown method 'eq'"
+    ) {
+      printf ("Error: shared rule cache mixes methods of different checkers\n");
+      return false;
+    }
+  }
+  return true;
+}
+
+bool test_packs () {
+  TinyRuleChecker e;
+  std::vector<std::string> exprs = {
+    "url.startsWith('/api/') && method.eq('GET')",
+    "url.startsWith('/api/v2/') || url.endsWith('.css')",
+    "url.matches('^/api/v[0-9]+/users/[0-9]+$') && !ua.icontains('bot')",
+    "code.in([200, 201, 204]) || code.gte(500) && ratio.lt(0.5)",
+    "tags.containsAny(['a', 'b']) && code.hasNoBits(0x1)",
+    "ua.eq(method) || code.in([1, [2, 3], 'x', 4.5])",
+    "code.eq(",
+    "missing.eq(1)",
+  };
+  TinyRuleChecker::RuleSet set = e.compile(exprs);
+
+  std::string pack = e.serialize(set);
+  TinyRuleChecker::RuleSet loaded, fromFile;
+  std::string error;
+  if (!e.deserialize(pack.data(), pack.size(), loaded, error)) {
+    printf ("Error deserializing rule set: %s\n", error.c_str());
+    return false;
+  }
+  if (!e.save(set, "tinyrulechecker_test.pack", error) || !e.load("tinyrulechecker_test.pack", fromFile, error)) {
+    printf ("Error saving/loading rule set: %s\n", error.c_str());
+    return false;
+  }
+  remove("tinyrulechecker_test.pack");
+  if (e.serialize(fromFile) != pack) return false;
+
+  const char *urls[] = { "/api/v2/users/42", "/static/site.css", "/api/v1/x" };
+  std::vector<TinyRuleChecker::EvalResult> expected, results, resultsFromFile;
+  for (int i = 0; i < 3; i++) {
+    e.setVarString("url", urls[i]);
+    e.setVarString("method", i ? "GET" : "POST");
+    e.setVarString("ua", i == 1 ? "GET" : "GoogleBot");
+    e.setVarInt("code", 200 + i * 300);
+    e.setVarFloat("ratio", 0.25f * i);
+    e.setVarArray("tags", std::vector<std::string>{ urls[i] + 1, "b" });
+
+    e.eval(set, expected);
+    e.eval(loaded, results);
+    e.eval(fromFile, resultsFromFile);
+    for (size_t j = 0; j < exprs.size(); j++) {
+      if (
+        results[j].result != expected[j].result || results[j].error != expected[j].error ||
+        resultsFromFile[j].result != expected[j].result || resultsFromFile[j].error != expected[j].error
+      ) {
+        printf ("Error evaluating loaded rule: %s\n - expected %d (%s)\n - got %d (%s)\n",
+          exprs[j].c_str(), expected[j].result, expected[j].error.c_str(), results[j].result, results[j].error.c_str());
+        return false;
+      }
+    }
+  }
+
+  // invalid packs
+  std::string corrupted = pack;
+  corrupted[corrupted.size() / 2] ^= 1;
+  std::string newer = pack;
+  newer[8] = 3;
+  TinyRuleChecker noMethods(false);
+  struct {
+    TinyRuleChecker *checker;
+    std::string      pack;
+    const char      *error;
+  } invalid[] = {
+    { &e, corrupted, "pack checksum mismatch" },
+    { &e, pack.substr(0, pack.size() - 8), "truncated pack" },
+    { &e, newer, "unsupported pack version 3" },
+    { &e, "#!/bin/sh\n", "not a rule set pack" },
+    { &noMethods, pack, "unknown method 'startsWith'" },
+  };
+  for (auto &test : invalid) {
+    if (test.checker->deserialize(test.pack.data(), test.pack.size(), loaded, error) || error != test.error) {
+      printf ("Error: expecting '%s' loading pack, got '%s'\n", test.error, error.c_str());
+      return false;
+    }
+  }
+  if (!loaded.rules.empty()) return false;
+
+  // programs that can't run, written with a valid checksum
+  TinyRuleChecker::Instruction s0 = { TinyRuleChecker::OP_STATEMENT, 0 };
+  std::vector<std::vector<TinyRuleChecker::Instruction>> programs = {
+    { { TinyRuleChecker::OP_AND, 0 } },
+    { { TinyRuleChecker::OP_NOT, 0 }, s0 },
+    { s0, s0 },
+    { s0, { (TinyRuleChecker::OpCode)'x', 0 } },
+  };
+  for (const auto &program : programs) {
+    TinyRuleChecker::RuleSet bad = set;
+    bad.rules[0].program = program;
+    std::string badPack = e.serialize(bad);
+    if (e.deserialize(badPack.data(), badPack.size(), loaded, error) || error != "corrupted pack") {
+      printf ("Error: pack with invalid program loaded (%s)\n", error.c_str());
+      return false;
+    }
+  }
+
+  // string indexes that would read or write out of bounds
+  if (set.stringIndexes.empty()) return false;
+  for (int i = 0; i < 4; i++) {
+    TinyRuleChecker::RuleSet bad = set;
+    TinyRuleChecker::StringIndex &index = bad.stringIndexes[0];
+    TinyRuleChecker::TrieNode &node = index.nodes[i == 3 ? 0 : index.nodes.size() - 1];
+    switch (i) {
+      case 0: node.matches.push_back(50000000); break;
+      case 1: index.type = TinyRuleChecker::INDEX_EQUAL; break;
+      case 2: index.nodes[0].edges.push_back({ 0, 0 }); break;
+      case 3: node.edges.push_back(node.edges[0]); break;
+    }
+    std::string badPack = e.serialize(bad);
+    if (e.deserialize(badPack.data(), badPack.size(), loaded, error) || error != "corrupted pack") {
+      printf ("Error: pack with invalid string index %d loaded (%s)\n", i, error.c_str());
+      return false;
+    }
+  }
+
+  // the stack depth is computed again, not read from the pack
+  TinyRuleChecker::RuleSet deep = set;
+  deep.rules[0].program.assign(200, s0);
+  deep.rules[0].program.insert(deep.rules[0].program.end(), 199, { TinyRuleChecker::OP_OR, 0 });
+  deep.rules[0].maxDepth = 1;
+  std::string deepPack = e.serialize(deep);
+  if (!e.deserialize(deepPack.data(), deepPack.size(), loaded, error) || loaded.rules[0].maxDepth != 200) {
+    printf ("Error loading deep program: %s\n", error.c_str());
+    return false;
+  }
+  e.setVarString("url", "/api/x");
+  e.eval(loaded, results);
+  if (!results[0].result) return false;
+
+  if (e.load("/nonexistent/rules.pack", loaded, error) || error != "can't open '/nonexistent/rules.pack'") return false;
+  return true;
+}
+
+bool test_reload () {
+  TinyRuleChecker e;
+  e.setVarInt("a", 10);
+
+  // version v has v rules
+  auto build = [&e](uint64_t version) {
+    std::vector<std::string> exprs;
+    for (uint64_t i = 0; i < version; i++) {
+      exprs.push_back("a.gt(" + std::to_string(i) + ")");
+    }
+    return std::make_shared<const TinyRuleChecker::RuleSet>(e.compile(exprs));
+  };
+
+  TinyRuleChecker::SharedRuleSet shared(build(1));
+  uint64_t version;
+  std::shared_ptr<const TinyRuleChecker::RuleSet> held = shared.acquire(&version);
+  if (version != 1 || held->rules.size() != 1) return false;
+
+  // readers keep their version until they drop it
+  if (shared.publish(build(2)) != 2 || shared.version() != 2) return false;
+  if (held->rules.size() != 1 || shared.acquire()->rules.size() != 2) return false;
+  if (shared.reclaim() != 1) return false;
+  held = NULL;
+  if (shared.reclaim() != 0) return false;
+
+  std::vector<TinyRuleChecker::EvalResult> results;
+  if (e.eval(shared, results) != 2 || results.size() != 2 || !results[1].result) return false;
+
+  // evaluators in other threads while publishing
+  std::vector<std::shared_ptr<const TinyRuleChecker::RuleSet>> sets;
+  for (uint64_t v = 3; v <= 50; v++) {
+    sets.push_back(build(v));
+  }
+
+  std::atomic<bool> done(false);
+  std::atomic<int> failures(0);
+  std::vector<std::thread> readers;
+  for (int t = 0; t < 4; t++) {
+    readers.emplace_back([&shared, &done, &failures]() {
+      TinyRuleChecker e;
+      e.setVarInt("a", 10);
+      std::vector<TinyRuleChecker::EvalResult> results;
+      uint64_t last = 0;
+      while (!done) {
+        uint64_t version = e.eval(shared, results);
+        if (results.size() != version || version < last) {
+          failures++;
+        }
+        for (size_t i = 0; i < results.size(); i++) {
+          if (results[i].result != (i < 10)) {
+            failures++;
+          }
+        }
+        last = version;
+      }
+    });
+  }
+
+  for (std::shared_ptr<const TinyRuleChecker::RuleSet> &set : sets) {
+    shared.publish(set);
+    std::this_thread::sleep_for(std::chrono::microseconds(200));
+  }
+  sets.clear();
+  done = true;
+  for (std::thread &reader : readers) {
+    reader.join();
+  }
+  return failures == 0 && shared.version() == 50 && shared.reclaim() == 0;
+}
+
+bool test_updates () {
+  TinyRuleChecker e;
+  auto randomExpr = []() {
+    std::string n = std::to_string(rand() % 3000);
+    switch (rand() % 5) {
+      case 0: return "url.startsWith('/" + n + "') && code.eq(" + std::to_string(rand() % 4) + ")";
+      case 1: return "url.endsWith('" + n + ".css') || url.startsWith('/" + n.substr(0, 1) + "')";
+      case 2: return "!ua.startsWith('" + n + "') && code.in([1, 2, " + n + "])";
+      case 3: return "code.eq(" + n + ") || ua.endsWith('" + n.substr(0, 2) + "')";
+      default: return std::string(rand() % 8 ? "url.startsWith('/1')" : "code.eq(");
+    }
+  };
+
+  // starts from a loaded set, which has no predicate keys
+  std::vector<std::string> exprs;
+  for (int i = 0; i < 300; i++) {
+    exprs.push_back(randomExpr());
+  }
+  std::string pack = e.serialize(e.compile(exprs));
+  TinyRuleChecker::RuleSet set;
+  std::string error;
+  if (!e.deserialize(pack.data(), pack.size(), set, error)) return false;
+
+  std::vector<bool> removed(exprs.size(), false);
+  std::vector<TinyRuleChecker::EvalResult> expected, results;
+  bool compacted = false;
+  for (int op = 0; op < 6000; op++) {
+    uint32_t i = rand() % exprs.size();
+    switch (rand() % 4) {
+      case 0:
+        exprs.push_back(randomExpr());
+        removed.push_back(false);
+        if (e.addRule(set, exprs.back().c_str()) != exprs.size() - 1) return false;
+        break;
+      case 1:
+        removed[i] = true;
+        if (!e.removeRule(set, i)) return false;
+        break;
+      default:
+        exprs[i] = randomExpr();
+        removed[i] = false;
+        if (!e.replaceRule(set, i, exprs[i].c_str())) return false;
+        break;
+    }
+    compacted |= (set.deadPredicates == 0 && op > 1000);
+
+    if (op % 500 != 499) {
+      continue;
+    }
+
+    // same results as the set compiled from scratch
+    std::vector<std::string> live;
+    for (size_t j = 0; j < exprs.size(); j++) {
+      live.push_back(removed[j] ? "url.eq(1) && code.eq(1)" : exprs[j]);
+    }
+    TinyRuleChecker::RuleSet fresh = e.compile(live);
+    for (int k = 0; k < 4; k++) {
+      e.setVarString("url", ("/" + std::to_string(rand() % 3000) + "/x" + std::to_string(rand() % 3000) + ".css").c_str());
+      e.setVarString("ua", std::to_string(rand() % 3000).c_str());
+      e.setVarInt("code", k);
+      e.eval(fresh, expected);
+      e.eval(set, results);
+      for (size_t j = 0; j < exprs.size(); j++) {
+        bool result = removed[j] ? false : expected[j].result;
+        const std::string &error = removed[j] ? std::string() : expected[j].error;
+        if (results[j].result != result || results[j].error != error) {
+          printf ("Error evaluating updated rule: %s\n - expected %d (%s)\n - got %d (%s)\n",
+            exprs[j].c_str(), result, error.c_str(), results[j].result, results[j].error.c_str());
+          return false;
+        }
+      }
+    }
+
+    // compacted sets have the same predicates
+    TinyRuleChecker::RuleSet copy = set;
+    e.compact(copy);
+    for (size_t j = 0; j < exprs.size(); j++) {
+      if (removed[j]) e.removeRule(fresh, j);
+    }
+    e.compact(fresh);
+    if (copy.deadPredicates != 0 || copy.predicates.size() != fresh.predicates.size()) return false;
+  }
+
+  return compacted && !e.replaceRule(set, exprs.size(), "code.eq(1)") && !e.removeRule(set, exprs.size());
+}
+
+bool test_compileAll () {
+  TinyRuleChecker e;
+  std::vector<std::string> exprs;
+  for (int i = 0; i < 5000; i++) {
+    std::string n = std::to_string(rand() % 2000);
+    switch (i % 6) {
+      case 0: exprs.push_back("url.startsWith('/" + n + "') && code.eq(" + std::to_string(i % 7) + ")"); break;
+      case 1: exprs.push_back("url.endsWith('" + n + ".css') || ua.icontains('bot')"); break;
+      case 2: exprs.push_back("ua.matches('^Mozilla/[0-9]+') && !code.in([1, 2, " + n + "])"); break;
+      case 3: exprs.push_back("tags.containsAny(['a', '" + n + "']) || code.hasAnyBits(0x" + n + ")"); break;
+      case 4: exprs.push_back(i % 60 == 4 ? "code.eq(" : "code.gt(" + n + ") && url.neq(ua)"); break;
+      default: exprs.push_back("nope.unknownMethod(1) || code.eq(1)"); break;
+    }
+  }
+
+  std::string expected = e.serialize(e.compile(exprs));
+  for (unsigned nthreads : {1, 2, 3, 8, 0}) {
+    TinyRuleChecker::RuleSet set = e.compileAll(exprs, nthreads);
+    if (e.serialize(set) != expected) {
+      printf ("Error: compileAll with %u threads differs from compile\n", nthreads);
+      return false;
+    }
+
+    // can be updated afterwards, sharing its predicates
+    size_t npredicates = set.predicates.size();
+    e.addRule(set, exprs[0].c_str());
+    if (set.predicates.size() != npredicates || set.predicateRefs.size() != npredicates) return false;
+  }
+
+  TinyRuleChecker::RuleSet empty = e.compileAll(std::vector<std::string>());
+  return empty.rules.empty() && empty.predicates.empty();
+}
+
+bool test_priorities () {
+  TinyRuleChecker e;
+  std::vector<std::string> exprs;
+  std::vector<int32_t> priorities;
+  for (int i = 0; i < 400; i++) {
+    std::string n = std::to_string(rand() % 20);
+    switch (rand() % 6) {
+      case 0: exprs.push_back("url.startsWith('/" + n + "') && code.eq(" + std::to_string(rand() % 3) + ")"); break;
+      case 1: exprs.push_back("code.lt(" + n + ") && url.endsWith('" + n.substr(0, 1) + "')"); break;
+      case 2: exprs.push_back("!url.startsWith('/" + n + "') && (code.eq(1) || ua.contains('" + n + "'))"); break;
+      case 3: exprs.push_back("url.startsWith('/" + n + "') || code.gte(" + n + ")"); break;
+      case 4: exprs.push_back(rand() % 2 ? "code.eq(" : "missing.eq(1) && code.eq(1)"); break;
+      default: exprs.push_back("code.eq(" + n + ") && !ua.eq('" + n + "') && url.contains('" + n + "')"); break;
+    }
+    priorities.push_back(rand() % 10);
+  }
+
+  TinyRuleChecker::RuleSet set = e.compile(exprs);
+  if (!e.setPriorities(set, priorities)) return false;
+  e.removeRule(set, 7);
+  if (set.rules[7].guard != TinyRuleChecker::NO_GUARD || set.rules[7].maxDepth != 0) return false;
+  e.addRule(set, "url.startsWith('/1')");
+  exprs.push_back("url.startsWith('/1')");
+  priorities.push_back(0);
+
+  std::string pack = e.serialize(set);
+  TinyRuleChecker::RuleSet loaded;
+  std::string error;
+  if (!e.deserialize(pack.data(), pack.size(), loaded, error) || loaded.order != set.order) return false;
+
+  std::vector<TinyRuleChecker::EvalResult> results;
+  std::vector<uint32_t> matches;
+  for (int i = 0; i < 200; i++) {
+    e.setVarString("url", ("/" + std::to_string(rand() % 25) + "/" + std::to_string(rand() % 25)).c_str());
+    e.setVarString("ua", std::to_string(rand() % 25).c_str());
+    e.setVarInt("code", rand() % 25);
+
+    // all matching rules, sorted by priority
+    e.eval(set, results);
+    std::vector<uint32_t> expected;
+    for (uint32_t j = 0; j < results.size(); j++) {
+      if (results[j].result && results[j].error.empty() && j != 7) expected.push_back(j);
+    }
+    std::stable_sort(expected.begin(), expected.end(), [&priorities](uint32_t a, uint32_t b) {
+      return priorities[a] > priorities[b];
+    });
+
+    size_t k = rand() % 5 + 1;
+    uint32_t first = 12345;
+    TinyRuleChecker::EvalResult er = e.firstMatch(i % 2 ? set : loaded, first);
+    if (er.result != !expected.empty() || (er.result && first != expected[0]) || !er.error.empty()) {
+      printf ("Error in firstMatch: got %d (rule %u), expected %zu matches\n", er.result, first, expected.size());
+      return false;
+    }
+    er = e.topK(set, k, matches);
+    expected.resize(std::min(k, expected.size()));
+    if (matches != expected || er.result != !expected.empty()) {
+      printf ("Error in topK(%zu): got %zu matches, expected %zu\n", k, matches.size(), expected.size());
+      return false;
+    }
+  }
+
+  // limits stop the search
+  e.setVarString("url", "/none");
+  e.setVarString("ua", "none");
+  e.setVarInt("code", -1);
+  e.setEvalLimits({ 5, 0, NULL });
+  uint32_t first;
+  TinyRuleChecker::EvalResult er = e.firstMatch(set, first);
+  e.setEvalLimits({ 0, 0, NULL });
+  if (er.result || er.status != TinyRuleChecker::EVAL_BUDGET_EXCEEDED) return false;
+
+  // without priorities, rules go in order
+  set = e.compile(std::vector<std::string>{ "code.eq(1)", "code.gt(0)", "code.gt(0)" });
+  e.setVarInt("code", 1);
+  return e.firstMatch(set, first).result && first == 0 && e.topK(set, 5, matches).result && matches.size() == 3 &&
+    !e.setPriorities(set, { 1, 2 }) && e.setPriorities(set, { 1, 2, 3 }) && e.firstMatch(set, first).result && first == 2;
+}
+
+bool test_diagrams () {
+  TinyRuleChecker e;
+  auto randomTerm = []() {
+    std::string n = std::to_string(rand() % 4);
+    switch (rand() % 6) {
+      case 0: return "a.eq(" + n + ")";
+      case 1: return "a.gt(" + n + ")";
+      case 2: return "s.startsWith('" + n + "')";
+      case 3: return "s.endsWith('" + n + "')";
+      case 4: return "b.eq(" + n + ")"; // type mismatch when b is a string
+      default: return "b.in([" + n + ", 5])";
+    }
+  };
+
+  for (int round = 0; round < 20; round++) {
+    std::vector<std::string> exprs;
+    for (int i = 0; i < 12; i++) {
+      std::string expr = randomTerm();
+      for (int j = rand() % 4; j > 0; j--) {
+        const char *ops[] = { " && ", " || ", " && !", " || !(" };
+        int op = rand() % 4;
+        expr = (op == 3 ? "(" : "") + expr + ops[op] + randomTerm() + (op == 3 ? "))" : "");
+      }
+      exprs.push_back(expr);
+    }
+    exprs.push_back("a.eq(");
+    TinyRuleChecker::RuleSet set = e.compile(exprs);
+    e.removeRule(set, 3);
+    TinyRuleChecker::RuleSet plain = set;
+    if (!e.compileDiagram(set) || set.diagram.nodes.empty()) return false;
+
+    std::vector<TinyRuleChecker::EvalResult> expected, results;
+    for (int i = 0; i < 50; i++) {
+      e.setVarInt("a", rand() % 5);
+      if (i % 5 == 4) {
+        e.setVarString("b", "x");
+      }
+      else {
+        e.setVarInt("b", rand() % 6);
+      }
+      e.setVarString("s", (std::to_string(rand() % 5) + std::to_string(rand() % 5)).c_str());
+      e.eval(plain, expected);
+      e.eval(set, results);
+      for (size_t j = 0; j < exprs.size(); j++) {
+        if (results[j].result != expected[j].result || results[j].error != expected[j].error) {
+          printf ("Error evaluating diagram: %s\n - expected %d (%s)\n - got %d (%s)\n",
+            exprs[j].c_str(), expected[j].result, expected[j].error.c_str(), results[j].result, results[j].error.c_str());
+          return false;
+        }
+      }
+    }
+  }
+
+  // missing variables fall back to evaluating each rule
+  TinyRuleChecker::RuleSet set = e.compile(std::vector<std::string>{ "a.eq(1) || c.eq(1)", "a.eq(2)" });
+  if (!e.compileDiagram(set)) return false;
+  std::vector<TinyRuleChecker::EvalResult> results;
+  e.setVarInt("a", 2);
+  e.eval(set, results);
+  if (results[0].error != "variable 'c' not found" || !results[1].result) return false;
+
+  // errors of predicates the walk skips are reported too
+  set = e.compile(std::vector<std::string>{ "a.eq(1)", "a.eq(2) && b.eq('x')" });
+  if (!e.compileDiagram(set)) return false;
+  e.setVarInt("a", 1);
+  e.setVarInt("b", 5);
+  e.eval(set, results);
+  if (!results[0].result || results[1].error != "type mismatch: type i vs s") {
+    printf ("Error: diagram hides the error of a skipped predicate (%s)\n", results[1].error.c_str());
+    return false;
+  }
+
+  // no diagram if the walk could hide errors whatever the types
+  e.setMethod("custom", [](const TinyRuleChecker::VarValue &, const TinyRuleChecker::VarValue &, TinyRuleChecker::EvalResult &eval) {
+    eval.error = "custom error";
+    return false;
+  });
+  for (const char *expr : { "a.eq('x')", "a.eq(b)", "a.custom(1)" }) {
+    TinyRuleChecker::RuleSet unsafe = e.compile(std::vector<std::string>{ "a.eq(1)", expr });
+    if (e.compileDiagram(unsafe) || !unsafe.diagram.nodes.empty()) {
+      printf ("Error: diagram compiled with %s\n", expr);
+      return false;
+    }
+  }
+
+  set = e.compile(std::vector<std::string>{ "a.eq(1) || c.eq(1)", "a.eq(2)" });
+  if (!e.compileDiagram(set)) return false;
+  e.setVarInt("a", 2);
+
+  // limits
+  e.setEvalLimits({ 1, 0, NULL });
+  e.setVarInt("c", 2);
+  e.eval(set, results);
+  e.setEvalLimits({ 0, 0, NULL });
+  if (results[1].result || results[1].status != TinyRuleChecker::EVAL_BUDGET_EXCEEDED) return false;
+
+  // too big, or updated
+  if (e.compileDiagram(set, 2) || !set.diagram.nodes.empty()) return false;
+  if (!e.compileDiagram(set)) return false;
+  e.addRule(set, "a.eq(3)");
+  return set.diagram.nodes.empty();
+}
+
+bool test_truthtables () {
+  TinyRuleChecker e;
+  auto randomTerm = []() {
+    const char *vars[] = { "a", "b", "c", "f" };
+    const char *methods[] = { "eq", "gt", "lte", "hasAnyBits" };
+    int v = rand() % 4;
+    std::string value = (v == 3) ? std::to_string(rand() % 8) + ".5" : std::to_string(rand() % 8);
+    return std::string(rand() % 3 ? "" : "!") + vars[v] + "." + (v == 3 ? methods[rand() % 3] : methods[rand() % 4]) + "(" + value + ")";
+  };
+
+  for (int i = 0; i < 300; i++) {
+    std::string expr = randomTerm();
+    int nterms = rand() % 7;
+    for (int j = 0; j < nterms; j++) {
+      expr = (j % 2 ? "(" + expr + ")" : expr) + (rand() % 2 ? " && " : " || ") + randomTerm();
+    }
+    TinyRuleChecker::Rule rule = e.compile(expr.c_str());
+    TinyRuleChecker::Rule branchy = rule;
+    branchy.tableInputs.clear();
+    if (nterms > 0 && rule.tableInputs.empty() != (nterms > 5)) {
+      printf ("Error: unexpected branchless form (%zu inputs) for %s\n", rule.tableInputs.size(), expr.c_str());
+      return false;
+    }
+
+    for (int k = 0; k < 20; k++) {
+      e.setVarInt("a", rand() % 8);
+      e.setVarInt("b", rand() % 8);
+      e.setVarFloat("f", rand() % 8 + 0.5f);
+      if (k == 19) {
+        e.setVarString("c", "x"); // type mismatch
+      }
+      else {
+        e.setVarInt("c", rand() % 8);
+      }
+      TinyRuleChecker::EvalResult expected = e.eval(branchy);
+      TinyRuleChecker::EvalResult er = e.eval(rule);
+      if (er.result != expected.result || er.error != expected.error) {
+        printf ("Error evaluating branchless rule: %s\n - expected %d (%s)\n - got %d (%s)\n",
+          expr.c_str(), expected.result, expected.error.c_str(), er.result, er.error.c_str());
+        return false;
+      }
+    }
+  }
+
+  // not for strings, nor single statements
+  return e.compile("s.eq('x') && a.eq(1)").tableInputs.empty() && e.compile("a.eq(1)").tableInputs.empty();
+}
+
+bool test_batches () {
+  TinyRuleChecker e;
+  auto randomTerm = []() {
+    const char *vars[] = { "a", "b", "f", "s", "c", "m" };
+    const char *methods[] = { "eq", "neq", "gt", "gte", "lt", "lte", "hasAnyBits", "hasNoBits" };
+    int v = rand() % 6;
+    std::string value = std::to_string(rand() % 8);
+    if (v == 2) value += ".5";
+    if (v == 3) value = rand() % 2 ? "'x'" : "'y'";
+    if (rand() % 8 == 0) value = "b"; // variable reference
+    return std::string(rand() % 3 ? "" : "!") + vars[v] + "." + methods[v >= 2 && v <= 3 ? rand() % 2 : rand() % 8] + "(" + value + ")";
+  };
+  auto randomValue = [](int var) {
+    TinyRuleChecker::VarValue v;
+    int r = rand() % 20;
+    if (var == 3 || r == 0) {
+      v.type = TinyRuleChecker::V_TYPE_STRING; // type mismatch for numbers
+      v.strval = rand() % 2 ? "x" : "y";
+    }
+    else if (var == 2 || r == 1) {
+      v.type = TinyRuleChecker::V_TYPE_FLOAT;
+      v.floatval = rand() % 8 + 0.5f;
+    }
+    else {
+      v.type = TinyRuleChecker::V_TYPE_INT;
+      v.intval = rand() % 8;
+    }
+    return v;
+  };
+
+  TinyRuleChecker::RecordBatch batch;
+  batch.vars = { "a", "b", "f", "s" };
+  std::vector<TinyRuleChecker::VarValue> values;
+  std::vector<TinyRuleChecker::EvalResult> results;
+  for (int i = 0; i < 300; i++) {
+    std::string expr = randomTerm();
+    int nterms = rand() % 6;
+    for (int j = 0; j < nterms; j++) {
+      expr = (j % 2 ? "(" + expr + ")" : expr) + (rand() % 2 ? " && " : " || ") + randomTerm();
+    }
+    TinyRuleChecker::Rule rule = e.compile(expr.c_str());
+
+    // sizes not multiple of the 16 lanes
+    batch.count = rand() % 40;
+    values.clear();
+    for (size_t r = 0; r < batch.count * batch.vars.size(); r++) {
+      values.push_back(randomValue(r % batch.vars.size()));
+    }
+    batch.values = values.data();
+    e.setVarInt("c", rand() % 8);
+    bool limited = i % 3 == 0;
+    if (limited) {
+      // a budget for the whole batch
+      e.setEvalLimits({ (uint64_t)(rand() % 40 + 1), 0, NULL });
+    }
+    e.evalBatch(rule, batch, results);
+    std::vector<TinyRuleChecker::EvalResult> batchResults = results;
+    e.setEvalLimits({ 0, 0, NULL });
+    bool exceeded = false;
+
+    for (size_t r = 0; r < batch.count; r++) {
+      for (size_t f = 0; f < batch.vars.size(); f++) {
+        const TinyRuleChecker::VarValue &v = values[r * batch.vars.size() + f];
+        const char *var = batch.vars[f].c_str();
+        if (v.type == TinyRuleChecker::V_TYPE_INT) e.setVarInt(var, v.intval);
+        else if (v.type == TinyRuleChecker::V_TYPE_FLOAT) e.setVarFloat(var, v.floatval);
+        else e.setVarString(var, v.strval.c_str());
+      }
+      TinyRuleChecker::EvalResult expected = e.eval(rule);
+      const TinyRuleChecker::EvalResult &er = batchResults[r];
+      exceeded = exceeded || er.status == TinyRuleChecker::EVAL_BUDGET_EXCEEDED;
+      if (exceeded) {
+        if (!limited || er.status != TinyRuleChecker::EVAL_BUDGET_EXCEEDED || er.result) {
+          printf ("Error: record %zu of a batch should be over budget: %s\n", r, expr.c_str());
+          return false;
+        }
+        continue;
+      }
+      if (er.result != expected.result || er.error != expected.error || er.status != expected.status) {
+        printf ("Error evaluating record %zu of a batch: %s\n - expected %d (%s)\n - got %d (%s)\n",
+          r, expr.c_str(), expected.result, expected.error.c_str(), er.result, er.error.c_str());
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+bool test_bitmaps () {
+  // sparse, dense and long stretches of rows, spanning a few containers
+  auto randomRows = [](std::vector<bool> &rows) {
+    TinyRuleChecker::MatchBitmap bitmap;
+    rows.assign(300000, false);
+    int kind = rand() % 3;
+    for (uint32_t row = 0; row < rows.size(); row++) {
+      if (kind == 0 ? rand() % 500 == 0 : (kind == 1 ? rand() % 3 == 0 : (row / 5000) % 3 == 0)) {
+        rows[row] = true;
+      }
+    }
+    // unordered adds too
+    for (uint32_t k = 0; k < 2; k++) {
+      for (uint32_t row = k; row < rows.size(); row += 2) {
+        if (rows[row]) bitmap.add(row);
+      }
+    }
+    return bitmap;
+  };
+  auto check = [](const char *what, const TinyRuleChecker::MatchBitmap &bitmap, const std::vector<bool> &expected) {
+    std::vector<uint32_t> rows;
+    for (uint32_t row = 0; row < expected.size(); row++) {
+      if (expected[row]) rows.push_back(row);
+    }
+    if (bitmap.rows() != rows || bitmap.cardinality() != rows.size() || (!rows.empty() && !bitmap.contains(rows[0]))) {
+      printf ("Error: wrong rows in %s bitmap (%zu rows, %zu expected)\n", what, (size_t)bitmap.cardinality(), rows.size());
+      return false;
+    }
+    return true;
+  };
+
+  for (int i = 0; i < 40; i++) {
+    std::vector<bool> ra, rb, expected(300000);
+    TinyRuleChecker::MatchBitmap a = randomRows(ra);
+    TinyRuleChecker::MatchBitmap b = randomRows(rb);
+    if (i % 2) {
+      a.optimize();
+    }
+    if (i % 4 >= 2) {
+      b.optimize();
+    }
+    if (!check("added", a, ra)) {
+      return false;
+    }
+
+    for (size_t r = 0; r < ra.size(); r++) expected[r] = ra[r] && rb[r];
+    if (!check("AND", a & b, expected) || a.andCardinality(b) != (a & b).cardinality()) {
+      return false;
+    }
+    for (size_t r = 0; r < ra.size(); r++) expected[r] = ra[r] || rb[r];
+    if (!check("OR", a | b, expected)) {
+      return false;
+    }
+    for (size_t r = 0; r < ra.size(); r++) expected[r] = ra[r] && !rb[r];
+    if (!check("ANDNOT", a.andNot(b), expected)) {
+      return false;
+    }
+
+    TinyRuleChecker::MatchBitmap optimized = a | b;
+    size_t bytes = optimized.bytes();
+    optimized.optimize();
+    if (!(optimized == (a | b)) || optimized.bytes() > bytes) {
+      printf ("Error: optimized bitmap differs or grew (%zu vs %zu bytes)\n", optimized.bytes(), bytes);
+      return false;
+    }
+
+    std::string data = optimized.serialize();
+    TinyRuleChecker::MatchBitmap loaded;
+    std::string error;
+    if (!loaded.deserialize(data.data(), data.size(), error) || !(loaded == optimized)) {
+      printf ("Error: serialized bitmap doesn't load back: %s\n", error.c_str());
+      return false;
+    }
+    if (loaded.deserialize(data.data(), data.size() - 1, error) || error != "corrupted match bitmap" || loaded.cardinality()) {
+      printf ("Error: truncated bitmap loaded\n");
+      return false;
+    }
+  }
+
+  // long stretches take a few bytes once optimized
+  TinyRuleChecker::MatchBitmap all;
+  for (uint32_t row = 0; row < 1000000; row++) {
+    all.add(row);
+  }
+  all.optimize();
+  if (all.bytes() > 1024 || all.cardinality() != 1000000) {
+    printf ("Error: 1M consecutive rows take %zu bytes\n", all.bytes());
+    return false;
+  }
+  all.add(5);
+  all.add(1000001);
+  if (all.cardinality() != 1000001 || !all.contains(1000001) || all.contains(1000000)) {
+    printf ("Error: wrong rows added to an optimized bitmap\n");
+    return false;
+  }
+
+  // matches of a batch
+  TinyRuleChecker e;
+  TinyRuleChecker::Rule rule = e.compile("a.gt(5) || b.eq(1)");
+  TinyRuleChecker::RuleSet set = e.compile(std::vector<std::string>{ "a.gt(5) || b.eq(1)", "a.lt(3)", "c.eq(1)" });
+  std::vector<TinyRuleChecker::VarValue> values(2 * 1000);
+  for (size_t i = 0; i < values.size(); i++) {
+    values[i].type = TinyRuleChecker::V_TYPE_INT;
+    values[i].intval = rand() % 10;
+  }
+  TinyRuleChecker::RecordBatch batch = { { "a", "b" }, values.data(), 1000 };
+  TinyRuleChecker::MatchBitmap matches;
+  std::vector<TinyRuleChecker::MatchBitmap> setMatches;
+  std::vector<TinyRuleChecker::EvalResult> results;
+  e.evalBatch(rule, batch, matches, 70000);
+  e.evalBatch(set, batch, setMatches, 70000);
+  e.evalBatch(rule, batch, results);
+  for (size_t r = 0; r < results.size(); r++) {
+    if (matches.contains(70000 + r) != results[r].result || setMatches[0].contains(70000 + r) != results[r].result) {
+      printf ("Error: wrong batch match for record %zu\n", r);
+      return false;
+    }
+  }
+  return setMatches.size() == 3 && setMatches[2].cardinality() == 0 && matches.rows()[0] >= 70000 &&
+    (setMatches[0] | setMatches[1]).cardinality() > matches.cardinality();
+}
+
+bool test_derived () {
+  TinyRuleChecker e;
+  int computed = 0;
+  e.setDerivedVar("ratio", { "a", "b" }, [&computed](
+    const std::vector<const TinyRuleChecker::VarValue *> &inputs, TinyRuleChecker::VarValue &value, std::string &error
+  ) {
+    computed++;
+    if (inputs[1]->intval == 0) {
+      error = "ratio: division by zero";
+      return false;
+    }
+    value.type = TinyRuleChecker::V_TYPE_FLOAT;
+    value.floatval = (float)inputs[0]->intval / inputs[1]->intval;
+    return true;
+  });
+  e.setDerivedVar("host", { "url" }, [](
+    const std::vector<const TinyRuleChecker::VarValue *> &inputs, TinyRuleChecker::VarValue &value, std::string &
+  ) {
+    const std::string &url = inputs[0]->strval;
+    size_t start = url.find("://");
+    start = (start == std::string::npos) ? 0 : start + 3;
+    value.type = TinyRuleChecker::V_TYPE_STRING;
+    value.strval = url.substr(start, url.find('/', start) - start);
+    return true;
+  });
+  e.setDerivedVar("hostLength", { "host" }, [](
+    const std::vector<const TinyRuleChecker::VarValue *> &inputs, TinyRuleChecker::VarValue &value, std::string &
+  ) {
+    value.type = TinyRuleChecker::V_TYPE_INT;
+    value.intval = inputs[0]->strval.size();
+    return true;
+  });
+
+  // missing inputs
+  ASSERT_ERROR_EXPR("ratio.gt(0.5)", "variable 'a' not found");
+  ASSERT_ERROR_EXPR("hostLength.eq(11)", "variable 'url' not found");
+
+  e.setVarInt("a", 3);
+  e.setVarInt("b", 4);
+  e.setVarString("url", "https://example.com/index.html");
+  ASSERT_EXPR("ratio.gt(0.5) && host.eq('example.com') && hostLength.eq(11)", true);
+  ASSERT_EXPR("ratio.lt(1.0) && hostLength.gt(a)", true);
+
+  // once per record, no matter how many rules use it
+  std::vector<std::string> exprs;
+  for (int i = 0; i < 100; i++) {
+    exprs.push_back("ratio.gt(0." + std::to_string(i) + ") && host.neq('x" + std::to_string(i) + "')");
+  }
+  TinyRuleChecker::RuleSet set = e.compile(exprs);
+  TinyRuleChecker::Rule rule = e.compile("ratio.gte(0.75)");
+  std::vector<TinyRuleChecker::EvalResult> results;
+  computed = 0;
+  e.setVarInt("b", 2);
+  e.eval(set, results);
+  e.setVarInt("other", 1);
+  e.eval(set, results);
+  bool ok = e.eval(rule).result;
+  if (computed != 1 || !ok || !results[99].result) {
+    printf ("Error: derived variable computed %d times for a record\n", computed);
+    return false;
+  }
+
+  // inputs set again, even to the same value
+  e.setVarInt("a", 3);
+  e.eval(rule);
+  e.clearVars();
+  e.setVarInt("a", 1);
+  e.setVarInt("b", 0);
+  ASSERT_ERROR_EXPR("ratio.gt(0.5)", "ratio: division by zero");
+  if (computed != 3) {
+    printf ("Error: derived variable computed %d times, 3 expected\n", computed);
+    return false;
+  }
+  e.setVarInt("b", 4);
+  ASSERT_EXPR("ratio.eq(0.25)", true);
+
+  // variables set take precedence, cycles are errors
+  e.setVarFloat("ratio", 0.5);
+  ASSERT_EXPR("ratio.eq(0.5)", true);
+  e.setDerivedVar("x", { "y" }, [](const std::vector<const TinyRuleChecker::VarValue *> &inputs, TinyRuleChecker::VarValue &value, std::string &) {
+    value = *inputs[0];
+    return true;
+  });
+  e.setDerivedVar("y", { "x" }, [](const std::vector<const TinyRuleChecker::VarValue *> &inputs, TinyRuleChecker::VarValue &value, std::string &) {
+    value = *inputs[0];
+    return true;
+  });
+  ASSERT_ERROR_EXPR("x.eq(1)", "variable 'x' depends on itself");
+
+  // batches compute them from each record
+  e.setDerivedVar("dbl", { "n" }, [](const std::vector<const TinyRuleChecker::VarValue *> &inputs, TinyRuleChecker::VarValue &value, std::string &) {
+    value.type = TinyRuleChecker::V_TYPE_INT;
+    value.intval = inputs[0]->intval * 2;
+    return true;
+  });
+  std::vector<TinyRuleChecker::VarValue> values(2);
+  for (int i = 0; i < 2; i++) {
+    values[i].type = TinyRuleChecker::V_TYPE_INT;
+    values[i].intval = 5 + 2 * i;
+  }
+  TinyRuleChecker::RecordBatch batch = { { "n" }, values.data(), 2 };
+  e.setVarInt("n", 7);
+  e.evalBatch(e.compile("dbl.eq(10) && !n.eq(a)"), batch, results);
+  if (results.size() != 2 || !results[0].result || results[1].result || !results[0].error.empty()) {
+    printf ("Error: derived variable not computed from batch records\n");
+    return false;
+  }
+  ASSERT_EXPR("dbl.eq(14)", true);
+
+  e.clearDerivedVars();
+  ASSERT_ERROR_EXPR("host.eq('example.com')", "variable 'host' not found");
+  return true;
+}
+
+bool test_paths () {
+  TinyRuleChecker e;
+  auto str = [](const char *s) {
+    TinyRuleChecker::VarValue v;
+    v.type = TinyRuleChecker::V_TYPE_STRING;
+    v.strval = s;
+    return v;
+  };
+  auto num = [](int i) {
+    TinyRuleChecker::VarValue v;
+    v.type = TinyRuleChecker::V_TYPE_INT;
+    v.intval = i;
+    return v;
+  };
+
+  // compiled before the variables exist
+  TinyRuleChecker::Rule rule = e.compile("user.geo.country.eq('US') && user.age.gte(18) && !user.name.eq(admin.name)");
+  e.setVarString("user.geo.country", "US");
+  e.setVarInt("user.age", 30);
+  e.setVarString("user.name", "bob");
+  e.setVarString("admin.name", "root");
+  ASSERT_EXPR("user.geo.country.eq('US') && user.age.gte(18) && !user.name.eq(admin.name)", true);
+  ASSERT_EXPR("user . geo . country.eq('US') && user.name.neq(admin . name)", true);
+  ASSERT_ERROR_EXPR("user.geo.country.eq", "expecting '('");
+  ASSERT_ERROR_EXPR("user.geo.(1)", "expecting '('");
+  ASSERT_ERROR_EXPR("user.(1)", "expecting identifier");
+  ASSERT_ERROR_EXPR("user.geo.eq('US')", "variable 'user.geo' not found");
+  if (!e.eval(rule).result) {
+    printf ("Error: compiled rule with dotted paths doesn't match\n");
+    return false;
+  }
+
+  // a whole subtree at once, fields not in the record are unset
+  TinyRuleChecker::VarTree user = { "", {}, {
+    { "name", str("alice"), {} },
+    { "geo", {}, { { "country", str("FR"), {} }, { "city", str("Paris"), {} } } }
+  } };
+  e.setVarTree("user", user);
+  ASSERT_EXPR("user.geo.country.eq('FR') && user.geo.city.eq('Paris') && user.name.eq('alice')", true);
+  ASSERT_ERROR_EXPR("user.age.gte(18)", "variable 'user.age' not found");
+  TinyRuleChecker::EvalResult er = e.eval(rule);
+  if (er.result || er.error != "variable 'user.age' not found") {
+    printf ("Error: compiled rule sees variables of a replaced subtree (%s)\n", er.error.c_str());
+    return false;
+  }
+  user.fields.push_back({ "age", num(17), {} });
+  e.setVarTree("user", user);
+  ASSERT_EXPR("user.age.lt(18)", true);
+
+  // derived from nested variables
+  e.setDerivedVar("user.adult", { "user.age" }, [](
+    const std::vector<const TinyRuleChecker::VarValue *> &inputs, TinyRuleChecker::VarValue &value, std::string &
+  ) {
+    value.type = TinyRuleChecker::V_TYPE_INT;
+    value.intval = inputs[0]->intval >= 18;
+    return true;
+  });
+  ASSERT_EXPR("user.adult.eq(0)", true);
+  user.fields.back().value.intval = 21;
+  e.setVarTree("user", user);
+  ASSERT_EXPR("user.adult.eq(1)", true);
+
+  // rules compiled by another checker look variables up by name
+  TinyRuleChecker other;
+  other.setVarInt("unrelated", 1);
+  TinyRuleChecker::Rule foreign = other.compile("user.geo.city.eq('Paris') && user.age.eq(21)");
+  if (!e.eval(foreign).result) {
+    printf ("Error: rule compiled by another checker doesn't match\n");
+    return false;
+  }
+
+  // rule sets, compiled in threads too
+  std::vector<std::string> exprs;
+  for (int i = 0; i < 600; i++) {
+    exprs.push_back("user.geo.country.eq('" + std::string(i % 2 ? "FR" : "US") + "') && user.age.gt(" + std::to_string(i % 30) + ")");
+  }
+  std::vector<TinyRuleChecker::EvalResult> results, parallelResults;
+  e.eval(e.compile(exprs), results);
+  e.eval(e.compileAll(exprs, 2), parallelResults);
+  for (size_t i = 0; i < exprs.size(); i++) {
+    bool expected = (i % 2) && (int)(i % 30) < 21;
+    if (results[i].result != expected || parallelResults[i].result != expected) {
+      printf ("Error: wrong result for rule %zu with dotted paths\n", i);
+      return false;
+    }
+  }
+
+  e.clearVars();
+  ASSERT_ERROR_EXPR("user.geo.country.eq('FR')", "variable 'user.geo.country' not found");
+  e.setVarString("user.geo.country", "FR");
+  ASSERT_EXPR("user.geo.country.eq('FR')", true);
+
+  // slots freed, rules and plans made before still work
+  TinyRuleChecker::BindingPlan plan = e.bindingPlan({ "user.age" });
+  TinyRuleChecker::Rule adult = e.compile("user.adult.eq(1) && user.geo.city.eq('Paris')");
+  for (int i = 0; i < 1000; i++) {
+    e.eval(("user.x" + std::to_string(i) + ".eq(1)").c_str());
+  }
+  e.clearVars(true);
+  ASSERT_ERROR_EXPR("user.geo.country.eq('FR')", "variable 'user.geo.country' not found");
+  e.setVarTree("user", user);
+  TinyRuleChecker::VarValue age = num(17);
+  e.setVars(plan, &age);
+  ASSERT_EXPR("user.adult.eq(0) && user.geo.city.eq('Paris')", true);
+  age.intval = 21;
+  e.setVars(plan, &age);
+  ASSERT_EXPR("user.adult.eq(1)", true);
+  if (!e.eval(adult).result || !e.eval(foreign).result) {
+    printf ("Error: compiled rule doesn't match after freeing slots\n");
+    return false;
+  }
+  return true;
+}
+
+// packed record for setVars: int32_t, float or string (uint32_t size + bytes)
+static void packInt(std::string &record, int32_t value) {
+  record.append((const char *)&value, sizeof(value));
+}
+
+static void packString(std::string &record, const std::string &value) {
+  uint32_t size = value.size();
+  record.append((const char *)&size, sizeof(size));
+  record += value;
+}
+
+bool test_bindings () {
+  TinyRuleChecker e;
+  TinyRuleChecker::BindingPlan plan = e.bindingPlan(
+    { "id", "ratio", "user.name", "user.geo.country" },
+    { TinyRuleChecker::V_TYPE_INT, TinyRuleChecker::V_TYPE_FLOAT, TinyRuleChecker::V_TYPE_STRING, TinyRuleChecker::V_TYPE_STRING }
+  );
+  TinyRuleChecker::Rule rule = e.compile("id.eq(7) && ratio.gt(0.5) && user.name.eq('bob') && user.geo.country.eq('US')");
+  int computed = 0;
+  e.setDerivedVar("nameLength", { "user.name" }, [&computed](
+    const std::vector<const TinyRuleChecker::VarValue *> &inputs, TinyRuleChecker::VarValue &value, std::string &
+  ) {
+    computed++;
+    value.type = TinyRuleChecker::V_TYPE_INT;
+    value.intval = inputs[0]->strval.size();
+    return true;
+  });
+
+  // from values
+  TinyRuleChecker::VarValue values[4];
+  values[0].type = TinyRuleChecker::V_TYPE_INT;
+  values[0].intval = 7;
+  values[1].type = TinyRuleChecker::V_TYPE_FLOAT;
+  values[1].floatval = 0.75f;
+  values[2].type = TinyRuleChecker::V_TYPE_STRING;
+  values[2].strval = "bob";
+  values[3].type = TinyRuleChecker::V_TYPE_STRING;
+  values[3].strval = "US";
+  e.setVars(plan, values);
+  if (!e.eval(rule).result) {
+    printf ("Error: rule doesn't match variables set from a binding plan\n");
+    return false;
+  }
+  ASSERT_EXPR("nameLength.eq(3)", true);
+
+  // from packed records
+  std::string error;
+  for (int i = 0; i < 10; i++) {
+    std::string record;
+    float ratio = i / 10.0f;
+    packInt(record, i);
+    record.append((const char *)&ratio, sizeof(ratio));
+    packString(record, std::string(i, 'x'));
+    packString(record, i % 2 ? "US" : "FR");
+    if (!e.setVars(plan, record.data(), record.size(), error)) {
+      printf ("Error setting a packed record: %s\n", error.c_str());
+      return false;
+    }
+    std::string expr = "id.eq(" + std::to_string(i) + ") && ratio.lt(" + std::to_string(ratio + 0.01f) + ")"
+      " && nameLength.eq(" + std::to_string(i) + ") && user.geo.country.eq('" + (i % 2 ? "US" : "FR") + "')";
+    TinyRuleChecker::EvalResult er = e.eval(expr.c_str());
+    if (!er.result) {
+      printf ("Error: wrong variables set from packed record %d (%s)\n", i, er.error.c_str());
+      return false;
+    }
+  }
+  if (computed != 11) {
+    printf ("Error: derived variable computed %d times, 11 expected\n", computed);
+    return false;
+  }
+
+  // bad records set nothing
+  std::string record;
+  packInt(record, 100);
+  record.append(4, '\0');
+  packString(record, "truncated");
+  if (e.setVars(plan, record.data(), record.size(), error) || error != "truncated record") {
+    printf ("Error: truncated record accepted (%s)\n", error.c_str());
+    return false;
+  }
+  packString(record, "US");
+  record += "?";
+  if (e.setVars(plan, record.data(), record.size(), error) || error != "record longer than its binding plan") {
+    printf ("Error: long record accepted (%s)\n", error.c_str());
+    return false;
+  }
+  ASSERT_EXPR("id.eq(9)", true);
+  if (e.setVars(e.bindingPlan({ "id" }), record.data(), 4, error) || error != "binding plan without types") {
+    printf ("Error: packed record set without types\n");
+    return false;
+  }
+
+  // plans of another checker look names up
+  TinyRuleChecker other;
+  other.setVarInt("unrelated", 1);
+  other.setVars(plan, values);
+  TinyRuleChecker::EvalResult er = other.eval(rule);
+  if (!er.result) {
+    printf ("Error: binding plan of another checker: %s\n", er.error.c_str());
+    return false;
+  }
+  return true;
+}
+
+bool benchmark(int npasses, int niterations) {
+  TinyRuleChecker e;
+  e.setRuleCache(0); // parse every time, see benchmark_cache
+  e.setVarInt("myint", 1);
+  e.setVarFloat("myfloat", 2.0);
+  e.setVarString("mystr", "my string");
+
+  for (int n = 0; n < npasses; n++) {
+    // test performance
+    std::chrono::time_point<std::chrono::system_clock> start, end;
+    start = std::chrono::system_clock::now();
+    for (int i = 0; i < niterations; i++) {
+      ASSERT_EXPR("myfloat.eq(1.9999999) || myint.eq(32)", false);
+    }
+    end = std::chrono::system_clock::now();
+    std::chrono::duration<double> elapsed_seconds = end-start;
+    printf(
+      "Pass %d: %.3f M ops/sec  (%d in %.3f seconds; 1 in %.3f nanoseconds)\n",
+      n+1,
+      ((float)niterations / 1e6) / elapsed_seconds.count(),
+      niterations,
+      elapsed_seconds.count(),
+      elapsed_seconds.count() / ((float)niterations / 1e9)
+    );
+  }
+
+  for (int n = 0; n < npasses; n++) {
+    // test performance
+    std::chrono::time_point<std::chrono::system_clock> start, end;
+    start = std::chrono::system_clock::now();
+    const char *expression = "(myfloat.eq(1.9999999) || myint.eq(32)) && mystr.contains('string')";
+    size_t nbytes = strlen(expression);
+    size_t nbytesProcessed = 0;
+    for (int i = 0; i < niterations; i++) {
+      ASSERT_EXPR(expression, false);
+      nbytesProcessed += nbytes;
+    }
+    end = std::chrono::system_clock::now();
+    std::chrono::duration<double> elapsed_seconds = end-start;
+    printf(
+      "Pass %d: %.3f MB/sec  (%ld in %.3f seconds; 1 in %.3f nanoseconds)\n",
+      n+1,
+      ((float)nbytesProcessed / 1e6) / elapsed_seconds.count(),
+      nbytesProcessed,
+      elapsed_seconds.count(),
+      elapsed_seconds.count() / ((float)nbytesProcessed / 1e9)
+    );
+  }
+
+  // test performance of 1000 ops
+  for (int n = 0; n < npasses; n++) {
+    std::chrono::time_point<std::chrono::system_clock> start, end;
+    start = std::chrono::system_clock::now();
+    int thousand = 1000;
+    for (int i = 0; i < thousand; i++) {
+      ASSERT_EXPR("myfloat.eq(1.9999999) || myint.eq(32)", false);
+    }
+    end = std::chrono::system_clock::now();
+    std::chrono::duration<double> elapsed_seconds = end-start;
+    printf(
+      "Pass %d: %d ops in %.3f ms (real)\n",
+      n,
+      thousand,
+      ((float)thousand)*elapsed_seconds.count()
+    );
+  }
+  return true;
+}
+
+bool benchmark_methods(int niterations) {
+  int nmethods[] = { 8, 64, 1024 };
+
+  for (int nmethod : nmethods) {
+    TinyRuleChecker e(false);
+    e.setVarInt("myint", 1);
+    for (int i = 0; i < nmethod; i++) {
+      e.setMethod(("method" + std::to_string(i)).c_str(), [](
+        const TinyRuleChecker::VarValue &v1,
+        const TinyRuleChecker::VarValue &v2,
+        TinyRuleChecker::EvalResult &eval
+      ) {
+        eval.result = v1.intval == v2.intval;
+        return true;
+      });
+    }
+
+    std::string expr = "myint.method" + std::to_string(nmethod - 1) + "(1)";
+    TinyRuleChecker::Rule rule = e.compile(expr.c_str());
+
+    for (int mode = 0; mode < 3; mode++) {
+      if (mode == 1) e.freezeMethods();
+
+      std::chrono::time_point<std::chrono::system_clock> start, end;
+      start = std::chrono::system_clock::now();
+      for (int i = 0; i < niterations; i++) {
+        if (mode == 2) {
+          if (!e.eval(rule).result) return false;
+        }
+        else {
+          ASSERT_EXPR(expr.c_str(), true);
+        }
+      }
+      end = std::chrono::system_clock::now();
+      std::chrono::duration<double> elapsed_seconds = end-start;
+      printf(
+        "%4d methods (%-8s): %.3f M ops/sec  (1 in %.3f nanoseconds)\n",
+        nmethod,
+        mode == 0 ? "lookup" : (mode == 1 ? "frozen" : "compiled"),
+        ((float)niterations / 1e6) / elapsed_seconds.count(),
+        elapsed_seconds.count() / ((float)niterations / 1e9)
+      );
+    }
+  }
+  return true;
+}
+
+bool benchmark_kernels(int niterations) {
+  // same 'gt' as the built-in one, but registered as a plain method, thus
+  // going through the generic type checks and switch on every call
+  TinyRuleChecker::MethodOperator genericGt = [](
+    const TinyRuleChecker::VarValue &v1,
+    const TinyRuleChecker::VarValue &v2,
+    TinyRuleChecker::EvalResult &eval
+  ) {
+    if (v1.type != v2.type) {
+      eval.error = "type mismatch";
+      return false;
+    }
+    switch (v1.type) {
+      case TinyRuleChecker::V_TYPE_INT: eval.result = v1.intval > v2.intval; break;
+      case TinyRuleChecker::V_TYPE_FLOAT: eval.result = v1.floatval > v2.floatval; break;
+      case TinyRuleChecker::V_TYPE_STRING: eval.result = v1.strval > v2.strval; break;
+      default: return false;
+    }
+    return true;
+  };
+
+  const char *exprs[] = {
+    "myint.gt(50) || myfloat.gt(0.5) || mystr.gt('m')",
+    "myint.gt(50) || myfloat.gt(0.5) || mystr.gt('m')",
+    "myint.eq(50) || myint.eq(0x2A) || myint.eq(0x55)",
+    "myint.hasAllBits(0x30) || myint.hasAnyBits(0x2A) || myint.hasNoBits(0x55)",
+  };
+  const char *names[] = { "generic", "typed", "eq", "bits" };
+  for (int mode = 0; mode < 4; mode++) {
+    const char *expr = exprs[mode];
+    TinyRuleChecker e;
+    if (mode == 0) e.setMethod("gt", genericGt);
+
+    TinyRuleChecker::Rule rule = e.compile(expr);
+    PerfCounter branchMisses(PERF_COUNT_HW_BRANCH_MISSES);
+
+    // pseudo-random values so that results can't be predicted
+    // (setting the variables is part of the measure)
+    uint32_t seed = 12345;
+    int matches = 0;
+    std::chrono::time_point<std::chrono::system_clock> start, end;
+    start = std::chrono::system_clock::now();
+    branchMisses.start();
+    for (int i = 0; i < niterations; i++) {
+      seed = seed * 1103515245 + 12345;
+      e.setVarInt("myint", (seed >> 16) % 100);
+      e.setVarFloat("myfloat", ((seed >> 8) % 100) / 100.0f);
+      e.setVarString("mystr", (seed & 1) ? "z" : "a");
+      matches += e.eval(rule).result;
+    }
+    long long misses = branchMisses.stop();
+    end = std::chrono::system_clock::now();
+    std::chrono::duration<double> elapsed_seconds = end-start;
+
+    char missesText[32] = "n/a";
+    if (misses >= 0) {
+      snprintf(missesText, sizeof(missesText), "%.3f", (double)misses / niterations);
+    }
+    printf(
+      "%-7s kernels: %.3f M ops/sec  (1 in %.3f nanoseconds; %d matches; branch misses per eval: %s)\n",
+      names[mode],
+      ((float)niterations / 1e6) / elapsed_seconds.count(),
+      elapsed_seconds.count() / ((float)niterations / 1e9),
+      matches,
+      missesText
+    );
+  }
+  return true;
+}
+
+// isDoubleOf from the README
+static bool isDoubleOf(
+  const TinyRuleChecker::VarValue &v1,
+  const TinyRuleChecker::VarValue &v2,
+  TinyRuleChecker::EvalResult &eval
+) {
+  if (v1.type == TinyRuleChecker::V_TYPE_INT) {
+    eval.result = v1.intval == 2*v2.intval;
+  }
+  else if (v1.type == TinyRuleChecker::V_TYPE_FLOAT) {
+    eval.result = v1.floatval == 2*v2.floatval;
+  }
+  else if (v1.type == TinyRuleChecker::V_TYPE_STRING) {
+    eval.result = v1.strval == (v2.strval + v2.strval);
+  }
+  else {
+    eval.error = "unsupported operation 'isDoubleOf' with type '" + std::string(1, v1.type) + "'";
+    return false;
+  }
+  return true;
+}
+
+struct IsMultipleOf {
+  int factor;
+
+  bool operator()(
+    const TinyRuleChecker::VarValue &v1,
+    const TinyRuleChecker::VarValue &v2,
+    TinyRuleChecker::EvalResult &eval
+  ) const {
+    if (v1.type == TinyRuleChecker::V_TYPE_INT) {
+      eval.result = v1.intval == factor*v2.intval;
+    }
+    else if (v1.type == TinyRuleChecker::V_TYPE_FLOAT) {
+      eval.result = v1.floatval == factor*v2.floatval;
+    }
+    else {
+      eval.error = "unsupported operation 'isMultipleOf' with type '" + std::string(1, v1.type) + "'";
+      return false;
+    }
+    return true;
+  }
+};
+
+bool benchmark_functors(int niterations) {
+  for (int mode = 0; mode < 2; mode++) {
+    TinyRuleChecker e(false);
+    e.setVarInt("myint", 10);
+    if (mode == 0) {
+      e.setMethod("isDoubleOf", isDoubleOf);
+    }
+    else {
+      e.setMethod("isDoubleOf", IsMultipleOf { 2 });
+    }
+
+    TinyRuleChecker::Rule rule = e.compile("myint.isDoubleOf(5) || myint.isDoubleOf(4)");
+    std::chrono::time_point<std::chrono::system_clock> start, end;
+    start = std::chrono::system_clock::now();
+    for (int i = 0; i < niterations; i++) {
+      if (!e.eval(rule).result) return false;
+    }
+    end = std::chrono::system_clock::now();
+    std::chrono::duration<double> elapsed_seconds = end-start;
+    printf(
+      "isDoubleOf (%-8s): %.3f M ops/sec  (1 in %.3f nanoseconds)\n",
+      mode == 0 ? "function" : "functor",
+      ((float)niterations / 1e6) / elapsed_seconds.count(),
+      elapsed_seconds.count() / ((float)niterations / 1e9)
+    );
+  }
+  return true;
+}
+
+bool benchmark_matches(int niterations) {
+  const char *cases[][2] = {
+    {
+      "Mozilla/5.0 (Windows NT 10.0; Win64; x64) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/120.0.0.0 Safari/537.36",
+      "(Chrome|Chromium)/1[0-9]{2}\\.[0-9.]+ (Mobile )?Safari"
+    },
+    {
+      "Mozilla/5.0 (compatible; Googlebot/2.1; +http://www.google.com/bot.html)",
+      "[Bb]ot|[Cc]rawler|[Ss]pider"
+    },
+    {
+      "https://shop.example.com/products/12345/reviews?page=2&sort=recent",
+      "^https?://[a-z0-9.-]+/products/[0-9]+(/reviews)?(\\?.*)?$"
+    },
+  };
+
+  niterations = niterations / 10 + 1;
+  for (const auto &c : cases) {
+    TinyRuleChecker e;
+    e.setVarString("value", c[0]);
+    std::string expr = "value.matches('" + std::string(c[1]) + "')";
+    TinyRuleChecker::Rule rule = e.compile(expr.c_str());
+    std::regex stdRegex(c[1]);
+    std::string text = c[0];
+
+    for (int mode = 0; mode < 2; mode++) {
+      int matches = 0;
+      std::chrono::time_point<std::chrono::system_clock> start, end;
+      start = std::chrono::system_clock::now();
+      for (int i = 0; i < niterations; i++) {
+        matches += (mode == 0) ? e.eval(rule).result : std::regex_search(text, stdRegex);
+      }
+      end = std::chrono::system_clock::now();
+      std::chrono::duration<double> elapsed_seconds = end-start;
+      if (matches != niterations) return false;
+
+      printf(
+        "matches %-10s %.3f M ops/sec  (1 in %.3f nanoseconds) %.40s\n",
+        mode == 0 ? "(dfa):" : "(std):",
+        ((float)niterations / 1e6) / elapsed_seconds.count(),
+        elapsed_seconds.count() / ((float)niterations / 1e9),
+        c[1]
+      );
+    }
+  }
+  return true;
+}
+
+bool benchmark_prefixes(int niterations) {
+  int nrules[] = { 10, 100, 1000, 5000 };
+
+  niterations = niterations / 1000 + 1;
+  for (int n : nrules) {
+    TinyRuleChecker e;
+    e.setVarString("url", "/service/7/resource/7/item");
+
+    std::vector<std::string> exprs;
+    for (int i = 0; i < n; i++) {
+      exprs.push_back(
+        "url.startsWith('/service/" + std::to_string(i % 100) + "/resource/" + std::to_string(i) + "/') || " +
+        "url.endsWith('/item" + std::to_string(i) + "')"
+      );
+    }
+
+    std::vector<TinyRuleChecker::Rule> rules;
+    for (const std::string &expr : exprs) {
+      rules.push_back(e.compile(expr.c_str()));
+    }
+    TinyRuleChecker::RuleSet set = e.compile(exprs);
+    std::vector<TinyRuleChecker::EvalResult> results;
+
+    for (int mode = 0; mode < 2; mode++) {
+      int matches = 0;
+      std::chrono::time_point<std::chrono::system_clock> start, end;
+      start = std::chrono::system_clock::now();
+      for (int i = 0; i < niterations; i++) {
+        if (mode == 0) {
+          for (const TinyRuleChecker::Rule &rule : rules) {
+            matches += e.eval(rule).result;
+          }
+        }
+        else {
+          e.eval(set, results);
+          for (const TinyRuleChecker::EvalResult &result : results) {
+            matches += result.result;
+          }
+        }
+      }
+      end = std::chrono::system_clock::now();
+      std::chrono::duration<double> elapsed_seconds = end-start;
+      if (matches != niterations) return false;
+
+      printf(
+        "%5d prefix rules (%-8s): %.3f K sets/sec  (1 in %.3f microseconds)\n",
+        n,
+        mode == 0 ? "one by one" : "rule set",
+        ((float)niterations / 1e3) / elapsed_seconds.count(),
+        elapsed_seconds.count() / ((float)niterations / 1e6)
+      );
+    }
+  }
+  return true;
+}
+
+bool benchmark_casefold(int niterations) {
+  const char *exprs[] = {
+    "host.ieq('www.example.com')",
+    "agent.icontains('applewebkit')",
+    "method.iin(['GET', 'HEAD', 'POST', 'PUT', 'DELETE'])",
+  };
+
+  for (const char *expr : exprs) {
+    for (int cache = 0; cache < 2; cache++) {
+      TinyRuleChecker e;
+      e.setCaseFoldCache(cache);
+      e.setVarString("host", "WWW.Example.COM");
+      e.setVarString("agent", "Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/120.0");
+      e.setVarString("method", "Post");
+      TinyRuleChecker::Rule rule = e.compile(expr);
+
+      std::chrono::time_point<std::chrono::system_clock> start, end;
+      start = std::chrono::system_clock::now();
+      for (int i = 0; i < niterations; i++) {
+        if (!e.eval(rule).result) return false;
+      }
+      end = std::chrono::system_clock::now();
+      std::chrono::duration<double> elapsed_seconds = end-start;
+      printf(
+        "%-52s (%-8s): %.3f M ops/sec  (1 in %.3f nanoseconds)\n",
+        expr,
+        cache ? "cached" : "no cache",
+        ((float)niterations / 1e6) / elapsed_seconds.count(),
+        elapsed_seconds.count() / ((float)niterations / 1e9)
+      );
+    }
+  }
+  return true;
+}
+
+bool benchmark_contains(int niterations) {
+  size_t sizes[] = { 16, 64, 256, 4096, 65536 };
+
+  for (size_t size : sizes) {
+    std::string haystack;
+    while (haystack.size() < size) {
+      haystack += "GET /api/v2/users?id=42&name=john HTTP/1.1 ";
+    }
+    haystack.resize(size - 6);
+    haystack += "HTTP/2";
+
+    // the previous std::string::find based 'contains', set the same way as
+    // the current one so that both have the same eval overhead
+    TinyRuleChecker e;
+    e.setMethod("findContains", [](const TinyRuleChecker::VarValue &, std::shared_ptr<void> &, std::string &) {
+      return true;
+    },
+    [](const TinyRuleChecker::VarValue &v1, const TinyRuleChecker::VarValue &v2, const void *, TinyRuleChecker::EvalResult &eval) {
+      eval.result = v1.strval.find(v2.strval) != std::string::npos;
+      return true;
+    });
+    e.setVarString("c", haystack.c_str());
+    TinyRuleChecker::Rule rules[2] = { e.compile("c.findContains('HTTP/2')"), e.compile("c.contains('HTTP/2')") };
+    int n = (int)(niterations * 16 / size) + 1;
+
+    double elapsed[2];
+    for (int mode = 0; mode < 2; mode++) {
+      int matches = 0;
+      std::chrono::time_point<std::chrono::system_clock> start, end;
+      start = std::chrono::system_clock::now();
+      for (int i = 0; i < n; i++) {
+        matches += e.eval(rules[mode]).result;
+      }
+      end = std::chrono::system_clock::now();
+      std::chrono::duration<double> elapsed_seconds = end-start;
+      if (matches != n) return false;
+      elapsed[mode] = elapsed_seconds.count();
+
+      printf(
+        "contains %5d bytes (%-11s): %.3f MB/sec  (1 in %.3f nanoseconds)%s\n",
+        (int)size,
+        mode == 0 ? "string find" : "contains",
+        ((float)n * size / 1e6) / elapsed[mode],
+        elapsed[mode] / ((float)n / 1e9),
+        mode == 0 ? "" : (" x" + std::to_string(elapsed[0] / elapsed[1]).substr(0, 4)).c_str()
+      );
+    }
+  }
+  return true;
+}
+
+bool benchmark_arrays(int niterations) {
+  int sizes[] = { 10, 100, 1000, 10000 };
+  const char *exprs[] = {
+    "ids.containsAny([3, 5, 7, 11, 13, 17, 19, 23])",
+    "ids.containsAll([4, 8, 16, 32])",
+    "ids.intersects(others)",
+    "tags.containsAny(['tag3', 'tag5', 'tag7', 'tag10'])",
+  };
+
+  for (int size : sizes) {
+    std::vector<int32_t> ids, others;
+    std::vector<std::string> tags;
+    for (int i = 0; i < size; i++) {
+      ids.push_back(i * 4);
+      others.push_back(i * 4 + 2);
+      tags.push_back("tag" + std::to_string(i * 2));
+    }
+    others.back() = ids.back();
+
+    TinyRuleChecker e;
+    e.setVarArray("ids", ids);
+    e.setVarArray("others", others);
+    e.setVarArray("tags", tags);
+
+    for (const char *expr : exprs) {
+      TinyRuleChecker::Rule rule = e.compile(expr);
+      int n = niterations / size + 1;
+      bool expected = strstr(expr, "containsAny([3") == NULL;
+
+      std::chrono::time_point<std::chrono::system_clock> start, end;
+      start = std::chrono::system_clock::now();
+      for (int i = 0; i < n; i++) {
+        if (e.eval(rule).result != expected) return false;
+      }
+      end = std::chrono::system_clock::now();
+      std::chrono::duration<double> elapsed_seconds = end-start;
+      printf(
+        "%5d elements, %-52s: %.3f M ops/sec  (1 in %.3f nanoseconds)\n",
+        size,
+        expr,
+        ((float)n / 1e6) / elapsed_seconds.count(),
+        elapsed_seconds.count() / ((float)n / 1e9)
+      );
+    }
+  }
+  return true;
+}
+
+bool benchmark_parser(int niterations) {
+  TinyRuleChecker e;
+  e.setVarInt("a", 100);
+
+  std::string expr;
+  for (int i = 0; i < 100000; i++) {
+    expr += (i == 0) ? "a.eq(" : (i % 2 ? " && a.gt(" : " || a.lt(");
+    expr += std::to_string(i == 0 ? 100 : i % 1000) + ")";
+  }
+
+  int n = niterations / 100000 + 1;
+  for (int mode = 0; mode < 3; mode++) {
+    TinyRuleChecker::Rule rule = e.compile(expr.c_str());
+    if (!rule.error.empty()) return false;
+
+    std::chrono::time_point<std::chrono::system_clock> start, end;
+    start = std::chrono::system_clock::now();
+    for (int i = 0; i < n; i++) {
+      TinyRuleChecker::EvalResult er;
+      if (mode == 0) {
+        er = e.eval(expr.c_str());
+      }
+      else if (mode == 1) {
+        er = e.eval(e.compile(expr.c_str()));
+      }
+      else {
+        er = e.eval(rule);
+      }
+      if (!er.error.empty() || !er.result) return false;
+    }
+    end = std::chrono::system_clock::now();
+    std::chrono::duration<double> elapsed_seconds = end-start;
+    printf(
+      "100k terms (%-16s): %.3f M terms/sec  (1 expression in %.3f milliseconds)\n",
+      mode == 0 ? "interpreted" : (mode == 1 ? "compile and eval" : "compiled"),
+      ((float)n * 100000 / 1e6) / elapsed_seconds.count(),
+      elapsed_seconds.count() / ((float)n / 1e3)
+    );
+  }
+  return true;
+}
+
+bool benchmark_cache(int niterations) {
+  std::vector<std::string> exprs;
+  for (int i = 0; i < 100; i++) {
+    exprs.push_back(
+      "(myint.eq(" + std::to_string(i) + ") || myfloat.gt(2.5)) && mystr.contains('str') && !mystr.eq('x" + std::to_string(i) + "')"
+    );
+  }
+
+  for (int mode = 0; mode < 2; mode++) {
+    TinyRuleChecker e;
+    e.setVarInt("myint", 1);
+    e.setVarFloat("myfloat", 2.0);
+    e.setVarString("mystr", "my string");
+    if (mode == 0) e.setRuleCache(0);
+
+    int matches = 0;
+    std::chrono::time_point<std::chrono::system_clock> start, end;
+    start = std::chrono::system_clock::now();
+    for (int i = 0; i < niterations; i++) {
+      matches += e.eval(exprs[i % exprs.size()].c_str()).result;
+    }
+    end = std::chrono::system_clock::now();
+    std::chrono::duration<double> elapsed_seconds = end-start;
+    if (matches != (niterations + 98) / 100) return false;
+
+    TinyRuleChecker::RuleCache::Stats stats = e.ruleCacheStats();
+    printf(
+      "eval(expr) %-8s: %.3f M ops/sec  (1 in %.3f nanoseconds; %llu hits, %llu misses)\n",
+      mode == 0 ? "no cache" : "cache",
+      ((float)niterations / 1e6) / elapsed_seconds.count(),
+      elapsed_seconds.count() / ((float)niterations / 1e9),
+      (unsigned long long)stats.hits,
+      (unsigned long long)stats.misses
+    );
+  }
+  return true;
+}
+
+bool benchmark_packs() {
+  std::vector<std::string> exprs;
+  for (int i = 0; i < 100000; i++) {
+    exprs.push_back(
+      "url.startsWith('/service/" + std::to_string(i % 1000) + "/') && code.in([" + std::to_string(i % 500) + ", 404]) || " +
+      "ua.icontains('agent" + std::to_string(i) + "') && !method.eq('" + (i % 2 ? "GET" : "POST") + "')"
+    );
+  }
+
+  TinyRuleChecker e;
+  std::string error;
+  TinyRuleChecker::RuleSet set, loaded;
+
+  std::chrono::time_point<std::chrono::system_clock> start, end;
+  start = std::chrono::system_clock::now();
+  set = e.compile(exprs);
+  end = std::chrono::system_clock::now();
+  std::chrono::duration<double> compileSeconds = end-start;
+
+  if (!e.save(set, "tinyrulechecker_bench.pack", error)) return false;
+
+  start = std::chrono::system_clock::now();
+  bool ok = e.load("tinyrulechecker_bench.pack", loaded, error);
+  end = std::chrono::system_clock::now();
+  std::chrono::duration<double> loadSeconds = end-start;
+
+  struct stat st;
+  stat("tinyrulechecker_bench.pack", &st);
+  remove("tinyrulechecker_bench.pack");
+  if (!ok || loaded.rules.size() != exprs.size()) return false;
+
+  printf(
+    "100k rules cold start: compile %.3f seconds, load pack %.3f seconds (%.1f MB)\n",
+    compileSeconds.count(),
+    loadSeconds.count(),
+    st.st_size / 1e6
+  );
+  return true;
+}
+
+bool benchmark_reload(int niterations) {
+  TinyRuleChecker e;
+  std::vector<std::shared_ptr<const TinyRuleChecker::RuleSet>> sets;
+  for (int v = 0; v < 2; v++) {
+    std::vector<std::string> exprs;
+    for (int i = 0; i < 1000; i++) {
+      exprs.push_back("a.gt(" + std::to_string(i + v) + ") && s.startsWith('/" + std::to_string(i) + "')");
+    }
+    sets.push_back(std::make_shared<const TinyRuleChecker::RuleSet>(e.compile(exprs)));
+  }
+
+  int n = niterations / 1000 + 100;
+  for (int mode = 0; mode < 2; mode++) {
+    TinyRuleChecker::SharedRuleSet shared(sets[0]);
+    std::atomic<bool> done(false);
+
+    // publisher, swapping sets every millisecond
+    std::thread publisher([&]() {
+      for (int i = 1; mode == 1 && !done; i++) {
+        shared.publish(sets[i % 2]);
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+      }
+    });
+
+    e.setVarInt("a", 500);
+    e.setVarString("s", "/42/x");
+    std::vector<TinyRuleChecker::EvalResult> results;
+    std::vector<double> latencies;
+    uint64_t firstVersion = shared.version();
+    for (int i = 0; i < n; i++) {
+      std::chrono::time_point<std::chrono::steady_clock> start = std::chrono::steady_clock::now();
+      e.eval(shared, results);
+      latencies.push_back(std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count() * 1e6);
+    }
+    done = true;
+    publisher.join();
+
+    std::sort(latencies.begin(), latencies.end());
+    printf(
+      "1000 rules %-15s: p50 %.2f us, p99 %.2f us, max %.2f us (%d reloads)\n",
+      mode == 0 ? "no reloads" : "reloading",
+      latencies[latencies.size() / 2],
+      latencies[latencies.size() * 99 / 100],
+      latencies.back(),
+      (int)(shared.version() - firstVersion)
+    );
+  }
+  return true;
+}
+
+bool benchmark_updates(int niterations) {
+  TinyRuleChecker e;
+  auto expr = [](int i) {
+    return "url.startsWith('/" + std::to_string(i) + "/') && code.eq(" + std::to_string(i % 100) + ")";
+  };
+
+  int nupdates = niterations / 1000 + 1000;
+  for (int nrules : {1000, 10000, 100000}) {
+    std::vector<std::string> exprs;
+    for (int i = 0; i < nrules; i++) {
+      exprs.push_back(expr(i));
+    }
+
+    std::chrono::time_point<std::chrono::steady_clock> start = std::chrono::steady_clock::now();
+    TinyRuleChecker::RuleSet set = e.compile(exprs);
+    double compileTime = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    // replace rules with new literals (compacting every now and then)
+    start = std::chrono::steady_clock::now();
+    for (int i = 0; i < nupdates; i++) {
+      e.replaceRule(set, (i * 7919) % nrules, expr(nrules + i).c_str());
+    }
+    double updateTime = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    printf(
+      "%6d rules: full compile %8.3f ms, replaceRule %6.2f us (%d updates)\n",
+      nrules, compileTime * 1e3, updateTime * 1e6 / nupdates, nupdates
+    );
+  }
+  return true;
+}
+
+bool benchmark_compileAll(int niterations) {
+  TinyRuleChecker e;
+  std::vector<std::string> exprs;
+  int nrules = std::min(1000000, niterations / 10 + 100000);
+  for (int i = 0; i < nrules; i++) {
+    exprs.push_back(
+      "url.startsWith('/" + std::to_string(i) + "/') && code.in([" + std::to_string(i % 100) + ", 500])"
+      " || ua.icontains('" + std::to_string(i % 1000) + "')"
+    );
+  }
+
+  std::chrono::time_point<std::chrono::steady_clock> start = std::chrono::steady_clock::now();
+  std::string expected = e.serialize(e.compile(exprs));
+  double serialTime = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  printf("%d rules compile          : %8.3f ms (pack hash %016zx)\n", nrules, serialTime * 1e3, std::hash<std::string>()(expected));
+
+  for (unsigned nthreads : {1u, 2u, 4u, std::max(1u, std::thread::hardware_concurrency())}) {
+    start = std::chrono::steady_clock::now();
+    std::string pack = e.serialize(e.compileAll(exprs, nthreads));
+    double time = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    printf(
+      "%d rules compileAll(%2u) : %8.3f ms (pack hash %016zx)%s\n",
+      nrules, nthreads, time * 1e3, std::hash<std::string>()(pack), pack == expected ? "" : " DIFFERENT"
+    );
+  }
+  return true;
+}
+
+bool benchmark_priorities(int niterations) {
+  TinyRuleChecker e;
+  std::vector<std::string> exprs;
+  std::vector<int32_t> priorities;
+  for (int i = 0; i < 10000; i++) {
+    exprs.push_back(
+      "url.startsWith('/svc" + std::to_string(i % 500) + "/') && method.eq('" + (i % 3 ? "GET" : "POST") + "')"
+      " && size.lt(" + std::to_string(i % 1000 * 10) + ")"
+    );
+    priorities.push_back(i % 97);
+  }
+  exprs.push_back("size.gte(0)"); // default route
+  priorities.push_back(-1);
+  TinyRuleChecker::RuleSet set = e.compile(exprs);
+  e.setPriorities(set, priorities);
+
+  std::vector<TinyRuleChecker::EvalResult> results;
+  std::vector<uint32_t> matches;
+  int n = niterations / 1000 + 100;
+  for (int mode = 0; mode < 3; mode++) {
+    uint64_t checksum = 0;
+    std::chrono::time_point<std::chrono::steady_clock> start = std::chrono::steady_clock::now();
+    for (int i = 0; i < n; i++) {
+      e.setVarString("url", ("/svc" + std::to_string(i % 600) + "/items").c_str());
+      e.setVarString("method", i % 2 ? "GET" : "POST");
+      e.setVarInt("size", i % 5000);
+
+      if (mode == 0) {
+        // all rules, then sort the matching ones
+        e.eval(set, results);
+        matches.clear();
+        for (uint32_t j = 0; j < results.size(); j++) {
+          if (results[j].result) matches.push_back(j);
+        }
+        std::stable_sort(matches.begin(), matches.end(), [&priorities](uint32_t a, uint32_t b) {
+          return priorities[a] > priorities[b];
+        });
+        checksum += matches[0];
+      }
+      else if (mode == 1) {
+        uint32_t first;
+        e.firstMatch(set, first);
+        checksum += first;
+      }
+      else {
+        e.topK(set, 5, matches);
+        checksum += matches[0];
+      }
+    }
+    double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    printf(
+      "10k rules %-20s: %8.2f us per eval (checksum %llu)\n",
+      mode == 0 ? "eval all and sort" : (mode == 1 ? "firstMatch" : "topK(5)"),
+      elapsed * 1e6 / n, (unsigned long long)checksum
+    );
+  }
+  return true;
+}
+
+bool benchmark_diagrams(int niterations) {
+  TinyRuleChecker e;
+  const char *methods[] = { "GET", "POST", "PUT", "DELETE" };
+  for (int nrules : {50, 200, 1000}) {
+    std::vector<std::string> exprs;
+    for (int i = 0; i < nrules; i++) {
+      exprs.push_back(
+        std::string("method.eq('") + methods[i % 4] + "') && code.eq(" + std::to_string(i / 4 % 25) + ")"
+        " && (region.eq(" + std::to_string(i % 7) + ") || tier.gt(" + std::to_string(i % 3) + "))"
+      );
+    }
+    TinyRuleChecker::RuleSet plain = e.compile(exprs);
+    TinyRuleChecker::RuleSet set = plain;
+
+    std::chrono::time_point<std::chrono::steady_clock> start = std::chrono::steady_clock::now();
+    bool compiled = e.compileDiagram(set, 1 << 20);
+    double buildTime = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    std::vector<TinyRuleChecker::EvalResult> results;
+    double times[2];
+    int n = niterations / 100 + 1000;
+    for (int mode = 0; mode < 2; mode++) {
+      start = std::chrono::steady_clock::now();
+      for (int i = 0; i < n; i++) {
+        e.setVarString("method", methods[i % 4]);
+        e.setVarInt("code", i % 30);
+        e.setVarInt("region", i % 9);
+        e.setVarInt("tier", i % 4);
+        e.eval(mode ? set : plain, results);
+      }
+      times[mode] = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count() * 1e6 / n;
+    }
+    printf(
+      "%4d rules, %3zu predicates: diagram %s %6zu nodes (built in %7.3f ms), eval %7.2f us vs %7.2f us (%.1fx)\n",
+      nrules, plain.predicates.size(), compiled ? "with" : "over", set.diagram.nodes.size(), buildTime * 1e3,
+      times[1], times[0], times[0] / times[1]
+    );
+  }
+  return true;
+}
+
+bool benchmark_truthtables(int niterations) {
+  TinyRuleChecker e;
+  std::vector<std::string> exprs;
+  for (int i = 0; i < 1000; i++) {
+    exprs.push_back(
+      "a.gt(" + std::to_string(rand() % 100) + ") && b.lt(" + std::to_string(rand() % 100) + ")"
+      " || c.hasAnyBits(" + std::to_string(1 << (i % 8)) + ") && !d.eq(" + std::to_string(i % 4) + ")"
+    );
+  }
+  TinyRuleChecker::RuleSet set = e.compile(exprs);
+  TinyRuleChecker::RuleSet branchy = set;
+  for (TinyRuleChecker::Rule &rule : branchy.rules) {
+    rule.tableInputs.clear();
+  }
+
+  // random outcomes
+  std::vector<int32_t> values;
+  for (int i = 0; i < 4096; i++) {
+    values.push_back(rand() % 100);
+  }
+
+  std::vector<TinyRuleChecker::EvalResult> results;
+  int n = niterations / 1000 + 100;
+  for (int mode = 0; mode < 2; mode++) {
+    size_t matches = 0;
+    std::chrono::time_point<std::chrono::steady_clock> start = std::chrono::steady_clock::now();
+    for (int i = 0; i < n; i++) {
+      e.setVarInt("a", values[i * 4 % 4096]);
+      e.setVarInt("b", values[(i * 4 + 1) % 4096]);
+      e.setVarInt("c", values[(i * 4 + 2) % 4096]);
+      e.setVarInt("d", values[(i * 4 + 3) % 4096] % 4);
+      e.eval(mode ? set : branchy, results);
+      for (const TinyRuleChecker::EvalResult &er : results) {
+        matches += er.result;
+      }
+    }
+    double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    printf(
+      "1000 rules, 4 numeric statements each (%-10s): %7.2f ns per rule (%zu matches)\n",
+      mode ? "branchless" : "branchy", elapsed * 1e9 / n / 1000, matches
+    );
+  }
+  return true;
+}
+
+bool benchmark_batches(int niterations) {
+  TinyRuleChecker e;
+  TinyRuleChecker::Rule rule = e.compile("(a.gt(50) && b.lt(20)) || (c.hasAnyBits(6) && !d.eq(3)) || f.gte(99.5)");
+  TinyRuleChecker::RecordBatch batch;
+  batch.vars = { "a", "b", "c", "d", "f" };
+  batch.count = 4096;
+  std::vector<TinyRuleChecker::VarValue> values(batch.count * batch.vars.size());
+  for (size_t i = 0; i < values.size(); i++) {
+    values[i].type = i % 5 == 4 ? TinyRuleChecker::V_TYPE_FLOAT : TinyRuleChecker::V_TYPE_INT;
+    values[i].intval = rand() % 100;
+    values[i].floatval = rand() % 100;
+  }
+  batch.values = values.data();
+
+  std::vector<TinyRuleChecker::EvalResult> results(batch.count);
+  int n = niterations / 100000 + 10;
+  for (int mode = 0; mode < 2; mode++) {
+    size_t matches = 0;
+    std::chrono::time_point<std::chrono::steady_clock> start = std::chrono::steady_clock::now();
+    for (int i = 0; i < n; i++) {
+      if (mode == 0) {
+        for (size_t r = 0; r < batch.count; r++) {
+          const TinyRuleChecker::VarValue *record = &values[r * 5];
+          e.setVarInt("a", record[0].intval);
+          e.setVarInt("b", record[1].intval);
+          e.setVarInt("c", record[2].intval);
+          e.setVarInt("d", record[3].intval);
+          e.setVarFloat("f", record[4].floatval);
+          results[r] = e.eval(rule);
+        }
+      }
+      else {
+        e.evalBatch(rule, batch, results);
+      }
+      for (const TinyRuleChecker::EvalResult &er : results) {
+        matches += er.result;
+      }
+    }
+    double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    printf(
+      "4096 records, 5 statements (%-12s): %7.2f ns per record (%zu matches)\n",
+      mode ? "evalBatch" : "eval each", elapsed * 1e9 / n / batch.count, matches
+    );
+  }
+  return true;
+}
+
+bool benchmark_bitmaps(int niterations) {
+  const uint32_t nrows = 10000000;
+  const char *names[] = { "0.01% random", "1% random", "50% random", "clustered" };
+  int n = niterations / 1000000 + 3;
+  for (int kind = 0; kind < 4; kind++) {
+    TinyRuleChecker::MatchBitmap bitmaps[2];
+    std::vector<uint64_t> bitsets[2];
+    for (int k = 0; k < 2; k++) {
+      bitsets[k].assign(nrows / 64, 0);
+      for (uint32_t row = 0; row < nrows; row++) {
+        bool match = kind == 0 ? rand() % 10000 == 0 : (kind == 1 ? rand() % 100 == 0 :
+          (kind == 2 ? rand() % 2 == 0 : (row + k * 3000) / 10000 % 4 == 0));
+        if (match) {
+          bitmaps[k].add(row);
+          bitsets[k][row / 64] |= (uint64_t)1 << (row % 64);
+        }
+      }
+      bitmaps[k].optimize();
+    }
+
+    // AND + count, OR
+    uint64_t count = 0;
+    std::chrono::time_point<std::chrono::steady_clock> start = std::chrono::steady_clock::now();
+    for (int i = 0; i < n; i++) {
+      count += (bitmaps[0] & bitmaps[1]).cardinality();
+      count += (bitmaps[0] | bitmaps[1]).cardinality();
+    }
+    double bitmapTime = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count() / n;
+
+    std::vector<uint64_t> result(bitsets[0].size());
+    start = std::chrono::steady_clock::now();
+    for (int i = 0; i < n; i++) {
+      for (int op = 0; op < 2; op++) {
+        for (size_t w = 0; w < result.size(); w++) {
+          result[w] = op ? bitsets[0][w] | bitsets[1][w] : bitsets[0][w] & bitsets[1][w];
+        }
+        for (uint64_t w : result) {
+          count += __builtin_popcountll(w);
+        }
+      }
+    }
+    double bitsetTime = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count() / n;
+
+    printf(
+      "10M rows, %-12s: %8.1f KB vs %8.1f KB bitset, AND+OR %7.3f ms vs %7.3f ms bitset (%llu)\n",
+      names[kind], bitmaps[0].bytes() / 1024.0, bitsets[0].size() * 8 / 1024.0,
+      bitmapTime * 1e3, bitsetTime * 1e3, (unsigned long long)count
+    );
+  }
+  return true;
+}
+
+bool benchmark_derived(int niterations) {
+  auto hostOf = [](const std::string &url) {
+    size_t start = url.find("://");
+    start = (start == std::string::npos) ? 0 : start + 3;
+    return url.substr(start, url.find('/', start) - start);
+  };
+
+  TinyRuleChecker e;
+  e.setMethod("hostIs", [hostOf](const TinyRuleChecker::VarValue &v1, const TinyRuleChecker::VarValue &v2, TinyRuleChecker::EvalResult &eval) {
+    eval.result = hostOf(v1.strval) == v2.strval;
+    return true;
+  });
+  e.setDerivedVar("host", { "url" }, [hostOf](
+    const std::vector<const TinyRuleChecker::VarValue *> &inputs, TinyRuleChecker::VarValue &value, std::string &
+  ) {
+    value.type = TinyRuleChecker::V_TYPE_STRING;
+    value.strval = hostOf(inputs[0]->strval);
+    return true;
+  });
+
+  std::vector<std::string> recomputed, derived;
+  for (int i = 0; i < 1000; i++) {
+    recomputed.push_back("url.hostIs('host" + std::to_string(i) + ".example.com') && size.gte(" + std::to_string(i) + ")");
+    derived.push_back("host.eq('host" + std::to_string(i) + ".example.com') && size.gte(" + std::to_string(i) + ")");
+  }
+  TinyRuleChecker::RuleSet sets[2] = { e.compile(recomputed), e.compile(derived) };
+
+  std::vector<TinyRuleChecker::EvalResult> results;
+  int n = niterations / 1000 + 100;
+  for (int mode = 0; mode < 2; mode++) {
+    size_t matches = 0;
+    std::chrono::time_point<std::chrono::steady_clock> start = std::chrono::steady_clock::now();
+    for (int i = 0; i < n; i++) {
+      e.setVarString("url", ("https://host" + std::to_string(i % 1000) + ".example.com/path/to/page").c_str());
+      e.setVarInt("size", i % 2000);
+      e.eval(sets[mode], results);
+      for (const TinyRuleChecker::EvalResult &er : results) {
+        matches += er.result;
+      }
+    }
+    double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    printf(
+      "1000 rules on a URL hostname (%-22s): %8.2f us per record (%zu matches)\n",
+      mode ? "derived variable" : "recomputed per method", elapsed * 1e6 / n, matches
+    );
+  }
+  return true;
+}
+
+bool benchmark_paths(int niterations) {
+  TinyRuleChecker e, other;
+  std::vector<std::string> exprs;
+  const char *paths[] = { "event.user.geo.country", "event.user.account.plan", "event.request.headers.agent", "event.request.path" };
+  for (int i = 0; i < 1000; i++) {
+    exprs.push_back(
+      std::string(paths[i % 4]) + ".eq('v" + std::to_string(i % 50) + "') || event.request.size.gt(" + std::to_string(i) + ")"
+    );
+  }
+  // slots of this checker vs rules compiled elsewhere, which look names up
+  TinyRuleChecker::RuleSet sets[2] = { other.compile(exprs), e.compile(exprs) };
+
+  std::vector<TinyRuleChecker::EvalResult> results;
+  int n = niterations / 1000 + 100;
+  for (int mode = 0; mode < 2; mode++) {
+    size_t matches = 0;
+    std::chrono::time_point<std::chrono::steady_clock> start = std::chrono::steady_clock::now();
+    for (int i = 0; i < n; i++) {
+      for (int p = 0; p < 4; p++) {
+        e.setVarString(paths[p], ("v" + std::to_string((i + p) % 60)).c_str());
+      }
+      e.setVarInt("event.request.size", i % 1000);
+      e.eval(sets[mode], results);
+      for (const TinyRuleChecker::EvalResult &er : results) {
+        matches += er.result;
+      }
+    }
+    double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    printf(
+      "1000 rules on dotted paths (%-14s): %8.2f us per record (%zu matches)\n",
+      mode ? "slots" : "name lookups", elapsed * 1e6 / n, matches
+    );
+  }
+  return true;
+}
+
+bool benchmark_bindings(int niterations) {
+  int n = niterations / 10 + 1000;
+  for (int nfields : { 10, 50, 200 }) {
+    TinyRuleChecker e;
+    std::vector<std::string> names;
+    std::vector<TinyRuleChecker::VarType> types;
+    for (int f = 0; f < nfields; f++) {
+      names.push_back("record.field" + std::to_string(f));
+      types.push_back(f % 2 ? TinyRuleChecker::V_TYPE_STRING : TinyRuleChecker::V_TYPE_INT);
+    }
+    TinyRuleChecker::BindingPlan plan = e.bindingPlan(names, types);
+    TinyRuleChecker::Rule rule = e.compile("record.field0.gt(500) && record.field1.eq('v3')");
+
+    // 16 distinct records, as values and packed
+    std::vector<TinyRuleChecker::VarValue> values(16 * nfields);
+    std::vector<std::string> records(16);
+    for (int r = 0; r < 16; r++) {
+      for (int f = 0; f < nfields; f++) {
+        TinyRuleChecker::VarValue &v = values[r * nfields + f];
+        v.type = types[f];
+        if (v.type == TinyRuleChecker::V_TYPE_INT) {
+          v.intval = r * 100 + f;
+          packInt(records[r], v.intval);
+        } else {
+          v.strval = "v" + std::to_string((r + f) % 10);
+          packString(records[r], v.strval);
+        }
+      }
+    }
+
+    const char *modes[] = { "setVar per field", "values", "packed record" };
+    std::string error;
+    for (int mode = 0; mode < 3; mode++) {
+      size_t matches = 0;
+      std::chrono::time_point<std::chrono::steady_clock> start = std::chrono::steady_clock::now();
+      for (int i = 0; i < n; i++) {
+        int r = i % 16;
+        const TinyRuleChecker::VarValue *record = &values[r * nfields];
+        if (mode == 0) {
+          for (int f = 0; f < nfields; f++) {
+            if (record[f].type == TinyRuleChecker::V_TYPE_INT) {
+              e.setVarInt(names[f].c_str(), record[f].intval);
+            } else {
+              e.setVarString(names[f].c_str(), record[f].strval.c_str());
+            }
+          }
+        } else if (mode == 1) {
+          e.setVars(plan, record);
+        } else if (!e.setVars(plan, records[r].data(), records[r].size(), error)) {
+          printf("Error setting packed record: %s\n", error.c_str());
+          return false;
+        }
+        matches += e.eval(rule).result;
+      }
+      double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+      printf(
+        "Set %3d fields (%-16s): %8.2f ns per record (%zu matches)\n",
+        nfields, modes[mode], elapsed * 1e9 / n, matches
+      );
     }
-    end = std::chrono::system_clock::now();
-    std::chrono::duration<double> elapsed_seconds = end-start;
-    printf(
-      "Pass %d: %d ops in %.3f ms (real)\n",
-      n,
-      thousand,
-      ((float)thousand)*elapsed_seconds.count()
-    );
   }
   return true;
 }
@@ -202,7 +3148,7 @@ bool benchmark(int npasses, int niterations) {
 int main() {
   // TinyRuleChecker::__generateLookupTable(); return -1;
 
-  bool testPassed = test_all();
+  bool testPassed = test_all() && test_compile() && test_matches() && test_rulesets() && test_casefold() && test_contains() && test_arrays() && test_bits() && test_parser() && test_limits() && test_cache() && test_packs() && test_reload() && test_updates() && test_compileAll() && test_priorities() && test_diagrams() && test_truthtables() && test_batches() && test_bitmaps() && test_derived() && test_paths() && test_bindings();
   printf (testPassed ? "Tests PASS!\n" : "One or more tests FAILED!\n");
 
   if (!testPassed) return -1;
@@ -217,5 +3163,27 @@ int main() {
 
   printf ("Running benchmark (n=%d)...\n", niterations);
   benchmark(3, niterations);
+  benchmark_methods(niterations);
+  benchmark_kernels(niterations);
+  benchmark_functors(niterations);
+  benchmark_matches(niterations);
+  benchmark_prefixes(niterations);
+  benchmark_casefold(niterations);
+  benchmark_contains(niterations);
+  benchmark_arrays(niterations);
+  benchmark_parser(niterations);
+  benchmark_cache(niterations);
+  benchmark_packs();
+  benchmark_reload(niterations);
+  benchmark_updates(niterations);
+  benchmark_compileAll(niterations);
+  benchmark_priorities(niterations);
+  benchmark_diagrams(niterations);
+  benchmark_truthtables(niterations);
+  benchmark_batches(niterations);
+  benchmark_bitmaps(niterations);
+  benchmark_derived(niterations);
+  benchmark_paths(niterations);
+  benchmark_bindings(niterations);
   return 0;
 }
@@ -8,19 +8,49 @@
 #include <cstring>
 #include <stdint.h>
 #include <charconv>
+#include <unordered_set>
+#include <bitset>
+#include <mutex>
+#include <thread>
+#include <deque>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+#endif
 
 #include "tinyrulechecker.h"
 
+// slots of rules compiled by another checker (or before clearVars(true)) are
+// not used
+static std::atomic<uint32_t> _slotSpaces(0);
+
 // -----------------------------------------------------------------------------
 // TinyRuleChecker constructor
 // -----------------------------------------------------------------------------
 TinyRuleChecker::TinyRuleChecker(bool defaultMethods) {
+  _slotSpace = ++_slotSpaces;
+
+  _caseFoldCache = false;
+  _methodsKey = 0;
+  _limits = {};
+  _limited = false;
+  _budget.status = EVAL_OK;
+
   clearVars();
   clearMethods();
 
   if (defaultMethods) {
     initMethods();
   }
+
+  setRuleCache(256, 4 << 20);
 }
 
 // -----------------------------------------------------------------------------
@@ -33,9 +63,25 @@ TinyRuleChecker::~TinyRuleChecker() {
 
 // -----------------------------------------------------------------------------
 // Clear internal variables
+//
+// Their slots are kept (unset) for the rules compiled so far, unless
+// freeSlots: then every slot is freed, and rules and binding plans made
+// before look their variables up by name, as those of another checker.
 // -----------------------------------------------------------------------------
-void TinyRuleChecker::clearVars() {
-  _variables.clear();
+void TinyRuleChecker::clearVars(bool freeSlots) {
+  if (freeSlots) {
+    _variables.clear();
+    _varNodes.clear();
+    _slotSpace = ++_slotSpaces;
+    _linkDerived();
+  }
+  for (uint32_t slot = 0; slot < _varNodes.size(); slot++) {
+    _variables.at(slot) = VarValue();
+    _variables.at(slot).type = V_TYPE_NONE;
+  }
+  for (DerivedVar &d : _derived) {
+    d.state = DERIVED_STALE;
+  }
 }
 
 // -----------------------------------------------------------------------------
@@ -45,7 +91,7 @@ void TinyRuleChecker::setVarInt(const char *name, int32_t value) {
   VarValue v;
   v.type = V_TYPE_INT;
   v.intval = value;
-  _variables.set(name, v);
+  _setVar(name, v);
 }
 
 // -----------------------------------------------------------------------------
@@ -55,7 +101,7 @@ void TinyRuleChecker::setVarFloat(const char *name, float value) {
   VarValue v;
   v.type = V_TYPE_FLOAT;
   v.floatval = value;
-  _variables.set(name, v);
+  _setVar(name, v);
 }
 
 // -----------------------------------------------------------------------------
@@ -65,309 +111,6007 @@ void TinyRuleChecker::setVarString(const char *name, const char *value) {
   VarValue v;
   v.type = V_TYPE_STRING;
   v.strval = value;
-  _variables.set(name, v);
+  v.foldState = _caseFoldCache ? FOLD_PENDING : FOLD_OFF;
+  _setVar(name, v);
 }
 
 // -----------------------------------------------------------------------------
-// Clear internal methods
+// _sortArray
+//
+// sort an array value the way setVarArray does for arrays set as values:
+// other types first, by int value, then strings in order, no duplicates, and
+// the sorted ints copied to 'ints'
 // -----------------------------------------------------------------------------
-void TinyRuleChecker::clearMethods() {
-  _methods.clear();
+static void _sortArray(TinyRuleChecker::VarValue &v) {
+  typedef TinyRuleChecker::VarValue VarValue;
+  std::stable_sort(v.array.begin(), v.array.end(), [](const VarValue &a, const VarValue &b) {
+    bool aString = a.type == TinyRuleChecker::V_TYPE_STRING;
+    bool bString = b.type == TinyRuleChecker::V_TYPE_STRING;
+    if (aString || bString) {
+      return (aString == bString) ? a.strval < b.strval : bString;
+    }
+    if (a.type != b.type) {
+      return a.type < b.type;
+    }
+    return a.type == TinyRuleChecker::V_TYPE_INT && a.intval < b.intval;
+  });
+  auto same = [](const VarValue &a, const VarValue &b) {
+    return a.type == b.type && (
+      (a.type == TinyRuleChecker::V_TYPE_INT && a.intval == b.intval) ||
+      (a.type == TinyRuleChecker::V_TYPE_STRING && a.strval == b.strval)
+    );
+  };
+  v.array.erase(std::unique(v.array.begin(), v.array.end(), same), v.array.end());
+
+  v.ints.clear();
+  for (const VarValue &item : v.array) {
+    if (item.type == TinyRuleChecker::V_TYPE_INT) {
+      v.ints.push_back(item.intval);
+    }
+  }
 }
 
 // -----------------------------------------------------------------------------
-// setMethod
+// setVarArray
+//
+// array variables hold sorted values with no duplicates, so set methods can
+// merge them with literal arrays
 // -----------------------------------------------------------------------------
-void TinyRuleChecker::setMethod(const char *name, TinyRuleChecker::MethodOperator method) {
-  _methods.set(name, method);
+void TinyRuleChecker::setVarArray(const char *name, const std::vector<int32_t> &values) {
+  VarValue v;
+  v.type = V_TYPE_ARRAY;
+  v.ints = values;
+  std::sort(v.ints.begin(), v.ints.end());
+  v.ints.erase(std::unique(v.ints.begin(), v.ints.end()), v.ints.end());
+
+  v.array.resize(v.ints.size());
+  for (size_t i = 0; i < v.ints.size(); i++) {
+    v.array[i].type = V_TYPE_INT;
+    v.array[i].intval = v.ints[i];
+  }
+  _setVar(name, v);
+}
+
+void TinyRuleChecker::setVarArray(const char *name, const std::vector<std::string> &values) {
+  std::vector<std::string> sorted(values);
+  std::sort(sorted.begin(), sorted.end());
+  sorted.erase(std::unique(sorted.begin(), sorted.end()), sorted.end());
+
+  VarValue v;
+  v.type = V_TYPE_ARRAY;
+  v.array.resize(sorted.size());
+  for (size_t i = 0; i < sorted.size(); i++) {
+    v.array[i].type = V_TYPE_STRING;
+    v.array[i].strval = std::move(sorted[i]);
+  }
+  _setVar(name, v);
 }
 
 // -----------------------------------------------------------------------------
-// initMethods
+// _varSlot
 //
-// Initialize all standard methods
+// slot of a variable path, created (unset) if new along with the nodes of
+// the paths above it, e.g. "user" and "user.geo" for "user.geo.country"
 // -----------------------------------------------------------------------------
-void TinyRuleChecker::initMethods() {
-#define ENSURE_SAME_TYPE(v1, v2) \
-    if (v1.type != v2.type) { \
-      eval.error = "type mismatch: type " + std::string(1, v1.type) + " vs " + std::string(1, v2.type); \
-      return false; \
-    } \
+uint32_t TinyRuleChecker::_varSlot(std::string_view path) {
+  uint32_t slot = _variables.find(path);
+  if (slot != _variables.NOT_FOUND) {
+    return slot;
+  }
 
-  setMethod("eq", [](const VarValue &v1, const VarValue &v2, EvalResult &eval) {
-    ENSURE_SAME_TYPE(v1, v2);
+  VarValue none;
+  none.type = V_TYPE_NONE;
+  slot = _variables.set(std::string(path), none);
+  _varNodes.resize(slot + 1);
+  _varNodes[slot].path = path;
 
-    switch (v1.type) {
-      case V_TYPE_INT:
-        eval.result = v1.intval == v2.intval;
-        break;
-      case V_TYPE_FLOAT:
-        eval.result = v1.floatval == v2.floatval;
-        break;
-      case V_TYPE_STRING:
-        eval.result = v1.strval == v2.strval;
-        break;
-      default:
-        eval.error = "unsupported operation 'eq' with type '" + std::string(1, v1.type) + "'";
-        return false;
+  size_t dot = path.rfind('.');
+  if (dot != std::string_view::npos && dot > 0) {
+    uint32_t parent = _varSlot(path.substr(0, dot));
+    _varNodes[parent].children.push_back(slot);
+  }
+  return slot;
+}
+
+// -----------------------------------------------------------------------------
+// _setVar
+// -----------------------------------------------------------------------------
+void TinyRuleChecker::_setVar(const char *name, VarValue &v) {
+  uint32_t slot = _varSlot(name);
+  _variables.at(slot) = std::move(v);
+  _invalidateDerived(slot);
+}
+
+// -----------------------------------------------------------------------------
+// setVarTree
+//
+// Set the variables of a nested record at once: each field is set as
+// path.name, nested records as path.name.field and so on. Variables below
+// path that are not in the record are unset, so a whole subtree is replaced.
+// -----------------------------------------------------------------------------
+void TinyRuleChecker::setVarTree(const char *path, const VarTree &tree) {
+  uint32_t slot = _varSlot(path);
+  _unsetVarTree(slot);
+  _bindVarTree(slot, tree);
+}
+
+// -----------------------------------------------------------------------------
+// bindingPlan
+//
+// Resolve variable names to slots for setVars(). Types are only needed to
+// set packed records, and must be int, float or string.
+// -----------------------------------------------------------------------------
+TinyRuleChecker::BindingPlan TinyRuleChecker::bindingPlan(
+  const std::vector<std::string> &names,
+  const std::vector<VarType> &types
+) {
+  BindingPlan plan;
+  plan.names = names;
+  plan.types = types;
+  plan.slotSpace = _slotSpace;
+  for (const std::string &name : names) {
+    plan.slots.push_back(_varSlot(name));
+  }
+  return plan;
+}
+
+// -----------------------------------------------------------------------------
+// setVars
+//
+// Set the variables of a binding plan at once, values[i] being the value of
+// plan.names[i]. The same as calling setVar* for each one, without looking
+// names up.
+// -----------------------------------------------------------------------------
+void TinyRuleChecker::setVars(const BindingPlan &plan, const VarValue *values) {
+  for (size_t i = 0; i < plan.names.size(); i++) {
+    // plans of other checkers have other slots
+    uint32_t slot = (plan.slotSpace == _slotSpace) ? plan.slots[i] : _varSlot(plan.names[i]);
+    VarValue &v = _variables.at(slot);
+    v = values[i];
+    if (v.type == V_TYPE_STRING) {
+      v.foldState = _caseFoldCache ? FOLD_PENDING : FOLD_OFF;
     }
-    return true;
-  });
+    else if (v.type == V_TYPE_ARRAY) {
+      _sortArray(v);
+    }
+    _invalidateDerived(slot);
+  }
+}
 
-  setMethod("neq", [](const VarValue &v1, const VarValue &v2, EvalResult &eval) {
-    ENSURE_SAME_TYPE(v1, v2);
+// -----------------------------------------------------------------------------
+// setVars
+//
+// Set the variables of a binding plan from a packed record: the value of
+// each one, in plan order, as an int32_t, a float or a string (uint32_t size
+// and bytes), all unaligned and in native byte order. Values are written in
+// place, reusing the memory of the previous ones. Returns FALSE with an
+// error (and no variable set) if the record doesn't match the plan.
+// -----------------------------------------------------------------------------
+bool TinyRuleChecker::setVars(const BindingPlan &plan, const void *record, size_t size, std::string &error) {
+  if (plan.types.size() != plan.names.size()) {
+    error = "binding plan without types";
+    return false;
+  }
 
-    switch (v1.type) {
-      case V_TYPE_INT:
-        eval.result = v1.intval != v2.intval;
-        break;
-      case V_TYPE_FLOAT:
-        eval.result = v1.floatval != v2.floatval;
-        break;
-      case V_TYPE_STRING:
-        eval.result = v1.strval != v2.strval;
-        break;
-      default:
-        eval.error = "unsupported operation 'neq' with type '" + std::string(1, v1.type) + "'";
-        return false;
+  // check first, so a bad record sets nothing
+  size_t offset = 0;
+  for (size_t i = 0; i < plan.types.size(); i++) {
+    size_t n = 4;
+    if (plan.types[i] == V_TYPE_STRING && size - offset >= 4) {
+      uint32_t length;
+      memcpy(&length, (const char *)record + offset, sizeof(length));
+      n += length;
     }
-    return true;
-  });
+    else if (plan.types[i] != V_TYPE_INT && plan.types[i] != V_TYPE_FLOAT && plan.types[i] != V_TYPE_STRING) {
+      error = "unsupported type for variable '" + plan.names[i] + "'";
+      return false;
+    }
+    if (n > size - offset) {
+      error = "truncated record";
+      return false;
+    }
+    offset += n;
+  }
+  if (offset != size) {
+    error = "record longer than its binding plan";
+    return false;
+  }
 
-  setMethod("gt", [](const VarValue &v1, const VarValue &v2, EvalResult &eval) {
-    ENSURE_SAME_TYPE(v1, v2);
+  const char *p = (const char *)record;
+  for (size_t i = 0; i < plan.types.size(); i++) {
+    uint32_t slot = (plan.slotSpace == _slotSpace) ? plan.slots[i] : _varSlot(plan.names[i]);
+    VarValue &v = _variables.at(slot);
+    v.type = plan.types[i];
+    if (v.type == V_TYPE_INT) {
+      memcpy(&v.intval, p, sizeof(v.intval));
+      p += 4;
+    }
+    else if (v.type == V_TYPE_FLOAT) {
+      memcpy(&v.floatval, p, sizeof(v.floatval));
+      p += 4;
+    }
+    else {
+      uint32_t length;
+      memcpy(&length, p, sizeof(length));
+      v.strval.assign(p + 4, length);
+      v.foldState = _caseFoldCache ? FOLD_PENDING : FOLD_OFF;
+      p += 4 + length;
+    }
+    if (!v.array.empty()) {
+      v.array.clear();
+      v.ints.clear();
+    }
+    _invalidateDerived(slot);
+  }
+  return true;
+}
 
-    switch (v1.type) {
-      case V_TYPE_INT:
-        eval.result = v1.intval > v2.intval;
-        break;
-      case V_TYPE_FLOAT:
-        eval.result = v1.floatval > v2.floatval;
-        break;
-      case V_TYPE_STRING:
-        eval.result = v1.strval > v2.strval;
+// -----------------------------------------------------------------------------
+// _unsetVarTree
+// -----------------------------------------------------------------------------
+void TinyRuleChecker::_unsetVarTree(uint32_t slot) {
+  VarValue &v = _variables.at(slot);
+  if (v.type != V_TYPE_NONE) {
+    v = VarValue();
+    v.type = V_TYPE_NONE;
+    _invalidateDerived(slot);
+  }
+  for (uint32_t child : _varNodes[slot].children) {
+    _unsetVarTree(child);
+  }
+}
+
+// -----------------------------------------------------------------------------
+// _bindVarTree
+//
+// set the (unset) subtree of a slot from a record, fields being found among
+// the children of the slot by name
+// -----------------------------------------------------------------------------
+void TinyRuleChecker::_bindVarTree(uint32_t slot, const VarTree &tree) {
+  if (tree.fields.empty()) {
+    VarValue &v = _variables.at(slot);
+    v = tree.value;
+    if (v.type == V_TYPE_STRING) {
+      v.foldState = _caseFoldCache ? FOLD_PENDING : FOLD_OFF;
+    }
+    else if (v.type == V_TYPE_ARRAY) {
+      _sortArray(v);
+    }
+    _invalidateDerived(slot);
+    return;
+  }
+
+  for (const VarTree &field : tree.fields) {
+    uint32_t child = _variables.NOT_FOUND;
+    size_t prefix = _varNodes[slot].path.size() + 1;
+    for (uint32_t c : _varNodes[slot].children) {
+      const std::string &path = _varNodes[c].path;
+      if (path.size() - prefix == field.name.size() && path.compare(prefix, std::string::npos, field.name) == 0) {
+        child = c;
         break;
-      default:
-        eval.error = "unsupported operation 'gt' with type '" + std::string(1, v1.type) + "'";
-        return false;
+      }
     }
-    return true;
-  });
+    if (child == _variables.NOT_FOUND) {
+      child = _varSlot(_varNodes[slot].path + "." + field.name);
+    }
+    _bindVarTree(child, field);
+  }
+}
 
-  setMethod("gte", [](const VarValue &v1, const VarValue &v2, EvalResult &eval) {
-    ENSURE_SAME_TYPE(v1, v2);
+// -----------------------------------------------------------------------------
+// _bindSlots
+//
+// resolve the variables of a compiled statement to slots of this checker
+// -----------------------------------------------------------------------------
+void TinyRuleChecker::_bindSlots(Statement &st) {
+  st.varSlot = _varSlot(st.var);
+  st.valueSlot = (st.value.type == V_TYPE_VARREF) ? _varSlot(st.value.strval) : 0;
+  st.slotSpace = _slotSpace;
+}
 
-    switch(v1.type) {
-      case V_TYPE_INT:
-        eval.result = v1.intval >= v2.intval;
-        break;
-      case V_TYPE_FLOAT:
-        eval.result = v1.floatval >= v2.floatval;
-        break;
-      case V_TYPE_STRING:
-        eval.result = v1.strval >= v2.strval;
-        break;
-      default:
-        eval.error = "unsupported operation 'gte' with type '" + std::string(1, v1.type) + "'";
-        return false;
+// -----------------------------------------------------------------------------
+// _setDerivedVar
+//
+// define (or redefine) a derived variable, see setDerivedVar. Variables set
+// with the same name take precedence.
+// -----------------------------------------------------------------------------
+void TinyRuleChecker::_setDerivedVar(const char *name, const std::vector<std::string> &inputs, DerivedVar &d) {
+  d.name = name;
+  d.inputs = inputs;
+  d.state = DERIVED_STALE;
+
+  const uint32_t *index = _derivedLookup.get(d.name);
+  if (index) {
+    _derived[*index] = std::move(d);
+  }
+  else {
+    _derivedLookup.set(d.name, _derived.size());
+    _derived.push_back(std::move(d));
+  }
+  _linkDerived();
+
+  // anything derived from it is stale too
+  _invalidateDerived(_varSlot(name));
+}
+
+// -----------------------------------------------------------------------------
+// _linkDerived
+//
+// resolve the names and inputs of derived variables to slots, so setting an
+// input finds what is derived from it
+// -----------------------------------------------------------------------------
+void TinyRuleChecker::_linkDerived() {
+  for (VarNode &node : _varNodes) {
+    node.dependents.clear();
+  }
+  for (uint32_t i = 0; i < _derived.size(); i++) {
+    _derived[i].slot = _varSlot(_derived[i].name);
+    for (const std::string &input : _derived[i].inputs) {
+      uint32_t slot = _varSlot(input);
+      _varNodes[slot].dependents.push_back(i);
     }
-    return true;
-  });
+  }
+}
 
-  setMethod("lt", [](const VarValue &v1, const VarValue &v2, EvalResult &eval) {
-    ENSURE_SAME_TYPE(v1, v2);
+// -----------------------------------------------------------------------------
+// clearDerivedVars
+// -----------------------------------------------------------------------------
+void TinyRuleChecker::clearDerivedVars() {
+  _derived.clear();
+  _derivedLookup.clear();
+  for (VarNode &node : _varNodes) {
+    node.dependents.clear();
+  }
+}
 
-    switch (v1.type) {
-      case V_TYPE_INT:
-        eval.result = v1.intval < v2.intval;
-        break;
-      case V_TYPE_FLOAT:
-        eval.result = v1.floatval < v2.floatval;
-        break;
-      case  V_TYPE_STRING:
-        eval.result = v1.strval < v2.strval;
-        break;
-      default:
-        eval.error = "unsupported operation 'lt' with type '" + std::string(1, v1.type) + "'";
-        return false;
+// -----------------------------------------------------------------------------
+// _invalidateDerived
+//
+// a variable changed: derived variables using it (directly or not) must be
+// computed again
+// -----------------------------------------------------------------------------
+void TinyRuleChecker::_invalidateDerived(uint32_t slot) {
+  if (_derived.empty()) {
+    return;
+  }
+
+  for (uint32_t i : _varNodes[slot].dependents) {
+    // dependents of a stale variable are already stale
+    if (_derived[i].state != DERIVED_STALE) {
+      _derived[i].state = DERIVED_STALE;
+      _invalidateDerived(_derived[i].slot);
     }
-    return true;
-  });
+  }
+}
 
-  setMethod("lte", [](const VarValue &v1, const VarValue &v2, EvalResult &eval) {
-    ENSURE_SAME_TYPE(v1, v2);
+// -----------------------------------------------------------------------------
+// _getDerivedVar
+//
+// value of a derived variable, computed if stale. Returns NULL if there's no
+// such variable or it can't be computed (see _varError).
+// -----------------------------------------------------------------------------
+const TinyRuleChecker::VarValue *TinyRuleChecker::_getDerivedVar(std::string_view name) {
+  const uint32_t *index = _derivedLookup.get(name);
+  if (index == NULL) {
+    return NULL;
+  }
 
-    switch (v1.type) {
-      case V_TYPE_INT:
-        eval.result = v1.intval <= v2.intval;
-        break;
-      case V_TYPE_FLOAT:
-        eval.result = v1.floatval <= v2.floatval;
-        break;
-      case  V_TYPE_STRING:
-        eval.result = v1.strval <= v2.strval;
-        break;
-      default:
-        eval.error = "unsupported operation 'lte' with type '" + std::string(1, v1.type) + "'";
+  DerivedVar &d = _derived[*index];
+  if (d.state == DERIVED_READY) {
+    return &d.value;
+  }
+  if (d.state != DERIVED_STALE) {
+    return NULL; // failed, or used by its own inputs
+  }
+
+  d.state = DERIVED_COMPUTING;
+  std::vector<const VarValue *> inputs(d.inputs.size());
+  for (size_t i = 0; i < d.inputs.size(); i++) {
+    inputs[i] = NULL;
+    if (_batchRecord) {
+      size_t field = std::find(_batchVars->begin(), _batchVars->end(), d.inputs[i]) - _batchVars->begin();
+      inputs[i] = (field < _batchVars->size()) ? &_batchRecord[field] : NULL;
+    }
+    if (inputs[i] == NULL) {
+      inputs[i] = _getVar(d.inputs[i]);
+    }
+    if (inputs[i] == NULL) {
+      d.error = _varError(d.inputs[i]);
+      d.state = DERIVED_FAILED;
+      return NULL;
+    }
+  }
+
+  d.value = VarValue();
+  d.error.clear();
+  if (!d.call(d.functor.get(), inputs, d.value, d.error)) {
+    if (d.error.empty()) {
+      d.error = "can't compute variable '" + d.name + "'";
+    }
+    d.state = DERIVED_FAILED;
+    return NULL;
+  }
+  if (d.value.type == V_TYPE_STRING) {
+    d.value.foldState = _caseFoldCache ? FOLD_PENDING : FOLD_OFF;
+  }
+  else if (d.value.type == V_TYPE_ARRAY) {
+    _sortArray(d.value);
+  }
+  d.state = DERIVED_READY;
+  return &d.value;
+}
+
+// -----------------------------------------------------------------------------
+// _varError
+//
+// error for a variable that couldn't be found
+// -----------------------------------------------------------------------------
+std::string TinyRuleChecker::_varError(std::string_view name) {
+  const uint32_t *index = _derived.empty() ? NULL : _derivedLookup.get(name);
+  if (index && _derived[*index].state == DERIVED_FAILED) {
+    return _derived[*index].error;
+  }
+  if (index && _derived[*index].state == DERIVED_COMPUTING) {
+    return "variable '" + std::string(name) + "' depends on itself";
+  }
+  return "variable '" + std::string(name) + "' not found";
+}
+
+// -----------------------------------------------------------------------------
+// setEvalLimits
+// -----------------------------------------------------------------------------
+void TinyRuleChecker::setEvalLimits(const EvalLimits &limits) {
+  _limits = limits;
+  _limited = limits.maxSteps || limits.maxMicros || limits.cancel;
+}
+
+// -----------------------------------------------------------------------------
+// _startBudget
+//
+// called at the start of every public eval
+// -----------------------------------------------------------------------------
+inline void TinyRuleChecker::_startBudget() {
+  _budget.status = EVAL_OK;
+  if (!_limited) {
+    return;
+  }
+
+  _budget.steps = 0;
+  _budget.nextClockCheck = 0;
+  if (_limits.maxMicros) {
+    _budget.deadline = std::chrono::steady_clock::now() + std::chrono::microseconds(_limits.maxMicros);
+  }
+}
+
+// -----------------------------------------------------------------------------
+// _spendBudget
+//
+// charge a statement to the budget of the current eval, returns FALSE with
+// an error (and _budget.status set) if it can't run
+// -----------------------------------------------------------------------------
+static inline size_t _budgetSize(const TinyRuleChecker::VarValue &v) {
+  return v.strval.size() + v.array.size();
+}
+
+bool TinyRuleChecker::_spendBudget(const VarValue &v1, const VarValue &v2, std::string &error) {
+  return _spendSteps(1 + (_budgetSize(v1) + _budgetSize(v2)) / 64, error);
+}
+
+// -----------------------------------------------------------------------------
+// _spendSteps
+//
+// charge steps to the budget of the current eval (a statement is 1 step, plus
+// 1 per 64 bytes or array items of its operands). The clock is only read
+// every 16 steps.
+// -----------------------------------------------------------------------------
+bool TinyRuleChecker::_spendSteps(uint64_t steps, std::string &error) {
+  if (_limits.cancel && _limits.cancel->load(std::memory_order_relaxed)) {
+    _budget.status = EVAL_CANCELLED;
+    error = "evaluation cancelled";
+    return false;
+  }
+
+  _budget.steps += steps;
+  if (_limits.maxSteps && _budget.steps > _limits.maxSteps) {
+    _budget.status = EVAL_BUDGET_EXCEEDED;
+    error = "budget exceeded";
+    return false;
+  }
+
+  if (_limits.maxMicros && _budget.steps >= _budget.nextClockCheck) {
+    _budget.nextClockCheck = _budget.steps + 16;
+    if (std::chrono::steady_clock::now() > _budget.deadline) {
+      _budget.status = EVAL_BUDGET_EXCEEDED;
+      error = "budget exceeded";
+      return false;
+    }
+  }
+  return true;
+}
+
+// -----------------------------------------------------------------------------
+// _setEvalStatus
+// -----------------------------------------------------------------------------
+inline void TinyRuleChecker::_setEvalStatus(EvalResult &er) {
+  if (er.error.empty()) {
+    er.status = EVAL_OK;
+  }
+  else {
+    er.status = (_budget.status != EVAL_OK) ? _budget.status : EVAL_ERROR;
+  }
+}
+
+// -----------------------------------------------------------------------------
+// setCaseFoldCache
+//
+// When enabled, string variables set from now on keep a lowercase copy built
+// the first time a case-insensitive method needs it, which pays off when many
+// rules use case-insensitive methods on the same variable.
+// -----------------------------------------------------------------------------
+void TinyRuleChecker::setCaseFoldCache(bool enabled) {
+  _caseFoldCache = enabled;
+}
+
+// -----------------------------------------------------------------------------
+// Clear internal methods
+// -----------------------------------------------------------------------------
+void TinyRuleChecker::clearMethods() {
+  _methods.clear();
+  _methodsKey = 0;
+  if (_ruleCache) {
+    _ruleCache->clear();
+  }
+}
+
+// -----------------------------------------------------------------------------
+// setMethod
+// -----------------------------------------------------------------------------
+void TinyRuleChecker::setMethod(const char *name, TinyRuleChecker::MethodOperator method) {
+  Method m = {};
+  m.op = method;
+  _setMethod(name, m);
+}
+
+// -----------------------------------------------------------------------------
+// setMethod
+//
+// method with a prepare step run on literal arguments when compiling rules
+// -----------------------------------------------------------------------------
+void TinyRuleChecker::setMethod(
+  const char *name,
+  TinyRuleChecker::MethodPrepare prepare,
+  TinyRuleChecker::PreparedMethodOperator method
+) {
+  Method m = {};
+  m.prepare = prepare;
+  m.preparedOp = method;
+  _setMethod(name, m);
+}
+
+// -----------------------------------------------------------------------------
+// _setMethod
+//
+// set a method along with its kernels, in _kernelIndex order (int, float,
+// string, array); NULL or missing kernels fall back to the method operator
+// -----------------------------------------------------------------------------
+void TinyRuleChecker::_setMethod(
+  const char *name,
+  MethodOperator op,
+  std::initializer_list<MethodKernel> kernels,
+  IndexType index,
+  LaneOp lanes
+) {
+  Method m = {};
+  m.op = op;
+  m.index = index;
+  m.lanes = lanes;
+  m.typedErrors = true;
+  int i = 0;
+  for (MethodKernel kernel : kernels) {
+    m.kernels[i++] = kernel;
+  }
+  _setMethod(name, m);
+}
+
+// -----------------------------------------------------------------------------
+// _setMethod
+//
+// Rules cached by eval(expr) have their methods resolved, so the cache key
+// includes a hash of every method set, in order: checkers sharing a cache
+// only share rules if they set the same functions (stateful methods by
+// functor instance, so never across checkers).
+// -----------------------------------------------------------------------------
+static inline uint64_t _hashBytes(const char *data, size_t len);
+
+void TinyRuleChecker::_setMethod(const char *name, const Method &method) {
+  _methods.set(name, method);
+
+  std::string key(name);
+  auto append = [&key](const void *data, size_t size) { key.append((const char *)data, size); };
+  append(&_methodsKey, sizeof(_methodsKey));
+  append(&method.op, sizeof(method.op));
+  append(&method.call, sizeof(method.call));
+  const void *functor = method.functor.get();
+  append(&functor, sizeof(functor));
+  append(&method.prepare, sizeof(method.prepare));
+  append(&method.preparedOp, sizeof(method.preparedOp));
+  append(method.kernels, sizeof(method.kernels));
+  append(&method.index, sizeof(method.index));
+  append(&method.lanes, sizeof(method.lanes));
+  append(&method.typedErrors, sizeof(method.typedErrors));
+  _methodsKey = _hashBytes(key.data(), key.size());
+
+  // cached rules have their methods resolved
+  if (_ruleCache) {
+    _ruleCache->clear();
+  }
+}
+
+// -----------------------------------------------------------------------------
+// _callMethod
+// -----------------------------------------------------------------------------
+inline bool TinyRuleChecker::_callMethod(
+  const Method &m,
+  const VarValue &v1,
+  const VarValue &v2,
+  const void *prepared,
+  EvalResult &result
+) {
+  if (m.op) {
+    return m.op(v1, v2, result);
+  }
+  else if (m.call) {
+    return m.call(m.functor.get(), v1, v2, result);
+  }
+  return m.preparedOp(v1, v2, prepared, result);
+}
+
+// -----------------------------------------------------------------------------
+// _kernelIndex
+// -----------------------------------------------------------------------------
+inline int TinyRuleChecker::_kernelIndex(VarType type) {
+  switch (type) {
+    case V_TYPE_INT: return 0;
+    case V_TYPE_FLOAT: return 1;
+    case V_TYPE_STRING: return 2;
+    case V_TYPE_ARRAY: return 3;
+    default: return -1;
+  }
+}
+
+// -----------------------------------------------------------------------------
+// freezeMethods
+//
+// Freeze the method registry into a minimal perfect hash. Call it once all
+// methods have been set up; setting a method afterwards thaws the registry
+// (it keeps working, just with the regular lookup).
+// -----------------------------------------------------------------------------
+bool TinyRuleChecker::freezeMethods() {
+  return _methods.freeze();
+}
+
+// -----------------------------------------------------------------------------
+// TinyRegex
+//
+// Small regular expression engine for the 'matches' method. Patterns are
+// parsed into a Thompson NFA which is turned into a DFA (subset construction)
+// over byte classes, so matching is linear and allocation-free.
+//
+// If the DFA would have too many states, it is built lazily instead, by each
+// thread matching it: states are created on demand (only then allocating)
+// and the cache is flushed when full. Patterns whose NFA would be too large
+// (nested repeats multiply) or too deeply nested are rejected.
+//
+// Supported syntax: literals, '.', '[...]', '[^...]', '\d \w \s \D \W \S',
+// escaped chars, '*', '+', '?', '{m}', '{m,}', '{m,n}', '|', '(...)',
+// '(?:...)', and '^' / '$' anchors at the beginning / end of the pattern.
+// Matching is a search (anywhere in the string) unless anchored.
+// -----------------------------------------------------------------------------
+class TinyRegex {
+  public:
+    static constexpr int MAX_DFA_STATES = 2048;
+    static constexpr int MAX_DFA_SIZE = 1 << 20; // nfa states in all dfa states
+    static constexpr int MAX_NFA_SIZE = 100000;  // nfa states and transitions
+    static constexpr int MAX_REPEAT = 1000;
+    static constexpr int MAX_DEPTH = 500;        // nested groups and repeats
+
+    bool compile(const std::string &pattern, std::string &error);
+    bool match(const char *s, size_t n) const;
+    bool lazy() const { return _lazy; }
+    size_t dfaStates() const { return _dfa.accept.size(); }
+
+  private:
+    typedef enum { N_SET, N_CONCAT, N_ALT, N_STAR, N_PLUS, N_QUEST, N_REPEAT } NodeType;
+
+    typedef struct {
+      NodeType          type;
+      int               set;      // N_SET: index in _sets
+      std::vector<int>  children;
+      int               min, max; // N_REPEAT (max -1 means unbounded)
+      uint32_t          size;     // of its nfa, see _sizeNode
+      int               depth;
+    } Node;
+
+    typedef struct {
+      std::vector<std::pair<int, int>> trans; // (set, target)
+      std::vector<int>                 eps;
+    } NState;
+
+    // parser
+    const char               *_p;
+    const char               *_end;
+    std::string               _error;
+    std::vector<Node>         _nodes;
+    std::vector<std::bitset<256>> _sets;
+    int                       _depth;
+
+    int _parseAlt();
+    int _parseConcat();
+    int _parseRepeat();
+    int _parseAtom();
+    bool _parseClass(std::bitset<256> &set);
+    bool _parseEscape(std::bitset<256> &set);
+    int _addNode(NodeType type, int set = -1);
+    bool _sizeNode(int node);
+
+    // nfa
+    std::vector<NState>       _nstates;
+    int  _newState();
+    void _build(int node, int from, int to);
+    void _closure(std::vector<int> &states) const;
+
+    // dfa, starting at state 0
+    typedef struct {
+      std::vector<std::vector<int>>   states; // nfa states of each dfa state
+      std::vector<char>               accept;
+      std::vector<int32_t>            table;  // -1 until computed
+      std::map<std::vector<int>, int> index;
+      size_t                          size;   // nfa states in all states
+    } Dfa;
+
+    uint8_t                   _byteClass[256];
+    std::vector<uint8_t>      _classRep;
+    int                       _nclasses;
+    bool                      _anchoredEnd;
+    bool                      _lazy;
+    int                       _dead;
+    int                       _nfaMatch;
+    std::vector<int>          _startStates;
+    Dfa                       _dfa;  // complete, unless lazy
+    uint64_t                  _id;   // of the compiled pattern, for lazy dfas
+
+    int _addDState(Dfa &dfa, const std::vector<int> &states) const;
+    int _step(Dfa &dfa, int dstate, int cls) const;
+    void _resetDfa(Dfa &dfa) const;
+    Dfa &_lazyDfa() const;
+    bool _matchLazy(const char *s, size_t n) const;
+};
+
+// -----------------------------------------------------------------------------
+// TinyRegex::compile
+// -----------------------------------------------------------------------------
+bool TinyRegex::compile(const std::string &pattern, std::string &error) {
+  _p = pattern.data();
+  _end = _p + pattern.size();
+  _error.clear();
+  _nodes.clear();
+  _sets.clear();
+  _depth = 0;
+
+  bool anchoredStart = (_p < _end && *_p == '^');
+  _p += anchoredStart;
+
+  int root = _parseAlt();
+  _anchoredEnd = false;
+  if (root >= 0 && _p < _end && *_p == '$' && _p + 1 == _end) {
+    _anchoredEnd = true;
+    _p++;
+  }
+
+  if (root >= 0 && _p < _end) {
+    _error = (*_p == ')') ? "unbalanced ')'" : "unexpected '" + std::string(1, *_p) + "'";
+  }
+  else if (root >= 0 && (anchoredStart || _anchoredEnd) && _nodes[root].type == N_ALT) {
+    _error = "anchors with '|' require a group, e.g. ^(a|b)$";
+  }
+
+  if (!_error.empty()) {
+    error = "invalid regex '" + pattern + "': " + _error;
+    return false;
+  }
+
+  // byte classes: bytes that behave the same in all sets share a class
+  std::map<std::vector<bool>, int> signatures;
+  _classRep.clear();
+  for (int b = 0; b < 256; b++) {
+    std::vector<bool> signature(_sets.size());
+    for (size_t i = 0; i < _sets.size(); i++) {
+      signature[i] = _sets[i][b];
+    }
+
+    auto it = signatures.find(signature);
+    if (it == signatures.end()) {
+      it = signatures.insert({signature, (int)_classRep.size()}).first;
+      _classRep.push_back(b);
+    }
+    _byteClass[b] = it->second;
+  }
+  _nclasses = _classRep.size();
+
+  // thompson nfa, with a leading any-byte loop for unanchored searches
+  _nstates.clear();
+  int from = _newState();
+  _nfaMatch = _newState();
+  if (!anchoredStart) {
+    _sets.emplace_back();
+    _sets.back().set();
+    _nstates[from].trans.push_back({(int)_sets.size() - 1, from});
+  }
+  _build(root, from, _nfaMatch);
+
+  // subset construction, falling back to lazy mode if too big
+  static std::atomic<uint64_t> ids(0);
+  _id = ++ids;
+  _lazy = false;
+  _startStates = { from };
+  _closure(_startStates);
+  _resetDfa(_dfa);
+
+  for (size_t d = 0; d < _dfa.states.size(); d++) {
+    if (_dfa.states.size() > MAX_DFA_STATES || _dfa.size > MAX_DFA_SIZE) {
+      _lazy = true;
+      break;
+    }
+
+    for (int c = 0; c < _nclasses; c++) {
+      _step(_dfa, d, c);
+    }
+  }
+
+  // state with no way to match anymore (only when anchored at the start)
+  _dead = -1;
+  auto dead = _dfa.index.find(std::vector<int>());
+  if (dead != _dfa.index.end()) {
+    _dead = dead->second;
+  }
+
+  // matching only needs the transitions (lazy dfas are per thread)
+  if (_lazy) {
+    _dfa = Dfa();
+  }
+  else {
+    _dfa.states = std::vector<std::vector<int>>();
+    _dfa.index.clear();
+  }
+
+  return true;
+}
+
+// -----------------------------------------------------------------------------
+// TinyRegex::match
+// -----------------------------------------------------------------------------
+bool TinyRegex::match(const char *s, size_t n) const {
+  if (_lazy) {
+    return _matchLazy(s, n);
+  }
+
+  const int32_t *table = _dfa.table.data();
+  const char *accept = _dfa.accept.data();
+  int state = 0;
+
+  if (_anchoredEnd) {
+    for (size_t i = 0; i < n && state != _dead; i++) {
+      state = table[state * _nclasses + _byteClass[(uint8_t)s[i]]];
+    }
+    return accept[state];
+  }
+
+  for (size_t i = 0; i < n && state != _dead; i++) {
+    if (accept[state]) {
+      return true;
+    }
+    state = table[state * _nclasses + _byteClass[(uint8_t)s[i]]];
+  }
+  return accept[state];
+}
+
+// -----------------------------------------------------------------------------
+// TinyRegex::_matchLazy
+// -----------------------------------------------------------------------------
+bool TinyRegex::_matchLazy(const char *s, size_t n) const {
+  Dfa &dfa = _lazyDfa();
+
+  int state = 0;
+  for (size_t i = 0; i < n; i++) {
+    if (!_anchoredEnd && dfa.accept[state]) {
+      return true;
+    }
+
+    int cls = _byteClass[(uint8_t)s[i]];
+    int next = dfa.table[state * _nclasses + cls];
+    if (next < 0) {
+      // flush the cache when full, keeping the current state
+      if (dfa.states.size() >= MAX_DFA_STATES || dfa.size > MAX_DFA_SIZE) {
+        std::vector<int> current = std::move(dfa.states[state]);
+        _resetDfa(dfa);
+        state = _addDState(dfa, current);
+      }
+      next = _step(dfa, state, cls);
+    }
+    state = next;
+
+    if (dfa.states[state].empty()) {
+      return false;
+    }
+  }
+  return dfa.accept[state];
+}
+
+// -----------------------------------------------------------------------------
+// TinyRegex::_lazyDfa
+//
+// lazy dfa of this regex for the calling thread, so that threads never wait
+// for each other while matching. Each thread keeps the dfas of the last few
+// lazy regexes it matched.
+// -----------------------------------------------------------------------------
+TinyRegex::Dfa &TinyRegex::_lazyDfa() const {
+  static const size_t MAX_LAZY_DFAS = 4;
+  thread_local std::vector<std::pair<uint64_t, std::unique_ptr<Dfa>>> dfas; // most recently used first
+
+  size_t i = 0;
+  while (i < dfas.size() && dfas[i].first != _id) {
+    i++;
+  }
+  if (i == dfas.size()) {
+    // new one, or the least recently used one reset
+    if (dfas.size() < MAX_LAZY_DFAS) {
+      dfas.emplace_back(0, std::unique_ptr<Dfa>(new Dfa()));
+    }
+    i = dfas.size() - 1;
+    dfas[i].first = _id;
+    _resetDfa(*dfas[i].second);
+  }
+
+  std::rotate(dfas.begin(), dfas.begin() + i, dfas.begin() + i + 1);
+  return *dfas[0].second;
+}
+
+// -----------------------------------------------------------------------------
+// TinyRegex::_resetDfa
+//
+// empty dfa with only the start state
+// -----------------------------------------------------------------------------
+void TinyRegex::_resetDfa(Dfa &dfa) const {
+  dfa.states.clear();
+  dfa.accept.clear();
+  dfa.table.clear();
+  dfa.index.clear();
+  dfa.size = 0;
+  _addDState(dfa, _startStates);
+}
+
+// -----------------------------------------------------------------------------
+// TinyRegex::_addDState
+//
+// find or add a dfa state for given (closed) set of nfa states
+// -----------------------------------------------------------------------------
+int TinyRegex::_addDState(Dfa &dfa, const std::vector<int> &states) const {
+  auto it = dfa.index.find(states);
+  if (it != dfa.index.end()) {
+    return it->second;
+  }
+
+  int d = dfa.states.size();
+  bool accept = std::binary_search(states.begin(), states.end(), _nfaMatch);
+  dfa.index[states] = d;
+  dfa.states.push_back(states);
+  dfa.accept.push_back(accept);
+  dfa.table.resize(dfa.table.size() + _nclasses, -1);
+  dfa.size += states.size();
+  return d;
+}
+
+// -----------------------------------------------------------------------------
+// TinyRegex::_step
+//
+// compute (and store) the transition of a dfa state with given byte class
+// -----------------------------------------------------------------------------
+int TinyRegex::_step(Dfa &dfa, int dstate, int cls) const {
+  uint8_t byte = _classRep[cls];
+  std::vector<int> next;
+  for (int s : dfa.states[dstate]) {
+    for (const auto &t : _nstates[s].trans) {
+      if (_sets[t.first][byte]) {
+        next.push_back(t.second);
+      }
+    }
+  }
+  _closure(next);
+
+  int d = _addDState(dfa, next);
+  dfa.table[dstate * _nclasses + cls] = d;
+  return d;
+}
+
+// -----------------------------------------------------------------------------
+// TinyRegex::_closure
+//
+// epsilon closure, leaves states sorted and unique
+// -----------------------------------------------------------------------------
+void TinyRegex::_closure(std::vector<int> &states) const {
+  std::vector<bool> seen(_nstates.size(), false);
+  std::vector<int> pending(states);
+  states.clear();
+
+  while (!pending.empty()) {
+    int s = pending.back();
+    pending.pop_back();
+    if (seen[s]) {
+      continue;
+    }
+    seen[s] = true;
+    states.push_back(s);
+    for (int e : _nstates[s].eps) {
+      pending.push_back(e);
+    }
+  }
+
+  // keep only states that matter (consuming or final) so that equivalent
+  // sets map to the same dfa state
+  states.erase(std::remove_if(states.begin(), states.end(), [&](int s) {
+    return _nstates[s].trans.empty() && s != _nfaMatch;
+  }), states.end());
+  std::sort(states.begin(), states.end());
+}
+
+// -----------------------------------------------------------------------------
+// TinyRegex::_newState
+// -----------------------------------------------------------------------------
+int TinyRegex::_newState() {
+  _nstates.emplace_back();
+  return _nstates.size() - 1;
+}
+
+// -----------------------------------------------------------------------------
+// TinyRegex::_build
+//
+// add nfa states for given node going from state 'from' to state 'to'
+// -----------------------------------------------------------------------------
+void TinyRegex::_build(int node, int from, int to) {
+  const Node &n = _nodes[node];
+
+  switch (n.type) {
+    case N_SET:
+      _nstates[from].trans.push_back({n.set, to});
+      break;
+
+    case N_CONCAT:
+      if (n.children.empty()) {
+        _nstates[from].eps.push_back(to);
+      }
+      for (size_t i = 0; i < n.children.size(); i++) {
+        int next = (i + 1 == n.children.size()) ? to : _newState();
+        _build(n.children[i], from, next);
+        from = next;
+      }
+      break;
+
+    case N_ALT:
+      for (int child : n.children) {
+        _build(child, from, to);
+      }
+      break;
+
+    case N_STAR:
+      {
+        int loop = _newState();
+        _nstates[from].eps.push_back(loop);
+        _nstates[loop].eps.push_back(to);
+        _build(n.children[0], loop, loop);
+      }
+      break;
+
+    case N_PLUS:
+      {
+        int a = _newState();
+        int b = _newState();
+        _nstates[from].eps.push_back(a);
+        _build(n.children[0], a, b);
+        _nstates[b].eps.push_back(a);
+        _nstates[b].eps.push_back(to);
+      }
+      break;
+
+    case N_QUEST:
+      _nstates[from].eps.push_back(to);
+      _build(n.children[0], from, to);
+      break;
+
+    case N_REPEAT:
+      {
+        int child = n.children[0];
+        for (int i = 0; i < n.min; i++) {
+          int next = _newState();
+          _build(child, from, next);
+          from = next;
+        }
+
+        if (n.max < 0) {
+          int loop = _newState();
+          _nstates[from].eps.push_back(loop);
+          _build(child, loop, loop);
+          from = loop;
+        }
+        else {
+          for (int i = n.min; i < n.max; i++) {
+            int next = _newState();
+            _nstates[from].eps.push_back(to);
+            _build(child, from, next);
+            from = next;
+          }
+        }
+        _nstates[from].eps.push_back(to);
+      }
+      break;
+  }
+}
+
+// -----------------------------------------------------------------------------
+// TinyRegex::_addNode
+// -----------------------------------------------------------------------------
+int TinyRegex::_addNode(NodeType type, int set) {
+  Node n;
+  n.type = type;
+  n.set = set;
+  n.min = n.max = 0;
+  n.size = 1;
+  n.depth = 1;
+  _nodes.push_back(n);
+  return _nodes.size() - 1;
+}
+
+// -----------------------------------------------------------------------------
+// TinyRegex::_sizeNode
+//
+// size and depth of the nfa of a node from those of its children (repeats
+// copy their child, so nested ones multiply). FALSE if too large.
+// -----------------------------------------------------------------------------
+bool TinyRegex::_sizeNode(int node) {
+  Node &n = _nodes[node];
+  uint64_t size = 1;
+  int depth = 0;
+  for (int child : n.children) {
+    size += _nodes[child].size + 1;
+    depth = std::max(depth, _nodes[child].depth);
+  }
+  if (n.type == N_REPEAT) {
+    uint64_t copies = (n.max < 0) ? n.min + 1 : n.max;
+    size = size * std::max<uint64_t>(copies, 1) + 1;
+  }
+
+  n.size = std::min<uint64_t>(size, MAX_NFA_SIZE + 1);
+  n.depth = depth + 1;
+  if (n.size > MAX_NFA_SIZE || n.depth > MAX_DEPTH) {
+    _error = "too large";
+    return false;
+  }
+  return true;
+}
+
+// -----------------------------------------------------------------------------
+// TinyRegex::_parseAlt
+//
+// alt -> concat ('|' concat)*
+// -----------------------------------------------------------------------------
+int TinyRegex::_parseAlt() {
+  int first = _parseConcat();
+  if (first < 0 || _p >= _end || *_p != '|') {
+    return first;
+  }
+
+  int alt = _addNode(N_ALT);
+  _nodes[alt].children.push_back(first);
+  while (_p < _end && *_p == '|') {
+    _p++;
+    int next = _parseConcat();
+    if (next < 0) {
+      return -1;
+    }
+    _nodes[alt].children.push_back(next);
+  }
+  return _sizeNode(alt) ? alt : -1;
+}
+
+// -----------------------------------------------------------------------------
+// TinyRegex::_parseConcat
+//
+// concat -> repeat*
+// -----------------------------------------------------------------------------
+int TinyRegex::_parseConcat() {
+  int concat = _addNode(N_CONCAT);
+  while (_p < _end && *_p != '|' && *_p != ')') {
+    // '$' is only accepted at the very end
+    if (*_p == '$' && _p + 1 == _end) {
+      break;
+    }
+
+    int next = _parseRepeat();
+    if (next < 0) {
+      return -1;
+    }
+    _nodes[concat].children.push_back(next);
+  }
+  return _sizeNode(concat) ? concat : -1;
+}
+
+// -----------------------------------------------------------------------------
+// TinyRegex::_parseRepeat
+//
+// repeat -> atom ('*' | '+' | '?' | '{' m (',' n?)? '}')*
+// -----------------------------------------------------------------------------
+int TinyRegex::_parseRepeat() {
+  int atom = _parseAtom();
+
+  while (atom >= 0 && _p < _end) {
+    NodeType type;
+    int min = 0, max = 0;
+
+    if (*_p == '*') type = N_STAR;
+    else if (*_p == '+') type = N_PLUS;
+    else if (*_p == '?') type = N_QUEST;
+    else if (*_p == '{') {
+      const char *q = _p + 1;
+      auto number = [&](int &value) {
+        const char *start = q;
+        value = 0;
+        while (q < _end && *q >= '0' && *q <= '9' && value <= MAX_REPEAT) {
+          value = value * 10 + (*q++ - '0');
+        }
+        return q > start;
+      };
+
+      if (!number(min)) {
+        _error = "expecting number after '{'";
+        return -1;
+      }
+      max = min;
+      if (q < _end && *q == ',') {
+        q++;
+        max = number(max) ? max : -1;
+      }
+      if (q >= _end || *q != '}') {
+        _error = "expecting '}'";
+        return -1;
+      }
+      if (min > MAX_REPEAT || max > MAX_REPEAT || (max >= 0 && max < min)) {
+        _error = "invalid repetition";
+        return -1;
+      }
+      _p = q;
+      type = N_REPEAT;
+    }
+    else {
+      break;
+    }
+    _p++;
+
+    int node = _addNode(type);
+    _nodes[node].children.push_back(atom);
+    _nodes[node].min = min;
+    _nodes[node].max = max;
+    atom = _sizeNode(node) ? node : -1;
+  }
+  return atom;
+}
+
+// -----------------------------------------------------------------------------
+// TinyRegex::_parseAtom
+//
+// atom -> '(' alt ')' | '(?:' alt ')' | '[' class ']' | '.' | '\' escape | char
+// -----------------------------------------------------------------------------
+int TinyRegex::_parseAtom() {
+  std::bitset<256> set;
+
+  switch (*_p) {
+    case '(':
+      {
+        _p++;
+        if (_end - _p >= 2 && _p[0] == '?' && _p[1] == ':') {
+          _p += 2;
+        }
+
+        // groups are parsed recursively
+        if (++_depth > MAX_DEPTH) {
+          _error = "too large";
+          return -1;
+        }
+        int alt = _parseAlt();
+        if (alt < 0) {
+          return -1;
+        }
+        if (_p >= _end || *_p != ')') {
+          _error = "expecting ')'";
+          return -1;
+        }
+        _p++;
+        _depth--;
+        return alt;
+      }
+
+    case '[':
+      _p++;
+      if (!_parseClass(set)) {
+        return -1;
+      }
+      break;
+
+    case '.':
+      _p++;
+      set.set();
+      set.reset('\n');
+      break;
+
+    case '\\':
+      _p++;
+      if (!_parseEscape(set)) {
+        return -1;
+      }
+      break;
+
+    case '*':
+    case '+':
+    case '?':
+    case '{':
+      _error = "nothing to repeat";
+      return -1;
+
+    case '^':
+    case '$':
+      _error = "unsupported anchor position";
+      return -1;
+
+    default:
+      set.set((uint8_t)*_p++);
+      break;
+  }
+
+  _sets.push_back(set);
+  return _addNode(N_SET, _sets.size() - 1);
+}
+
+// -----------------------------------------------------------------------------
+// TinyRegex::_parseEscape
+// -----------------------------------------------------------------------------
+bool TinyRegex::_parseEscape(std::bitset<256> &set) {
+  if (_p >= _end) {
+    _error = "trailing '\\'";
+    return false;
+  }
+
+  char ch = *_p++;
+  bool negate = (ch == 'D' || ch == 'W' || ch == 'S');
+  switch (ch) {
+    case 'd': case 'D':
+      for (int b = '0'; b <= '9'; b++) set.set(b);
+      break;
+    case 'w': case 'W':
+      for (int b = 0; b < 256; b++) if (isalnum(b) || b == '_') set.set(b);
+      break;
+    case 's': case 'S':
+      for (int b = 0; b < 256; b++) if (isspace(b)) set.set(b);
+      break;
+    case 'n': set.set('\n'); break;
+    case 'r': set.set('\r'); break;
+    case 't': set.set('\t'); break;
+    default:  set.set((uint8_t)ch); break;
+  }
+
+  if (negate) {
+    set.flip();
+  }
+  return true;
+}
+
+// -----------------------------------------------------------------------------
+// TinyRegex::_parseClass
+//
+// '[' already consumed, parses up to ']'
+// -----------------------------------------------------------------------------
+bool TinyRegex::_parseClass(std::bitset<256> &set) {
+  bool negate = (_p < _end && *_p == '^');
+  _p += negate;
+
+  bool first = true;
+  while (_p < _end && (*_p != ']' || first)) {
+    first = false;
+
+    std::bitset<256> item;
+    uint8_t lo = *_p;
+    if (*_p == '\\') {
+      lo = 0;
+      _p++;
+      if (!_parseEscape(item)) {
+        return false;
+      }
+      // classes like \d can't be part of a range
+      if (item.count() != 1) {
+        set |= item;
+        continue;
+      }
+      while (!item[lo]) {
+        lo++;
+      }
+    }
+    else {
+      _p++;
+    }
+
+    uint8_t hi = lo;
+    if (_end - _p >= 2 && *_p == '-' && _p[1] != ']') {
+      hi = _p[1];
+      _p += 2;
+      if (hi == '\\') {
+        if (_p >= _end) {
+          _error = "trailing '\\'";
+          return false;
+        }
+        hi = *_p++;
+      }
+      if (hi < lo) {
+        _error = "invalid range in class";
+        return false;
+      }
+    }
+
+    for (int b = lo; b <= hi; b++) {
+      set.set(b);
+    }
+  }
+
+  if (_p >= _end) {
+    _error = "expecting ']'";
+    return false;
+  }
+  _p++;
+
+  if (negate) {
+    set.flip();
+  }
+  return true;
+}
+
+// -----------------------------------------------------------------------------
+// _getRegex
+//
+// compiled regex for given pattern, shared by all rules using that pattern.
+// The least recently used patterns are evicted when the cache is full.
+// -----------------------------------------------------------------------------
+static std::shared_ptr<const TinyRegex> _getRegex(const std::string &pattern, std::string &error) {
+  static const size_t MAX_CACHED_REGEX = 1024;
+  typedef std::pair<std::string, std::shared_ptr<const TinyRegex>> Entry;
+  static std::mutex mutex;
+  static std::list<Entry> lru; // most recently used first
+  static std::unordered_map<std::string, std::list<Entry>::iterator> cache;
+
+  std::unique_lock<std::mutex> lock(mutex);
+  auto it = cache.find(pattern);
+  if (it != cache.end()) {
+    lru.splice(lru.begin(), lru, it->second);
+    return it->second->second;
+  }
+
+  // compiled unlocked, other threads may add the same pattern meanwhile
+  lock.unlock();
+  std::shared_ptr<TinyRegex> regex = std::make_shared<TinyRegex>();
+  if (!regex->compile(pattern, error)) {
+    return NULL;
+  }
+  lock.lock();
+
+  it = cache.find(pattern);
+  if (it != cache.end()) {
+    lru.splice(lru.begin(), lru, it->second);
+    return it->second->second;
+  }
+  while (lru.size() >= MAX_CACHED_REGEX) {
+    cache.erase(lru.back().first);
+    lru.pop_back();
+  }
+  lru.push_front({pattern, regex});
+  cache[pattern] = lru.begin();
+  return regex;
+}
+
+// -----------------------------------------------------------------------------
+// _foldAscii
+//
+// ASCII lowercase of a character
+// -----------------------------------------------------------------------------
+static inline uint8_t _foldAscii(uint8_t ch) {
+  return ch + (((uint8_t)(ch - 'A') < 26) << 5);
+}
+
+// -----------------------------------------------------------------------------
+// _foldString
+//
+// lowercase copy of a string, reusing the memory of 'folded'
+// -----------------------------------------------------------------------------
+static void _foldString(const std::string &s, std::string &folded) {
+  folded.assign(s);
+  for (char &ch : folded) {
+    ch = _foldAscii(ch);
+  }
+}
+
+#ifdef __SSE2__
+// -----------------------------------------------------------------------------
+// _foldAscii16
+//
+// ASCII lowercase of 16 characters at once
+// -----------------------------------------------------------------------------
+static inline __m128i _foldAscii16(__m128i x) {
+  // 'A'..'Z' are moved to the lowest signed values to check both bounds with a
+  // single signed comparison
+  __m128i shifted = _mm_add_epi8(x, _mm_set1_epi8((char)(0x80 - 'A')));
+  __m128i upper = _mm_cmplt_epi8(shifted, _mm_set1_epi8((char)(0x80 + 26)));
+  return _mm_or_si128(x, _mm_and_si128(upper, _mm_set1_epi8(0x20)));
+}
+#endif
+
+// -----------------------------------------------------------------------------
+// _foldEqual
+//
+// compare n characters of 's' (any case) with 'folded' (lowercase)
+// -----------------------------------------------------------------------------
+static inline bool _foldEqual(const char *s, const char *folded, size_t n) {
+  size_t i = 0;
+#ifdef __SSE2__
+  for (; i + 16 <= n; i += 16) {
+    __m128i a = _foldAscii16(_mm_loadu_si128((const __m128i *)(s + i)));
+    __m128i b = _mm_loadu_si128((const __m128i *)(folded + i));
+    if (_mm_movemask_epi8(_mm_cmpeq_epi8(a, b)) != 0xFFFF) {
+      return false;
+    }
+  }
+#endif
+  for (; i < n; i++) {
+    if (_foldAscii(s[i]) != (uint8_t)folded[i]) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// -----------------------------------------------------------------------------
+// _foldFind
+//
+// TRUE if 'folded' (lowercase) is found in 's' (any case); candidates are
+// found comparing the first char of the needle with 16 chars at once
+// -----------------------------------------------------------------------------
+static bool _foldFind(const char *s, size_t n, const char *folded, size_t m) {
+  if (m == 0) {
+    return true;
+  }
+  if (m > n) {
+    return false;
+  }
+
+  size_t last = n - m;
+  size_t i = 0;
+#ifdef __SSE2__
+  __m128i first = _mm_set1_epi8(folded[0]);
+  for (; i + 16 <= last + 1; i += 16) {
+    __m128i block = _foldAscii16(_mm_loadu_si128((const __m128i *)(s + i)));
+    uint32_t mask = _mm_movemask_epi8(_mm_cmpeq_epi8(block, first));
+    while (mask) {
+      size_t pos = i + __builtin_ctz(mask);
+      if (_foldEqual(s + pos + 1, folded + 1, m - 1)) {
+        return true;
+      }
+      mask &= mask - 1;
+    }
+  }
+#endif
+  for (; i <= last; i++) {
+    if (_foldAscii(s[i]) == (uint8_t)folded[0] && _foldEqual(s + i + 1, folded + 1, m - 1)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// -----------------------------------------------------------------------------
+// _foldFindIn
+//
+// TRUE if 's' (any case) is found in 'folded' (lowercase), the other way
+// around than _foldFind
+// -----------------------------------------------------------------------------
+static bool _foldFindIn(const char *folded, size_t n, const char *s, size_t m) {
+  if (m == 0) {
+    return true;
+  }
+  if (m > n) {
+    return false;
+  }
+
+  uint8_t first = _foldAscii(s[0]);
+  const char *end = folded + n - m + 1;
+  for (const char *p = folded; (p = (const char *)memchr(p, first, end - p)) != NULL; p++) {
+    if (_foldEqual(s + 1, p + 1, m - 1)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// -----------------------------------------------------------------------------
+// _foldHash
+//
+// FNV-1a of the lowercase string
+// -----------------------------------------------------------------------------
+static inline uint32_t _foldHash(const char *s, size_t n) {
+  uint32_t hash = 2166136261U;
+  for (size_t i = 0; i < n; i++) {
+    hash ^= _foldAscii(s[i]);
+    hash *= 16777619;
+  }
+  return hash;
+}
+
+// -----------------------------------------------------------------------------
+// _cachedFold
+//
+// lowercase version of a string variable if the fold cache is enabled for
+// it (built on first use), NULL otherwise
+// -----------------------------------------------------------------------------
+static inline const std::string *_cachedFold(const TinyRuleChecker::VarValue &v) {
+  if (v.foldState == TinyRuleChecker::FOLD_OFF) {
+    return NULL;
+  }
+  if (v.foldState == TinyRuleChecker::FOLD_PENDING) {
+    _foldString(v.strval, v.foldedval);
+    v.foldState = TinyRuleChecker::FOLD_READY;
+  }
+  return &v.foldedval;
+}
+
+// -----------------------------------------------------------------------------
+// FoldedLiteral
+//
+// prepared state of case-insensitive methods: lowercase literal string, or
+// lowercase strings of a literal array sorted by hash
+// -----------------------------------------------------------------------------
+struct FoldedLiteral {
+  std::string                                   str;
+  std::vector<std::pair<uint32_t, std::string>> items;
+};
+
+// fold a literal into 'folded', reusing its memory
+static void _foldLiteral(const TinyRuleChecker::VarValue &literal, FoldedLiteral &folded) {
+  if (literal.type == TinyRuleChecker::V_TYPE_STRING) {
+    _foldString(literal.strval, folded.str);
+  }
+  else if (literal.type == TinyRuleChecker::V_TYPE_ARRAY) {
+    size_t n = 0;
+    for (const TinyRuleChecker::VarValue &item : literal.array) {
+      if (item.type == TinyRuleChecker::V_TYPE_STRING) {
+        if (n == folded.items.size()) {
+          folded.items.emplace_back();
+        }
+        folded.items[n].first = _foldHash(item.strval.data(), item.strval.size());
+        _foldString(item.strval, folded.items[n++].second);
+      }
+    }
+    folded.items.resize(n);
+    std::sort(folded.items.begin(), folded.items.end());
+  }
+}
+
+static bool _prepareFolded(
+  const TinyRuleChecker::VarValue &literal,
+  std::shared_ptr<void> &prepared,
+  std::string &
+) {
+  std::shared_ptr<FoldedLiteral> folded = std::make_shared<FoldedLiteral>();
+  _foldLiteral(literal, *folded);
+  prepared = folded;
+  return true;
+}
+
+// -----------------------------------------------------------------------------
+// SubstringNeedle
+//
+// prepared state of substring searches: the two needle positions whose bytes
+// are compared 16/32 candidates at a time. The second one is the last byte
+// that differs from the first one, to discard more candidates on needles
+// like "aaab" than the first/last pair would
+// -----------------------------------------------------------------------------
+struct SubstringNeedle {
+  size_t pos1;
+  size_t pos2;
+};
+
+static inline SubstringNeedle _substringNeedle(const char *needle, size_t m) {
+  SubstringNeedle sn = { 0, m ? m - 1 : 0 };
+  while (sn.pos2 > 0 && needle[sn.pos2] == needle[0]) {
+    sn.pos2--;
+  }
+  if (sn.pos2 == 0) {
+    sn.pos2 = m ? m - 1 : 0;
+  }
+  return sn;
+}
+
+// -----------------------------------------------------------------------------
+// _findSubstringScalar
+// -----------------------------------------------------------------------------
+static bool _findSubstringScalar(const char *s, size_t n, const char *needle, size_t m, const SubstringNeedle &) {
+  const char *end = s + n - m + 1;
+  for (const char *p = s; p < end; p++) {
+    p = (const char *)memchr(p, needle[0], end - p);
+    if (p == NULL) {
+      return false;
+    }
+    if (memcmp(p + 1, needle + 1, m - 1) == 0) {
+      return true;
+    }
+  }
+  return false;
+}
+
+#if defined(__x86_64__) && defined(__GNUC__)
+// -----------------------------------------------------------------------------
+// _findSubstringSSE2
+//
+// compare two needle bytes against 16 candidate positions at once, and check
+// the whole needle only where both match
+// -----------------------------------------------------------------------------
+static bool _findSubstringSSE2(const char *s, size_t n, const char *needle, size_t m, const SubstringNeedle &sn) {
+  const __m128i b1 = _mm_set1_epi8(needle[sn.pos1]);
+  const __m128i b2 = _mm_set1_epi8(needle[sn.pos2]);
+
+  size_t i = 0;
+  for (; i + sn.pos2 + 16 <= n && i + m <= n; i += 16) {
+    __m128i c1 = _mm_cmpeq_epi8(b1, _mm_loadu_si128((const __m128i *)(s + i)));
+    __m128i c2 = _mm_cmpeq_epi8(b2, _mm_loadu_si128((const __m128i *)(s + i + sn.pos2)));
+    uint32_t mask = _mm_movemask_epi8(_mm_and_si128(c1, c2));
+    while (mask) {
+      size_t pos = i + __builtin_ctz(mask);
+      if (pos + m <= n && memcmp(s + pos, needle, m) == 0) {
+        return true;
+      }
+      mask &= mask - 1;
+    }
+  }
+  return i + m <= n && _findSubstringScalar(s + i, n - i, needle, m, sn);
+}
+
+// -----------------------------------------------------------------------------
+// _findSubstringAVX2
+//
+// same as _findSubstringSSE2 with 32 candidate positions at once
+// -----------------------------------------------------------------------------
+__attribute__((target("avx2")))
+static bool _findSubstringAVX2(const char *s, size_t n, const char *needle, size_t m, const SubstringNeedle &sn) {
+  const __m256i b1 = _mm256_set1_epi8(needle[sn.pos1]);
+  const __m256i b2 = _mm256_set1_epi8(needle[sn.pos2]);
+
+  size_t i = 0;
+  for (; i + sn.pos2 + 32 <= n && i + m <= n; i += 32) {
+    __m256i c1 = _mm256_cmpeq_epi8(b1, _mm256_loadu_si256((const __m256i *)(s + i)));
+    __m256i c2 = _mm256_cmpeq_epi8(b2, _mm256_loadu_si256((const __m256i *)(s + i + sn.pos2)));
+    uint32_t mask = _mm256_movemask_epi8(_mm256_and_si256(c1, c2));
+    while (mask) {
+      size_t pos = i + __builtin_ctz(mask);
+      if (pos + m <= n && memcmp(s + pos, needle, m) == 0) {
+        return true;
+      }
+      mask &= mask - 1;
+    }
+  }
+  return i + m <= n && _findSubstringSSE2(s + i, n - i, needle, m, sn);
+}
+#endif
+
+typedef bool (*FindSubstringFn)(const char *, size_t, const char *, size_t, const SubstringNeedle &);
+
+// -----------------------------------------------------------------------------
+// _findSubstringImpl
+//
+// best implementation for the running CPU, picked once
+// -----------------------------------------------------------------------------
+static FindSubstringFn _findSubstringImpl() {
+#if defined(__x86_64__) && defined(__GNUC__)
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) {
+    return _findSubstringAVX2;
+  }
+  return _findSubstringSSE2;
+#else
+  return _findSubstringScalar;
+#endif
+}
+
+static const FindSubstringFn _findSubstringFn = _findSubstringImpl();
+
+// -----------------------------------------------------------------------------
+// _findSubstring
+//
+// TRUE if 'needle' is found in 's'; 'sn' may be NULL if not prepared
+// -----------------------------------------------------------------------------
+static inline bool _findSubstring(const std::string &s, const std::string &needle, const SubstringNeedle *sn) {
+  size_t m = needle.size();
+  if (m == 0) {
+    return true;
+  }
+  if (m > s.size()) {
+    return false;
+  }
+  if (m == 1) {
+    return memchr(s.data(), needle[0], s.size()) != NULL;
+  }
+  SubstringNeedle unprepared;
+  if (sn == NULL) {
+    unprepared = _substringNeedle(needle.data(), m);
+    sn = &unprepared;
+  }
+  return _findSubstringFn(s.data(), s.size(), needle.data(), m, *sn);
+}
+
+// -----------------------------------------------------------------------------
+// ArrayLiteralSet
+//
+// prepared state of set methods: sorted values of the literal, by type
+// -----------------------------------------------------------------------------
+struct ArrayLiteralSet {
+  std::vector<int32_t>            ints;
+  std::vector<std::string>        strings;
+  std::unordered_set<std::string> hashed;
+  bool                            others = false;  // values that no array variable can hold
+};
+
+static void _addToArraySet(const TinyRuleChecker::VarValue &v, ArrayLiteralSet &set) {
+  switch (v.type) {
+    case TinyRuleChecker::V_TYPE_INT: set.ints.push_back(v.intval); break;
+    case TinyRuleChecker::V_TYPE_STRING: set.strings.push_back(v.strval); break;
+    default: set.others = true; break;
+  }
+}
+
+static bool _prepareArraySet(
+  const TinyRuleChecker::VarValue &literal,
+  std::shared_ptr<void> &prepared,
+  std::string &
+) {
+  std::shared_ptr<ArrayLiteralSet> set = std::make_shared<ArrayLiteralSet>();
+  if (literal.type == TinyRuleChecker::V_TYPE_ARRAY) {
+    for (const TinyRuleChecker::VarValue &v : literal.array) {
+      _addToArraySet(v, *set);
+    }
+  }
+  else {
+    _addToArraySet(literal, *set);
+  }
+
+  std::sort(set->ints.begin(), set->ints.end());
+  set->ints.erase(std::unique(set->ints.begin(), set->ints.end()), set->ints.end());
+  std::sort(set->strings.begin(), set->strings.end());
+  set->strings.erase(std::unique(set->strings.begin(), set->strings.end()), set->strings.end());
+  set->hashed.insert(set->strings.begin(), set->strings.end());
+  prepared = set;
+  return true;
+}
+
+static const ArrayLiteralSet _emptyArraySet;
+
+// -----------------------------------------------------------------------------
+// _isIntArrayVar
+//
+// TRUE for non-empty int arrays set by setVarArray, whose sorted values can be
+// used as they are
+// -----------------------------------------------------------------------------
+static inline bool _isIntArrayVar(const TinyRuleChecker::VarValue &v) {
+  return v.type == TinyRuleChecker::V_TYPE_ARRAY && !v.ints.empty() && v.ints.size() == v.array.size();
+}
+
+#ifdef __SSE2__
+// -----------------------------------------------------------------------------
+// _matchBlocks
+//
+// compare every value of a block of 4 with every value of another block,
+// returning the mask of values of 'b' found in 'a'
+// -----------------------------------------------------------------------------
+static inline uint32_t _matchBlocks(const int32_t *a, const int32_t *b) {
+  __m128i va = _mm_loadu_si128((const __m128i *)a);
+  __m128i vb = _mm_loadu_si128((const __m128i *)b);
+  __m128i eq = _mm_cmpeq_epi32(vb, va);
+  eq = _mm_or_si128(eq, _mm_cmpeq_epi32(vb, _mm_shuffle_epi32(va, _MM_SHUFFLE(0, 3, 2, 1))));
+  eq = _mm_or_si128(eq, _mm_cmpeq_epi32(vb, _mm_shuffle_epi32(va, _MM_SHUFFLE(1, 0, 3, 2))));
+  eq = _mm_or_si128(eq, _mm_cmpeq_epi32(vb, _mm_shuffle_epi32(va, _MM_SHUFFLE(2, 1, 0, 3))));
+  return _mm_movemask_ps(_mm_castsi128_ps(eq));
+}
+#endif
+
+// -----------------------------------------------------------------------------
+// _intersectsSorted
+//
+// TRUE if sorted arrays 'a' and 'b' share any value. Arrays of similar size
+// are merged 4x4 values at a time, otherwise the values of the smaller one
+// are looked up in the bigger one
+// -----------------------------------------------------------------------------
+static bool _intersectsSorted(const int32_t *a, size_t na, const int32_t *b, size_t nb) {
+  if (na < nb) {
+    std::swap(a, b);
+    std::swap(na, nb);
+  }
+  if (nb * 32 < na) {
+    for (size_t j = 0; j < nb; j++) {
+      if (std::binary_search(a, a + na, b[j])) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  size_t i = 0, j = 0;
+#ifdef __SSE2__
+  while (i + 4 <= na && j + 4 <= nb) {
+    if (_matchBlocks(a + i, b + j)) {
+      return true;
+    }
+    int32_t amax = a[i + 3], bmax = b[j + 3];
+    i += (amax <= bmax) ? 4 : 0;
+    j += (bmax <= amax) ? 4 : 0;
+  }
+#endif
+  while (i < na && j < nb) {
+    if (a[i] == b[j]) {
+      return true;
+    }
+    a[i] < b[j] ? i++ : j++;
+  }
+  return false;
+}
+
+// -----------------------------------------------------------------------------
+// _containsSorted
+//
+// TRUE if every value of sorted array 'b' is in sorted array 'a' (no
+// duplicates in any of them)
+// -----------------------------------------------------------------------------
+static bool _containsSorted(const int32_t *a, size_t na, const int32_t *b, size_t nb) {
+  if (nb > na) {
+    return false;
+  }
+  if (nb * 32 < na) {
+    const int32_t *from = a;
+    for (size_t j = 0; j < nb; j++) {
+      from = std::lower_bound(from, a + na, b[j]);
+      if (from == a + na || *from != b[j]) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  size_t i = 0, j = 0;
+  uint32_t found = 0;
+#ifdef __SSE2__
+  // 'found' accumulates values of the current block of 'b' seen in 'a'
+  while (i + 4 <= na && j + 4 <= nb) {
+    found |= _matchBlocks(a + i, b + j);
+    int32_t amax = a[i + 3], bmax = b[j + 3];
+    i += (amax <= bmax) ? 4 : 0;
+    if (bmax <= amax) {
+      if (found != 0xF) {
+        return false;
+      }
+      found = 0;
+      j += 4;
+    }
+  }
+#endif
+  for (; j < nb; j++, found >>= 1) {
+    if (!(found & 1) && !std::binary_search(a + i, a + na, b[j])) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// -----------------------------------------------------------------------------
+// _hasString
+// -----------------------------------------------------------------------------
+static inline bool _hasString(const std::vector<TinyRuleChecker::VarValue> &sorted, const std::string &s) {
+  auto it = std::lower_bound(
+    sorted.begin(),
+    sorted.end(),
+    s,
+    [](const TinyRuleChecker::VarValue &v, const std::string &s) { return v.type != TinyRuleChecker::V_TYPE_STRING || v.strval < s; }
+  );
+  return it != sorted.end() && it->type == TinyRuleChecker::V_TYPE_STRING && it->strval == s;
+}
+
+// -----------------------------------------------------------------------------
+// InLiteralSet
+//
+// prepared state of 'in' for literal arrays
+// -----------------------------------------------------------------------------
+struct InLiteralSet {
+  std::vector<int32_t>            ints;
+  std::vector<float>              floats;
+  std::unordered_set<std::string> strings;
+};
+
+// -----------------------------------------------------------------------------
+// initMethods
+//
+// Initialize all standard methods
+// -----------------------------------------------------------------------------
+void TinyRuleChecker::initMethods() {
+#define ENSURE_SAME_TYPE(v1, v2) \
+    if (v1.type != v2.type) { \
+      eval.error = "type mismatch: type " + std::string(1, v1.type) + " vs " + std::string(1, v2.type); \
+      return false; \
+    } \
+
+#define COMPARE_KERNELS(op) { \
+    [](const VarValue &v1, const VarValue &v2) { return v1.intval op v2.intval; }, \
+    [](const VarValue &v1, const VarValue &v2) { return v1.floatval op v2.floatval; }, \
+    [](const VarValue &v1, const VarValue &v2) { return v1.strval op v2.strval; } \
+  }
+
+  _setMethod("eq", [](const VarValue &v1, const VarValue &v2, EvalResult &eval) {
+    ENSURE_SAME_TYPE(v1, v2);
+
+    switch (v1.type) {
+      case V_TYPE_INT:
+        eval.result = v1.intval == v2.intval;
+        break;
+      case V_TYPE_FLOAT:
+        eval.result = v1.floatval == v2.floatval;
+        break;
+      case V_TYPE_STRING:
+        eval.result = v1.strval == v2.strval;
+        break;
+      default:
+        eval.error = "unsupported operation 'eq' with type '" + std::string(1, v1.type) + "'";
+        return false;
+    }
+    return true;
+  }, COMPARE_KERNELS(==), INDEX_EQUAL, LANE_EQ);
+
+  _setMethod("neq", [](const VarValue &v1, const VarValue &v2, EvalResult &eval) {
+    ENSURE_SAME_TYPE(v1, v2);
+
+    switch (v1.type) {
+      case V_TYPE_INT:
+        eval.result = v1.intval != v2.intval;
+        break;
+      case V_TYPE_FLOAT:
+        eval.result = v1.floatval != v2.floatval;
+        break;
+      case V_TYPE_STRING:
+        eval.result = v1.strval != v2.strval;
+        break;
+      default:
+        eval.error = "unsupported operation 'neq' with type '" + std::string(1, v1.type) + "'";
+        return false;
+    }
+    return true;
+  }, COMPARE_KERNELS(!=), INDEX_NONE, LANE_NEQ);
+
+  _setMethod("gt", [](const VarValue &v1, const VarValue &v2, EvalResult &eval) {
+    ENSURE_SAME_TYPE(v1, v2);
+
+    switch (v1.type) {
+      case V_TYPE_INT:
+        eval.result = v1.intval > v2.intval;
+        break;
+      case V_TYPE_FLOAT:
+        eval.result = v1.floatval > v2.floatval;
+        break;
+      case V_TYPE_STRING:
+        eval.result = v1.strval > v2.strval;
+        break;
+      default:
+        eval.error = "unsupported operation 'gt' with type '" + std::string(1, v1.type) + "'";
+        return false;
+    }
+    return true;
+  }, COMPARE_KERNELS(>), INDEX_NONE, LANE_GT);
+
+  _setMethod("gte", [](const VarValue &v1, const VarValue &v2, EvalResult &eval) {
+    ENSURE_SAME_TYPE(v1, v2);
+
+    switch(v1.type) {
+      case V_TYPE_INT:
+        eval.result = v1.intval >= v2.intval;
+        break;
+      case V_TYPE_FLOAT:
+        eval.result = v1.floatval >= v2.floatval;
+        break;
+      case V_TYPE_STRING:
+        eval.result = v1.strval >= v2.strval;
+        break;
+      default:
+        eval.error = "unsupported operation 'gte' with type '" + std::string(1, v1.type) + "'";
+        return false;
+    }
+    return true;
+  }, COMPARE_KERNELS(>=), INDEX_NONE, LANE_GTE);
+
+  _setMethod("lt", [](const VarValue &v1, const VarValue &v2, EvalResult &eval) {
+    ENSURE_SAME_TYPE(v1, v2);
+
+    switch (v1.type) {
+      case V_TYPE_INT:
+        eval.result = v1.intval < v2.intval;
+        break;
+      case V_TYPE_FLOAT:
+        eval.result = v1.floatval < v2.floatval;
+        break;
+      case  V_TYPE_STRING:
+        eval.result = v1.strval < v2.strval;
+        break;
+      default:
+        eval.error = "unsupported operation 'lt' with type '" + std::string(1, v1.type) + "'";
+        return false;
+    }
+    return true;
+  }, COMPARE_KERNELS(<), INDEX_NONE, LANE_LT);
+
+  _setMethod("lte", [](const VarValue &v1, const VarValue &v2, EvalResult &eval) {
+    ENSURE_SAME_TYPE(v1, v2);
+
+    switch (v1.type) {
+      case V_TYPE_INT:
+        eval.result = v1.intval <= v2.intval;
+        break;
+      case V_TYPE_FLOAT:
+        eval.result = v1.floatval <= v2.floatval;
+        break;
+      case  V_TYPE_STRING:
+        eval.result = v1.strval <= v2.strval;
+        break;
+      default:
+        eval.error = "unsupported operation 'lte' with type '" + std::string(1, v1.type) + "'";
+        return false;
+    }
+    return true;
+  }, COMPARE_KERNELS(<=), INDEX_NONE, LANE_LTE);
+
+  setMethod("contains", [](const VarValue &literal, std::shared_ptr<void> &prepared, std::string &) {
+    if (literal.type == V_TYPE_STRING) {
+      prepared = std::make_shared<SubstringNeedle>(_substringNeedle(literal.strval.data(), literal.strval.size()));
+    }
+    return true;
+  },
+  [](const VarValue &v1, const VarValue &v2, const void *prepared, EvalResult &eval) {
+    if (v1.type == V_TYPE_STRING) {
+      eval.result = _findSubstring(v1.strval, v2.strval, (const SubstringNeedle *)prepared);
+    }
+    else {
+      eval.error = "unsupported operation 'contains' with type '" + std::string(1, v1.type) + "'";
+      return false;
+    }
+    return true;
+  });
+
+  _setMethod("startsWith", [](const VarValue &v1, const VarValue &v2, EvalResult &eval) {
+    ENSURE_SAME_TYPE(v1, v2);
+
+    if (v1.type != V_TYPE_STRING) {
+      eval.error = "unsupported operation 'startsWith' with type '" + std::string(1, v1.type) + "'";
+      return false;
+    }
+    eval.result = v1.strval.compare(0, v2.strval.size(), v2.strval) == 0;
+    return true;
+  }, {
+    NULL,
+    NULL,
+    [](const VarValue &v1, const VarValue &v2) {
+      return v1.strval.compare(0, v2.strval.size(), v2.strval) == 0;
+    }
+  }, INDEX_PREFIX);
+
+  _setMethod("endsWith", [](const VarValue &v1, const VarValue &v2, EvalResult &eval) {
+    ENSURE_SAME_TYPE(v1, v2);
+
+    if (v1.type != V_TYPE_STRING) {
+      eval.error = "unsupported operation 'endsWith' with type '" + std::string(1, v1.type) + "'";
+      return false;
+    }
+    eval.result = v1.strval.size() >= v2.strval.size() &&
+      v1.strval.compare(v1.strval.size() - v2.strval.size(), v2.strval.size(), v2.strval) == 0;
+    return true;
+  }, {
+    NULL,
+    NULL,
+    [](const VarValue &v1, const VarValue &v2) {
+      return v1.strval.size() >= v2.strval.size() &&
+        v1.strval.compare(v1.strval.size() - v2.strval.size(), v2.strval.size(), v2.strval) == 0;
+    }
+  }, INDEX_SUFFIX);
+
+  setMethod("in", [](const VarValue &literal, std::shared_ptr<void> &prepared, std::string &) {
+    if (literal.type != V_TYPE_ARRAY) {
+      return true;
+    }
+
+    std::shared_ptr<InLiteralSet> set = std::make_shared<InLiteralSet>();
+    for (const VarValue &v : literal.array) {
+      switch (v.type) {
+        case V_TYPE_INT: set->ints.push_back(v.intval); break;
+        case V_TYPE_FLOAT: set->floats.push_back(v.floatval); break;
+        case V_TYPE_STRING: set->strings.insert(v.strval); break;
+        default: break;
+      }
+    }
+    std::sort(set->ints.begin(), set->ints.end());
+    std::sort(set->floats.begin(), set->floats.end());
+    prepared = set;
+    return true;
+  },
+  [](const VarValue &v1, const VarValue &v2, const void *prepared, EvalResult &eval) {
+    if (prepared && v2.type == V_TYPE_ARRAY) {
+      const InLiteralSet *set = (const InLiteralSet *)prepared;
+      switch (v1.type) {
+        case V_TYPE_INT:
+          eval.result = std::binary_search(set->ints.begin(), set->ints.end(), v1.intval);
+          break;
+        case V_TYPE_FLOAT:
+          eval.result = std::binary_search(set->floats.begin(), set->floats.end(), v1.floatval);
+          break;
+        case V_TYPE_STRING:
+          eval.result = set->strings.count(v1.strval) > 0;
+          break;
+        default:
+          eval.result = false;
+          break;
+      }
+    }
+    else if (v2.type == V_TYPE_STRING) {
+      eval.result = _findSubstring(v2.strval, v1.strval, NULL);
+    }
+    else if (v2.type == V_TYPE_ARRAY) {
+      for (const VarValue &v : v2.array) {
+        if (v1.type == v.type) {
+          switch (v1.type) {
+            case V_TYPE_INT:
+              if (v1.intval == v.intval) {
+                eval.result = true;
+                return true;
+              }
+              break;
+            case V_TYPE_FLOAT:
+              if (v1.floatval == v.floatval) {
+                eval.result = true;
+                return true;
+              }
+              break;
+            case V_TYPE_STRING:
+              if (v1.strval == v.strval) {
+                eval.result = true;
+                return true;
+              }
+              break;
+            default:
+              break;
+          }
+        }
+      }
+      eval.result = false;
+    }
+    else {
+      eval.error = "unsupported operation 'in' with type '" + std::string(1, v2.type) + "'";
+      return false;
+    }
+    return true;
+  });
+
+  setMethod("matches", [](const VarValue &literal, std::shared_ptr<void> &prepared, std::string &error) {
+    if (literal.type != V_TYPE_STRING) {
+      error = "unsupported operation 'matches' with type '" + std::string(1, literal.type) + "'";
+      return false;
+    }
+
+    std::shared_ptr<const TinyRegex> regex = _getRegex(literal.strval, error);
+    prepared = std::const_pointer_cast<TinyRegex>(regex);
+    return regex != NULL;
+  },
+  [](const VarValue &v1, const VarValue &v2, const void *prepared, EvalResult &eval) {
+    if (v1.type != V_TYPE_STRING || v2.type != V_TYPE_STRING) {
+      eval.error = "unsupported operation 'matches' with type '" + std::string(1, v1.type != V_TYPE_STRING ? v1.type : v2.type) + "'";
+      return false;
+    }
+
+    std::shared_ptr<const TinyRegex> regex;
+    if (prepared == NULL) {
+      regex = _getRegex(v2.strval, eval.error);
+      if (regex == NULL) {
+        return false;
+      }
+      prepared = regex.get();
+    }
+
+    eval.result = ((const TinyRegex *)prepared)->match(v1.strval.data(), v1.strval.size());
+    return true;
+  });
+
+  // case-insensitive methods, literals are lowercased when prepared (or on
+  // each call if not prepared, into a buffer of the thread)
+#define ENSURE_STRINGS(name, v1, v2, arrayAllowed) \
+    if (v1.type != V_TYPE_STRING || (v2.type != V_TYPE_STRING && !(arrayAllowed && v2.type == V_TYPE_ARRAY))) { \
+      eval.error = "unsupported operation '" name "' with type '" + std::string(1, v1.type != V_TYPE_STRING ? v1.type : v2.type) + "'"; \
+      return false; \
+    } \
+    if (prepared == NULL) { \
+      thread_local FoldedLiteral unprepared; \
+      _foldLiteral(v2, unprepared); \
+      prepared = &unprepared; \
+    } \
+    const FoldedLiteral *literal = (const FoldedLiteral *)prepared; \
+    const std::string *cached = _cachedFold(v1);
+
+  setMethod("ieq", _prepareFolded, [](const VarValue &v1, const VarValue &v2, const void *prepared, EvalResult &eval) {
+    ENSURE_STRINGS("ieq", v1, v2, false);
+
+    const std::string &s = cached ? *cached : v1.strval;
+    if (s.size() != literal->str.size()) {
+      eval.result = false;
+    }
+    else if (cached) {
+      eval.result = memcmp(s.data(), literal->str.data(), s.size()) == 0;
+    }
+    else {
+      eval.result = _foldEqual(s.data(), literal->str.data(), s.size());
+    }
+    return true;
+  });
+
+  setMethod("icontains", _prepareFolded, [](const VarValue &v1, const VarValue &v2, const void *prepared, EvalResult &eval) {
+    ENSURE_STRINGS("icontains", v1, v2, false);
+
+    if (cached) {
+      eval.result = cached->find(literal->str) != std::string::npos;
+    }
+    else {
+      eval.result = _foldFind(v1.strval.data(), v1.strval.size(), literal->str.data(), literal->str.size());
+    }
+    return true;
+  });
+
+  setMethod("iin", _prepareFolded, [](const VarValue &v1, const VarValue &v2, const void *prepared, EvalResult &eval) {
+    ENSURE_STRINGS("iin", v1, v2, true);
+
+    const std::string &s = cached ? *cached : v1.strval;
+    if (v2.type == V_TYPE_STRING) {
+      // substring of the literal
+      if (cached) {
+        eval.result = literal->str.find(s) != std::string::npos;
+      }
+      else {
+        eval.result = _foldFindIn(literal->str.data(), literal->str.size(), s.data(), s.size());
+      }
+      return true;
+    }
+
+    uint32_t hash = _foldHash(s.data(), s.size());
+    auto it = std::lower_bound(
+      literal->items.begin(),
+      literal->items.end(),
+      hash,
+      [](const std::pair<uint32_t, std::string> &item, uint32_t h) { return item.first < h; }
+    );
+
+    eval.result = false;
+    for (; it != literal->items.end() && it->first == hash; ++it) {
+      if (it->second.size() == s.size() && _foldEqual(s.data(), it->second.data(), s.size())) {
+        eval.result = true;
+        break;
+      }
+    }
+    return true;
+  });
+
+  // set methods on array variables (see setVarArray)
+#define ENSURE_ARRAY_SET(name, v1, v2) \
+    if (v1.type != V_TYPE_ARRAY) { \
+      eval.error = "unsupported operation '" name "' with type '" + std::string(1, v1.type) + "'"; \
+      return false; \
+    } \
+    std::shared_ptr<void> unprepared; \
+    if (prepared == NULL && !_isIntArrayVar(v2)) { \
+      _prepareArraySet(v2, unprepared, eval.error); \
+      prepared = unprepared.get(); \
+    } \
+    const ArrayLiteralSet *set = prepared ? (const ArrayLiteralSet *)prepared : &_emptyArraySet; \
+    const std::vector<int32_t> &ints = prepared ? set->ints : v2.ints;
+
+  auto containsAny = [](const VarValue &v1, const VarValue &v2, const void *prepared, EvalResult &eval) {
+    ENSURE_ARRAY_SET("containsAny", v1, v2);
+
+    if (_intersectsSorted(v1.ints.data(), v1.ints.size(), ints.data(), ints.size())) {
+      eval.result = true;
+      return true;
+    }
+
+    eval.result = false;
+    if (v1.array.size() <= set->strings.size()) {
+      for (const VarValue &v : v1.array) {
+        if (v.type == V_TYPE_STRING && set->hashed.count(v.strval)) {
+          eval.result = true;
+          break;
+        }
+      }
+    }
+    else {
+      for (const std::string &s : set->strings) {
+        if (_hasString(v1.array, s)) {
+          eval.result = true;
+          break;
+        }
+      }
+    }
+    return true;
+  };
+  setMethod("containsAny", _prepareArraySet, containsAny);
+  setMethod("intersects", _prepareArraySet, containsAny);
+
+  setMethod("containsAll", _prepareArraySet, [](const VarValue &v1, const VarValue &v2, const void *prepared, EvalResult &eval) {
+    ENSURE_ARRAY_SET("containsAll", v1, v2);
+
+    eval.result = !set->others && _containsSorted(v1.ints.data(), v1.ints.size(), ints.data(), ints.size());
+    for (size_t i = 0; eval.result && i < set->strings.size(); i++) {
+      eval.result = _hasString(v1.array, set->strings[i]);
+    }
+    return true;
+  });
+
+  // bit masks; a single AND + compare when compiled
+  _setMethod("hasAllBits", [](const VarValue &v1, const VarValue &v2, EvalResult &eval) {
+    if (v1.type != V_TYPE_INT || v2.type != V_TYPE_INT) {
+      eval.error = "unsupported operation 'hasAllBits' with type '" + std::string(1, v1.type != V_TYPE_INT ? v1.type : v2.type) + "'";
+      return false;
+    }
+    eval.result = (v1.intval & v2.intval) == v2.intval;
+    return true;
+  }, {
+    [](const VarValue &v1, const VarValue &v2) { return (v1.intval & v2.intval) == v2.intval; }
+  }, INDEX_NONE, LANE_ALL_BITS);
+
+  _setMethod("hasAnyBits", [](const VarValue &v1, const VarValue &v2, EvalResult &eval) {
+    if (v1.type != V_TYPE_INT || v2.type != V_TYPE_INT) {
+      eval.error = "unsupported operation 'hasAnyBits' with type '" + std::string(1, v1.type != V_TYPE_INT ? v1.type : v2.type) + "'";
+      return false;
+    }
+    eval.result = (v1.intval & v2.intval) != 0;
+    return true;
+  }, {
+    [](const VarValue &v1, const VarValue &v2) { return (v1.intval & v2.intval) != 0; }
+  }, INDEX_NONE, LANE_ANY_BITS);
+
+  _setMethod("hasNoBits", [](const VarValue &v1, const VarValue &v2, EvalResult &eval) {
+    if (v1.type != V_TYPE_INT || v2.type != V_TYPE_INT) {
+      eval.error = "unsupported operation 'hasNoBits' with type '" + std::string(1, v1.type != V_TYPE_INT ? v1.type : v2.type) + "'";
+      return false;
+    }
+    eval.result = (v1.intval & v2.intval) == 0;
+    return true;
+  }, {
+    [](const VarValue &v1, const VarValue &v2) { return (v1.intval & v2.intval) == 0; }
+  }, INDEX_NONE, LANE_NO_BITS);
+
+  // built-ins with prepared state, set like custom methods
+  for (const char *name : { "contains", "in", "matches", "ieq", "icontains", "iin", "containsAny", "intersects", "containsAll" }) {
+    Method m = *_methods.get(std::string_view(name));
+    m.typedErrors = true;
+    _setMethod(name, m);
+  }
+
+  freezeMethods();
+}
+
+// -----------------------------------------------------------------------------
+// setRuleCache
+//
+// cache used by eval(expr), 0 entries to disable it (256 entries and 4 MB by
+// default)
+// -----------------------------------------------------------------------------
+void TinyRuleChecker::setRuleCache(size_t maxEntries, size_t maxBytes) {
+  _ruleCache = maxEntries ? std::make_shared<RuleCache>(maxEntries, maxBytes) : NULL;
+}
+
+void TinyRuleChecker::setRuleCache(std::shared_ptr<RuleCache> cache) {
+  _ruleCache = cache;
+}
+
+// -----------------------------------------------------------------------------
+// ruleCacheStats
+// -----------------------------------------------------------------------------
+TinyRuleChecker::RuleCache::Stats TinyRuleChecker::ruleCacheStats() {
+  return _ruleCache ? _ruleCache->stats() : RuleCache::Stats{};
+}
+
+// -----------------------------------------------------------------------------
+// RuleCache constructor
+// -----------------------------------------------------------------------------
+TinyRuleChecker::RuleCache::RuleCache(size_t maxEntries, size_t maxBytes, bool concurrent) {
+  _maxEntries = maxEntries;
+  _maxBytes = maxBytes;
+  _concurrent = concurrent;
+  _stats = {};
+}
+
+// -----------------------------------------------------------------------------
+// RuleCache::get
+//
+// cached rule for the expression, NULL if not cached. Entries are found by
+// hash and verified with the full text.
+// -----------------------------------------------------------------------------
+std::shared_ptr<const TinyRuleChecker::Rule>
+TinyRuleChecker::RuleCache::get(const char *expr, size_t len, uint64_t hash) {
+  std::unique_lock<std::mutex> lock(_mutex, std::defer_lock);
+  if (_concurrent) {
+    lock.lock();
+  }
+
+  auto it = _entries.find(hash);
+  if (it == _entries.end() || it->second->expr.size() != len || memcmp(it->second->expr.data(), expr, len) != 0) {
+    _stats.misses++;
+    return NULL;
+  }
+
+  _stats.hits++;
+  if (it->second != _lru.begin()) {
+    _lru.splice(_lru.begin(), _lru, it->second);
+  }
+  return it->second->rule;
+}
+
+// -----------------------------------------------------------------------------
+// RuleCache::admit
+//
+// TRUE if the expression was seen before, so it is worth compiling it
+// -----------------------------------------------------------------------------
+bool TinyRuleChecker::RuleCache::admit(uint64_t hash) {
+  std::unique_lock<std::mutex> lock(_mutex, std::defer_lock);
+  if (_concurrent) {
+    lock.lock();
+  }
+
+  if (_seen.erase(hash)) {
+    return true;
+  }
+  if (_seen.size() >= _maxEntries * 4) {
+    _seen.clear();
+  }
+  _seen.insert(hash);
+  return false;
+}
+
+// -----------------------------------------------------------------------------
+// _ruleBytes
+//
+// approximate memory used by a compiled rule
+// -----------------------------------------------------------------------------
+static size_t _valueBytes(const TinyRuleChecker::VarValue &v) {
+  size_t bytes = sizeof(v) + v.strval.capacity() + v.ints.capacity() * sizeof(int32_t);
+  for (const TinyRuleChecker::VarValue &item : v.array) {
+    bytes += _valueBytes(item);
+  }
+  return bytes;
+}
+
+static size_t _ruleBytes(const TinyRuleChecker::Rule &rule) {
+  size_t bytes = sizeof(rule) + rule.error.capacity() + rule.program.capacity() * sizeof(TinyRuleChecker::Instruction);
+  for (const TinyRuleChecker::Statement &st : rule.statements) {
+    bytes += sizeof(st) + st.var.capacity() + st.methodName.capacity() + _valueBytes(st.value) - sizeof(st.value);
+  }
+  return bytes;
+}
+
+// -----------------------------------------------------------------------------
+// RuleCache::put
+//
+// add a rule, evicting the least recently used ones to stay within limits
+// -----------------------------------------------------------------------------
+void TinyRuleChecker::RuleCache::put(const char *expr, size_t len, uint64_t hash, std::shared_ptr<const Rule> rule) {
+  std::unique_lock<std::mutex> lock(_mutex, std::defer_lock);
+  if (_concurrent) {
+    lock.lock();
+  }
+
+  // same hash, either the same expression compiled by another thread or a
+  // collision, the newest wins
+  auto it = _entries.find(hash);
+  if (it != _entries.end()) {
+    _stats.bytes -= it->second->bytes;
+    _lru.erase(it->second);
+    _entries.erase(it);
+  }
+
+  size_t bytes = _ruleBytes(*rule) + len + sizeof(Entry);
+  if (_maxBytes && bytes > _maxBytes) {
+    return;
+  }
+
+  while (_lru.size() >= _maxEntries || (_maxBytes && _stats.bytes + bytes > _maxBytes)) {
+    _stats.bytes -= _lru.back().bytes;
+    _stats.evictions++;
+    _entries.erase(_lru.back().hash);
+    _lru.pop_back();
+  }
+
+  _lru.push_front({hash, std::string(expr, len), rule, bytes});
+  _entries[hash] = _lru.begin();
+  _stats.bytes += bytes;
+}
+
+// -----------------------------------------------------------------------------
+// RuleCache::clear
+// -----------------------------------------------------------------------------
+void TinyRuleChecker::RuleCache::clear() {
+  std::unique_lock<std::mutex> lock(_mutex, std::defer_lock);
+  if (_concurrent) {
+    lock.lock();
+  }
+
+  _lru.clear();
+  _entries.clear();
+  _seen.clear();
+  _stats.bytes = 0;
+}
+
+// -----------------------------------------------------------------------------
+// RuleCache::stats
+// -----------------------------------------------------------------------------
+TinyRuleChecker::RuleCache::Stats TinyRuleChecker::RuleCache::stats() {
+  std::unique_lock<std::mutex> lock(_mutex, std::defer_lock);
+  if (_concurrent) {
+    lock.lock();
+  }
+
+  Stats stats = _stats;
+  stats.entries = _lru.size();
+  return stats;
+}
+
+// -----------------------------------------------------------------------------
+// _hashBytes
+//
+// 64-bit hash, 8 bytes at a time
+// -----------------------------------------------------------------------------
+static inline uint64_t _hashBytes(const char *data, size_t len) {
+  uint64_t hash = 14695981039346656037ULL ^ len;
+  size_t i = 0;
+  for (; i + 8 <= len; i += 8) {
+    uint64_t word;
+    memcpy(&word, data + i, 8);
+    hash = (hash ^ word) * 0xff51afd7ed558ccdULL;
+    hash ^= hash >> 32;
+  }
+  for (; i < len; i++) {
+    hash = (hash ^ (uint8_t)data[i]) * 1099511628211ULL;
+  }
+  return hash ^ (hash >> 29);
+}
+
+// -----------------------------------------------------------------------------
+// _hashExpr
+//
+// hash of an expression, along with its length
+// -----------------------------------------------------------------------------
+static inline uint64_t _hashExpr(const char *expr, size_t &len) {
+  len = strlen(expr);
+  return _hashBytes(expr, len);
+}
+
+// -----------------------------------------------------------------------------
+// eval
+//
+// Returns TRUE if the expression is valid and the result is stored in the
+// 'result' parameter. Returns FALSE otherwise.
+//
+// Repeated expressions are compiled and cached (see setRuleCache); those that
+// fail to compile are interpreted, so errors are the same either way.
+// -----------------------------------------------------------------------------
+TinyRuleChecker::EvalResult
+TinyRuleChecker::eval(const char *expr) {
+  if (_ruleCache) {
+    size_t len;
+    // the same text never has the same key with other methods
+    uint64_t hash = _hashExpr(expr, len) ^ _methodsKey;
+    std::shared_ptr<const Rule> rule = _ruleCache->get(expr, len, hash);
+    if (rule == NULL && _ruleCache->admit(hash)) {
+      // with limits, the expression is only compiled (and its literals
+      // prepared) once it has been parsed within budget
+      if (_limited) {
+        EvalResult er = _interpret(expr);
+        if (er.status == EVAL_OK || er.status == EVAL_ERROR) {
+          _ruleCache->put(expr, len, hash, std::make_shared<const Rule>(compile(expr)));
+        }
+        return er;
+      }
+      rule = std::make_shared<const Rule>(compile(expr));
+      _ruleCache->put(expr, len, hash, rule);
+    }
+    if (rule && rule->error.empty()) {
+      return eval(*rule);
+    }
+  }
+
+  return _interpret(expr);
+}
+
+// -----------------------------------------------------------------------------
+// _interpret
+//
+// evaluate the expression while parsing it
+// -----------------------------------------------------------------------------
+TinyRuleChecker::EvalResult
+TinyRuleChecker::_interpret(const char *expr) {
+  ParseState ps { expr };
+  EvalResult er;
+
+  _startBudget();
+
+  // no matter if error or not, we are assigning both vars
+  _parseExpr(ps);
+
+  // we should have consumed everything, otherwise there's an error
+  if (ps.error.empty() && _peekToken(ps.next, ps.token)) {
+    er.error = "unexpected token \'" + std::string(ps.token.value) + "\'";
+    er.status = EVAL_ERROR;
+    return er;
+  }
+
+  er.result = ps.result;
+  er.error = ps.error;
+  _setEvalStatus(er);
+
+  return er;
+}
+
+// -----------------------------------------------------------------------------
+// _isIndexable
+// -----------------------------------------------------------------------------
+static inline bool _isIndexable(const TinyRuleChecker::Statement &st) {
+  return (
+    (st.method.index == TinyRuleChecker::INDEX_PREFIX || st.method.index == TinyRuleChecker::INDEX_SUFFIX) &&
+    !st.hasVarRefs && st.value.type == TinyRuleChecker::V_TYPE_STRING
+  );
+}
+
+// -----------------------------------------------------------------------------
+// _ruleGuard
+//
+// find a statement the rule needs to be true to match (one of the terms of
+// its top-level '&&'s), preferring one answered by a string index. Returns
+// its program position or NO_GUARD.
+// -----------------------------------------------------------------------------
+static uint32_t _ruleGuard(
+  const TinyRuleChecker::Rule &rule,
+  const std::vector<TinyRuleChecker::Statement> &statements
+) {
+  const uint32_t NO_GUARD = TinyRuleChecker::NO_GUARD;
+
+  // for each value on the program stack, its best required statement
+  std::vector<uint32_t> stack;
+  for (uint32_t i = 0; i < rule.program.size(); i++) {
+    const TinyRuleChecker::Instruction &ins = rule.program[i];
+    switch (ins.op) {
+      case TinyRuleChecker::OP_STATEMENT:
+        stack.push_back(i);
+        break;
+
+      case TinyRuleChecker::OP_AND:
+        if (stack.size() < 2) {
+          return NO_GUARD;
+        }
+        {
+          uint32_t right = stack.back();
+          stack.pop_back();
+          uint32_t &left = stack.back();
+          if (
+            left == NO_GUARD ||
+            (right != NO_GUARD &&
+             !_isIndexable(statements[rule.program[left].index]) &&
+             _isIndexable(statements[rule.program[right].index]))
+          ) {
+            left = right;
+          }
+        }
+        break;
+
+      case TinyRuleChecker::OP_OR:
+        if (stack.size() < 2) {
+          return NO_GUARD;
+        }
+        stack.pop_back();
+        stack.back() = NO_GUARD;
+        break;
+
+      case TinyRuleChecker::OP_NOT:
+        if (stack.empty()) {
+          return NO_GUARD;
+        }
+        stack.back() = NO_GUARD;
+        break;
+    }
+  }
+  return stack.empty() ? NO_GUARD : stack.back();
+}
+
+// -----------------------------------------------------------------------------
+// _buildTruthTable
+//
+// Rules whose statements are all cheap (numeric comparisons or bit tests on
+// a literal, with a typed kernel) can be evaluated without branches: each
+// statement sets a bit of a mask, and the mask indexes a truth table of the
+// whole program. A rough cost model decides it (in simple operations): the
+// program costs a kernel call plus an unpredictable branch per statement and
+// one operation per instruction, the table a kernel call plus a shift per
+// statement and the lookup. Up to 6 statements (a 64-bit table).
+// -----------------------------------------------------------------------------
+static void _buildTruthTable(
+  TinyRuleChecker::Rule &rule,
+  const std::vector<TinyRuleChecker::Statement> &statements
+) {
+  const int KERNEL_COST = 2;
+  const int BRANCH_COST = 2;
+
+  rule.tableInputs.clear();
+  rule.truthTable = 0;
+
+  std::vector<uint32_t> inputs;
+  int programCost = 0;
+  for (uint32_t i = 0; i < rule.program.size(); i++) {
+    const TinyRuleChecker::Instruction &ins = rule.program[i];
+    if (ins.op != TinyRuleChecker::OP_STATEMENT) {
+      programCost++;
+      continue;
+    }
+
+    const TinyRuleChecker::Statement &st = statements[ins.index];
+    if (
+      st.kernel == NULL || st.hasVarRefs ||
+      (st.kernelType != TinyRuleChecker::V_TYPE_INT && st.kernelType != TinyRuleChecker::V_TYPE_FLOAT) ||
+      inputs.size() == 6
+    ) {
+      return;
+    }
+    inputs.push_back(i);
+    programCost += KERNEL_COST + BRANCH_COST;
+  }
+
+  int tableCost = inputs.size() * (KERNEL_COST + 1) + 1;
+  if (inputs.empty() || tableCost >= programCost) {
+    return;
+  }
+
+  // run the program with each combination of statement results
+  std::vector<char> stack;
+  for (uint32_t mask = 0; mask < (1u << inputs.size()); mask++) {
+    stack.clear();
+    uint32_t bit = 0;
+    for (const TinyRuleChecker::Instruction &ins : rule.program) {
+      switch (ins.op) {
+        case TinyRuleChecker::OP_STATEMENT:
+          stack.push_back((mask >> bit++) & 1);
+          break;
+        case TinyRuleChecker::OP_AND:
+          stack[stack.size() - 2] &= stack.back();
+          stack.pop_back();
+          break;
+        case TinyRuleChecker::OP_OR:
+          stack[stack.size() - 2] |= stack.back();
+          stack.pop_back();
+          break;
+        case TinyRuleChecker::OP_NOT:
+          stack.back() = !stack.back();
+          break;
+      }
+    }
+    rule.truthTable |= (uint64_t)stack.back() << mask;
+  }
+  rule.tableInputs = inputs;
+}
+
+// -----------------------------------------------------------------------------
+// compile
+//
+// Parse the expression once into a Rule that can be evaluated many times
+// with eval(rule). Methods are resolved at compile time, so a method set
+// after compiling a rule won't be seen by that rule. Variables are resolved
+// on each evaluation.
+//
+// On error, the returned rule has a non-empty 'error'.
+// -----------------------------------------------------------------------------
+TinyRuleChecker::Rule
+TinyRuleChecker::compile(const char *expr) {
+  return _compile(expr, true);
+}
+
+// -----------------------------------------------------------------------------
+// _programDepth
+//
+// stack depth needed to run a postfix program. FALSE if it can't run: unknown
+// opcode, operator without operands, or other than one result at the end
+// (empty programs are removed rules)
+// -----------------------------------------------------------------------------
+static bool _programDepth(const std::vector<TinyRuleChecker::Instruction> &program, uint32_t &maxDepth) {
+  uint32_t depth = 0;
+  maxDepth = 0;
+  for (const TinyRuleChecker::Instruction &ins : program) {
+    switch (ins.op) {
+      case TinyRuleChecker::OP_STATEMENT:
+        depth++;
+        maxDepth = std::max(maxDepth, depth);
+        break;
+
+      case TinyRuleChecker::OP_AND:
+      case TinyRuleChecker::OP_OR:
+        if (depth < 2) {
+          return false;
+        }
+        depth--;
+        break;
+
+      case TinyRuleChecker::OP_NOT:
+        if (depth < 1) {
+          return false;
+        }
+        break;
+
+      default:
+        return false;
+    }
+  }
+  return program.empty() || depth == 1;
+}
+
+// -----------------------------------------------------------------------------
+// _compile
+//
+// see compile(expr), without resolving variables to slots unless bindSlots
+// (which changes the variables, so it can't be done from several threads)
+// -----------------------------------------------------------------------------
+TinyRuleChecker::Rule
+TinyRuleChecker::_compile(const char *expr, bool bindSlots) {
+  Rule rule;
+  rule.maxDepth = 0;
+  rule.guard = NO_GUARD;
+
+  ParseState ps { expr };
+  ps.result = false;
+  ps.rule = &rule;
+  ps.bindSlots = bindSlots;
+
+  _parseExpr(ps);
+
+  if (ps.error.empty() && _peekToken(ps.next, ps.token)) {
+    ps.error = "unexpected token \'" + std::string(ps.token.value) + "\'";
+  }
+
+  if (!ps.error.empty()) {
+    rule.statements.clear();
+    rule.program.clear();
+    rule.error = ps.error;
+    return rule;
+  }
+
+  _programDepth(rule.program, rule.maxDepth);
+  rule.guard = _ruleGuard(rule, rule.statements);
+  _buildTruthTable(rule, rule.statements);
+  return rule;
+}
+
+// -----------------------------------------------------------------------------
+// eval
+//
+// Evaluate a compiled rule. As with eval(expr), all statements are evaluated
+// (no short-circuit), so errors are reported no matter the result.
+// -----------------------------------------------------------------------------
+TinyRuleChecker::EvalResult
+TinyRuleChecker::eval(const Rule &rule) {
+  EvalResult er;
+  _startBudget();
+  _evalProgram(rule, rule.statements, NULL, er);
+  _setEvalStatus(er);
+  return er;
+}
+
+// -----------------------------------------------------------------------------
+// _appendValueKey
+//
+// append a value to a key that identifies it (same value means same key)
+// -----------------------------------------------------------------------------
+static void _appendValueKey(const TinyRuleChecker::VarValue &v, std::string &key) {
+  key += (char)v.type;
+  switch (v.type) {
+    case TinyRuleChecker::V_TYPE_INT:
+      key += std::to_string(v.intval);
+      break;
+    case TinyRuleChecker::V_TYPE_FLOAT:
+      key.append((const char *)&v.floatval, sizeof(v.floatval));
+      break;
+    case TinyRuleChecker::V_TYPE_ARRAY:
+      key += std::to_string(v.array.size()) + "[";
+      for (const TinyRuleChecker::VarValue &item : v.array) {
+        _appendValueKey(item, key);
+      }
+      key += "]";
+      break;
+    default:
+      key += std::to_string(v.strval.size()) + ":" + v.strval;
+      break;
+  }
+}
+
+// unused predicates a rule set can have before replaceRule/removeRule compact
+// it (only if they are also a quarter of all predicates)
+static const uint32_t COMPACT_MIN_DEAD = 1024;
+
+// -----------------------------------------------------------------------------
+// compile
+//
+// Compile a set of rules to be evaluated together. Equal statements (same
+// variable, method and literal) are evaluated once for all rules using them,
+// and startsWith/endsWith literals on the same variable are indexed in a
+// trie, so one walk over the variable answers all of them.
+//
+// Rules that fail to compile keep their error in rules[i].error.
+// -----------------------------------------------------------------------------
+TinyRuleChecker::RuleSet
+TinyRuleChecker::compile(const std::vector<std::string> &exprs) {
+  RuleSet set;
+  set.rules.reserve(exprs.size());
+
+  for (const std::string &expr : exprs) {
+    Rule rule = compile(expr.c_str());
+    _linkRule(set, rule, false);
+    set.rules.push_back(std::move(rule));
+  }
+
+  _buildStringIndexes(set);
+  return set;
+}
+
+// -----------------------------------------------------------------------------
+// _predicateKey
+//
+// key identifying a statement, equal statements are the same predicate
+// -----------------------------------------------------------------------------
+static std::string _predicateKey(const TinyRuleChecker::Statement &st) {
+  std::string key = st.var + "." + st.methodName + "(";
+  _appendValueKey(st.value, key);
+  return key;
+}
+
+// -----------------------------------------------------------------------------
+// _linkRule
+//
+// move the statements of a compiled rule into the predicates of the set,
+// sharing the ones already there, and point its program to them. New
+// predicates are added to the string indexes if 'index' is set.
+// -----------------------------------------------------------------------------
+void TinyRuleChecker::_linkRule(RuleSet &set, Rule &rule, bool index) {
+  for (Instruction &ins : rule.program) {
+    if (ins.op != OP_STATEMENT) {
+      continue;
+    }
+
+    Statement &st = rule.statements[ins.index];
+    std::string key = _predicateKey(st);
+
+    auto it = set.predicateKeys.find(key);
+    if (it == set.predicateKeys.end()) {
+      uint32_t predicate = set.predicates.size();
+      it = set.predicateKeys.insert({key, predicate}).first;
+      set.predicates.push_back(std::move(st));
+      set.predicateRefs.push_back(0);
+      if (index) {
+        _addToStringIndex(set, predicate);
+      }
+    }
+    else if (set.predicateRefs[it->second] == 0) {
+      set.deadPredicates--; // used again
+    }
+    set.predicateRefs[it->second]++;
+    ins.index = it->second;
+  }
+  rule.statements.clear();
+}
+
+// -----------------------------------------------------------------------------
+// _unlinkRule
+//
+// drop the references of a rule to the predicates of the set
+// -----------------------------------------------------------------------------
+void TinyRuleChecker::_unlinkRule(RuleSet &set, const Rule &rule) {
+  for (const Instruction &ins : rule.program) {
+    if (ins.op == OP_STATEMENT && --set.predicateRefs[ins.index] == 0) {
+      set.deadPredicates++;
+    }
+  }
+}
+
+// -----------------------------------------------------------------------------
+// _indexPredicates
+//
+// rebuild the predicate keys and references of a set that doesn't have them
+// (e.g. loaded from a pack)
+// -----------------------------------------------------------------------------
+void TinyRuleChecker::_indexPredicates(RuleSet &set) {
+  if (set.predicateRefs.size() == set.predicates.size()) {
+    return;
+  }
+
+  set.predicateKeys.clear();
+  for (uint32_t p = 0; p < set.predicates.size(); p++) {
+    set.predicateKeys.insert({_predicateKey(set.predicates[p]), p});
+  }
+
+  set.predicateRefs.assign(set.predicates.size(), 0);
+  for (const Rule &rule : set.rules) {
+    for (const Instruction &ins : rule.program) {
+      if (ins.op == OP_STATEMENT) {
+        set.predicateRefs[ins.index]++;
+      }
+    }
+  }
+  set.deadPredicates = std::count(set.predicateRefs.begin(), set.predicateRefs.end(), 0);
+}
+
+// -----------------------------------------------------------------------------
+// addRule
+//
+// Compile a rule and add it to the set, returning its index. Statements
+// already in the set are shared, new ones are added to the string indexes
+// without rebuilding them.
+//
+// If the rule fails to compile it is added anyway with its error.
+// -----------------------------------------------------------------------------
+uint32_t TinyRuleChecker::addRule(RuleSet &set, const char *expr) {
+  _indexPredicates(set);
+  set.diagram = Diagram();
+
+  Rule rule = compile(expr);
+  _linkRule(set, rule, true);
+  set.rules.push_back(std::move(rule));
+
+  // lowest priority among equal ones, as it is the last rule
+  uint32_t index = set.rules.size() - 1;
+  if (!set.priorities.empty()) {
+    set.priorities.push_back(0);
+    auto it = std::upper_bound(set.order.begin(), set.order.end(), index, [&set](uint32_t a, uint32_t b) {
+      return set.priorities[a] > set.priorities[b];
+    });
+    set.order.insert(it, index);
+  }
+  return index;
+}
+
+// -----------------------------------------------------------------------------
+// replaceRule
+//
+// Compile a rule to take the place of rules[index]. Returns FALSE if there is
+// no such rule.
+// -----------------------------------------------------------------------------
+bool TinyRuleChecker::replaceRule(RuleSet &set, uint32_t index, const char *expr) {
+  if (index >= set.rules.size()) {
+    return false;
+  }
+  _indexPredicates(set);
+  set.diagram = Diagram();
+
+  // link first, so that predicates used by both versions are kept alive
+  Rule rule = compile(expr);
+  _linkRule(set, rule, true);
+  _unlinkRule(set, set.rules[index]);
+  set.rules[index] = std::move(rule);
+
+  if (set.deadPredicates >= COMPACT_MIN_DEAD && set.deadPredicates >= set.predicates.size() / 4) {
+    compact(set);
+  }
+  return true;
+}
+
+// -----------------------------------------------------------------------------
+// removeRule
+//
+// Remove rules[index] from the set. Other rules keep their index: the removed
+// rule is left empty and always evaluates to false. Returns FALSE if there is
+// no such rule.
+// -----------------------------------------------------------------------------
+bool TinyRuleChecker::removeRule(RuleSet &set, uint32_t index) {
+  if (index >= set.rules.size()) {
+    return false;
+  }
+  _indexPredicates(set);
+  set.diagram = Diagram();
+
+  _unlinkRule(set, set.rules[index]);
+  set.rules[index] = Rule();
+
+  if (set.deadPredicates >= COMPACT_MIN_DEAD && set.deadPredicates >= set.predicates.size() / 4) {
+    compact(set);
+  }
+  return true;
+}
+
+// -----------------------------------------------------------------------------
+// compact
+//
+// Drop the predicates no rule uses anymore and rebuild the string indexes.
+// replaceRule/removeRule call it when unused predicates are at least
+// COMPACT_MIN_DEAD and a quarter of all of them.
+// -----------------------------------------------------------------------------
+void TinyRuleChecker::compact(RuleSet &set) {
+  _indexPredicates(set);
+  if (set.deadPredicates == 0) {
+    return;
+  }
+  set.diagram = Diagram();
+
+  std::vector<uint32_t> remap(set.predicates.size(), UINT32_MAX);
+  uint32_t live = 0;
+  for (uint32_t p = 0; p < set.predicates.size(); p++) {
+    if (set.predicateRefs[p] == 0) {
+      continue;
+    }
+    if (live != p) {
+      set.predicates[live] = std::move(set.predicates[p]);
+      set.predicateRefs[live] = set.predicateRefs[p];
+    }
+    remap[p] = live++;
+  }
+  set.predicates.resize(live);
+  set.predicateRefs.resize(live);
+  set.deadPredicates = 0;
+
+  for (Rule &rule : set.rules) {
+    for (Instruction &ins : rule.program) {
+      if (ins.op == OP_STATEMENT) {
+        ins.index = remap[ins.index];
+      }
+    }
+  }
+
+  for (auto it = set.predicateKeys.begin(); it != set.predicateKeys.end(); ) {
+    if (remap[it->second] == UINT32_MAX) {
+      it = set.predicateKeys.erase(it);
+    }
+    else {
+      it->second = remap[it->second];
+      ++it;
+    }
+  }
+
+  _buildStringIndexes(set);
+}
+
+// -----------------------------------------------------------------------------
+// eval
+//
+// Evaluate all rules of the set, results[i] being the result of rules[i].
+// Shared predicates are evaluated once.
+// -----------------------------------------------------------------------------
+void TinyRuleChecker::eval(const RuleSet &set, std::vector<EvalResult> &results) {
+  _startBudget();
+  results.resize(set.rules.size());
+  if (!set.diagram.nodes.empty() && _evalDiagram(set, results)) {
+    return;
+  }
+
+  _predicateResults.assign(set.predicates.size(), PR_UNKNOWN);
+  uint8_t *memo = _predicateResults.data();
+
+  for (const StringIndex &index : set.stringIndexes) {
+    _evalStringIndex(set, index, memo);
+  }
+
+  for (size_t i = 0; i < set.rules.size(); i++) {
+    results[i].error.clear();
+
+    // out of budget, remaining rules are not evaluated (results so far are
+    // kept)
+    if (_budget.status != EVAL_OK) {
+      results[i].result = false;
+      results[i].error = results[i - 1].error;
+      results[i].status = _budget.status;
+      continue;
+    }
+
+    _evalProgram(set.rules[i], set.predicates, memo, results[i]);
+    _setEvalStatus(results[i]);
+  }
+}
+
+// -----------------------------------------------------------------------------
+// setPriorities
+//
+// Set the priority of each rule of the set for firstMatch() and topK()
+// (higher first, equal priorities in rule order). Without priorities rules
+// go in order. Returns FALSE if there isn't one priority per rule.
+// -----------------------------------------------------------------------------
+bool TinyRuleChecker::setPriorities(RuleSet &set, const std::vector<int32_t> &priorities) {
+  if (priorities.empty()) {
+    set.priorities.clear();
+    set.order.clear();
+    return true;
+  }
+  if (priorities.size() != set.rules.size()) {
+    return false;
+  }
+
+  set.priorities = priorities;
+  set.order.resize(set.rules.size());
+  for (uint32_t i = 0; i < set.order.size(); i++) {
+    set.order[i] = i;
+  }
+  std::stable_sort(set.order.begin(), set.order.end(), [&set](uint32_t a, uint32_t b) {
+    return set.priorities[a] > set.priorities[b];
+  });
+  return true;
+}
+
+// -----------------------------------------------------------------------------
+// firstMatch
+//
+// Find the matching rule with the highest priority. Returns a TRUE result
+// with its index if there is one. Rules are evaluated by priority until one
+// matches, skipping those whose guard statement (see _ruleGuard) is known to
+// be false, which string indexes answer at once.
+//
+// Rules that fail to evaluate don't match. The result only has an error if
+// an evaluation limit was hit.
+// -----------------------------------------------------------------------------
+TinyRuleChecker::EvalResult
+TinyRuleChecker::firstMatch(const RuleSet &set, uint32_t &index) {
+  EvalResult er;
+  std::vector<uint32_t> &matches = _priorityMatches;
+  matches.clear();
+  _evalByPriority(set, 1, matches, er);
+  if (er.result) {
+    index = matches[0];
+  }
+  return er;
+}
+
+// -----------------------------------------------------------------------------
+// topK
+//
+// Find the (up to) k matching rules with the highest priority, in priority
+// order. Same as firstMatch() otherwise.
+// -----------------------------------------------------------------------------
+TinyRuleChecker::EvalResult
+TinyRuleChecker::topK(const RuleSet &set, size_t k, std::vector<uint32_t> &matches) {
+  EvalResult er;
+  matches.clear();
+  _evalByPriority(set, k, matches, er);
+  return er;
+}
+
+// -----------------------------------------------------------------------------
+// _evalByPriority
+// -----------------------------------------------------------------------------
+void TinyRuleChecker::_evalByPriority(
+  const RuleSet &set,
+  size_t k,
+  std::vector<uint32_t> &matches,
+  EvalResult &er
+) {
+  _startBudget();
+  _predicateResults.assign(set.predicates.size(), PR_UNKNOWN);
+  uint8_t *memo = _predicateResults.data();
+
+  for (const StringIndex &index : set.stringIndexes) {
+    _evalStringIndex(set, index, memo);
+  }
+
+  EvalResult ruleResult;
+  for (size_t i = 0; i < set.rules.size() && matches.size() < k; i++) {
+    uint32_t r = set.order.empty() ? i : set.order[i];
+    const Rule &rule = set.rules[r];
+    if (!rule.error.empty() || rule.program.empty()) {
+      continue;
+    }
+
+    if (rule.guard != NO_GUARD) {
+      uint32_t p = rule.program[rule.guard].index;
+      if (memo[p] == PR_UNKNOWN) {
+        bool result = false;
+        memo[p] = _evalCompiledStatement(set.predicates[p], result, er.error) ?
+          (result ? PR_TRUE : PR_FALSE) : PR_ERROR;
+      }
+      if (memo[p] != PR_TRUE) {
+        if (_budget.status != EVAL_OK) {
+          break;
+        }
+        continue;
+      }
+    }
+
+    ruleResult.error.clear();
+    _evalProgram(rule, set.predicates, memo, ruleResult);
+    if (_budget.status != EVAL_OK) {
+      er.error = ruleResult.error;
+      break;
+    }
+    if (ruleResult.result && ruleResult.error.empty()) {
+      matches.push_back(r);
+    }
+  }
+
+  // only limits are reported
+  if (_budget.status == EVAL_OK) {
+    er.error.clear();
+  }
+  er.result = !matches.empty();
+  _setEvalStatus(er);
+}
+
+// -----------------------------------------------------------------------------
+// DiagramBuilder
+//
+// builds a reduced ordered decision diagram with sets of rules as terminals
+// (multi-terminal BDD): equal nodes are shared, and nodes whose two branches
+// are the same are dropped. Gives up once it has more than 'maxNodes' nodes.
+// -----------------------------------------------------------------------------
+struct DiagramBuilder {
+  static constexpr uint32_t TERMINAL = 0xFFFFFFFF;
+  enum { AND, OR };
+
+  typedef struct {
+    uint32_t level; // position of the predicate in the order, TERMINAL
+    uint32_t lo;    // for terminals, index in 'sets'
+    uint32_t hi;
+  } Node;
+
+  size_t                                             maxNodes;
+  bool                                               full = false;
+  std::vector<Node>                                  nodes;
+  std::vector<std::unordered_map<uint64_t, uint32_t>> unique; // by level
+  std::vector<std::vector<uint32_t>>                 sets;
+  std::map<std::vector<uint32_t>, uint32_t>          terminals;
+  std::unordered_map<uint64_t, uint32_t>             computed[2];
+  std::unordered_map<uint32_t, uint32_t>             negated;   // current rule
+
+  // levels testing equality of the same variable with different literals:
+  // if one is true, the others are false (so they are not tested)
+  std::vector<uint32_t>                              groups;    // by level
+  std::vector<uint32_t>                              groupLast; // by group
+  std::unordered_map<uint64_t, uint32_t>             restricted;
+
+  DiagramBuilder(size_t levels, size_t maxNodes) : maxNodes(maxNodes), unique(levels), groups(levels, TERMINAL) {
+    terminal(std::vector<uint32_t>()); // node 0, no rule matches
+  }
+
+  uint32_t terminal(const std::vector<uint32_t> &set) {
+    auto it = terminals.find(set);
+    if (it != terminals.end()) {
+      return it->second;
+    }
+    uint32_t node = nodes.size();
+    nodes.push_back({TERMINAL, (uint32_t)sets.size(), 0});
+    sets.push_back(set);
+    terminals.insert({set, node});
+    return node;
+  }
+
+  uint32_t node(uint32_t level, uint32_t lo, uint32_t hi) {
+    if (groups[level] != TERMINAL) {
+      hi = restrict(hi, groups[level]);
+    }
+    if (lo == hi) {
+      return lo;
+    }
+    auto inserted = unique[level].insert({(uint64_t)lo << 32 | hi, (uint32_t)nodes.size()});
+    if (inserted.second) {
+      nodes.push_back({level, lo, hi});
+      full |= (nodes.size() > maxNodes);
+    }
+    return inserted.first->second;
+  }
+
+  uint32_t apply(int op, uint32_t f, uint32_t g) {
+    if (full) {
+      return 0;
+    }
+    if (f > g) {
+      std::swap(f, g); // both are commutative
+    }
+    if (f == 0) {
+      return op == AND ? 0 : g;
+    }
+    if (f == g) {
+      return f;
+    }
+
+    Node nf = nodes[f];
+    Node ng = nodes[g];
+    if (nf.level == TERMINAL && ng.level == TERMINAL) {
+      std::vector<uint32_t> set;
+      std::set_union(
+        sets[nf.lo].begin(), sets[nf.lo].end(), sets[ng.lo].begin(), sets[ng.lo].end(), std::back_inserter(set)
+      );
+      return terminal(set);
+    }
+
+    uint64_t key = (uint64_t)f << 32 | g;
+    auto it = computed[op].find(key);
+    if (it != computed[op].end()) {
+      return it->second;
+    }
+
+    uint32_t level = std::min(nf.level, ng.level);
+    uint32_t lo = apply(op, nf.level == level ? nf.lo : f, ng.level == level ? ng.lo : g);
+    uint32_t hi = apply(op, nf.level == level ? nf.hi : f, ng.level == level ? ng.hi : g);
+    uint32_t result = node(level, lo, hi);
+    computed[op].insert({key, result});
+    return result;
+  }
+
+  // diagram with the levels of a group set to false
+  uint32_t restrict(uint32_t f, uint32_t group) {
+    Node nf = nodes[f];
+    if (nf.level == TERMINAL || nf.level > groupLast[group] || full) {
+      return f;
+    }
+
+    uint64_t key = (uint64_t)f << 32 | group;
+    auto it = restricted.find(key);
+    if (it != restricted.end()) {
+      return it->second;
+    }
+    uint32_t result = restrict(nf.lo, group);
+    if (groups[nf.level] != group) {
+      result = node(nf.level, result, restrict(nf.hi, group));
+    }
+    restricted.insert({key, result});
+    return result;
+  }
+
+  // negation of a diagram of a single rule (terminals are {} or {rule})
+  uint32_t negate(uint32_t f, uint32_t rule) {
+    if (full) {
+      return 0;
+    }
+    Node nf = nodes[f];
+    if (nf.level == TERMINAL) {
+      return sets[nf.lo].empty() ? terminal({rule}) : 0;
+    }
+
+    auto it = negated.find(f);
+    if (it != negated.end()) {
+      return it->second;
+    }
+    uint32_t lo = negate(nf.lo, rule);
+    uint32_t hi = negate(nf.hi, rule);
+    uint32_t result = node(nf.level, lo, hi);
+    negated.insert({f, result});
+    return result;
+  }
+};
+
+// -----------------------------------------------------------------------------
+// compileDiagram
+//
+// Merge all rules of the set into a single decision diagram over its
+// predicates, so that eval(set, results) finds all matching rules in one
+// walk from the root, evaluating at most one predicate per level. Predicates
+// are ordered by how many rules use their variable, then by how many rules
+// use them.
+//
+// The walk skips predicates, which must not hide their errors: it only runs
+// when each variable has a type none of its predicates fails on. That is
+// known for built-in methods with literals, whose errors only depend on the
+// operand types.
+//
+// Returns FALSE, leaving the set to be evaluated as usual, if the diagram
+// would have more than 'maxNodes' nodes, or a predicate uses a custom method
+// or a variable as value, or no type of a variable suits all its predicates.
+// The diagram is dropped when the set is updated, and it is not saved in
+// packs.
+// -----------------------------------------------------------------------------
+bool TinyRuleChecker::compileDiagram(RuleSet &set, size_t maxNodes) {
+  set.diagram = Diagram();
+
+  // predicate order
+  std::vector<uint32_t> refs(set.predicates.size(), 0);
+  std::map<std::string, uint32_t> varRefs;
+  for (const Rule &rule : set.rules) {
+    for (const Instruction &ins : rule.program) {
+      if (ins.op == OP_STATEMENT) {
+        refs[ins.index]++;
+        varRefs[set.predicates[ins.index].var]++;
+      }
+    }
+  }
+
+  // variable types none of the predicates fails on, trying each type
+  std::map<std::string, uint8_t> varTypes;
+  const VarType types[] = { V_TYPE_INT, V_TYPE_FLOAT, V_TYPE_STRING, V_TYPE_ARRAY };
+  for (uint32_t p = 0; p < set.predicates.size(); p++) {
+    const Statement &st = set.predicates[p];
+    if (refs[p] == 0) {
+      continue;
+    }
+    if (!st.method.typedErrors || st.hasVarRefs) {
+      return false;
+    }
+
+    uint8_t mask = 0;
+    for (VarType type : types) {
+      VarValue sample = {};
+      sample.type = type;
+      EvalResult er;
+      if (_callMethod(st.method, sample, st.value, st.prepared.get(), er)) {
+        mask |= 1 << _kernelIndex(type);
+      }
+    }
+    auto it = varTypes.insert({st.var, 0xF}).first;
+    it->second &= mask;
+    if (it->second == 0) {
+      return false;
+    }
+  }
+
+  std::vector<uint32_t> order;
+  for (uint32_t p = 0; p < set.predicates.size(); p++) {
+    if (refs[p] > 0) {
+      order.push_back(p);
+    }
+  }
+  if (order.size() > maxNodes) {
+    return false;
+  }
+  std::stable_sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b) {
+    uint32_t va = varRefs[set.predicates[a].var];
+    uint32_t vb = varRefs[set.predicates[b].var];
+    if (va != vb) {
+      return va > vb;
+    }
+    if (set.predicates[a].var != set.predicates[b].var) {
+      return set.predicates[a].var < set.predicates[b].var;
+    }
+    return refs[a] > refs[b];
+  });
+
+  // diagram of each rule, then OR of all of them
+  DiagramBuilder b(order.size(), maxNodes);
+  std::vector<uint32_t> levels(set.predicates.size(), DiagramBuilder::TERMINAL);
+  std::map<std::string, uint32_t> groups;
+  for (uint32_t level = 0; level < order.size(); level++) {
+    const Statement &st = set.predicates[order[level]];
+    levels[order[level]] = level;
+
+    // equality with a literal, grouped by variable and literal type (not
+    // floats, 0.0 and -0.0 are equal)
+    if (st.method.index == INDEX_EQUAL && (st.value.type == V_TYPE_INT || st.value.type == V_TYPE_STRING)) {
+      auto group = groups.insert({st.var + (char)st.value.type, (uint32_t)groups.size()}).first;
+      if (group->second == b.groupLast.size()) {
+        b.groupLast.push_back(level);
+      }
+      b.groups[level] = group->second;
+      b.groupLast[group->second] = level;
+    }
+  }
+
+  std::vector<uint32_t> diagrams;
+  std::vector<uint32_t> stack;
+  for (uint32_t r = 0; r < set.rules.size() && !b.full; r++) {
+    const Rule &rule = set.rules[r];
+    if (!rule.error.empty() || rule.program.empty()) {
+      continue;
+    }
+
+    stack.clear();
+    b.negated.clear();
+    for (const Instruction &ins : rule.program) {
+      switch (ins.op) {
+        case OP_STATEMENT:
+          stack.push_back(b.node(levels[ins.index], 0, b.terminal({r})));
+          break;
+        case OP_AND:
+        case OP_OR:
+          {
+            uint32_t g = stack.back();
+            stack.pop_back();
+            stack.back() = b.apply(ins.op == OP_AND ? DiagramBuilder::AND : DiagramBuilder::OR, stack.back(), g);
+          }
+          break;
+        case OP_NOT:
+          stack.back() = b.negate(stack.back(), r);
+          break;
+      }
+    }
+    diagrams.push_back(stack.back());
+  }
+
+  // in pairs, so that each rule is not added to a whole diagram of the ones
+  // before
+  while (diagrams.size() > 1 && !b.full) {
+    for (size_t i = 0; i < diagrams.size() / 2; i++) {
+      diagrams[i] = b.apply(DiagramBuilder::OR, diagrams[2 * i], diagrams[2 * i + 1]);
+    }
+    if (diagrams.size() % 2) {
+      diagrams[diagrams.size() / 2] = diagrams.back();
+    }
+    diagrams.resize((diagrams.size() + 1) / 2);
+  }
+  if (b.full) {
+    return false;
+  }
+  uint32_t root = diagrams.empty() ? 0 : diagrams[0];
+
+  // keep the nodes reachable from the root, root first
+  Diagram &diagram = set.diagram;
+  std::unordered_map<uint32_t, uint32_t> ids;
+  std::vector<uint32_t> pending;
+  ids.insert({root, 0});
+  pending.push_back(root);
+  diagram.nodes.push_back({});
+  for (size_t i = 0; i < pending.size(); i++) {
+    const DiagramBuilder::Node &n = b.nodes[pending[i]];
+    DiagramNode &dn = diagram.nodes[i];
+    if (n.level == DiagramBuilder::TERMINAL) {
+      const std::vector<uint32_t> &rules = b.sets[n.lo];
+      dn = {NO_GUARD, (uint32_t)diagram.matches.size(), (uint32_t)rules.size()};
+      diagram.matches.insert(diagram.matches.end(), rules.begin(), rules.end());
+      continue;
+    }
+
+    uint32_t next[2] = {n.lo, n.hi};
+    for (int j = 0; j < 2; j++) {
+      auto inserted = ids.insert({next[j], (uint32_t)pending.size()});
+      if (inserted.second) {
+        pending.push_back(next[j]);
+        diagram.nodes.push_back({});
+      }
+      next[j] = inserted.first->second;
+    }
+    diagram.nodes[i] = {order[n.level], next[0], next[1]};
+  }
+
+  for (const auto &var : varTypes) {
+    diagram.vars.push_back(var.first);
+    diagram.types.push_back(var.second);
+  }
+  return true;
+}
+
+// -----------------------------------------------------------------------------
+// _evalDiagram
+//
+// walk the decision diagram of the set. Returns FALSE if a variable is
+// missing or has a type some predicate fails on (see compileDiagram), or a
+// predicate can't be evaluated, for the set to be evaluated as usual and
+// report the errors of each rule.
+// -----------------------------------------------------------------------------
+bool TinyRuleChecker::_evalDiagram(const RuleSet &set, std::vector<EvalResult> &results) {
+  const Diagram &diagram = set.diagram;
+  for (size_t i = 0; i < diagram.vars.size(); i++) {
+    const VarValue *pVar = _getVar(diagram.vars[i]);
+    int k = pVar ? _kernelIndex(pVar->type) : -1;
+    if (k < 0 || !((diagram.types[i] >> k) & 1)) {
+      return false;
+    }
+  }
+
+  std::string error;
+  uint32_t node = 0;
+  while (diagram.nodes[node].predicate != NO_GUARD) {
+    const DiagramNode &dn = diagram.nodes[node];
+    bool result = false;
+    if (!_evalCompiledStatement(set.predicates[dn.predicate], result, error)) {
+      if (_budget.status == EVAL_OK) {
+        return false;
+      }
+
+      // out of budget, no rule is evaluated
+      for (EvalResult &er : results) {
+        er.result = false;
+        er.error = error;
+        er.status = _budget.status;
+      }
+      return true;
+    }
+    node = result ? dn.hi : dn.lo;
+  }
+
+  for (size_t i = 0; i < results.size(); i++) {
+    results[i].result = false;
+    results[i].error = set.rules[i].error;
+    _setEvalStatus(results[i]);
+  }
+  const DiagramNode &terminal = diagram.nodes[node];
+  for (uint32_t i = terminal.lo; i < terminal.lo + terminal.hi; i++) {
+    results[diagram.matches[i]].result = true;
+  }
+  return true;
+}
+
+// -----------------------------------------------------------------------------
+// _evalCompiledStatement
+// -----------------------------------------------------------------------------
+inline bool TinyRuleChecker::_evalCompiledStatement(
+  const Statement &st,
+  bool &result,
+  std::string &error
+) {
+  VarValue resolved;
+  const VarValue *pValue = &st.value;
+  if (st.value.type == V_TYPE_VARREF) {
+    // a plain variable is used as it is, big arrays are not copied
+    pValue = _slotVar(st.slotSpace, st.valueSlot, st.value.strval);
+    if (pValue == NULL) {
+      error = _varError(st.value.strval);
+      return false;
+    }
+  }
+  else if (st.hasVarRefs) {
+    if (!_resolveVarRefs(st.value, resolved, error)) {
+      return false;
+    }
+    pValue = &resolved;
+  }
+
+  const VarValue *pVar = _slotVar(st.slotSpace, st.varSlot, st.var);
+  if (pVar == NULL) {
+    error = _varError(st.var);
+    return false;
+  }
+
+  return _runStatement(st, *pVar, *pValue, result, error);
+}
+
+// -----------------------------------------------------------------------------
+// _runStatement
+//
+// run the method of a compiled statement on the given variable and value
+// -----------------------------------------------------------------------------
+inline bool TinyRuleChecker::_runStatement(
+  const Statement &st,
+  const VarValue &var,
+  const VarValue &value,
+  bool &result,
+  std::string &error
+) {
+  if (_limited && !_spendBudget(var, value, error)) {
+    return false;
+  }
+
+  if (st.kernel && var.type == st.kernelType) {
+    result = st.kernel(var, value);
+    return true;
+  }
+
+  EvalResult evalResult;
+  if (!_callMethod(st.method, var, value, st.prepared.get(), evalResult)) {
+    error = evalResult.error;
+    return false;
+  }
+  result = evalResult.result;
+  return true;
+}
+
+// -----------------------------------------------------------------------------
+// _evalTruthTable
+//
+// evaluate a rule with its truth table (see _buildTruthTable). Returns FALSE
+// if some statement can't be run by its kernel.
+// -----------------------------------------------------------------------------
+inline bool TinyRuleChecker::_evalTruthTable(
+  const Rule &rule,
+  const std::vector<Statement> &statements,
+  uint8_t *memo,
+  bool &result
+) {
+  uint32_t mask = 0;
+  for (uint32_t i = 0; i < rule.tableInputs.size(); i++) {
+    uint32_t index = rule.program[rule.tableInputs[i]].index;
+
+    // shared predicates of a rule set, known once evaluated
+    if (memo && (memo[index] == PR_TRUE || memo[index] == PR_FALSE)) {
+      mask |= (uint32_t)(memo[index] == PR_TRUE) << i;
+      continue;
+    }
+
+    const Statement &st = statements[index];
+    const VarValue *pVar = _slotVar(st.slotSpace, st.varSlot, st.var);
+    if (pVar == NULL || pVar->type != st.kernelType) {
+      return false;
+    }
+    bool value = st.kernel(*pVar, st.value);
+    if (memo) {
+      memo[index] = value ? PR_TRUE : PR_FALSE;
+    }
+    mask |= (uint32_t)value << i;
+  }
+  result = (rule.truthTable >> mask) & 1;
+  return true;
+}
+
+// -----------------------------------------------------------------------------
+// _evalProgram
+//
+// run the postfix program of a rule; statements are memoized in 'memo' (if
+// given) so that rules sharing them don't evaluate them twice
+// -----------------------------------------------------------------------------
+void TinyRuleChecker::_evalProgram(
+  const Rule &rule,
+  const std::vector<Statement> &statements,
+  uint8_t *memo,
+  EvalResult &er
+) {
+  er.result = false;
+
+  if (!rule.error.empty()) {
+    er.error = rule.error;
+    return;
+  }
+
+  // removed rule
+  if (rule.program.empty()) {
+    return;
+  }
+
+  // branchless form, unless limits have to be checked (or it can't tell the
+  // result, e.g. a variable type that reports an error)
+  if (!rule.tableInputs.empty() && !_limited && _evalTruthTable(rule, statements, memo, er.result)) {
+    return;
+  }
+
+  char localStack[64];
+  std::vector<char> heapStack;
+  char *stack = localStack;
+  if (rule.maxDepth > sizeof(localStack)) {
+    heapStack.resize(rule.maxDepth);
+    stack = heapStack.data();
+  }
+
+  uint32_t top = 0;
+  for (const Instruction &ins : rule.program) {
+    switch (ins.op) {
+      case OP_STATEMENT:
+        {
+          bool result = false;
+          if (memo && memo[ins.index] != PR_UNKNOWN && memo[ins.index] != PR_ERROR) {
+            result = (memo[ins.index] == PR_TRUE);
+          }
+          else if (_evalCompiledStatement(statements[ins.index], result, er.error)) {
+            if (memo) {
+              memo[ins.index] = result ? PR_TRUE : PR_FALSE;
+            }
+          }
+          else {
+            // errors are not memoized, the statement is evaluated again to
+            // report the error on every rule using it
+            if (memo) {
+              memo[ins.index] = PR_ERROR;
+            }
+            return;
+          }
+          stack[top++] = result;
+        }
+        break;
+
+      case OP_AND:
+        top--;
+        stack[top - 1] &= stack[top];
+        break;
+
+      case OP_OR:
+        top--;
+        stack[top - 1] |= stack[top];
+        break;
+
+      case OP_NOT:
+        stack[top - 1] = !stack[top - 1];
+        break;
+    }
+  }
+
+  er.result = stack[0];
+}
+
+// -----------------------------------------------------------------------------
+// compileAll
+//
+// Same as compile(exprs), using 'nthreads' threads (0 for one per core) to
+// compile the rules. Each thread compiles a contiguous range of rules and
+// dedups their statements; ranges are then merged in order, so predicates
+// are numbered by first use as in compile(exprs) and the result is the same
+// no matter the number of threads.
+//
+// Methods (and their prepare callbacks) are called from those threads, so
+// they must not be changed meanwhile. Predicate keys may not be kept: they
+// are rebuilt if the set is updated later.
+// -----------------------------------------------------------------------------
+TinyRuleChecker::RuleSet
+TinyRuleChecker::compileAll(const std::vector<std::string> &exprs, unsigned nthreads) {
+  if (nthreads == 0) {
+    nthreads = std::max(1u, std::thread::hardware_concurrency());
+  }
+  // not worth a thread for less than this many rules
+  nthreads = std::max<size_t>(1, std::min<size_t>(nthreads, exprs.size() / 256));
+  if (nthreads == 1) {
+    return compile(exprs);
+  }
+
+  // statements of a range of rules, deduped; rule programs point to them
+  // until the ranges are merged
+  typedef struct {
+    size_t                   first;
+    size_t                   last;
+    std::deque<std::string>  keys; // not moved, they are referenced
+    std::vector<Statement>   statements;
+    std::vector<uint32_t>    predicates; // final predicate of each statement
+  } Range;
+
+  RuleSet set;
+  set.rules.resize(exprs.size());
+  std::vector<Range> ranges(nthreads);
+
+  auto compileRange = [this, &exprs, &set](Range &range) {
+    std::unordered_map<std::string_view, uint32_t> local;
+    for (size_t i = range.first; i < range.last; i++) {
+      Rule &rule = set.rules[i];
+      rule = _compile(exprs[i].c_str(), false);
+
+      for (Instruction &ins : rule.program) {
+        if (ins.op != OP_STATEMENT) {
+          continue;
+        }
+        std::string key = _predicateKey(rule.statements[ins.index]);
+        auto it = local.find(key);
+        if (it == local.end()) {
+          range.keys.push_back(std::move(key));
+          it = local.insert({range.keys.back(), (uint32_t)range.statements.size()}).first;
+          range.statements.push_back(std::move(rule.statements[ins.index]));
+        }
+        ins.index = it->second;
+      }
+      rule.statements.clear();
+    }
+  };
+
+  std::vector<std::thread> threads;
+  for (unsigned t = 0; t < nthreads; t++) {
+    ranges[t].first = exprs.size() * t / nthreads;
+    ranges[t].last = exprs.size() * (t + 1) / nthreads;
+    if (t + 1 < nthreads) {
+      threads.emplace_back(compileRange, std::ref(ranges[t]));
+    }
+  }
+  compileRange(ranges[nthreads - 1]);
+  for (std::thread &thread : threads) {
+    thread.join();
+  }
+
+  // merge in order: first statements seen are the first predicates
+  size_t nkeys = 0;
+  for (const Range &range : ranges) {
+    nkeys += range.keys.size();
+  }
+  std::unordered_map<std::string_view, uint32_t> predicates;
+  predicates.reserve(nkeys);
+  for (Range &range : ranges) {
+    range.predicates.resize(range.keys.size());
+    for (size_t i = 0; i < range.keys.size(); i++) {
+      auto inserted = predicates.insert({range.keys[i], (uint32_t)set.predicates.size()});
+      if (inserted.second) {
+        set.predicates.push_back(std::move(range.statements[i]));
+      }
+      range.predicates[i] = inserted.first->second;
+    }
+    range.statements.clear();
+  }
+  for (Statement &st : set.predicates) {
+    _bindSlots(st);
+  }
+
+  auto relinkRange = [&set](const Range &range) {
+    for (size_t i = range.first; i < range.last; i++) {
+      for (Instruction &ins : set.rules[i].program) {
+        if (ins.op == OP_STATEMENT) {
+          ins.index = range.predicates[ins.index];
+        }
+      }
+    }
+  };
+
+  threads.clear();
+  for (unsigned t = 0; t + 1 < nthreads; t++) {
+    threads.emplace_back(relinkRange, std::cref(ranges[t]));
+  }
+  relinkRange(ranges[nthreads - 1]);
+  for (std::thread &thread : threads) {
+    thread.join();
+  }
+
+  _buildStringIndexes(set);
+  return set;
+}
+
+// records evaluated at once by evalBatch
+static const int LANES = 16;
+
+// -----------------------------------------------------------------------------
+// _compareLanes
+//
+// compare an int (or float) of each lane with a literal, one bit per lane.
+// Values are gathered from the records, four lanes per SSE2 compare.
+// -----------------------------------------------------------------------------
+static uint32_t _compareLanes(
+  TinyRuleChecker::LaneOp op,
+  TinyRuleChecker::VarType type,
+  const TinyRuleChecker::VarValue *const *lane,
+  const TinyRuleChecker::VarValue &literal
+) {
+  uint32_t mask = 0;
+#ifdef __SSE2__
+  for (int q = 0; q < LANES; q += 4) {
+    int bits;
+    if (type == TinyRuleChecker::V_TYPE_INT) {
+      __m128i v = _mm_set_epi32(lane[q + 3]->intval, lane[q + 2]->intval, lane[q + 1]->intval, lane[q]->intval);
+      __m128i l = _mm_set1_epi32(literal.intval);
+      __m128i c;
+      switch (op) {
+        case TinyRuleChecker::LANE_EQ:
+        case TinyRuleChecker::LANE_NEQ:
+          c = _mm_cmpeq_epi32(v, l);
+          break;
+        case TinyRuleChecker::LANE_GT:
+        case TinyRuleChecker::LANE_LTE:
+          c = _mm_cmpgt_epi32(v, l);
+          break;
+        case TinyRuleChecker::LANE_LT:
+        case TinyRuleChecker::LANE_GTE:
+          c = _mm_cmplt_epi32(v, l);
+          break;
+        case TinyRuleChecker::LANE_ALL_BITS:
+          c = _mm_cmpeq_epi32(_mm_and_si128(v, l), l);
+          break;
+        default: // any bits (negated below), no bits
+          c = _mm_cmpeq_epi32(_mm_and_si128(v, l), _mm_setzero_si128());
+          break;
+      }
+      bits = _mm_movemask_ps(_mm_castsi128_ps(c));
+      if (
+        op == TinyRuleChecker::LANE_NEQ || op == TinyRuleChecker::LANE_LTE ||
+        op == TinyRuleChecker::LANE_GTE || op == TinyRuleChecker::LANE_ANY_BITS
+      ) {
+        bits ^= 0xF;
+      }
+    }
+    else {
+      __m128 v = _mm_set_ps(lane[q + 3]->floatval, lane[q + 2]->floatval, lane[q + 1]->floatval, lane[q]->floatval);
+      __m128 l = _mm_set1_ps(literal.floatval);
+      __m128 c;
+      switch (op) {
+        case TinyRuleChecker::LANE_EQ:  c = _mm_cmpeq_ps(v, l); break;
+        case TinyRuleChecker::LANE_NEQ: c = _mm_cmpneq_ps(v, l); break;
+        case TinyRuleChecker::LANE_GT:  c = _mm_cmpgt_ps(v, l); break;
+        case TinyRuleChecker::LANE_GTE: c = _mm_cmpge_ps(v, l); break;
+        case TinyRuleChecker::LANE_LT:  c = _mm_cmplt_ps(v, l); break;
+        default:                        c = _mm_cmple_ps(v, l); break;
+      }
+      bits = _mm_movemask_ps(c);
+    }
+    mask |= (uint32_t)bits << q;
+  }
+#else
+  for (int i = 0; i < LANES; i++) {
+    bool result;
+    if (type == TinyRuleChecker::V_TYPE_INT) {
+      int32_t v = lane[i]->intval;
+      int32_t l = literal.intval;
+      switch (op) {
+        case TinyRuleChecker::LANE_EQ:       result = v == l; break;
+        case TinyRuleChecker::LANE_NEQ:      result = v != l; break;
+        case TinyRuleChecker::LANE_GT:       result = v > l; break;
+        case TinyRuleChecker::LANE_GTE:      result = v >= l; break;
+        case TinyRuleChecker::LANE_LT:       result = v < l; break;
+        case TinyRuleChecker::LANE_LTE:      result = v <= l; break;
+        case TinyRuleChecker::LANE_ALL_BITS: result = (v & l) == l; break;
+        case TinyRuleChecker::LANE_ANY_BITS: result = (v & l) != 0; break;
+        default:                             result = (v & l) == 0; break;
+      }
+    }
+    else {
+      float v = lane[i]->floatval;
+      float l = literal.floatval;
+      switch (op) {
+        case TinyRuleChecker::LANE_EQ:  result = v == l; break;
+        case TinyRuleChecker::LANE_NEQ: result = v != l; break;
+        case TinyRuleChecker::LANE_GT:  result = v > l; break;
+        case TinyRuleChecker::LANE_GTE: result = v >= l; break;
+        case TinyRuleChecker::LANE_LT:  result = v < l; break;
+        default:                        result = v <= l; break;
+      }
+    }
+    mask |= (uint32_t)result << i;
+  }
+#endif
+  return mask;
+}
+
+// -----------------------------------------------------------------------------
+// evalBatch
+//
+// Evaluate a compiled rule on each record of a row-major batch, results[i]
+// being the result for record i. Variables not in the batch are taken from
+// the checker. The same as setting the variables of each record and calling
+// eval(rule), but records are evaluated 16 at a time: each instruction works
+// on a 16-bit mask (one bit per record), and int/float comparisons and bit
+// tests with a literal compare 4 records per SIMD instruction. Other
+// statements (and records whose variable has another type) are evaluated
+// record by record. Limits (see setEvalLimits) apply to the whole batch.
+// -----------------------------------------------------------------------------
+void TinyRuleChecker::evalBatch(const Rule &rule, const RecordBatch &batch, std::vector<EvalResult> &results) {
+  _startBudget();
+  _evalBatch(rule, rule.statements, _batchFields(rule.statements, batch), batch, results);
+}
+
+// -----------------------------------------------------------------------------
+// evalBatch
+//
+// Add the records of a batch that match the rule to a bitmap, numbered from
+// firstRow, so that consecutive batches of a dataset can fill the same one.
+// Records with errors don't match.
+// -----------------------------------------------------------------------------
+void TinyRuleChecker::evalBatch(const Rule &rule, const RecordBatch &batch, MatchBitmap &matches, uint32_t firstRow) {
+  evalBatch(rule, batch, _batchResults);
+  for (size_t i = 0; i < _batchResults.size(); i++) {
+    if (_batchResults[i].result) {
+      matches.add(firstRow + i);
+    }
+  }
+}
+
+// -----------------------------------------------------------------------------
+// evalBatch
+//
+// Evaluate every rule of a set on a batch, adding the matching records of
+// rule i to matches[i] (see above)
+// -----------------------------------------------------------------------------
+void TinyRuleChecker::evalBatch(const RuleSet &set, const RecordBatch &batch, std::vector<MatchBitmap> &matches, uint32_t firstRow) {
+  _startBudget();
+  std::vector<std::pair<int, int>> fields = _batchFields(set.predicates, batch);
+  matches.resize(set.rules.size());
+  for (size_t r = 0; r < set.rules.size(); r++) {
+    _evalBatch(set.rules[r], set.predicates, fields, batch, _batchResults);
+    for (size_t i = 0; i < _batchResults.size(); i++) {
+      if (_batchResults[i].result) {
+        matches[r].add(firstRow + i);
+      }
+    }
+  }
+}
+
+// -----------------------------------------------------------------------------
+// _batchFields
+//
+// field of the variable (and plain variable reference) of each statement in a
+// batch, -1 if not in the batch
+// -----------------------------------------------------------------------------
+std::vector<std::pair<int, int>> TinyRuleChecker::_batchFields(
+  const std::vector<Statement> &statements,
+  const RecordBatch &batch
+) {
+  int nvars = batch.vars.size();
+  std::vector<std::pair<int, int>> fields;
+  for (const Statement &st : statements) {
+    int var = std::find(batch.vars.begin(), batch.vars.end(), st.var) - batch.vars.begin();
+    int value = st.value.type != V_TYPE_VARREF ? nvars :
+      std::find(batch.vars.begin(), batch.vars.end(), st.value.strval) - batch.vars.begin();
+    fields.push_back({var < nvars ? var : -1, value < nvars ? value : -1});
+  }
+  return fields;
+}
+
+// -----------------------------------------------------------------------------
+// _evalBatch
+//
+// see evalBatch, statements being those the program of the rule refers to
+// -----------------------------------------------------------------------------
+void TinyRuleChecker::_evalBatch(
+  const Rule &rule,
+  const std::vector<Statement> &statements,
+  const std::vector<std::pair<int, int>> &fields,
+  const RecordBatch &batch,
+  std::vector<EvalResult> &results
+) {
+  results.resize(batch.count);
+  for (EvalResult &er : results) {
+    er.result = false;
+    er.error = rule.error;
+    _setEvalStatus(er);
+  }
+  if (!rule.error.empty() || rule.program.empty()) {
+    return;
+  }
+
+  // derived variables not in the batch are computed from each record
+  bool derived = false;
+  for (const Instruction &ins : rule.program) {
+    if (ins.op == OP_STATEMENT && !_derived.empty()) {
+      const Statement &st = statements[ins.index];
+      derived = derived || st.hasVarRefs ||
+        (fields[ins.index].first < 0 && _derivedLookup.get(st.var)) ||
+        (fields[ins.index].second < 0 && st.value.type == V_TYPE_VARREF && _derivedLookup.get(st.value.strval));
+    }
+  }
+
+  size_t nvars = batch.vars.size();
+  std::vector<uint32_t> stack(rule.maxDepth);
+  const VarValue *lane[LANES];
+  VarValue resolved, sortedVar, sortedValue;
+  // with limits, records run one at a time to spend the budget in order
+  size_t blockSize = (_limited || derived) ? 1 : LANES;
+  for (size_t first = 0; first < batch.count; first += blockSize) {
+    const VarValue *records = batch.values + first * nvars;
+    if (derived) {
+      _batchVars = &batch.vars;
+      _batchRecord = records;
+      for (DerivedVar &d : _derived) {
+        d.state = DERIVED_STALE;
+      }
+    }
+    uint32_t nlanes = std::min(blockSize, batch.count - first);
+    uint32_t active = (1u << nlanes) - 1;
+    uint32_t failed = 0;
+
+    uint32_t top = 0;
+    for (const Instruction &ins : rule.program) {
+      switch (ins.op) {
+        case OP_STATEMENT:
+          {
+            const Statement &st = statements[ins.index];
+            int field = fields[ins.index].first;
+            int valueField = fields[ins.index].second;
+            uint32_t lanes = active & ~failed;
+            uint32_t mask = 0;
+
+            if (
+              st.method.lanes != LANE_NONE && st.kernel && !st.hasVarRefs && field >= 0 && !_limited &&
+              (st.kernelType == V_TYPE_INT || st.kernelType == V_TYPE_FLOAT)
+            ) {
+              uint32_t typed = 0;
+              for (int l = 0; l < LANES; l++) {
+                lane[l] = &st.value;
+                if ((lanes >> l) & 1) {
+                  const VarValue *v = &records[l * nvars + field];
+                  if (v->type == st.kernelType) {
+                    lane[l] = v;
+                    typed |= 1u << l;
+                  }
+                }
+              }
+              mask = _compareLanes(st.method.lanes, st.kernelType, lane, st.value) & typed;
+              lanes &= ~typed;
+            }
+            else if (field < 0 && valueField < 0 && !_limited) {
+              // same for all records
+              bool result = false;
+              std::string error;
+              if (_evalCompiledStatement(st, result, error)) {
+                mask = result ? lanes : 0;
+              }
+              else {
+                for (int l = 0; l < LANES; l++) {
+                  if ((lanes >> l) & 1) {
+                    results[first + l].error = error;
+                  }
+                }
+                failed |= lanes;
+              }
+              lanes = 0;
+            }
+
+            // one record at a time
+            for (int l = 0; lanes; l++, lanes >>= 1) {
+              if (!(lanes & 1)) {
+                continue;
+              }
+              const VarValue *pVar = field >= 0 ? &records[l * nvars + field] : _slotVar(st.slotSpace, st.varSlot, st.var);
+              const VarValue *pValue = &st.value;
+              std::string &error = results[first + l].error;
+              bool result = false;
+              if (valueField >= 0) {
+                pValue = &records[l * nvars + valueField];
+              }
+              else if (st.value.type == V_TYPE_VARREF) {
+                pValue = _slotVar(st.slotSpace, st.valueSlot, st.value.strval);
+                if (pValue == NULL) {
+                  error = _varError(st.value.strval);
+                }
+              }
+              else if (st.hasVarRefs) {
+                pValue = _resolveVarRefs(st.value, resolved, error) ? &resolved : NULL;
+              }
+              if (pVar == NULL && pValue != NULL) {
+                error = _varError(st.var);
+              }
+              // arrays of records are sorted as if set with setVars
+              if (field >= 0 && pVar->type == V_TYPE_ARRAY) {
+                sortedVar = *pVar;
+                _sortArray(sortedVar);
+                pVar = &sortedVar;
+              }
+              if (valueField >= 0 && pValue->type == V_TYPE_ARRAY) {
+                sortedValue = *pValue;
+                _sortArray(sortedValue);
+                pValue = &sortedValue;
+              }
+
+              if (pVar && pValue && _runStatement(st, *pVar, *pValue, result, error)) {
+                mask |= (uint32_t)result << l;
+              }
+              else {
+                failed |= 1u << l;
+              }
+            }
+            stack[top++] = mask;
+          }
+          break;
+
+        case OP_AND:
+          top--;
+          stack[top - 1] &= stack[top];
+          break;
+
+        case OP_OR:
+          top--;
+          stack[top - 1] |= stack[top];
+          break;
+
+        case OP_NOT:
+          stack[top - 1] ^= active;
+          break;
+      }
+    }
+
+    for (uint32_t l = 0; l < nlanes; l++) {
+      EvalResult &er = results[first + l];
+      er.result = !((failed >> l) & 1) && ((stack[0] >> l) & 1);
+      _setEvalStatus(er);
+    }
+  }
+
+  // values derived from the last record are not those of the checker
+  if (derived) {
+    _batchVars = NULL;
+    _batchRecord = NULL;
+    for (DerivedVar &d : _derived) {
+      d.state = DERIVED_STALE;
+    }
+  }
+}
+
+// -----------------------------------------------------------------------------
+// MatchBitmap containers
+// -----------------------------------------------------------------------------
+typedef TinyRuleChecker::MatchBitmap::Container BitmapContainer;
+
+static const uint32_t CONTAINER_ARRAY_MAX = TinyRuleChecker::MatchBitmap::ARRAY_MAX;
+static const uint32_t CONTAINER_WORDS = TinyRuleChecker::MatchBitmap::BITMAP_WORDS;
+
+enum { BITMAP_AND, BITMAP_OR, BITMAP_ANDNOT };
+
+// -----------------------------------------------------------------------------
+// _containerContains
+// -----------------------------------------------------------------------------
+static bool _containerContains(const BitmapContainer &c, uint16_t low) {
+  if (c.type == TinyRuleChecker::MatchBitmap::BITMAP) {
+    return (c.words[low >> 6] >> (low & 63)) & 1;
+  }
+  if (c.type == TinyRuleChecker::MatchBitmap::ARRAY) {
+    return std::binary_search(c.values.begin(), c.values.end(), low);
+  }
+
+  // last run starting at or before low
+  size_t lo = 0, hi = c.values.size() / 2;
+  while (lo < hi) {
+    size_t mid = (lo + hi) / 2;
+    if (c.values[mid * 2] <= low) lo = mid + 1; else hi = mid;
+  }
+  return lo > 0 && low - c.values[(lo - 1) * 2] <= c.values[(lo - 1) * 2 + 1];
+}
+
+// -----------------------------------------------------------------------------
+// _containerWords
+//
+// bits of any container
+// -----------------------------------------------------------------------------
+static void _containerWords(const BitmapContainer &c, uint64_t *words) {
+  if (c.type == TinyRuleChecker::MatchBitmap::BITMAP) {
+    memcpy(words, c.words.data(), CONTAINER_WORDS * sizeof(uint64_t));
+    return;
+  }
+
+  memset(words, 0, CONTAINER_WORDS * sizeof(uint64_t));
+  if (c.type == TinyRuleChecker::MatchBitmap::ARRAY) {
+    for (uint16_t v : c.values) {
+      words[v >> 6] |= (uint64_t)1 << (v & 63);
+    }
+    return;
+  }
+
+  for (size_t i = 0; i < c.values.size(); i += 2) {
+    uint32_t start = c.values[i];
+    uint32_t end = start + c.values[i + 1]; // inclusive
+    for (uint32_t w = start >> 6; w <= end >> 6; w++) {
+      uint64_t mask = ~(uint64_t)0;
+      if (w == start >> 6) mask &= ~(uint64_t)0 << (start & 63);
+      if (w == end >> 6) mask &= ~(uint64_t)0 >> (63 - (end & 63));
+      words[w] |= mask;
+    }
+  }
+}
+
+// -----------------------------------------------------------------------------
+// _setContainerWords
+//
+// make a container from bits, as an array if sparse
+// -----------------------------------------------------------------------------
+static void _setContainerWords(BitmapContainer &c, const uint64_t *words) {
+  uint32_t cardinality = 0;
+  for (uint32_t w = 0; w < CONTAINER_WORDS; w++) {
+    cardinality += __builtin_popcountll(words[w]);
+  }
+
+  c.cardinality = cardinality;
+  c.values.clear();
+  c.words.clear();
+  if (cardinality > CONTAINER_ARRAY_MAX) {
+    c.type = TinyRuleChecker::MatchBitmap::BITMAP;
+    c.values.shrink_to_fit();
+    c.words.assign(words, words + CONTAINER_WORDS);
+    return;
+  }
+
+  c.type = TinyRuleChecker::MatchBitmap::ARRAY;
+  c.words.shrink_to_fit();
+  c.values.reserve(cardinality);
+  for (uint32_t w = 0; w < CONTAINER_WORDS; w++) {
+    for (uint64_t bits = words[w]; bits; bits &= bits - 1) {
+      c.values.push_back(w * 64 + __builtin_ctzll(bits));
+    }
+  }
+}
+
+// -----------------------------------------------------------------------------
+// _mergeArrays
+//
+// AND, OR or ANDNOT of two sorted arrays into out (which must have room for
+// both), or just the number of values if out is NULL. Branchless, as which
+// side advances is hard to predict.
+// -----------------------------------------------------------------------------
+static uint32_t _mergeArrays(const uint16_t *a, uint32_t na, const uint16_t *b, uint32_t nb, int op, uint16_t *out) {
+  uint32_t i = 0, j = 0, n = 0;
+  if (op == BITMAP_AND) {
+    while (i < na && j < nb) {
+      uint16_t x = a[i], y = b[j];
+      if (out) {
+        out[n] = x;
+      }
+      n += x == y;
+      i += x <= y;
+      j += y <= x;
+    }
+    return n;
+  }
+
+  while (i < na && j < nb) {
+    uint16_t x = a[i], y = b[j];
+    if (op == BITMAP_OR) {
+      out[n++] = x < y ? x : y;
+    }
+    else {
+      out[n] = x;
+      n += x < y;
+    }
+    i += x <= y;
+    j += y <= x;
+  }
+  memcpy(out + n, a + i, (na - i) * sizeof(uint16_t));
+  n += na - i;
+  if (op == BITMAP_OR) {
+    memcpy(out + n, b + j, (nb - j) * sizeof(uint16_t));
+    n += nb - j;
+  }
+  return n;
+}
+
+// -----------------------------------------------------------------------------
+// _combineRuns
+//
+// AND, OR or ANDNOT of two run containers, sweeping over the run boundaries
+// -----------------------------------------------------------------------------
+static void _combineRuns(const BitmapContainer &a, const BitmapContainer &b, int op, BitmapContainer &out) {
+  const uint32_t NONE = 0x20000;
+  size_t i = 0, j = 0;
+  bool inA = false, inB = false;
+  uint32_t runStart = 0;
+  out.type = TinyRuleChecker::MatchBitmap::RUN;
+  out.cardinality = 0;
+
+  while (true) {
+    // next boundary: a run start, or the row after its end
+    uint32_t nextA = i >= a.values.size() ? NONE : a.values[i] + (inA ? a.values[i + 1] + 1u : 0);
+    uint32_t nextB = j >= b.values.size() ? NONE : b.values[j] + (inB ? b.values[j + 1] + 1u : 0);
+    uint32_t p = std::min(nextA, nextB);
+    if (p == NONE) {
+      break;
+    }
+
+    bool before = op == BITMAP_AND ? inA && inB : (op == BITMAP_OR ? inA || inB : inA && !inB);
+    if (nextA == p) {
+      inA = !inA;
+      i += inA ? 0 : 2;
+    }
+    if (nextB == p) {
+      inB = !inB;
+      j += inB ? 0 : 2;
+    }
+    bool after = op == BITMAP_AND ? inA && inB : (op == BITMAP_OR ? inA || inB : inA && !inB);
+
+    if (!before && after) {
+      runStart = p;
+    }
+    else if (before && !after) {
+      out.values.push_back(runStart);
+      out.values.push_back(p - 1 - runStart);
+      out.cardinality += p - runStart;
+    }
+  }
+}
+
+// -----------------------------------------------------------------------------
+// _combineContainers
+//
+// AND, OR or ANDNOT of two containers with the same key. Sorted arrays are
+// merged, so are runs, arrays ANDed with (or subtracted) anything are probed,
+// anything else goes through bits.
+// -----------------------------------------------------------------------------
+static void _combineContainers(const BitmapContainer &a, const BitmapContainer &b, int op, BitmapContainer &out) {
+  const uint8_t ARRAY = TinyRuleChecker::MatchBitmap::ARRAY;
+  const uint8_t RUN = TinyRuleChecker::MatchBitmap::RUN;
+  out.key = a.key;
+  out.values.clear();
+  out.words.clear();
+
+  if (a.type == ARRAY && b.type == ARRAY && (op != BITMAP_OR || a.cardinality + b.cardinality <= CONTAINER_ARRAY_MAX)) {
+    out.type = ARRAY;
+    out.values.resize(a.cardinality + b.cardinality);
+    out.cardinality = _mergeArrays(
+      a.values.data(), a.cardinality, b.values.data(), b.cardinality, op, out.values.data()
+    );
+    out.values.resize(out.cardinality);
+    return;
+  }
+
+  if (a.type == RUN && b.type == RUN) {
+    _combineRuns(a, b, op, out);
+    return;
+  }
+
+  const BitmapContainer *array = a.type == ARRAY ? &a : (op == BITMAP_AND && b.type == ARRAY ? &b : NULL);
+  if (array && op != BITMAP_OR) {
+    const BitmapContainer &other = array == &a ? b : a;
+    out.type = ARRAY;
+    for (uint16_t v : array->values) {
+      if (_containerContains(other, v) == (op == BITMAP_AND)) {
+        out.values.push_back(v);
+      }
+    }
+    out.cardinality = out.values.size();
+    return;
+  }
+
+  uint64_t wa[CONTAINER_WORDS], wb[CONTAINER_WORDS];
+  const uint64_t *pa = a.words.data(), *pb = b.words.data();
+  if (a.type != TinyRuleChecker::MatchBitmap::BITMAP) {
+    _containerWords(a, wa);
+    pa = wa;
+  }
+  if (b.type != TinyRuleChecker::MatchBitmap::BITMAP) {
+    _containerWords(b, wb);
+    pb = wb;
+  }
+  uint64_t words[CONTAINER_WORDS];
+  for (uint32_t w = 0; w < CONTAINER_WORDS; w++) {
+    words[w] = op == BITMAP_AND ? pa[w] & pb[w] : (op == BITMAP_OR ? pa[w] | pb[w] : pa[w] & ~pb[w]);
+  }
+  _setContainerWords(out, words);
+}
+
+// -----------------------------------------------------------------------------
+// MatchBitmap::add
+//
+// Rows are cheapest to add in ascending order (as evalBatch does), which
+// only touches the last container
+// -----------------------------------------------------------------------------
+void TinyRuleChecker::MatchBitmap::add(uint32_t row) {
+  uint16_t key = row >> 16;
+  uint16_t low = row & 0xFFFF;
+
+  std::vector<Container>::iterator it = _containers.end();
+  if (_containers.empty() || _containers.back().key < key) {
+    _containers.push_back({key, ARRAY, 0, {}, {}});
+    it = _containers.end() - 1;
+  }
+  else if (_containers.back().key == key) {
+    it = _containers.end() - 1;
+  }
+  else {
+    it = std::lower_bound(_containers.begin(), _containers.end(), key, [](const Container &c, uint16_t key) {
+      return c.key < key;
+    });
+    if (it->key != key) {
+      it = _containers.insert(it, {key, ARRAY, 0, {}, {}});
+    }
+  }
+
+  Container &c = *it;
+  if (c.type == RUN) {
+    if (_containerContains(c, low)) {
+      return;
+    }
+    uint64_t words[BITMAP_WORDS];
+    _containerWords(c, words);
+    _setContainerWords(c, words);
+  }
+
+  if (c.type == ARRAY) {
+    if (c.values.empty() || c.values.back() < low) {
+      c.values.push_back(low);
+    }
+    else {
+      std::vector<uint16_t>::iterator pos = std::lower_bound(c.values.begin(), c.values.end(), low);
+      if (*pos == low) {
+        return;
+      }
+      c.values.insert(pos, low);
+    }
+    c.cardinality++;
+
+    if (c.cardinality > ARRAY_MAX) {
+      uint64_t words[BITMAP_WORDS];
+      _containerWords(c, words);
+      _setContainerWords(c, words);
+    }
+    return;
+  }
+
+  uint64_t &word = c.words[low >> 6];
+  uint64_t bit = (uint64_t)1 << (low & 63);
+  c.cardinality += !(word & bit);
+  word |= bit;
+}
+
+// -----------------------------------------------------------------------------
+// MatchBitmap::contains
+// -----------------------------------------------------------------------------
+bool TinyRuleChecker::MatchBitmap::contains(uint32_t row) const {
+  uint16_t key = row >> 16;
+  std::vector<Container>::const_iterator it = std::lower_bound(
+    _containers.begin(), _containers.end(), key, [](const Container &c, uint16_t key) {
+      return c.key < key;
+    }
+  );
+  return it != _containers.end() && it->key == key && _containerContains(*it, row & 0xFFFF);
+}
+
+// -----------------------------------------------------------------------------
+// MatchBitmap::cardinality
+// -----------------------------------------------------------------------------
+uint64_t TinyRuleChecker::MatchBitmap::cardinality() const {
+  uint64_t cardinality = 0;
+  for (const Container &c : _containers) {
+    cardinality += c.cardinality;
+  }
+  return cardinality;
+}
+
+// -----------------------------------------------------------------------------
+// MatchBitmap::rows
+//
+// all rows, in ascending order
+// -----------------------------------------------------------------------------
+std::vector<uint32_t> TinyRuleChecker::MatchBitmap::rows() const {
+  std::vector<uint32_t> rows;
+  rows.reserve(cardinality());
+  for (const Container &c : _containers) {
+    uint32_t high = (uint32_t)c.key << 16;
+    if (c.type == ARRAY) {
+      for (uint16_t v : c.values) {
+        rows.push_back(high | v);
+      }
+    }
+    else if (c.type == RUN) {
+      for (size_t i = 0; i < c.values.size(); i += 2) {
+        for (uint32_t v = c.values[i]; v <= (uint32_t)c.values[i] + c.values[i + 1]; v++) {
+          rows.push_back(high | v);
+        }
+      }
+    }
+    else {
+      for (uint32_t w = 0; w < BITMAP_WORDS; w++) {
+        for (uint64_t bits = c.words[w]; bits; bits &= bits - 1) {
+          rows.push_back(high | (w * 64 + __builtin_ctzll(bits)));
+        }
+      }
+    }
+  }
+  return rows;
+}
+
+// -----------------------------------------------------------------------------
+// MatchBitmap::_combine
+//
+// AND, OR or ANDNOT of two bitmaps, container by container
+// -----------------------------------------------------------------------------
+TinyRuleChecker::MatchBitmap TinyRuleChecker::MatchBitmap::_combine(const MatchBitmap &a, const MatchBitmap &b, int op) {
+  MatchBitmap result;
+  size_t i = 0, j = 0;
+  Container c;
+  while (i < a._containers.size() || j < b._containers.size()) {
+    bool inA = i < a._containers.size() && (j == b._containers.size() || a._containers[i].key <= b._containers[j].key);
+    bool inB = j < b._containers.size() && (i == a._containers.size() || b._containers[j].key <= a._containers[i].key);
+
+    if (inA && inB) {
+      _combineContainers(a._containers[i++], b._containers[j++], op, c);
+      if (c.cardinality) {
+        result._containers.push_back(std::move(c));
+      }
+    }
+    else if (inA) {
+      if (op != BITMAP_AND) {
+        result._containers.push_back(a._containers[i]);
+      }
+      i++;
+    }
+    else {
+      if (op == BITMAP_OR) {
+        result._containers.push_back(b._containers[j]);
+      }
+      j++;
+    }
+  }
+  return result;
+}
+
+// -----------------------------------------------------------------------------
+// MatchBitmap::operator&
+// -----------------------------------------------------------------------------
+TinyRuleChecker::MatchBitmap TinyRuleChecker::MatchBitmap::operator&(const MatchBitmap &other) const {
+  return _combine(*this, other, BITMAP_AND);
+}
+
+// -----------------------------------------------------------------------------
+// MatchBitmap::operator|
+// -----------------------------------------------------------------------------
+TinyRuleChecker::MatchBitmap TinyRuleChecker::MatchBitmap::operator|(const MatchBitmap &other) const {
+  return _combine(*this, other, BITMAP_OR);
+}
+
+// -----------------------------------------------------------------------------
+// MatchBitmap::andNot
+//
+// rows of this bitmap not in the other one
+// -----------------------------------------------------------------------------
+TinyRuleChecker::MatchBitmap TinyRuleChecker::MatchBitmap::andNot(const MatchBitmap &other) const {
+  return _combine(*this, other, BITMAP_ANDNOT);
+}
+
+// -----------------------------------------------------------------------------
+// MatchBitmap::andCardinality
+//
+// number of rows in both bitmaps, without building their intersection
+// -----------------------------------------------------------------------------
+uint64_t TinyRuleChecker::MatchBitmap::andCardinality(const MatchBitmap &other) const {
+  uint64_t cardinality = 0;
+  size_t i = 0, j = 0;
+  while (i < _containers.size() && j < other._containers.size()) {
+    const Container &a = _containers[i];
+    const Container &b = other._containers[j];
+    if (a.key < b.key) {
+      i++;
+      continue;
+    }
+    if (b.key < a.key) {
+      j++;
+      continue;
+    }
+    i++;
+    j++;
+
+    if (a.type == ARRAY && b.type == ARRAY) {
+      cardinality += _mergeArrays(a.values.data(), a.cardinality, b.values.data(), b.cardinality, BITMAP_AND, NULL);
+      continue;
+    }
+    if (a.type == ARRAY || b.type == ARRAY) {
+      const Container &array = a.type == ARRAY ? a : b;
+      const Container &probed = a.type == ARRAY ? b : a;
+      for (uint16_t v : array.values) {
+        cardinality += _containerContains(probed, v);
+      }
+      continue;
+    }
+
+    uint64_t wa[BITMAP_WORDS], wb[BITMAP_WORDS];
+    const uint64_t *pa = a.words.data(), *pb = b.words.data();
+    if (a.type != BITMAP) {
+      _containerWords(a, wa);
+      pa = wa;
+    }
+    if (b.type != BITMAP) {
+      _containerWords(b, wb);
+      pb = wb;
+    }
+    for (uint32_t w = 0; w < BITMAP_WORDS; w++) {
+      cardinality += __builtin_popcountll(pa[w] & pb[w]);
+    }
+  }
+  return cardinality;
+}
+
+// -----------------------------------------------------------------------------
+// MatchBitmap::operator==
+//
+// same rows, no matter how they are stored
+// -----------------------------------------------------------------------------
+bool TinyRuleChecker::MatchBitmap::operator==(const MatchBitmap &other) const {
+  if (_containers.size() != other._containers.size()) {
+    return false;
+  }
+  for (size_t i = 0; i < _containers.size(); i++) {
+    const Container &a = _containers[i];
+    const Container &b = other._containers[i];
+    if (a.key != b.key || a.cardinality != b.cardinality) {
+      return false;
+    }
+    if (a.type == b.type && a.type != BITMAP) {
+      if (a.values != b.values) return false;
+      continue;
+    }
+    uint64_t wa[BITMAP_WORDS], wb[BITMAP_WORDS];
+    _containerWords(a, wa);
+    _containerWords(b, wb);
+    if (memcmp(wa, wb, sizeof(wa)) != 0) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// -----------------------------------------------------------------------------
+// MatchBitmap::optimize
+//
+// store each container in its smallest form, using runs where rows come in
+// long stretches (e.g. most records matching)
+// -----------------------------------------------------------------------------
+void TinyRuleChecker::MatchBitmap::optimize() {
+  uint64_t words[BITMAP_WORDS];
+  for (Container &c : _containers) {
+    _containerWords(c, words);
+
+    // a run starts at each bit set whose previous bit is not
+    uint32_t nruns = 0;
+    uint64_t carry = 0;
+    for (uint32_t w = 0; w < BITMAP_WORDS; w++) {
+      nruns += __builtin_popcountll(words[w] & ~((words[w] << 1) | carry));
+      carry = words[w] >> 63;
+    }
+
+    size_t runBytes = nruns * 4;
+    size_t otherBytes = c.cardinality > ARRAY_MAX ? BITMAP_WORDS * 8 : c.cardinality * 2;
+    if (runBytes >= otherBytes) {
+      if (c.type == RUN) {
+        _setContainerWords(c, words);
+      }
+      continue;
+    }
+
+    c.type = RUN;
+    c.words.clear();
+    c.words.shrink_to_fit();
+    c.values.clear();
+    c.values.reserve(nruns * 2);
+    uint32_t v = 0;
+    while (v < BITMAP_WORDS * 64) {
+      uint64_t bits = words[v >> 6] >> (v & 63);
+      if (!bits) {
+        v = (v | 63) + 1;
+        continue;
+      }
+      v += __builtin_ctzll(bits);
+
+      uint32_t start = v;
+      while (v < BITMAP_WORDS * 64) {
+        uint64_t unset = ~words[v >> 6] >> (v & 63);
+        if (unset) {
+          v += __builtin_ctzll(unset);
+          break;
+        }
+        v = (v | 63) + 1;
+      }
+      c.values.push_back(start);
+      c.values.push_back(v - 1 - start);
+    }
+    c.values.shrink_to_fit();
+  }
+}
+
+// -----------------------------------------------------------------------------
+// MatchBitmap::bytes
+//
+// memory used by the rows
+// -----------------------------------------------------------------------------
+size_t TinyRuleChecker::MatchBitmap::bytes() const {
+  size_t bytes = sizeof(MatchBitmap) + _containers.capacity() * sizeof(Container);
+  for (const Container &c : _containers) {
+    bytes += c.values.capacity() * sizeof(uint16_t) + c.words.capacity() * sizeof(uint64_t);
+  }
+  return bytes;
+}
+
+// -----------------------------------------------------------------------------
+// MatchBitmap::serialize
+//
+// "TRCBMAP1", the number of containers (uint32_t) and, for each one, its key
+// (uint16_t), type (uint8_t), a padding byte, its cardinality (uint32_t), the
+// number of uint16_t values (uint32_t) and those values or, for bitmaps, 1024
+// uint64_t words. All little-endian, as stored in memory.
+// -----------------------------------------------------------------------------
+static const char BITMAP_MAGIC[8] = { 'T', 'R', 'C', 'B', 'M', 'A', 'P', '1' };
+
+std::string TinyRuleChecker::MatchBitmap::serialize() const {
+  std::string out(BITMAP_MAGIC, sizeof(BITMAP_MAGIC));
+  uint32_t count = _containers.size();
+  out.append((const char *)&count, sizeof(count));
+
+  for (const Container &c : _containers) {
+    uint8_t header[12] = { 0 };
+    uint32_t nvalues = c.values.size();
+    memcpy(header, &c.key, 2);
+    header[2] = c.type;
+    memcpy(header + 4, &c.cardinality, 4);
+    memcpy(header + 8, &nvalues, 4);
+    out.append((const char *)header, sizeof(header));
+    if (c.type == BITMAP) {
+      out.append((const char *)c.words.data(), BITMAP_WORDS * sizeof(uint64_t));
+    }
+    else {
+      out.append((const char *)c.values.data(), nvalues * sizeof(uint16_t));
+    }
+  }
+  return out;
+}
+
+// -----------------------------------------------------------------------------
+// MatchBitmap::deserialize
+//
+// Load a bitmap made by serialize(). Returns FALSE with an error (and the
+// bitmap empty) if the data is not valid.
+// -----------------------------------------------------------------------------
+bool TinyRuleChecker::MatchBitmap::deserialize(const void *data, size_t size, std::string &error) {
+  _containers.clear();
+  const char *p = (const char *)data;
+  const char *end = p + size;
+
+  uint32_t count;
+  if (size < sizeof(BITMAP_MAGIC) + sizeof(count) || memcmp(p, BITMAP_MAGIC, sizeof(BITMAP_MAGIC)) != 0) {
+    error = "not a match bitmap";
+    return false;
+  }
+  p += sizeof(BITMAP_MAGIC);
+  memcpy(&count, p, sizeof(count));
+  p += sizeof(count);
+
+  std::vector<Container> containers;
+  error = "corrupted match bitmap";
+  for (uint32_t i = 0; i < count; i++) {
+    Container c;
+    uint32_t nvalues;
+    if (end - p < 12) {
+      return false;
+    }
+    memcpy(&c.key, p, 2);
+    c.type = p[2];
+    memcpy(&c.cardinality, p + 4, 4);
+    memcpy(&nvalues, p + 8, 4);
+    p += 12;
+    if (!containers.empty() && containers.back().key >= c.key) {
+      return false;
+    }
+
+    uint64_t cardinality = 0;
+    if (c.type == BITMAP) {
+      if ((size_t)(end - p) < BITMAP_WORDS * sizeof(uint64_t)) {
+        return false;
+      }
+      c.words.resize(BITMAP_WORDS);
+      memcpy(c.words.data(), p, BITMAP_WORDS * sizeof(uint64_t));
+      p += BITMAP_WORDS * sizeof(uint64_t);
+      for (uint64_t w : c.words) {
+        cardinality += __builtin_popcountll(w);
+      }
+    }
+    else if (c.type == ARRAY || c.type == RUN) {
+      if (nvalues > ARRAY_MAX * 2 || (size_t)(end - p) < nvalues * sizeof(uint16_t)) {
+        return false;
+      }
+      c.values.resize(nvalues);
+      memcpy(c.values.data(), p, nvalues * sizeof(uint16_t));
+      p += nvalues * sizeof(uint16_t);
+
+      if (c.type == ARRAY) {
+        cardinality = nvalues;
+        for (uint32_t v = 1; v < nvalues; v++) {
+          if (c.values[v - 1] >= c.values[v]) return false;
+        }
+      }
+      else {
+        if (nvalues % 2) {
+          return false;
+        }
+        int64_t previousEnd = -2;
+        for (uint32_t v = 0; v < nvalues; v += 2) {
+          int64_t start = c.values[v], last = start + c.values[v + 1];
+          if (start <= previousEnd + 1 || last > 0xFFFF) return false;
+          cardinality += last - start + 1;
+          previousEnd = last;
+        }
+      }
+    }
+    else {
+      return false;
+    }
+
+    if (cardinality != c.cardinality || cardinality == 0 || (c.type == ARRAY && cardinality > ARRAY_MAX)) {
+      return false;
+    }
+    containers.push_back(std::move(c));
+  }
+  if (p != end) {
+    return false;
+  }
+
+  _containers = std::move(containers);
+  error.clear();
+  return true;
+}
+
+// -----------------------------------------------------------------------------
+// _insertTrie
+//
+// add the literal of a predicate to a string index trie
+// -----------------------------------------------------------------------------
+static void _insertTrie(TinyRuleChecker::StringIndex &index, uint32_t predicate, const std::string &literal) {
+  index.predicates.push_back(predicate);
+
+  uint32_t node = 0;
+  size_t n = literal.size();
+  for (size_t i = 0; i < n; i++) {
+    uint8_t ch = literal[index.type == TinyRuleChecker::INDEX_PREFIX ? i : n - 1 - i];
+    std::vector<std::pair<uint8_t, uint32_t>> &edges = index.nodes[node].edges;
+
+    auto edge = std::lower_bound(edges.begin(), edges.end(), std::make_pair(ch, (uint32_t)0));
+    if (edge != edges.end() && edge->first == ch) {
+      node = edge->second;
+    }
+    else {
+      uint32_t child = index.nodes.size();
+      edges.insert(edge, {ch, child});
+      index.nodes.emplace_back();
+      node = child;
+    }
+  }
+  index.nodes[node].matches.push_back(predicate);
+}
+
+// -----------------------------------------------------------------------------
+// _buildStringIndexes
+//
+// build a trie per variable with all startsWith literals, and another one
+// with all endsWith literals (reversed)
+// -----------------------------------------------------------------------------
+void TinyRuleChecker::_buildStringIndexes(RuleSet &set) {
+  set.stringIndexes.clear();
+
+  std::map<std::pair<std::string, IndexType>, size_t> indexes;
+  for (uint32_t p = 0; p < set.predicates.size(); p++) {
+    const Statement &st = set.predicates[p];
+    if (!_isIndexable(st)) {
+      continue;
+    }
+
+    auto it = indexes.find({st.var, st.method.index});
+    if (it == indexes.end()) {
+      it = indexes.insert({{st.var, st.method.index}, set.stringIndexes.size()}).first;
+      set.stringIndexes.emplace_back();
+      set.stringIndexes.back().var = st.var;
+      set.stringIndexes.back().type = st.method.index;
+      set.stringIndexes.back().nodes.emplace_back();
+    }
+
+    _insertTrie(set.stringIndexes[it->second], p, st.value.strval);
+  }
+}
+
+// -----------------------------------------------------------------------------
+// _addToStringIndex
+//
+// add a new predicate to the trie of its variable (if indexable), creating
+// the trie if needed
+// -----------------------------------------------------------------------------
+void TinyRuleChecker::_addToStringIndex(RuleSet &set, uint32_t predicate) {
+  const Statement &st = set.predicates[predicate];
+  if (!_isIndexable(st)) {
+    return;
+  }
+
+  for (StringIndex &index : set.stringIndexes) {
+    if (index.type == st.method.index && index.var == st.var) {
+      _insertTrie(index, predicate, st.value.strval);
+      return;
+    }
+  }
+
+  set.stringIndexes.emplace_back();
+  StringIndex &index = set.stringIndexes.back();
+  index.var = st.var;
+  index.type = st.method.index;
+  index.nodes.emplace_back();
+  _insertTrie(index, predicate, st.value.strval);
+}
+
+// -----------------------------------------------------------------------------
+// _evalStringIndex
+//
+// walk the trie with the variable value, all predicates found on the way
+// are true, all the others are false. If the variable is not a string
+// predicates are left to be evaluated one by one (and report the error).
+// -----------------------------------------------------------------------------
+void TinyRuleChecker::_evalStringIndex(
+  const RuleSet &,
+  const StringIndex &index,
+  uint8_t *memo
+) {
+  const VarValue *pVar = _getVar(index.var);
+  if (pVar == NULL || pVar->type != V_TYPE_STRING) {
+    return;
+  }
+
+  for (uint32_t p : index.predicates) {
+    memo[p] = PR_FALSE;
+  }
+
+  const std::string &value = pVar->strval;
+  size_t n = value.size();
+  uint32_t node = 0;
+  for (size_t i = 0; ; i++) {
+    for (uint32_t p : index.nodes[node].matches) {
+      memo[p] = PR_TRUE;
+    }
+
+    if (i == n) {
+      break;
+    }
+
+    uint8_t ch = value[index.type == INDEX_PREFIX ? i : n - 1 - i];
+    const std::vector<std::pair<uint8_t, uint32_t>> &edges = index.nodes[node].edges;
+    auto edge = std::lower_bound(edges.begin(), edges.end(), std::make_pair(ch, (uint32_t)0));
+    if (edge == edges.end() || edge->first != ch) {
+      break;
+    }
+    node = edge->second;
+  }
+}
+
+// -----------------------------------------------------------------------------
+// SharedRuleSet constructor
+// -----------------------------------------------------------------------------
+TinyRuleChecker::SharedRuleSet::SharedRuleSet(std::shared_ptr<const RuleSet> set) {
+  _current = std::make_shared<const Published>(Published{1, set ? set : std::make_shared<const RuleSet>()});
+}
+
+// -----------------------------------------------------------------------------
+// SharedRuleSet::acquire
+//
+// current version of the rule set, valid for as long as it is held
+// -----------------------------------------------------------------------------
+std::shared_ptr<const TinyRuleChecker::RuleSet>
+TinyRuleChecker::SharedRuleSet::acquire(uint64_t *version) const {
+  std::shared_ptr<const Published> published = std::atomic_load_explicit(&_current, std::memory_order_acquire);
+  if (version) {
+    *version = published->version;
+  }
+
+  // shares ownership of the published version, which owns the set
+  return std::shared_ptr<const RuleSet>(published, published->set.get());
+}
+
+// -----------------------------------------------------------------------------
+// SharedRuleSet::publish
+//
+// replace the rule set, returning the new version number. Evaluations in
+// progress finish with the version they acquired.
+// -----------------------------------------------------------------------------
+uint64_t TinyRuleChecker::SharedRuleSet::publish(std::shared_ptr<const RuleSet> set) {
+  uint64_t version;
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+
+    std::shared_ptr<const Published> current = std::atomic_load_explicit(&_current, std::memory_order_relaxed);
+    version = current->version + 1;
+    std::shared_ptr<const Published> published = std::make_shared<const Published>(
+      Published{version, set ? set : std::make_shared<const RuleSet>()}
+    );
+
+    _retired.push_back(std::atomic_exchange_explicit(&_current, published, std::memory_order_acq_rel));
+  }
+
+  reclaim();
+  return version;
+}
+
+// -----------------------------------------------------------------------------
+// SharedRuleSet::reclaim
+//
+// free the old versions no reader holds anymore, returns how many are still
+// held. Once retired, a version can't be acquired again, so when this is the
+// only reference left, no reader can come back to it.
+// -----------------------------------------------------------------------------
+size_t TinyRuleChecker::SharedRuleSet::reclaim() {
+  std::vector<std::shared_ptr<const Published>> unused;
+  size_t held;
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    for (size_t i = 0; i < _retired.size(); ) {
+      if (_retired[i].use_count() == 1) {
+        unused.push_back(std::move(_retired[i]));
+        _retired[i] = std::move(_retired.back());
+        _retired.pop_back();
+      }
+      else {
+        i++;
+      }
+    }
+    held = _retired.size();
+  }
+
+  // freed out of the lock, so other publishers don't wait for it
+  unused.clear();
+  return held;
+}
+
+// -----------------------------------------------------------------------------
+// SharedRuleSet::version
+// -----------------------------------------------------------------------------
+uint64_t TinyRuleChecker::SharedRuleSet::version() const {
+  return std::atomic_load_explicit(&_current, std::memory_order_acquire)->version;
+}
+
+// -----------------------------------------------------------------------------
+// eval
+//
+// Evaluate the current version of a shared rule set (see eval(RuleSet)),
+// returning the version evaluated.
+// -----------------------------------------------------------------------------
+uint64_t TinyRuleChecker::eval(const SharedRuleSet &shared, std::vector<EvalResult> &results) {
+  uint64_t version;
+  std::shared_ptr<const RuleSet> set = shared.acquire(&version);
+  eval(*set, results);
+  return version;
+}
+
+// -----------------------------------------------------------------------------
+// Rule set packs
+//
+// A pack is a header followed by sections of fixed-size records (strings,
+// values, predicates, rules, instructions and string index tries), aligned to
+// 8 bytes. Records refer to each other by index, never by pointer, so a pack
+// is read in place from a mapped file. Strings are interned: every variable,
+// method name or literal is stored once.
+// -----------------------------------------------------------------------------
+static const char     PACK_MAGIC[8] = { 'T', 'R', 'C', 'P', 'A', 'C', 'K', 0 };
+static const uint32_t PACK_VERSION = 2;
+static const uint32_t PACK_ENDIAN = 0x01020304;
+static const uint32_t PACK_NONE = 0xFFFFFFFF;
+
+enum {
+  PS_STRINGS = 0,
+  PS_CHARS,
+  PS_VALUES,
+  PS_PREDICATES,
+  PS_RULES,
+  PS_PROGRAM,
+  PS_INDEXES,
+  PS_NODES,
+  PS_EDGES,
+  PS_LISTS,      // uint32_t lists: index predicates, node matches
+  PS_COUNT
+};
+
+struct PackHeader {
+  char     magic[8];
+  uint32_t version;
+  uint32_t endian;
+  uint64_t size;      // whole pack
+  uint64_t checksum;  // of everything after the header
+  struct {
+    uint64_t offset;
+    uint64_t count;
+  } sections[PS_COUNT];
+};
+
+struct PackedString { uint32_t offset, size; };
+struct PackedValue { uint32_t type, bits, str, first, count; };  // array items are contiguous
+struct PackedPredicate { uint32_t var, method, value; };
+struct PackedRule { uint32_t first, count, maxDepth, error; int32_t priority; };
+struct PackedInstruction { uint32_t op, index; };
+struct PackedIndex { uint32_t var, type, firstPredicate, predicateCount, firstNode, nodeCount; };
+struct PackedNode { uint32_t firstEdge, edgeCount, firstMatch, matchCount; };
+struct PackedEdge { uint32_t byte, node; };
+
+static const size_t PACK_RECORD_SIZES[PS_COUNT] = {
+  sizeof(PackedString), 1, sizeof(PackedValue), sizeof(PackedPredicate), sizeof(PackedRule),
+  sizeof(PackedInstruction), sizeof(PackedIndex), sizeof(PackedNode), sizeof(PackedEdge), sizeof(uint32_t)
+};
+
+// -----------------------------------------------------------------------------
+// PackWriter
+// -----------------------------------------------------------------------------
+struct PackWriter {
+  std::vector<PackedString>                 strings;
+  std::string                               chars;
+  std::unordered_map<std::string, uint32_t> interned;
+  std::vector<PackedValue>                  values;
+  std::vector<PackedPredicate>              predicates;
+  std::vector<PackedRule>                   rules;
+  std::vector<PackedInstruction>            program;
+  std::vector<PackedIndex>                  indexes;
+  std::vector<PackedNode>                   nodes;
+  std::vector<PackedEdge>                   edges;
+  std::vector<uint32_t>                     lists;
+
+  uint32_t addString(const std::string &s) {
+    auto it = interned.find(s);
+    if (it != interned.end()) {
+      return it->second;
+    }
+    uint32_t id = strings.size();
+    strings.push_back({(uint32_t)chars.size(), (uint32_t)s.size()});
+    chars += s;
+    interned[s] = id;
+    return id;
+  }
+
+  void setValue(uint32_t slot, const TinyRuleChecker::VarValue &v) {
+    PackedValue pv = { (uint32_t)v.type, 0, PACK_NONE, 0, 0 };
+    if (v.type == TinyRuleChecker::V_TYPE_INT) {
+      pv.bits = (uint32_t)v.intval;
+    }
+    else if (v.type == TinyRuleChecker::V_TYPE_FLOAT) {
+      memcpy(&pv.bits, &v.floatval, sizeof(pv.bits));
+    }
+    else if (v.type != TinyRuleChecker::V_TYPE_ARRAY) {
+      pv.str = addString(v.strval);
+    }
+
+    pv.first = values.size();
+    pv.count = v.array.size();
+    values.resize(values.size() + v.array.size());
+    values[slot] = pv;
+    for (uint32_t i = 0; i < pv.count; i++) {
+      setValue(pv.first + i, v.array[i]);
+    }
+  }
+
+  uint32_t addValue(const TinyRuleChecker::VarValue &v) {
+    uint32_t slot = values.size();
+    values.resize(slot + 1);
+    setValue(slot, v);
+    return slot;
+  }
+
+  template <typename T>
+  static void append(std::string &out, PackHeader &header, int section, const std::vector<T> &records) {
+    out.resize((out.size() + 7) & ~(size_t)7);
+    header.sections[section].offset = out.size();
+    header.sections[section].count = records.size();
+    out.append((const char *)records.data(), records.size() * sizeof(T));
+  }
+};
+
+// -----------------------------------------------------------------------------
+// serialize
+//
+// Binary pack of a compiled rule set, to be loaded with deserialize() or
+// load(), possibly by another process. Methods are stored by name and
+// resolved again when loading.
+// -----------------------------------------------------------------------------
+std::string TinyRuleChecker::serialize(const RuleSet &set) {
+  PackWriter w;
+
+  for (const Statement &st : set.predicates) {
+    uint32_t var = w.addString(st.var);
+    uint32_t method = w.addString(st.methodName);
+    w.predicates.push_back({var, method, w.addValue(st.value)});
+  }
+
+  for (size_t i = 0; i < set.rules.size(); i++) {
+    const Rule &rule = set.rules[i];
+    w.rules.push_back({
+      (uint32_t)w.program.size(),
+      (uint32_t)rule.program.size(),
+      rule.maxDepth,
+      rule.error.empty() ? PACK_NONE : w.addString(rule.error),
+      set.priorities.empty() ? 0 : set.priorities[i]
+    });
+    for (const Instruction &ins : rule.program) {
+      w.program.push_back({(uint32_t)ins.op, ins.index});
+    }
+  }
+
+  for (const StringIndex &index : set.stringIndexes) {
+    w.indexes.push_back({
+      w.addString(index.var),
+      (uint32_t)index.type,
+      (uint32_t)w.lists.size(),
+      (uint32_t)index.predicates.size(),
+      (uint32_t)w.nodes.size(),
+      (uint32_t)index.nodes.size()
+    });
+    w.lists.insert(w.lists.end(), index.predicates.begin(), index.predicates.end());
+    for (const TrieNode &node : index.nodes) {
+      w.nodes.push_back({
+        (uint32_t)w.edges.size(),
+        (uint32_t)node.edges.size(),
+        (uint32_t)w.lists.size(),
+        (uint32_t)node.matches.size()
+      });
+      for (const std::pair<uint8_t, uint32_t> &edge : node.edges) {
+        w.edges.push_back({edge.first, edge.second});
+      }
+      w.lists.insert(w.lists.end(), node.matches.begin(), node.matches.end());
+    }
+  }
+
+  PackHeader header = {};
+  memcpy(header.magic, PACK_MAGIC, sizeof(PACK_MAGIC));
+  header.version = PACK_VERSION;
+  header.endian = PACK_ENDIAN;
+
+  std::string out(sizeof(header), '\0');
+  PackWriter::append(out, header, PS_STRINGS, w.strings);
+  PackWriter::append(out, header, PS_CHARS, std::vector<char>(w.chars.begin(), w.chars.end()));
+  PackWriter::append(out, header, PS_VALUES, w.values);
+  PackWriter::append(out, header, PS_PREDICATES, w.predicates);
+  PackWriter::append(out, header, PS_RULES, w.rules);
+  PackWriter::append(out, header, PS_PROGRAM, w.program);
+  PackWriter::append(out, header, PS_INDEXES, w.indexes);
+  PackWriter::append(out, header, PS_NODES, w.nodes);
+  PackWriter::append(out, header, PS_EDGES, w.edges);
+  PackWriter::append(out, header, PS_LISTS, w.lists);
+
+  header.size = out.size();
+  header.checksum = _hashBytes(out.data() + sizeof(header), out.size() - sizeof(header));
+  memcpy(&out[0], &header, sizeof(header));
+  return out;
+}
+
+// -----------------------------------------------------------------------------
+// PackReader
+//
+// records of a pack, read in place; all indexes are checked against the
+// section sizes
+// -----------------------------------------------------------------------------
+struct PackReader {
+  const char *data;
+  PackHeader  header;
+
+  template <typename T>
+  const T *section(int s) const {
+    return (const T *)(data + header.sections[s].offset);
+  }
+  uint64_t count(int s) const {
+    return header.sections[s].count;
+  }
+  bool valid(int s, uint64_t first, uint64_t n) const {
+    return first <= count(s) && n <= count(s) - first;
+  }
+
+  bool getString(uint32_t id, std::string &s) const {
+    if (id >= count(PS_STRINGS)) {
+      return false;
+    }
+    const PackedString &ps = section<PackedString>(PS_STRINGS)[id];
+    if (!valid(PS_CHARS, ps.offset, ps.size)) {
+      return false;
+    }
+    s.assign(section<char>(PS_CHARS) + ps.offset, ps.size);
+    return true;
+  }
+
+  bool getValue(uint32_t id, TinyRuleChecker::VarValue &v, int depth = 0) const {
+    if (id >= count(PS_VALUES) || depth > 64) {
+      return false;
+    }
+    const PackedValue &pv = section<PackedValue>(PS_VALUES)[id];
+    v.type = (TinyRuleChecker::VarType)pv.type;
+    switch (v.type) {
+      case TinyRuleChecker::V_TYPE_INT:
+        v.intval = (int32_t)pv.bits;
+        break;
+      case TinyRuleChecker::V_TYPE_FLOAT:
+        memcpy(&v.floatval, &pv.bits, sizeof(v.floatval));
+        break;
+      case TinyRuleChecker::V_TYPE_STRING:
+      case TinyRuleChecker::V_TYPE_VARREF:
+        if (!getString(pv.str, v.strval)) {
+          return false;
+        }
+        break;
+      case TinyRuleChecker::V_TYPE_ARRAY:
+        if (!valid(PS_VALUES, pv.first, pv.count)) {
+          return false;
+        }
+        v.array.resize(pv.count);
+        for (uint32_t i = 0; i < pv.count; i++) {
+          if (!getValue(pv.first + i, v.array[i], depth + 1)) {
+            return false;
+          }
+        }
+        break;
+      default:
+        return false;
+    }
+    return true;
+  }
+};
+
+// -----------------------------------------------------------------------------
+// deserialize
+//
+// Load a rule set from a pack made by serialize(). The pack must be 8-byte
+// aligned (as mapped files and std::string buffers are). Returns FALSE with
+// an error if the pack is not valid, or uses methods this checker doesn't
+// have.
+// -----------------------------------------------------------------------------
+bool TinyRuleChecker::deserialize(const void *data, size_t size, RuleSet &loaded, std::string &error) {
+  loaded = RuleSet();
+  RuleSet set;
+
+  PackReader r;
+  r.data = (const char *)data;
+  if (size < sizeof(PackHeader) || memcmp(r.data, PACK_MAGIC, sizeof(PACK_MAGIC)) != 0) {
+    error = "not a rule set pack";
+    return false;
+  }
+  memcpy(&r.header, data, sizeof(PackHeader));
+  if (r.header.version != PACK_VERSION) {
+    error = "unsupported pack version " + std::to_string(r.header.version);
+    return false;
+  }
+  if (r.header.endian != PACK_ENDIAN || ((uintptr_t)data & 7) != 0) {
+    error = "pack not readable on this platform";
+    return false;
+  }
+  if (r.header.size != size) {
+    error = "truncated pack";
+    return false;
+  }
+  if (_hashBytes(r.data + sizeof(PackHeader), size - sizeof(PackHeader)) != r.header.checksum) {
+    error = "pack checksum mismatch";
+    return false;
+  }
+  for (int s = 0; s < PS_COUNT; s++) {
+    uint64_t offset = r.header.sections[s].offset;
+    uint64_t count = r.header.sections[s].count;
+    if ((offset & 7) || offset > size || count > (size - offset) / PACK_RECORD_SIZES[s]) {
+      error = "corrupted pack";
+      return false;
+    }
+  }
+  error = "corrupted pack";
+
+  const PackedPredicate *predicates = r.section<PackedPredicate>(PS_PREDICATES);
+  set.predicates.resize(r.count(PS_PREDICATES));
+  for (size_t i = 0; i < set.predicates.size(); i++) {
+    Statement &st = set.predicates[i];
+    if (
+      !r.getString(predicates[i].var, st.var) ||
+      !r.getString(predicates[i].method, st.methodName) ||
+      !r.getValue(predicates[i].value, st.value)
+    ) {
+      return false;
+    }
+    if (!_resolveStatement(st, error)) {
+      return false;
+    }
+    _bindSlots(st);
+  }
+
+  const PackedRule *rules = r.section<PackedRule>(PS_RULES);
+  std::vector<int32_t> priorities;
+  const PackedInstruction *program = r.section<PackedInstruction>(PS_PROGRAM);
+  set.rules.resize(r.count(PS_RULES));
+  for (size_t i = 0; i < set.rules.size(); i++) {
+    Rule &rule = set.rules[i];
+    if (
+      !r.valid(PS_PROGRAM, rules[i].first, rules[i].count) ||
+      (rules[i].error != PACK_NONE && !r.getString(rules[i].error, rule.error))
+    ) {
+      return false;
+    }
+    rule.program.resize(rules[i].count);
+    for (uint32_t j = 0; j < rules[i].count; j++) {
+      const PackedInstruction &ins = program[rules[i].first + j];
+      if (ins.op == OP_STATEMENT && ins.index >= set.predicates.size()) {
         return false;
+      }
+      rule.program[j] = {(OpCode)ins.op, ins.index};
     }
-    return true;
-  });
 
-  setMethod("contains", [](const VarValue &v1, const VarValue &v2, EvalResult &eval) {
-    if (v1.type == V_TYPE_STRING) {
-      eval.result = v1.strval.find(v2.strval) != std::string::npos;
-    }
-    else {
-      eval.error = "unsupported operation 'contains' with type '" + std::string(1, v1.type) + "'";
+    // the stored depth is not trusted: packs are shared between processes
+    if (!_programDepth(rule.program, rule.maxDepth)) {
       return false;
     }
-    return true;
-  });
+    rule.guard = _ruleGuard(rule, set.predicates);
+    _buildTruthTable(rule, set.predicates);
 
-  setMethod("in", [](const VarValue &v1, const VarValue &v2, EvalResult &eval) {
-    if (v2.type == V_TYPE_STRING) {
-      eval.result = v2.strval.find(v1.strval) != std::string::npos;
+    if (rules[i].priority != 0) {
+      priorities.resize(set.rules.size(), 0);
+      priorities[i] = rules[i].priority;
     }
-    else if (v2.type == V_TYPE_ARRAY) {
-      for (const VarValue &v : v2.array) {
-        if (v1.type == v.type) {
-          switch (v1.type) {
-            case V_TYPE_INT:
-              if (v1.intval == v.intval) {
-                eval.result = true;
-                return true;
-              }
-              break;
-            case V_TYPE_FLOAT:
-              if (v1.floatval == v.floatval) {
-                eval.result = true;
-                return true;
-              }
-              break;
-            case V_TYPE_STRING:
-              if (v1.strval == v.strval) {
-                eval.result = true;
-                return true;
-              }
-              break;
-            default:
-              break;
-          }
+  }
+  setPriorities(set, priorities);
+
+  const PackedIndex *indexes = r.section<PackedIndex>(PS_INDEXES);
+  const PackedNode *nodes = r.section<PackedNode>(PS_NODES);
+  const PackedEdge *edges = r.section<PackedEdge>(PS_EDGES);
+  const uint32_t *lists = r.section<uint32_t>(PS_LISTS);
+  set.stringIndexes.resize(r.count(PS_INDEXES));
+  for (size_t i = 0; i < set.stringIndexes.size(); i++) {
+    const PackedIndex &pi = indexes[i];
+    StringIndex &index = set.stringIndexes[i];
+    index.type = (IndexType)pi.type;
+    if (
+      (index.type != INDEX_PREFIX && index.type != INDEX_SUFFIX) ||
+      !r.getString(pi.var, index.var) ||
+      !r.valid(PS_LISTS, pi.firstPredicate, pi.predicateCount) ||
+      !r.valid(PS_NODES, pi.firstNode, pi.nodeCount) ||
+      pi.nodeCount == 0
+    ) {
+      return false;
+    }
+    index.predicates.assign(lists + pi.firstPredicate, lists + pi.firstPredicate + pi.predicateCount);
+
+    index.nodes.resize(pi.nodeCount);
+    for (uint32_t j = 0; j < pi.nodeCount; j++) {
+      const PackedNode &pn = nodes[pi.firstNode + j];
+      if (!r.valid(PS_EDGES, pn.firstEdge, pn.edgeCount) || !r.valid(PS_LISTS, pn.firstMatch, pn.matchCount)) {
+        return false;
+      }
+      TrieNode &node = index.nodes[j];
+      node.edges.resize(pn.edgeCount);
+      for (uint32_t k = 0; k < pn.edgeCount; k++) {
+        const PackedEdge &pe = edges[pn.firstEdge + k];
+        // sorted by byte, lookups are binary searches
+        if (pe.byte > 0xff || pe.node >= pi.nodeCount || (k > 0 && pe.byte <= node.edges[k - 1].first)) {
+          return false;
+        }
+        node.edges[k] = {(uint8_t)pe.byte, pe.node};
+      }
+      node.matches.assign(lists + pn.firstMatch, lists + pn.firstMatch + pn.matchCount);
+      for (uint32_t p : node.matches) {
+        if (p >= set.predicates.size()) {
+          return false;
         }
       }
-      eval.result = false;
     }
-    else {
-      eval.error = "unsupported operation 'in' with type '" + std::string(1, v2.type) + "'";
-      return false;
+
+    for (uint32_t p : index.predicates) {
+      if (p >= set.predicates.size()) {
+        return false;
+      }
     }
-    return true;
-  });
+  }
+
+  loaded = std::move(set);
+  error.clear();
+  return true;
 }
 
 // -----------------------------------------------------------------------------
-// eval
-//
-// Returns TRUE if the expression is valid and the result is stored in the
-// 'result' parameter. Returns FALSE otherwise.
+// save
 // -----------------------------------------------------------------------------
-TinyRuleChecker::EvalResult
-TinyRuleChecker::eval(const char *expr) {
-  ParseState ps { expr };
-  EvalResult er;
+bool TinyRuleChecker::save(const RuleSet &set, const char *path, std::string &error) {
+  std::string pack = serialize(set);
 
-  // no matter if error or not, we are assigning both vars
-  _parseExpr(ps);
+  FILE *f = fopen(path, "wb");
+  if (f == NULL) {
+    error = "can't open '" + std::string(path) + "'";
+    return false;
+  }
+  bool written = fwrite(pack.data(), 1, pack.size(), f) == pack.size();
+  if (fclose(f) != 0 || !written) {
+    error = "can't write '" + std::string(path) + "'";
+    return false;
+  }
+  return true;
+}
 
-  // we should have consumed everything, otherwise there's an error
-  if (ps.error.empty() && _peekToken(ps.next, ps.token)) {
-    er.error = "unexpected token \'" + std::string(ps.token.value) + "\'";
-    return er;
+// -----------------------------------------------------------------------------
+// load
+//
+// Load a rule set saved with save(). The file is mapped only while the rule
+// set is built from it: nothing refers to the mapping afterwards.
+// -----------------------------------------------------------------------------
+bool TinyRuleChecker::load(const char *path, RuleSet &set, std::string &error) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    error = "can't open '" + std::string(path) + "'";
+    return false;
   }
 
-  er.result = ps.result;
-  er.error = ps.error;
+  struct stat st;
+  if (fstat(fd, &st) != 0 || st.st_size == 0) {
+    close(fd);
+    error = "not a rule set pack";
+    return false;
+  }
 
-  return er;
+  void *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED) {
+    error = "can't map '" + std::string(path) + "'";
+    return false;
+  }
+
+  bool loaded = deserialize(data, st.st_size, set, error);
+  munmap(data, st.st_size);
+  return loaded;
 }
 
+// -----------------------------------------------------------------------------
+// ParseStack
+//
+// stack for the expression parser, on the native stack unless expressions are
+// deeply nested
+// -----------------------------------------------------------------------------
+template <typename T>
+class ParseStack {
+  public:
+    ParseStack() : _data(_local), _capacity(sizeof(_local) / sizeof(T)), _size(0) {}
+
+    inline void push(T v) {
+      if (_size == _capacity) {
+        _heap.resize(_capacity * 2);
+        if (_data == _local) {
+          std::copy(_local, _local + _size, _heap.begin());
+        }
+        _data = _heap.data();
+        _capacity = _heap.size();
+      }
+      _data[_size++] = v;
+    }
+    inline T pop() { return _data[--_size]; }
+    inline T &top() { return _data[_size - 1]; }
+    inline size_t size() const { return _size; }
+
+  private:
+    T              _local[64];
+    std::vector<T> _heap;
+    T             *_data;
+    size_t         _capacity;
+    size_t         _size;
+};
+
 // -----------------------------------------------------------------------------
 // _parseExpr
 //
 // parse an expression and returns the result in the 'result' parameter.
 //
-// expr      -> '(' expr ')'
+// expr      -> orexpr
+// orexpr    -> andexpr ('||' andexpr)*
+// andexpr   -> term ('&&' term)*
+// term      -> '(' expr ')'
 //           -> statement
-//           -> statement boolop expr
+//
+// Parsed without recursion (shunting-yard), operators and pending results
+// are kept in explicit stacks, so there is no limit on the number of terms
+// or nesting levels other than memory.
 // -----------------------------------------------------------------------------
 bool TinyRuleChecker::_parseExpr(ParseState &ps) {
-  const char *peekNext = _nextToken(ps.next, ps.token);
-  if (peekNext == NULL) {
-    ps.error = "expecting expression";
-    return false;
-  }
+  ParseStack<TokenType> ops;
+  ParseStack<char> results;
 
-  if (ps.token.type == TK_LPAR) {
-    // consume LPAR
-    ps.next = peekNext;
+  // apply the operator on top of the stack
+  auto reduce = [&]() {
+    TokenType op = ops.pop();
+    bool rhs = results.pop();
+    if (op == TK_AND) {
+      results.top() &= rhs;
+    }
+    else {
+      results.top() |= rhs;
+    }
+    if (ps.rule) {
+      ps.rule->program.push_back({op == TK_AND ? OP_AND : OP_OR, 0});
+    }
+  };
 
-    // then expression
-    if (!_parseExpr(ps)) {
-      // preserve error by parseExpr
+  for (;;) {
+    // a term is expected, opening as many parens as found
+    const char *peekNext = _nextToken(ps.next, ps.token);
+    while (peekNext != NULL && ps.token.type == TK_LPAR) {
+      ps.next = peekNext;
+      ops.push(TK_LPAR);
+      peekNext = _nextToken(ps.next, ps.token);
+    }
+    if (peekNext == NULL) {
+      ps.error = "expecting expression";
       return false;
     }
 
-    // then RPAR
-    ps.next = _nextToken(ps.next, ps.token);
-    if (ps.token.type != TK_RPAR) {
-      ps.error = "expecting ')'";
+    if (!_parseStatement(ps)) {
+      // preserve error by parseStatement
       return false;
     }
-  }
-  else if (!_parseStatement(ps)) {
-    // preserve error by parseStatement
-    return false;
-  }
+    results.push(ps.result);
 
-  // let's see what's ahead (we might need to process some extra things or
-  // we might just want to return to higher level, e.g still ")..." to be
-  // processed)
-  peekNext = _nextToken(ps.next, ps.token);
-  switch(ps.token.type) {
-    case TK_AND:
-      {
-        // consume AND
+    // then closing parens, until a boolean operator or the end of expression
+    for (;;) {
+      peekNext = _nextToken(ps.next, ps.token);
+      if (ps.token.type == TK_AND || ps.token.type == TK_OR) {
+        // consume operator; '&&' binds tighter than '||', both are left
+        // associative
         ps.next = peekNext;
+        while (
+          ops.size() > 0 && ops.top() != TK_LPAR &&
+          (ops.top() == TK_AND || ps.token.type == TK_OR)
+        ) {
+          reduce();
+        }
+        ops.push(ps.token.type);
+        break;
+      }
 
-        bool result = ps.result;
-        if (!_parseExpr(ps))
-          return false;
+      // consume RPAR if there is an open paren, otherwise leave it to higher
+      // level (to be reported as unexpected)
+      bool openParen = false;
+      while (ops.size() > 0) {
+        if (ops.top() == TK_LPAR) {
+          openParen = true;
+          break;
+        }
+        reduce();
+      }
 
-        ps.result &= result;
+      if (!openParen) {
+        ps.result = results.top();
         return true;
       }
-      break;
-
-    case TK_OR:
-      {
-        // consume OR
-        ps.next = peekNext;
 
-        bool result = ps.result;
-        if (!_parseExpr(ps))
-          return false;
-
-        ps.result |= result;
+      if (ps.token.type != TK_RPAR) {
+        ps.error = "expecting ')'";
+        return false;
       }
-      return true;
-    default:
-      // nothing else to manage on purpose
-      break;
+      ps.next = peekNext;
+      ops.pop();
+    }
   }
-
-  // let's allow high-level function to continue processing if needed
-  return true;
 }
 
 // -----------------------------------------------------------------------------
@@ -375,8 +6119,9 @@ bool TinyRuleChecker::_parseExpr(ParseState &ps) {
 //
 // parse a statement and returns the result in the 'result' parameter.
 //
-// statement -> id '.' id '(' value ')'
+// statement -> path '.' id '(' value ')'
 //           -> 'not' statement
+// path      -> id ('.' id)*
 // -----------------------------------------------------------------------------
 bool
 TinyRuleChecker::_parseStatement(ParseState &ps) {
@@ -386,13 +6131,15 @@ TinyRuleChecker::_parseStatement(ParseState &ps) {
     return false;
   }
 
-  // optional 'not' operator
-  if (ps.token.type == TK_NOT) {
-    if (!_parseStatement(ps))
+  // optional 'not' operators
+  uint32_t nots = 0;
+  while (ps.token.type == TK_NOT) {
+    nots++;
+    ps.next = _nextToken(ps.next, ps.token);
+    if (ps.next == NULL) {
+      ps.error = "expecting statement";
       return false;
-
-    ps.result = !ps.result;
-    return true;
+    }
   }
 
   // expecting an identifier
@@ -401,24 +6148,33 @@ TinyRuleChecker::_parseStatement(ParseState &ps) {
     return false;
   }
 
-  std::string_view id = ps.token.value;
+  // the variable path, followed by the method
+  std::string_view id, method;
+  std::string joined;
+  _parsePath(ps, id, joined);
 
-  // then expecting a dot
-  ps.next = _nextToken(ps.next, ps.token);
-  if (ps.token.type != TK_DOT) {
-    ps.error = "expecting '.'";
-    return false;
+  size_t dot = id.rfind('.');
+  if (dot != std::string_view::npos) {
+    method = id.substr(dot + 1);
+    id = id.substr(0, dot);
   }
+  else {
+    // then expecting a dot
+    ps.next = _nextToken(ps.next, ps.token);
+    if (ps.token.type != TK_DOT) {
+      ps.error = "expecting '.'";
+      return false;
+    }
 
-  // then another identifier
-  ps.next = _nextToken(ps.next, ps.token);
-  if (ps.token.type != TK_ID) {
-    ps.error = "expecting identifier";
-    return false;
+    // then another identifier
+    ps.next = _nextToken(ps.next, ps.token);
+    if (ps.token.type != TK_ID) {
+      ps.error = "expecting identifier";
+      return false;
+    }
+    method = ps.token.value;
   }
 
-  std::string_view method = ps.token.value;
-
   // then a '('
   ps.next = _nextToken(ps.next, ps.token);
   if (ps.token.type != TK_LPAR) {
@@ -440,13 +6196,62 @@ TinyRuleChecker::_parseStatement(ParseState &ps) {
     return false;
   }
 
+  // when compiling, statement is stored for later evaluation
+  if (ps.rule) {
+    if (!_compileStatement(ps, id, method, value)) {
+      return false;
+    }
+    for (uint32_t i = 0; i < nots; i++) {
+      ps.rule->program.push_back({OP_NOT, 0});
+    }
+    return true;
+  }
+
   // evaluate the statement inline
-  const VarValue *pVar = _variables.get(id);
+  const VarValue *pVar = _getVar(id);
   if (pVar == NULL) {
-    ps.error = "variable '" + std::string(id) + "' not found";
+    ps.error = _varError(id);
     return false;
   }
-  return _evalStatement(ps, *pVar, method, value);
+  // the value was charged while parsed
+  if (_limited && !_spendSteps(1 + _budgetSize(*pVar) / 64, ps.error)) {
+    return false;
+  }
+  if (!_evalStatement(ps, *pVar, method, value)) {
+    return false;
+  }
+  ps.result ^= (nots & 1);
+  return true;
+}
+
+// -----------------------------------------------------------------------------
+// _parsePath
+//
+// Dotted variable path starting at the current identifier: as long as '.'
+// and another identifier follow, they are part of it (a statement takes the
+// last one as its method). The path points into the expression, or into
+// 'joined' if there are spaces around the dots.
+// -----------------------------------------------------------------------------
+void TinyRuleChecker::_parsePath(ParseState &ps, std::string_view &path, std::string &joined) {
+  path = ps.token.value;
+
+  Token dot, segment;
+  const char *next;
+  while ((next = _nextToken(ps.next, dot)) != NULL && dot.type == TK_DOT) {
+    const char *after = _nextToken(next, segment);
+    if (after == NULL || segment.type != TK_ID) {
+      break;
+    }
+    ps.next = after;
+
+    if (joined.empty() && segment.value.data() == path.data() + path.size() + 1) {
+      path = std::string_view(path.data(), path.size() + 1 + segment.value.size());
+    }
+    else {
+      joined = std::string(path) + "." + std::string(segment.value);
+      path = joined;
+    }
+  }
 }
 
 // -----------------------------------------------------------------------------
@@ -474,6 +6279,11 @@ TinyRuleChecker::_parseValue(ParseState &ps, VarValue &v) {
         v.type = V_TYPE_STRING;
         v.strval = ps.token.value;
 
+        // interpreted, big literals are charged as they are parsed
+        if (_limited && ps.rule == NULL && v.strval.size() >= 64 && !_spendSteps(v.strval.size() / 64, ps.error)) {
+          return false;
+        }
+
         // no escape sequences, thus, we are done!
         if (ps.token.type == TK_RAW_STRING_NO_ESCAPE)
           return true;
@@ -510,12 +6320,22 @@ TinyRuleChecker::_parseValue(ParseState &ps, VarValue &v) {
 
     case TK_ID:
       {
-        const VarValue *pVar = _variables.get(ps.token.value);
+        std::string_view path;
+        std::string joined;
+        _parsePath(ps, path, joined);
+
+        if (ps.rule) {
+          // variables are resolved on evaluation
+          v.type = V_TYPE_VARREF;
+          v.strval = path;
+          return true;
+        }
+
+        const VarValue *pVar = _getVar(path);
         if (pVar == NULL) {
-          ps.error = "variable '" + std::string(ps.token.value) + "' not found";
+          ps.error = _varError(path);
           return false;
         }
-
         v = *pVar;
       }
       return true;
@@ -525,7 +6345,11 @@ TinyRuleChecker::_parseValue(ParseState &ps, VarValue &v) {
         v.type = V_TYPE_ARRAY;
         v.array.clear();
 
-        _peekToken(ps.next, ps.token);
+        // empty array
+        if (_peekToken(ps.next, ps.token) && ps.token.type == TK_RBRACE) {
+          ps.next = _nextToken(ps.next, ps.token);
+        }
+
         while (ps.token.type != TK_RBRACE) {
           VarValue vtmp;
           if (!_parseValue(ps, vtmp)) {
@@ -534,6 +6358,9 @@ TinyRuleChecker::_parseValue(ParseState &ps, VarValue &v) {
           }
 
           v.array.push_back(vtmp);
+          if (_limited && ps.rule == NULL && v.array.size() % 64 == 0 && !_spendSteps(1, ps.error)) {
+            return false;
+          }
 
           // then a ',' or end of array
           ps.next = _nextToken(ps.next, ps.token);
@@ -576,14 +6403,21 @@ bool TinyRuleChecker::_evalStatement(
   //   return false;
   // }
 
-  const MethodOperator *pMethod = _methods.get(method);
+  const Method *pMethod = _methods.get(method);
   if (pMethod == NULL) {
     ps.error = "unknown method '" + std::string(method) + "'";
     return false;
   }
 
+  // same types on both sides can go straight to the kernel, if any
+  int k = _kernelIndex(v1.type);
+  if (v1.type == v2.type && k >= 0 && pMethod->kernels[k]) {
+    ps.result = pMethod->kernels[k](v1, v2);
+    return true;
+  }
+
   EvalResult evalResult;
-  if (!(*pMethod)(v1, v2, evalResult)) {
+  if (!_callMethod(*pMethod, v1, v2, NULL, evalResult)) {
     ps.error = evalResult.error;
     return false;
   }
@@ -592,6 +6426,114 @@ bool TinyRuleChecker::_evalStatement(
   return true;
 }
 
+// -----------------------------------------------------------------------------
+// _hasVarRefs
+// -----------------------------------------------------------------------------
+static bool _hasVarRefs(const TinyRuleChecker::VarValue &v) {
+  if (v.type == TinyRuleChecker::V_TYPE_VARREF) {
+    return true;
+  }
+
+  for (const TinyRuleChecker::VarValue &item : v.array) {
+    if (_hasVarRefs(item)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// -----------------------------------------------------------------------------
+// _compileStatement
+//
+// store the statement in the rule being compiled, with its method resolved
+// -----------------------------------------------------------------------------
+bool TinyRuleChecker::_compileStatement(
+  ParseState &ps,
+  const std::string_view &id,
+  const std::string_view &method,
+  VarValue &value
+) {
+  Statement st;
+  st.var = id;
+  st.methodName = method;
+  st.value = std::move(value);
+  if (!_resolveStatement(st, ps.error)) {
+    return false;
+  }
+  if (ps.bindSlots) {
+    _bindSlots(st);
+  }
+
+  ps.rule->program.push_back({OP_STATEMENT, (uint32_t)ps.rule->statements.size()});
+  ps.rule->statements.push_back(std::move(st));
+  return true;
+}
+
+// -----------------------------------------------------------------------------
+// _resolveStatement
+//
+// resolve the method of a statement (by methodName), its kernel and the
+// prepared state of its literal
+// -----------------------------------------------------------------------------
+bool TinyRuleChecker::_resolveStatement(Statement &st, std::string &error) {
+  const Method *pMethod = _methods.get(st.methodName);
+  if (pMethod == NULL) {
+    error = "unknown method '" + st.methodName + "'";
+    return false;
+  }
+
+  st.method = *pMethod;
+  st.hasVarRefs = _hasVarRefs(st.value);
+
+  // pick the monomorphic kernel for the literal type; the variable type is
+  // only known on evaluation, so it is guarded there
+  int k = st.hasVarRefs ? -1 : _kernelIndex(st.value.type);
+  st.kernel = (k >= 0) ? pMethod->kernels[k] : NULL;
+  st.kernelType = st.value.type;
+
+  st.prepared = NULL;
+  if (pMethod->prepare && !st.hasVarRefs) {
+    if (!pMethod->prepare(st.value, st.prepared, error)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// -----------------------------------------------------------------------------
+// _resolveVarRefs
+//
+// copy given value replacing variable references by their current values
+// -----------------------------------------------------------------------------
+bool TinyRuleChecker::_resolveVarRefs(
+  const VarValue &v,
+  VarValue &resolved,
+  std::string &error
+) {
+  if (v.type == V_TYPE_VARREF) {
+    const VarValue *pVar = _getVar(v.strval);
+    if (pVar == NULL) {
+      error = _varError(v.strval);
+      return false;
+    }
+
+    resolved = *pVar;
+    return true;
+  }
+
+  resolved.type = v.type;
+  resolved.intval = v.intval;
+  resolved.floatval = v.floatval;
+  resolved.strval = v.strval;
+  resolved.array.resize(v.array.size());
+  for (size_t i = 0; i < v.array.size(); i++) {
+    if (!_resolveVarRefs(v.array[i], resolved.array[i], error)) {
+      return false;
+    }
+  }
+  return true;
+}
+
 // -----------------------------------------------------------------------------
 // _peekToken
 //
@@ -765,6 +6707,22 @@ const char *TinyRuleChecker::_nextToken(const char *expr, Token &t) {
         // skip first digit or sign
         expr++;
 
+        // hexadecimal, mostly for bit masks (0x80000000 wraps to INT32_MIN)
+        if (negative && *expr == '0') {
+          expr++;
+        }
+        if ((*expr == 'x' || *expr == 'X') && *(expr-1) == '0' && isxdigit((unsigned char)*(expr+1))) {
+          uint32_t hex = 0;
+          expr++;
+          while (isxdigit((unsigned char)*expr)) {
+            hex = hex * 16 + (*expr <= '9' ? *expr - '0' : (*expr | 0x20) - 'a' + 10);
+            expr++;
+          }
+          t.intval = (int32_t)(negative ? 0U - hex : hex);
+          t.value = std::string_view(start_expr, expr - start_expr);
+          break;
+        }
+
         //while(isdigit(*expr)) {
         while (*expr >= '0' && *expr <= '9') {
           t.intval = t.intval * 10 + (*expr - '0');
@@ -10,6 +10,15 @@
 #include <stdint.h>
 #include <map>
 #include <vector>
+#include <algorithm>
+#include <memory>
+#include <type_traits>
+#include <atomic>
+#include <chrono>
+#include <list>
+#include <mutex>
+#include <unordered_map>
+#include <unordered_set>
 
 // -----------------------------------------------------------------------------
 // FastStringLookup
@@ -23,6 +32,11 @@
 // Note that this is not a normal hash table, because here in case of collissions
 // we don't try to insert the new element anywhere, we just mark it as a collission
 // which will get resolved by using the lookup map.
+//
+// Once all keys are known, the table can be frozen into a minimal perfect hash
+// (hash and displace), which resolves every key with a single hash, a single
+// slot and a single comparison, no matter how many keys there are. Setting a
+// new key after freezing thaws the table back to the regular lookup.
 // -----------------------------------------------------------------------------
 template<typename T>
 class FastStringLookup {
@@ -36,17 +50,36 @@ class FastStringLookup {
       clear();
     }
 
+    static constexpr uint32_t NOT_FOUND = 0xFFFFFFFF;
+
     void clear();
-    void set(const std::string &key, T value);
+    uint32_t set(const std::string &key, T value);
     const T *get(const std::string &key) const;
     const T *get(const std::string_view &key) const;
 
+    // values by index (as returned by set or find), stable until clear()
+    uint32_t find(const std::string_view &key) const;
+    T &at(uint32_t index) { return _values[index]; }
+    const T &at(uint32_t index) const { return _values[index]; }
+
+    bool freeze();
+    bool frozen() const { return !_mphSlots.empty(); }
+
   private:
     static uint32_t _fnvHash32v(const uint8_t *data, size_t n);
+    static uint64_t _fnvHash64v(const uint8_t *data, size_t n);
+    static uint32_t _mphSlot(uint64_t hash, std::pair<uint32_t, uint32_t> d, uint32_t n);
+    void _thaw();
+
     std::map<std::string, uint32_t, std::less<>> _lookupMap;
     std::vector<uint32_t>    _lookup;
     std::vector<std::string> _lookupNames;
     std::vector<T>           _values;
+
+    // minimal perfect hash (only when frozen)
+    std::vector<std::pair<uint32_t, uint32_t>> _mphDisplacements;
+    std::vector<uint32_t>    _mphSlots;
+    std::vector<std::string> _mphNames;
 };
 
 // -----------------------------------------------------------------------------
@@ -59,7 +92,9 @@ class TinyRuleChecker {
       V_TYPE_INT = 'i',
       V_TYPE_FLOAT = 'f',
       V_TYPE_STRING = 's',
-      V_TYPE_ARRAY = 'a'
+      V_TYPE_ARRAY = 'a',
+      V_TYPE_VARREF = 'r', // compiled rules only: variable named by strval
+      V_TYPE_NONE = 'n'    // variable not set (see setVarTree)
     } VarType;
 
     typedef struct _VarValue {
@@ -68,33 +103,438 @@ class TinyRuleChecker {
       float                  floatval;
       std::string            strval;
       std::vector<_VarValue> array;
+
+      // sorted int values of arrays set by setVarArray
+      std::vector<int32_t>   ints;
+
+      // lowercase strval, computed on first use (see setCaseFoldCache)
+      mutable uint8_t        foldState = FOLD_OFF;
+      mutable std::string    foldedval;
     } VarValue;
 
+    enum { FOLD_OFF = 0, FOLD_PENDING, FOLD_READY };
+
+    typedef enum {
+      EVAL_OK = 0,
+      EVAL_ERROR,
+      EVAL_BUDGET_EXCEEDED,  // see setEvalLimits
+      EVAL_CANCELLED
+    } EvalStatus;
+
     typedef struct {
       bool        result;
       std::string error;
+      EvalStatus  status = EVAL_OK;
     } EvalResult;
 
+    // limits on the work of each eval call, 0 (or NULL) meaning no limit.
+    // Steps are statements evaluated, each one costing 1 more step for each
+    // 64 bytes (or array values) of its operands, and are checked before a
+    // statement runs. 'cancel' can be set from any thread to abort evaluations
+    // in progress.
+    typedef struct {
+      uint64_t                 maxSteps;
+      uint64_t                 maxMicros;
+      const std::atomic<bool> *cancel;
+    } EvalLimits;
+
     typedef bool (*MethodOperator)(
       const VarValue &v1,
       const VarValue &v2,
       EvalResult &result
     );
 
+    // monomorphic version of a method, only valid when both values have the
+    // type it was registered for (no type checks, no errors)
+    typedef bool (*MethodKernel)(
+      const VarValue &v1,
+      const VarValue &v2
+    );
+
+    // stateful methods (functors) are called through a trampoline generated
+    // for each functor type, where the functor body can be inlined
+    typedef bool (*MethodCall)(
+      const void *functor,
+      const VarValue &v1,
+      const VarValue &v2,
+      EvalResult &result
+    );
+
+    // methods can precompute some state out of a literal argument once, when
+    // the rule is compiled (e.g. search tables, sets); returns FALSE with an
+    // error if the literal is not valid for the method
+    typedef bool (*MethodPrepare)(
+      const VarValue &literal,
+      std::shared_ptr<void> &prepared,
+      std::string &error
+    );
+
+    // same as MethodOperator, receiving the prepared state, which is NULL if
+    // the argument could not be prepared (not a literal, or not compiled)
+    typedef bool (*PreparedMethodOperator)(
+      const VarValue &v1,
+      const VarValue &v2,
+      const void *prepared,
+      EvalResult &result
+    );
+
+    // built-in methods whose literals can be indexed in rule sets, or (for
+    // INDEX_EQUAL) of which only one literal can match a variable
+    typedef enum {
+      INDEX_NONE = 0,
+      INDEX_PREFIX = 'p',
+      INDEX_SUFFIX = 's',
+      INDEX_EQUAL = 'e'
+    } IndexType;
+
+    // built-in comparisons that batches run on many records at once
+    typedef enum {
+      LANE_NONE = 0,
+      LANE_EQ,
+      LANE_NEQ,
+      LANE_GT,
+      LANE_GTE,
+      LANE_LT,
+      LANE_LTE,
+      LANE_ALL_BITS,
+      LANE_ANY_BITS,
+      LANE_NO_BITS
+    } LaneOp;
+
+    typedef struct {
+      MethodOperator         op;         // plain function methods
+      MethodCall             call;       // stateful methods, calling functor
+      std::shared_ptr<void>  functor;
+      MethodPrepare          prepare;    // methods with prepared state
+      PreparedMethodOperator preparedOp;
+      MethodKernel           kernels[4]; // by type, see _kernelIndex
+      IndexType              index;
+      LaneOp                 lanes;
+      bool                   typedErrors; // built-in: errors only depend on operand types
+    } Method;
+
+    typedef enum {
+      OP_STATEMENT = 's',
+      OP_AND = '&',
+      OP_OR = '|',
+      OP_NOT = '!'
+    } OpCode;
+
+    typedef struct {
+      OpCode   op;
+      uint32_t index; // statement index (OP_STATEMENT only)
+    } Instruction;
+
+    typedef struct {
+      std::string     var;
+      std::string     methodName;
+      Method          method;     // resolved at compile time
+      MethodKernel    kernel;     // used when var type is kernelType
+      VarType         kernelType;
+      std::shared_ptr<void> prepared;
+      VarValue        value;
+      bool            hasVarRefs; // value needs variables resolved on eval
+
+      // slots of var (and of value, if a variable) in the variables of the
+      // checker that compiled it, only used by that checker (see _bindSlots)
+      uint32_t        varSlot;
+      uint32_t        valueSlot;
+      uint32_t        slotSpace = 0;
+    } Statement;
+
+    // compiled expression: statements with their methods already resolved and
+    // a postfix program combining their results
+    typedef struct {
+      std::vector<Statement>   statements;
+      std::vector<Instruction> program;
+      uint32_t                 maxDepth = 0;
+      uint32_t                 guard = NO_GUARD; // statement the rule needs to be
+                                                 // true (program position)
+      std::vector<uint32_t>    tableInputs;      // branchless form (see
+      uint64_t                 truthTable = 0;   // _buildTruthTable), if any inputs
+      std::string              error;
+    } Rule;
+    static constexpr uint32_t NO_GUARD = 0xFFFFFFFF;
+
+    typedef struct {
+      std::vector<std::pair<uint8_t, uint32_t>> edges;  // sorted by byte
+      std::vector<uint32_t>                     matches; // predicates ending here
+    } TrieNode;
+
+    // trie with the literals of all startsWith (or endsWith, reversed)
+    // predicates of a variable, so that one walk answers all of them
+    typedef struct {
+      std::string            var;
+      IndexType              type;
+      std::vector<uint32_t>  predicates;
+      std::vector<TrieNode>  nodes;
+    } StringIndex;
+
+    // rule set as a decision diagram over its predicates: each node tests a
+    // predicate and goes to 'lo' (false) or 'hi' (true), until a terminal
+    // node (predicate NO_GUARD) with the matching rules, which are
+    // matches[lo .. lo + hi). nodes[0] is the root.
+    typedef struct {
+      uint32_t predicate;
+      uint32_t lo;
+      uint32_t hi;
+    } DiagramNode;
+
+    typedef struct {
+      std::vector<DiagramNode> nodes;
+      std::vector<uint32_t>    matches;
+      std::vector<std::string> vars;  // variables the predicates use
+      std::vector<uint8_t>     types; // of each variable, with no predicate failing (_kernelIndex bits)
+    } Diagram;
+
+    // rules evaluated together: equal statements are shared among rules (rule
+    // programs point to 'predicates' instead of their own statements).
+    // Predicates no longer used by any rule (after removing or replacing
+    // rules) are kept until the set is compacted.
+    typedef struct {
+      std::vector<Rule>               rules;
+      std::vector<Statement>          predicates;
+      std::map<std::string, uint32_t> predicateKeys;
+      std::vector<uint32_t>           predicateRefs;  // rule references
+      uint32_t                        deadPredicates = 0;
+      std::vector<StringIndex>        stringIndexes;
+      std::vector<int32_t>            priorities; // empty if none set
+      std::vector<uint32_t>           order;      // rules by priority
+      Diagram                         diagram;    // empty if not compiled
+    } RuleSet;
+
+    // LRU cache of compiled rules by expression text, used by eval(expr) so
+    // that repeated expressions run compiled. Expressions are only compiled
+    // the second time they are seen. A 'concurrent' cache can be shared by
+    // checkers in different threads; rules are only shared by checkers that
+    // set the same methods (see _setMethod)
+    class RuleCache {
+      public:
+        typedef struct {
+          uint64_t hits;
+          uint64_t misses;
+          uint64_t evictions;
+          size_t   entries;
+          size_t   bytes;
+        } Stats;
+
+        RuleCache(size_t maxEntries, size_t maxBytes = 0, bool concurrent = false);
+
+        std::shared_ptr<const Rule> get(const char *expr, size_t len, uint64_t hash);
+        bool admit(uint64_t hash);
+        void put(const char *expr, size_t len, uint64_t hash, std::shared_ptr<const Rule> rule);
+        void clear();
+        Stats stats();
+
+      private:
+        typedef struct {
+          uint64_t                    hash;
+          std::string                 expr;
+          std::shared_ptr<const Rule> rule;
+          size_t                      bytes;
+        } Entry;
+
+        size_t                     _maxEntries;
+        size_t                     _maxBytes;
+        bool                       _concurrent;
+        std::mutex                 _mutex;
+        std::list<Entry>           _lru; // most recently used first
+        std::unordered_map<uint64_t, std::list<Entry>::iterator> _entries;
+        std::unordered_set<uint64_t> _seen; // expressions seen once
+        Stats                      _stats;
+    };
+
+    // rule set that can be replaced while other threads evaluate it: readers
+    // get the current version, which stays valid for them until they drop it,
+    // and old versions are freed by the publishing thread (in publish or
+    // reclaim) once no reader holds them, never by a reader
+    class SharedRuleSet {
+      public:
+        SharedRuleSet(std::shared_ptr<const RuleSet> set = NULL);
+
+        std::shared_ptr<const RuleSet> acquire(uint64_t *version = NULL) const;
+        uint64_t publish(std::shared_ptr<const RuleSet> set);
+        size_t reclaim();
+        uint64_t version() const;
+
+      private:
+        typedef struct {
+          uint64_t                       version;
+          std::shared_ptr<const RuleSet> set;
+        } Published;
+
+        std::shared_ptr<const Published>              _current;
+        std::mutex                                    _mutex;    // publishers
+        std::vector<std::shared_ptr<const Published>> _retired;
+    };
+
+    // compressed set of row numbers (e.g. the records matching a rule), made
+    // of containers of 65536 rows each: sorted arrays when sparse, bitmaps
+    // when dense, and runs after optimize() if smaller
+    class MatchBitmap {
+      public:
+        void clear() { _containers.clear(); }
+        void add(uint32_t row);
+        bool contains(uint32_t row) const;
+        uint64_t cardinality() const;
+        std::vector<uint32_t> rows() const;
+
+        MatchBitmap operator&(const MatchBitmap &other) const;
+        MatchBitmap operator|(const MatchBitmap &other) const;
+        MatchBitmap andNot(const MatchBitmap &other) const;
+        uint64_t andCardinality(const MatchBitmap &other) const;
+        bool operator==(const MatchBitmap &other) const;
+
+        void optimize();
+        size_t bytes() const;
+
+        std::string serialize() const;
+        bool deserialize(const void *data, size_t size, std::string &error);
+
+        enum { ARRAY = 'a', BITMAP = 'b', RUN = 'r' };
+        enum { ARRAY_MAX = 4096, BITMAP_WORDS = 1024 };
+
+        typedef struct {
+          uint16_t              key;         // high 16 bits of its rows
+          uint8_t               type;
+          uint32_t              cardinality;
+          std::vector<uint16_t> values;      // array: sorted rows, run: start, length - 1 pairs
+          std::vector<uint64_t> words;       // bitmap
+        } Container;
+
+      private:
+        static MatchBitmap _combine(const MatchBitmap &a, const MatchBitmap &b, int op);
+
+        std::vector<Container> _containers; // by key
+    };
+
     TinyRuleChecker(bool defaultMethods = true);
     ~TinyRuleChecker();
 
-    void clearVars();
+    void clearVars(bool freeSlots = false);
     void setVarInt(const char *name, int value);
     void setVarFloat(const char *name, float value);
     void setVarString(const char *name, const char *value);
+    void setVarArray(const char *name, const std::vector<int32_t> &values);
+    void setVarArray(const char *name, const std::vector<std::string> &values);
+    void setCaseFoldCache(bool enabled);
+    void setEvalLimits(const EvalLimits &limits);
+
+    // nested record for setVarTree: fields are variables named
+    // path.name (or nested records, when they have fields themselves)
+    typedef struct _VarTree {
+      std::string           name;
+      VarValue              value;
+      std::vector<_VarTree> fields;
+    } VarTree;
+    void setVarTree(const char *path, const VarTree &tree);
+
+    // variables set together on each record by setVars(), resolved to slots
+    // once. Types are those of the values of packed records (see README).
+    typedef struct {
+      std::vector<std::string> names;
+      std::vector<VarType>     types;
+      std::vector<uint32_t>    slots;
+      uint32_t                 slotSpace;
+    } BindingPlan;
+    BindingPlan bindingPlan(const std::vector<std::string> &names, const std::vector<VarType> &types = {});
+    void setVars(const BindingPlan &plan, const VarValue *values);
+    bool setVars(const BindingPlan &plan, const void *record, size_t size, std::string &error);
+
+    // variable computed from other variables (inputs, which can be derived
+    // too) by any callable with the DeriveFunction signature, once per
+    // record: the value is kept until one of its inputs is set again
+    typedef bool (*DeriveFunction)(
+      const std::vector<const VarValue *> &inputs,
+      VarValue &value,
+      std::string &error
+    );
+    template<typename F>
+    void setDerivedVar(const char *name, const std::vector<std::string> &inputs, F &&functor) {
+      typedef typename std::decay<F>::type Functor;
+
+      DerivedVar d;
+      d.value.type = V_TYPE_NONE;
+      d.value.intval = 0;
+      d.value.floatval = 0;
+      d.functor = std::make_shared<Functor>(std::forward<F>(functor));
+      d.call = [](const void *f, const std::vector<const VarValue *> &inputs, VarValue &value, std::string &error) {
+        return (*(const Functor *)f)(inputs, value, error);
+      };
+      _setDerivedVar(name, inputs, d);
+    }
+    void clearDerivedVars();
+
+    void setRuleCache(size_t maxEntries, size_t maxBytes = 0);
+    void setRuleCache(std::shared_ptr<RuleCache> cache);
+    RuleCache::Stats ruleCacheStats();
 
     void clearMethods();
     void initMethods();
     void setMethod(const char *name, MethodOperator method);
+    void setMethod(const char *name, MethodPrepare prepare, PreparedMethodOperator method);
+
+    // any callable with the MethodOperator signature, e.g. capturing lambdas
+    // (calls must be const and can happen from several rules)
+    template<typename F>
+    void setMethod(const char *name, F &&functor) {
+      typedef typename std::decay<F>::type Functor;
+
+      if constexpr (std::is_convertible<Functor, MethodOperator>::value) {
+        setMethod(name, (MethodOperator)functor);
+      }
+      else {
+        Method m = {};
+        m.functor = std::make_shared<Functor>(std::forward<F>(functor));
+        m.call = [](const void *f, const VarValue &v1, const VarValue &v2, EvalResult &result) {
+          return (*(const Functor *)f)(v1, v2, result);
+        };
+        _setMethod(name, m);
+      }
+    }
+    bool freezeMethods();
 
     EvalResult eval(const char *expr);
 
+    Rule compile(const char *expr);
+    EvalResult eval(const Rule &rule);
+
+    RuleSet compile(const std::vector<std::string> &exprs);
+    RuleSet compileAll(const std::vector<std::string> &exprs, unsigned nthreads = 0);
+    void eval(const RuleSet &set, std::vector<EvalResult> &results);
+    uint64_t eval(const SharedRuleSet &shared, std::vector<EvalResult> &results);
+
+    // evaluate a rule set with a single walk over a decision diagram
+    bool compileDiagram(RuleSet &set, size_t maxNodes = 1 << 16);
+
+    // row-major batch of records for evalBatch(): field f of record r is
+    // values[r * vars.size() + f]
+    typedef struct {
+      std::vector<std::string> vars;
+      const VarValue          *values;
+      size_t                   count;
+    } RecordBatch;
+    void evalBatch(const Rule &rule, const RecordBatch &batch, std::vector<EvalResult> &results);
+    void evalBatch(const Rule &rule, const RecordBatch &batch, MatchBitmap &matches, uint32_t firstRow = 0);
+    void evalBatch(const RuleSet &set, const RecordBatch &batch, std::vector<MatchBitmap> &matches, uint32_t firstRow = 0);
+
+    // matching rules by priority, evaluating as few rules as possible
+    bool setPriorities(RuleSet &set, const std::vector<int32_t> &priorities);
+    EvalResult firstMatch(const RuleSet &set, uint32_t &index);
+    EvalResult topK(const RuleSet &set, size_t k, std::vector<uint32_t> &matches);
+
+    // update single rules of a compiled set (see README)
+    uint32_t addRule(RuleSet &set, const char *expr);
+    bool replaceRule(RuleSet &set, uint32_t index, const char *expr);
+    bool removeRule(RuleSet &set, uint32_t index);
+    void compact(RuleSet &set);
+
+    // compiled rule sets in a binary pack (see README)
+    std::string serialize(const RuleSet &set);
+    bool deserialize(const void *data, size_t size, RuleSet &set, std::string &error);
+    bool save(const RuleSet &set, const char *path, std::string &error);
+    bool load(const char *path, RuleSet &set, std::string &error);
+
   private:
     typedef enum {
       TK_UNKNOWN = 'u',
@@ -130,22 +570,141 @@ class TinyRuleChecker {
 
     typedef struct {
       const char *next;
-      Token       token;
-      bool        result;
-      std::string error;
+      Token       token = {};
+      bool        result = false;
+      std::string error = {};
+      Rule       *rule = NULL;   // when compiling, statements are emitted here
+      bool        bindSlots = false;
     } ParseState;
 
+    // variables by dotted path, with slots (indexes) compiled rules use
+    // instead of names. Each path has a node listing the paths one level
+    // below it, and cleared variables keep their slot with V_TYPE_NONE.
     FastStringLookup<VarValue> _variables;
-    FastStringLookup<MethodOperator> _methods;
+    typedef struct {
+      std::string           path;
+      std::vector<uint32_t> children;
+      std::vector<uint32_t> dependents; // derived variables using it
+    } VarNode;
+    std::vector<VarNode> _varNodes;
+    uint32_t             _slotSpace;
+
+    uint32_t _varSlot(std::string_view path);
+    void _setVar(const char *name, VarValue &v);
+    void _unsetVarTree(uint32_t slot);
+    void _bindVarTree(uint32_t slot, const VarTree &tree);
+    void _bindSlots(Statement &st);
+    inline const VarValue *_slotVar(uint32_t slotSpace, uint32_t slot, const std::string &name) {
+      if (slotSpace != _slotSpace) {
+        return _getVar(name);
+      }
+      const VarValue &v = _variables.at(slot);
+      return (v.type != V_TYPE_NONE) ? &v : (_derived.empty() ? NULL : _getDerivedVar(name));
+    }
+
+    // derived variables, computed on first use after their inputs change
+    enum { DERIVED_STALE = 0, DERIVED_COMPUTING, DERIVED_READY, DERIVED_FAILED };
+    typedef struct {
+      std::string              name;
+      std::vector<std::string> inputs;
+      std::shared_ptr<void>    functor;
+      bool (*call)(const void *functor, const std::vector<const VarValue *> &inputs, VarValue &value, std::string &error);
+      uint8_t                  state = DERIVED_STALE;
+      VarValue                 value;
+      std::string              error;
+      uint32_t                 slot;  // of its name, see VarNode
+    } DerivedVar;
+    std::vector<DerivedVar> _derived;
+    FastStringLookup<uint32_t> _derivedLookup;
+
+    template<typename K>
+    const VarValue *_getVar(const K &name) {
+      const VarValue *pVar = _variables.get(name);
+      if (pVar && pVar->type != V_TYPE_NONE) {
+        return pVar;
+      }
+      return _derived.empty() ? NULL : _getDerivedVar(name);
+    }
+    const VarValue *_getDerivedVar(std::string_view name);
+    std::string _varError(std::string_view name);
+    void _setDerivedVar(const char *name, const std::vector<std::string> &inputs, DerivedVar &d);
+    void _linkDerived();
+    void _invalidateDerived(uint32_t slot);
+    FastStringLookup<Method> _methods;
+    uint64_t                 _methodsKey; // of the methods set so far, see _setMethod
+
+    // rule set evaluation state: for each predicate, PR_UNKNOWN until it
+    // is evaluated, then PR_FALSE, PR_TRUE or PR_ERROR
+    enum { PR_UNKNOWN = 0, PR_FALSE, PR_TRUE, PR_ERROR };
+    std::vector<uint8_t> _predicateResults;
+    std::vector<uint32_t> _priorityMatches;
+    std::vector<EvalResult> _batchResults;
+
+    // record of a batch that derived variables take their inputs from, if
+    // any (see _evalBatch)
+    const std::vector<std::string> *_batchVars = NULL;
+    const VarValue                 *_batchRecord = NULL;
+
+    // work done by the current eval call, when there are limits
+    EvalLimits _limits;
+    bool       _limited;
+    struct {
+      uint64_t                              steps;
+      uint64_t                              nextClockCheck;
+      std::chrono::steady_clock::time_point deadline;
+      EvalStatus                            status;
+    } _budget;
+
+    std::shared_ptr<RuleCache> _ruleCache;
+
+    EvalResult _interpret(const char *expr);
+
+    inline void _startBudget();
+    bool _spendBudget(const VarValue &v1, const VarValue &v2, std::string &error);
+    bool _spendSteps(uint64_t steps, std::string &error);
+    inline void _setEvalStatus(EvalResult &er);
+
+    bool _caseFoldCache;
+
+    void _setMethod(const char *name, MethodOperator op, std::initializer_list<MethodKernel> kernels, IndexType index = INDEX_NONE, LaneOp lanes = LANE_NONE);
+    void _setMethod(const char *name, const Method &method);
+    static bool _callMethod(const Method &m, const VarValue &v1, const VarValue &v2, const void *prepared, EvalResult &result);
+    static int _kernelIndex(VarType type);
 
     std::string _stringifyToken(const Token &t);
     const char *_nextToken(const char *expr, Token &t);
     bool _peekToken(const char *expr, Token &t);
+    void _parsePath(ParseState &ps, std::string_view &path, std::string &joined);
 
     bool _parseExpr(ParseState &ps);
     bool _parseStatement(ParseState &ps);
     bool _parseValue(ParseState &ps, VarValue &v);
     bool _evalStatement(ParseState &ps, const VarValue &v1, const std::string_view &method, const VarValue &v2);
+    Rule _compile(const char *expr, bool bindSlots);
+    bool _compileStatement(ParseState &ps, const std::string_view &id, const std::string_view &method, VarValue &value);
+    bool _resolveStatement(Statement &st, std::string &error);
+    bool _resolveVarRefs(const VarValue &v, VarValue &resolved, std::string &error);
+
+    bool _evalCompiledStatement(const Statement &st, bool &result, std::string &error);
+    std::vector<std::pair<int, int>> _batchFields(const std::vector<Statement> &statements, const RecordBatch &batch);
+    void _evalBatch(
+      const Rule &rule,
+      const std::vector<Statement> &statements,
+      const std::vector<std::pair<int, int>> &fields,
+      const RecordBatch &batch,
+      std::vector<EvalResult> &results
+    );
+    bool _runStatement(const Statement &st, const VarValue &var, const VarValue &value, bool &result, std::string &error);
+    bool _evalTruthTable(const Rule &rule, const std::vector<Statement> &statements, uint8_t *memo, bool &result);
+    void _evalProgram(const Rule &rule, const std::vector<Statement> &statements, uint8_t *memo, EvalResult &er);
+    void _linkRule(RuleSet &set, Rule &rule, bool index);
+    void _unlinkRule(RuleSet &set, const Rule &rule);
+    void _indexPredicates(RuleSet &set);
+    void _buildStringIndexes(RuleSet &set);
+    void _addToStringIndex(RuleSet &set, uint32_t predicate);
+    void _evalStringIndex(const RuleSet &set, const StringIndex &index, uint8_t *memo);
+    bool _evalDiagram(const RuleSet &set, std::vector<EvalResult> &results);
+    void _evalByPriority(const RuleSet &set, size_t k, std::vector<uint32_t> &matches, EvalResult &er);
 };
 
 // -----------------------------------------------------------------------------
@@ -167,6 +726,45 @@ uint32_t FastStringLookup<T>::_fnvHash32v(const uint8_t *data, size_t n) {
   return result;
 }
 
+// -----------------------------------------------------------------------------
+// FastStringLookup<T>::_fnvHash64v
+//
+// 64-bit FNV-1a, used by the perfect hash so that a single pass over the key
+// gives us the bucket and both slot hashes. Bits are mixed at the end, since
+// FNV alone spreads keys like "m1", "m2"... poorly in the lower bits.
+// -----------------------------------------------------------------------------
+template<typename T>
+uint64_t FastStringLookup<T>::_fnvHash64v(const uint8_t *data, size_t n) {
+  const uint64_t PRIME = 1099511628211ULL;
+  uint64_t result = 14695981039346656037ULL;
+
+  for(size_t i = 0; i < n; i++) {
+    result ^= data[i];
+    result *= PRIME;
+  }
+
+  result ^= result >> 33;
+  result *= 0xff51afd7ed558ccdULL;
+  result ^= result >> 33;
+  return result;
+}
+
+// -----------------------------------------------------------------------------
+// FastStringLookup<T>::_mphSlot
+//
+// slot of a key in the perfect hash given the displacement of its bucket
+// -----------------------------------------------------------------------------
+template<typename T>
+inline uint32_t FastStringLookup<T>::_mphSlot(
+  uint64_t hash,
+  std::pair<uint32_t, uint32_t> d,
+  uint32_t n
+) {
+  uint64_t h1 = (uint32_t)(hash >> 32);
+  uint64_t h2 = (uint32_t)((hash * 0x9E3779B97F4A7C15ULL) >> 32) | 1;
+  return (uint32_t)((h1 + d.first * h2 + d.second) % n);
+}
+
 // -----------------------------------------------------------------------------
 // FastStringLookup<T>::clear
 // -----------------------------------------------------------------------------
@@ -175,14 +773,119 @@ void FastStringLookup<T>::clear() {
   _lookupMap.clear();
   _values.clear();
   std::fill(_lookup.begin(), _lookup.end(), 0);
+  _thaw();
+}
+
+// -----------------------------------------------------------------------------
+// FastStringLookup<T>::_thaw
+// -----------------------------------------------------------------------------
+template<typename T>
+void FastStringLookup<T>::_thaw() {
+  _mphDisplacements.clear();
+  _mphSlots.clear();
+  _mphNames.clear();
+}
+
+// -----------------------------------------------------------------------------
+// FastStringLookup<T>::freeze
+//
+// Build a minimal perfect hash with the current keys (CHD-like): keys are
+// spread into buckets, and buckets (biggest first) look for a displacement
+// that places all their keys in free slots of a table with exactly one slot
+// per key.
+//
+// Returns FALSE if no perfect hash could be found, in which case the regular
+// lookup keeps being used.
+// -----------------------------------------------------------------------------
+template<typename T>
+bool FastStringLookup<T>::freeze() {
+  _thaw();
+
+  uint32_t n = _lookupMap.size();
+  if (n == 0) {
+    return false;
+  }
+
+  std::vector<uint64_t> hashes;
+  std::vector<std::vector<uint32_t>> buckets(n);
+  for (const auto &it : _lookupMap) {
+    uint64_t hash = _fnvHash64v((const uint8_t*)it.first.data(), it.first.size());
+    buckets[(uint32_t)hash % n].push_back(hashes.size());
+    hashes.push_back(hash);
+  }
+
+  std::vector<uint32_t> order(n);
+  for (uint32_t i = 0; i < n; i++) {
+    order[i] = i;
+  }
+  std::stable_sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b) {
+    return buckets[a].size() > buckets[b].size();
+  });
+
+  std::vector<std::pair<uint32_t, uint32_t>> displacements(n, {0, 0});
+  std::vector<bool> taken(n, false);
+  std::vector<uint32_t> slots;
+
+  for (uint32_t b : order) {
+    const std::vector<uint32_t> &bucket = buckets[b];
+    if (bucket.empty()) {
+      break;
+    }
+
+    bool found = false;
+    for (uint32_t d0 = 0; d0 < n && !found; d0++) {
+      for (uint32_t d1 = 0; d1 < n && !found; d1++) {
+        slots.clear();
+        for (uint32_t k : bucket) {
+          uint32_t slot = _mphSlot(hashes[k], {d0, d1}, n);
+          if (taken[slot] || std::find(slots.begin(), slots.end(), slot) != slots.end()) {
+            break;
+          }
+          slots.push_back(slot);
+        }
+
+        if (slots.size() == bucket.size()) {
+          found = true;
+          displacements[b] = {d0, d1};
+          for (uint32_t slot : slots) {
+            taken[slot] = true;
+          }
+        }
+      }
+    }
+
+    if (!found) {
+      return false;
+    }
+  }
+
+  _mphSlots.resize(n);
+  _mphNames.resize(n);
+  for (const auto &it : _lookupMap) {
+    uint64_t hash = _fnvHash64v((const uint8_t*)it.first.data(), it.first.size());
+    uint32_t slot = _mphSlot(hash, displacements[(uint32_t)hash % n], n);
+    _mphSlots[slot] = it.second;
+    _mphNames[slot] = it.first;
+  }
+  _mphDisplacements.swap(displacements);
+  return true;
 }
 
 // -----------------------------------------------------------------------------
 // FastStringLookup<T>::set
 // -----------------------------------------------------------------------------
 template<typename T>
-void FastStringLookup<T>::set(const std::string &key, T value) {
-  uint32_t index = _values.size();
+uint32_t FastStringLookup<T>::set(const std::string &key, T value) {
+  _thaw();
+
+  // existing keys keep their index
+  uint32_t index = find(key);
+  if (index != NOT_FOUND) {
+    _values[index] = std::move(value);
+    return index;
+  }
+
+  index = _values.size();
   uint32_t qkey = _fnvHash32v((const uint8_t*)key.c_str(), key.size()) % _lookup.size();
 
   _values.push_back(value);
@@ -190,6 +893,18 @@ void FastStringLookup<T>::set(const std::string &key, T value) {
   _lookupMap[key] = index;
   _lookup[qkey] = (_lookup[qkey] == 0 ? index + 1 : _lookup.size());
   _lookupNames[qkey] = key;
+  return index;
+}
+
+// -----------------------------------------------------------------------------
+// FastStringLookup<T>::find
+//
+// index of the value of a key, NOT_FOUND if not set
+// -----------------------------------------------------------------------------
+template<typename T>
+inline uint32_t FastStringLookup<T>::find(const std::string_view &key) const {
+  const T *value = get(key);
+  return value ? (uint32_t)(value - _values.data()) : NOT_FOUND;
 }
 
 // -----------------------------------------------------------------------------
@@ -197,6 +912,15 @@ void FastStringLookup<T>::set(const std::string &key, T value) {
 // -----------------------------------------------------------------------------
 template<typename T>
 inline const T *FastStringLookup<T>::get(const std::string_view &key) const {
+  if (!_mphSlots.empty()) {
+    uint32_t n = _mphSlots.size();
+    uint64_t hash = _fnvHash64v((const uint8_t*)key.data(), key.size());
+    uint32_t slot = _mphSlot(hash, _mphDisplacements[(uint32_t)hash % n], n);
+    const std::string &name = _mphNames[slot];
+    return (name.size() == key.size() && memcmp(name.data(), key.data(), key.size()) == 0)
+      ? &_values[_mphSlots[slot]] : NULL;
+  }
+
   uint32_t qkey = _fnvHash32v((const uint8_t*)key.data(), key.size()) % _lookup.size();
   uint32_t index = _lookup[qkey];
   if (index == 0) {